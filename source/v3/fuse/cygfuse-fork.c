@@ -0,0 +1,55 @@
+/**
+ * @file fuse/cygfuse-fork.c
+ * Revalidation of the WinFsp API dispatch table after fork.
+ *
+ * Cygwin fork is fragile and cannot always correctly handle dlopen'ed
+ * DLL's if they are native (rather than Cygwin ones). So in a forked child
+ * any API pointer that was bound in the parent may have become stale.
+ *
+ * Rather than unconditionally reloading the WinFsp DLL after every fork,
+ * the fork child handler in cygfuse.c asks the DLL for each bound API
+ * again. If the DLL is still mapped where it was, all answers match and
+ * the table is kept as is. Otherwise the whole table is reset to the
+ * resolver thunks, which will reload the DLL on next use.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <dlfcn.h>
+#include <stddef.h>
+
+#include "cygfuse-internal.h"
+
+void cygfuse_api_reset(void **table, const struct cygfuse_api_desc *desc, size_t count)
+{
+    for (size_t i = 0; count > i; i++)
+        __atomic_store_n(&table[i], desc[i].thunk, __ATOMIC_RELEASE);
+}
+
+int cygfuse_api_revalidate(void *handle, void **table,
+    const struct cygfuse_api_desc *desc, size_t count)
+{
+    if (0 == handle)
+        return 0;
+
+    for (size_t i = 0; count > i; i++)
+    {
+        void *p = table[i];
+        if (desc[i].thunk == p || (0 != desc[i].fallback && desc[i].fallback == p))
+            continue;
+        if (dlsym(handle, desc[i].name) != p)
+        {
+            cygfuse_api_reset(table, desc, count);
+            return 0;
+        }
+    }
+
+    return 1;
+}
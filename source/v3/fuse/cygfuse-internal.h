@@ -0,0 +1,165 @@
+/**
+ * @file fuse/cygfuse-internal.h
+ * Declarations shared between the cygfuse source files.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#ifndef CYGFUSE_INTERNAL_H_INCLUDED
+#define CYGFUSE_INTERNAL_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* cygfuse-locate.c */
+#define CYGFUSE_WINFSP_REGPATH          \
+    "/proc/registry32/HKEY_LOCAL_MACHINE/Software/WinFsp/InstallDir"
+#define CYGFUSE_WINFSP_CACHE            "/var/run/cygfuse-winfsp"
+#define CYGFUSE_WINFSP_ENV              "CYGFUSE_WINFSP"
+void *cygfuse_locate_winfsp(const char *name, const char *regpath, const char *cachepath);
+
+/* cygfuse-fork.c */
+struct cygfuse_api_desc
+{
+    const char *name;
+    void *thunk;
+    void *fallback;
+};
+void cygfuse_api_reset(void **table, const struct cygfuse_api_desc *desc, size_t count);
+int cygfuse_api_revalidate(void *handle, void **table,
+    const struct cygfuse_api_desc *desc, size_t count);
+
+/*
+ * Per-thread data, such as the counters of cygfuse-stats.c and the rings
+ * of cygfuse-record.c and cygfuse-trace.c. The data of a thread is found
+ * through a thread key whose destructor is cygfuse_tls_retire, and is
+ * also kept on a list, which is never shrunk, for readers that go through
+ * the data of all threads. The data of an exited thread is reused by the
+ * next new thread. The struct cygfuse_tls must be the first member.
+ */
+struct cygfuse_tls
+{
+    struct cygfuse_tls *next;
+    int free;
+};
+static inline void cygfuse_tls_retire(void *data)
+{
+    __atomic_store_n(&((struct cygfuse_tls *)data)->free, 1, __ATOMIC_RELEASE);
+}
+/* returns the data of the calling thread or 0; *passigned is set if it was assigned just now */
+static inline void *cygfuse_tls_get(pthread_key_t key, struct cygfuse_tls **list, size_t size,
+    int *passigned)
+{
+    struct cygfuse_tls *tls;
+
+    *passigned = 0;
+    tls = pthread_getspecific(key);
+    if (0 != tls)
+        return tls;
+
+    for (tls = __atomic_load_n(list, __ATOMIC_ACQUIRE); 0 != tls; tls = tls->next)
+        if (__atomic_exchange_n(&tls->free, 0, __ATOMIC_ACQ_REL))
+            break;
+
+    if (0 == tls)
+    {
+        tls = calloc(1, size);
+        if (0 == tls)
+            return 0;
+        tls->next = __atomic_load_n(list, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(list, &tls->next, tls,
+            1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    if (0 != pthread_setspecific(key, tls))
+    {
+        cygfuse_tls_retire(tls);
+        return 0;
+    }
+    *passigned = 1;
+    return tls;
+}
+
+/* cygfuse-stats.c */
+#define CYGFUSE_STATS_ENV               "CYGFUSE_STATS"
+#define CYGFUSE_HIST_SUBBITS            2
+#define CYGFUSE_HIST_SUB                (1 << CYGFUSE_HIST_SUBBITS)
+#define CYGFUSE_HIST_MAXBIT             47  /* ~39 hours */
+#define CYGFUSE_HIST_BUCKETS            \
+    ((CYGFUSE_HIST_MAXBIT - CYGFUSE_HIST_SUBBITS + 2) * CYGFUSE_HIST_SUB)
+struct cygfuse_stat
+{
+    uint64_t count;
+    uint64_t errors;
+    uint64_t sum;
+    uint64_t hist[CYGFUSE_HIST_BUCKETS];
+};
+struct cygfuse_stats
+{
+    const char *title;
+    const char *const *names;
+    size_t count;
+    pthread_key_t key;
+    struct cygfuse_tls *shards;
+    struct cygfuse_stats *next;
+};
+#define CYGFUSE_STATS_INIT(title, names)\
+    { title, names, sizeof names / sizeof names[0] }
+struct cygfuse_stats_timer
+{
+    struct cygfuse_stats *stats;
+    size_t index;
+    uint64_t start;
+    int error;
+};
+unsigned cygfuse_hist_bucket(uint64_t ns);
+uint64_t cygfuse_hist_upper(unsigned bucket);
+int cygfuse_stats_init(void);
+int cygfuse_stats_enabled(void);
+void cygfuse_stats_register(struct cygfuse_stats *stats);
+void cygfuse_stats_record(struct cygfuse_stats *stats, size_t index, uint64_t ns, int error);
+void cygfuse_stats_merge(struct cygfuse_stats *stats, size_t index, struct cygfuse_stat *out);
+void cygfuse_stats_dump(struct cygfuse_stats *stats, FILE *file);
+void cygfuse_stats_report(void (*report)(FILE *file));
+void cygfuse_dump_register(void (*dump)(void));
+int cygfuse_dump_enabled(void);
+void cygfuse_dump(void);
+static inline uint64_t cygfuse_hash_path(const char *path)
+{
+    /* FNV-1a */
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++)
+        hash = (hash ^ *p) * 0x100000001b3ULL;
+    return hash;
+}
+static inline uint64_t cygfuse_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+static inline struct cygfuse_stats_timer cygfuse_stats_timer_start(
+    struct cygfuse_stats *stats, size_t index)
+{
+    struct cygfuse_stats_timer timer = { stats, index, cygfuse_now(), 0 };
+    return timer;
+}
+static inline void cygfuse_stats_timer_stop(struct cygfuse_stats_timer *timer)
+{
+    cygfuse_stats_record(timer->stats, timer->index, cygfuse_now() - timer->start, timer->error);
+}
+
+#endif
@@ -24,152 +24,326 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/cygwin.h>
 #include <sys/stat.h>
 
-static void *cygfuse_init_slow(int force);
-static void *cygfuse_init_winfsp();
+#include "cygfuse-internal.h"
 
-static pthread_mutex_t cygfuse_mutex = PTHREAD_MUTEX_INITIALIZER;
-static void *cygfuse_handle = 0;
+#if !defined(CYGFUSE_STATIC)
+/*
+ * WinFsp API dispatch table.
+ *
+ * Every WinFsp API pointer starts out pointing to a resolver thunk. The
+ * first call through a pointer lands in its thunk, which loads the WinFsp
+ * DLL if necessary, looks up that single symbol and patches the pointer so
+ * that subsequent calls go straight to WinFsp (much like an ELF PLT).
+ * Programs therefore only pay for the APIs they actually use, and older
+ * WinFsp releases that lack newer APIs keep working as long as those APIs
+ * are not called or have a fallback.
+ *
+ * Pointers are patched with release semantics and read with acquire
+ * semantics (a plain load on x86), so the steady state cost of an API call
+ * is a load followed by an indirect call.
+ *
+ * X(RET, API, PARAMS, ARGS, FALLBACK)
+ */
+#define CYGFUSE_API_LIST(X)             \
+    /* winfsp_fuse.h */                 \
+    X(void, fsp_fuse_signal_handler,    \
+        (int sig),                      \
+        (sig), 0)                       \
+    /* fuse_common.h */                 \
+    X(int, fsp_fuse_version,            \
+        (struct fsp_fuse_env *env),     \
+        (env), 0)                       \
+    X(struct fuse_chan *, fsp_fuse_mount,\
+        (struct fsp_fuse_env *env, const char *mountpoint, struct fuse_args *args),\
+        (env, mountpoint, args), 0)     \
+    X(void, fsp_fuse_unmount,           \
+        (struct fsp_fuse_env *env, const char *mountpoint, struct fuse_chan *ch),\
+        (env, mountpoint, ch), 0)       \
+    X(int, fsp_fuse_parse_cmdline,      \
+        (struct fsp_fuse_env *env, struct fuse_args *args,\
+            char **mountpoint, int *multithreaded, int *foreground),\
+        (env, args, mountpoint, multithreaded, foreground), 0)\
+    X(int32_t, fsp_fuse_ntstatus_from_errno,\
+        (struct fsp_fuse_env *env, int err),\
+        (env, err), 0)                  \
+    /* fuse.h */                        \
+    X(int, fsp_fuse_main_real,          \
+        (struct fsp_fuse_env *env, int argc, char *argv[],\
+            const struct fuse_operations *ops, size_t opsize, void *data),\
+        (env, argc, argv, ops, opsize, data), 0)\
+    X(int, fsp_fuse_is_lib_option,      \
+        (struct fsp_fuse_env *env, const char *opt),\
+        (env, opt), 0)                  \
+    X(struct fuse *, fsp_fuse_new,      \
+        (struct fsp_fuse_env *env, struct fuse_chan *ch, struct fuse_args *args,\
+            const struct fuse_operations *ops, size_t opsize, void *data),\
+        (env, ch, args, ops, opsize, data), 0)\
+    X(void, fsp_fuse_destroy,           \
+        (struct fsp_fuse_env *env, struct fuse *f),\
+        (env, f), 0)                    \
+    X(int, fsp_fuse_loop,               \
+        (struct fsp_fuse_env *env, struct fuse *f),\
+        (env, f), 0)                    \
+    X(int, fsp_fuse_loop_mt,            \
+        (struct fsp_fuse_env *env, struct fuse *f),\
+        (env, f), 0)                    \
+    X(void, fsp_fuse_exit,              \
+        (struct fsp_fuse_env *env, struct fuse *f),\
+        (env, f), 0)                    \
+    X(int, fsp_fuse_exited,             \
+        (struct fsp_fuse_env *env, struct fuse *f),\
+        (env, f), 0)                    \
+    X(int, fsp_fuse_notify,             \
+        (struct fsp_fuse_env *env, struct fuse *f, const char *path, uint32_t action),\
+        (env, f, path, action), cygfuse_fallback_fsp_fuse_notify)\
+    X(struct fuse_context *, fsp_fuse_get_context,\
+        (struct fsp_fuse_env *env),     \
+        (env), 0)                       \
+    /* fuse_opt.h */                    \
+    X(int, fsp_fuse_opt_parse,          \
+        (struct fsp_fuse_env *env, struct fuse_args *args, void *data,\
+            const struct fuse_opt opts[], fuse_opt_proc_t proc),\
+        (env, args, data, opts, proc), 0)\
+    X(int, fsp_fuse_opt_add_arg,        \
+        (struct fsp_fuse_env *env, struct fuse_args *args, const char *arg),\
+        (env, args, arg), 0)            \
+    X(int, fsp_fuse_opt_insert_arg,     \
+        (struct fsp_fuse_env *env, struct fuse_args *args, int pos, const char *arg),\
+        (env, args, pos, arg), 0)       \
+    X(void, fsp_fuse_opt_free_args,     \
+        (struct fsp_fuse_env *env, struct fuse_args *args),\
+        (env, args), 0)                 \
+    X(int, fsp_fuse_opt_add_opt,        \
+        (struct fsp_fuse_env *env, char **opts, const char *opt),\
+        (env, opts, opt), 0)            \
+    X(int, fsp_fuse_opt_add_opt_escaped,\
+        (struct fsp_fuse_env *env, char **opts, const char *opt),\
+        (env, opts, opt), 0)            \
+    X(int, fsp_fuse_opt_match,          \
+        (struct fsp_fuse_env *env, const struct fuse_opt opts[], const char *opt),\
+        (env, opts, opt), 0)
 
-static inline void *cygfuse_init_fast(void)
+struct cygfuse_api
 {
-    void *handle = cygfuse_handle;
-    __sync_synchronize(); /* memory barrier */
-    if (0 == handle)
-        handle = cygfuse_init_slow(0);
-    return handle;
-}
-
-static void *cygfuse_init_slow(int force)
-{
-    void *handle;
-    pthread_mutex_lock(&cygfuse_mutex);
-    handle = cygfuse_handle;
-    if (force || 0 == handle)
-    {
-        handle = cygfuse_init_winfsp();
-        __sync_synchronize(); /* memory barrier */
-        cygfuse_handle = handle;
-    }
-    pthread_mutex_unlock(&cygfuse_mutex);
-    return handle;
-}
+#define CYGFUSE_API_MEMBER(RET, API, PARAMS, ARGS, FALLBACK)\
+    void *API;
+    CYGFUSE_API_LIST(CYGFUSE_API_MEMBER)
+#undef CYGFUSE_API_MEMBER
+};
+static struct cygfuse_api cygfuse_api;
 
 /*
- * Unfortunately Cygwin fork is very fragile and cannot even correctly
- * handle dlopen'ed DLL's if they are native (rather than Cygwin ones).
+ * Instrumentation.
  *
- * So we have this very nasty hack where we reset the dlopen'ed handle
- * immediately after daemonization. This will force cygfuse_init() to
- * reload the WinFsp DLL and reset all API pointers in the daemonized
- * process.
+ * When statistics are enabled (see cygfuse-stats.c) every dispatch table
+ * entry points to a timed wrapper instead, which counts the call and
+ * records its latency before calling through cygfuse_api_bound. The
+ * resolver thunks then patch cygfuse_api_bound rather than cygfuse_api.
+ * When statistics are disabled none of this is in the call path.
  */
-static inline int cygfuse_daemon(int nochdir, int noclose)
-{
-    if (-1 == daemon(nochdir, noclose))
-        return -1;
+static struct cygfuse_api cygfuse_api_bound;
+static struct cygfuse_api *cygfuse_api_target = &cygfuse_api;
 
-    /* force reload of WinFsp DLL to workaround fork() problems */
-    cygfuse_init_slow(1);
+enum
+{
+#define CYGFUSE_API_INDEX(RET, API, PARAMS, ARGS, FALLBACK)\
+    CYGFUSE_API_INDEX_ ## API,
+    CYGFUSE_API_LIST(CYGFUSE_API_INDEX)
+#undef CYGFUSE_API_INDEX
+};
 
-    return 0;
-}
-#define daemon                          cygfuse_daemon
+static const char *const cygfuse_api_names[] =
+{
+#define CYGFUSE_API_NAME(RET, API, PARAMS, ARGS, FALLBACK)\
+    #API,
+    CYGFUSE_API_LIST(CYGFUSE_API_NAME)
+#undef CYGFUSE_API_NAME
+};
+static struct cygfuse_stats cygfuse_api_stats = CYGFUSE_STATS_INIT("winfsp", cygfuse_api_names);
+#endif
 
-#define FSP_FUSE_API                    static
+#if !defined(CYGFUSE_STATIC)
+/*
+ * The pfn_* pointers declared by the WinFsp headers are never defined;
+ * they only provide the API types used to cast the dispatch table entries.
+ */
+#define FSP_FUSE_API                    extern
 #define FSP_FUSE_API_NAME(api)          (* pfn_ ## api)
-#define FSP_FUSE_API_CALL(api)          (cygfuse_init_fast(), pfn_ ## api)
+#define FSP_FUSE_API_CALL(api)          \
+    ((__typeof__(pfn_ ## api))__atomic_load_n(&cygfuse_api.api, __ATOMIC_ACQUIRE))
+#else
+/*
+ * Statically bound build (make static). WinFsp is linked at build time, so
+ * the WinFsp headers declare its APIs directly and every API call goes
+ * straight to WinFsp through the import table; there is no dispatch table,
+ * no dlopen and no fork handling. WinFsp APIs that have a fallback in the
+ * dynamic build are required.
+ */
+#define FSP_FUSE_API                    extern
+#endif
 #define FSP_FUSE_SYM(proto, ...)        __attribute__ ((visibility("default"))) proto { __VA_ARGS__ }
+#define FSP_FUSE_SIGNAL_DUMP            (cygfuse_dump_enabled() ? cygfuse_dump : 0)
 #include <fuse_common.h>
 #include <fuse.h>
 #include <fuse_opt.h>
 
+#if !defined(CYGFUSE_STATIC)
 #if defined(__LP64__)
 #define CYGFUSE_WINFSP_NAME             "winfsp-x64.dll"
 #else
 #define CYGFUSE_WINFSP_NAME             "winfsp-x86.dll"
 #endif
-#define CYGFUSE_WINFSP_PATH             "bin\\" CYGFUSE_WINFSP_NAME
-#define CYGFUSE_GET_API(h, n)           \
-    if (0 == (*(void **)&(pfn_ ## n) = dlsym(h, #n)))\
-        return cygfuse_init_fail();
 
-static void *cygfuse_init_fail();
+static pthread_mutex_t cygfuse_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void *cygfuse_handle = 0;
+
+static void *cygfuse_init_fail(const char *name);
 static void *cygfuse_init_winfsp()
 {
     void *h;
 
-    h = dlopen(CYGFUSE_WINFSP_NAME, RTLD_NOW);
+    h = cygfuse_locate_winfsp(CYGFUSE_WINFSP_NAME,
+        CYGFUSE_WINFSP_REGPATH, CYGFUSE_WINFSP_CACHE);
     if (0 == h)
-    {
-        char winpath[260], *psxpath;
-        int regfd, bytes;
-
-        regfd = open("/proc/registry32/HKEY_LOCAL_MACHINE/Software/WinFsp/InstallDir", O_RDONLY);
-        if (-1 == regfd)
-            return cygfuse_init_fail();
-
-        bytes = read(regfd, winpath, sizeof winpath - sizeof CYGFUSE_WINFSP_PATH);
-        close(regfd);
-        if (-1 == bytes || 0 == bytes)
-            return cygfuse_init_fail();
-
-        if ('\0' == winpath[bytes - 1])
-            bytes--;
-        memcpy(winpath + bytes, CYGFUSE_WINFSP_PATH, sizeof CYGFUSE_WINFSP_PATH);
-
-        psxpath = (char *)cygwin_create_path(CCP_WIN_A_TO_POSIX | CCP_PROC_CYGDRIVE, winpath);
-        if (0 == psxpath)
-            return cygfuse_init_fail();
-
-        h = dlopen(psxpath, RTLD_NOW);
-        free(psxpath);
-        if (0 == h)
-            return cygfuse_init_fail();
-    }
-
-    /* winfsp_fuse.h */
-    CYGFUSE_GET_API(h, fsp_fuse_signal_handler);
-
-    /* fuse_common.h */
-    CYGFUSE_GET_API(h, fsp_fuse_version);
-    CYGFUSE_GET_API(h, fsp_fuse_mount);
-    CYGFUSE_GET_API(h, fsp_fuse_unmount);
-    CYGFUSE_GET_API(h, fsp_fuse_parse_cmdline);
-    CYGFUSE_GET_API(h, fsp_fuse_ntstatus_from_errno);
-
-    /* fuse.h */
-    CYGFUSE_GET_API(h, fsp_fuse_main_real);
-    CYGFUSE_GET_API(h, fsp_fuse_is_lib_option);
-    CYGFUSE_GET_API(h, fsp_fuse_new);
-    CYGFUSE_GET_API(h, fsp_fuse_destroy);
-    CYGFUSE_GET_API(h, fsp_fuse_loop);
-    CYGFUSE_GET_API(h, fsp_fuse_loop_mt);
-    CYGFUSE_GET_API(h, fsp_fuse_exit);
-    CYGFUSE_GET_API(h, fsp_fuse_exited);
-    CYGFUSE_GET_API(h, fsp_fuse_get_context);
-
-    /* fuse_opt.h */
-    CYGFUSE_GET_API(h, fsp_fuse_opt_parse);
-    CYGFUSE_GET_API(h, fsp_fuse_opt_add_arg);
-    CYGFUSE_GET_API(h, fsp_fuse_opt_insert_arg);
-    CYGFUSE_GET_API(h, fsp_fuse_opt_free_args);
-    CYGFUSE_GET_API(h, fsp_fuse_opt_add_opt);
-    CYGFUSE_GET_API(h, fsp_fuse_opt_add_opt_escaped);
-    CYGFUSE_GET_API(h, fsp_fuse_opt_match);
+        return cygfuse_init_fail(CYGFUSE_WINFSP_NAME);
 
     return h;
 }
 
-static void *cygfuse_init_fail()
+static void *cygfuse_init_fail(const char *name)
 {
-    fprintf(stderr, "cygfuse: initialization failed: " CYGFUSE_WINFSP_NAME " not found\n");
+    fprintf(stderr, "cygfuse: initialization failed: %s not found\n", name);
     exit(1);
     return 0;
 }
 
+static void *cygfuse_bind(void **pfn, const char *name, void *thunk, void *fallback)
+{
+    void *p;
+    pthread_mutex_lock(&cygfuse_mutex);
+    p = *pfn;
+    if (thunk == p)
+    {
+        if (0 == cygfuse_handle)
+            cygfuse_handle = cygfuse_init_winfsp();
+        p = dlsym(cygfuse_handle, name);
+        if (0 == p)
+            p = fallback;
+        if (0 == p)
+            cygfuse_init_fail(name);
+        __atomic_store_n(pfn, p, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&cygfuse_mutex);
+    return p;
+}
+
+/* fallbacks for APIs missing from older WinFsp releases */
+static int cygfuse_fallback_fsp_fuse_notify(struct fsp_fuse_env *env,
+    struct fuse *f, const char *path, uint32_t action)
+{
+    (void)env;
+    (void)f;
+    (void)path;
+    (void)action;
+    return -ENOSYS;
+}
+
+#define CYGFUSE_API_THUNK(RET, API, PARAMS, ARGS, FALLBACK)\
+    static RET cygfuse_thunk_ ## API PARAMS\
+    {\
+        return ((__typeof__(pfn_ ## API))cygfuse_bind(&cygfuse_api_target->API, #API,\
+            (void *)cygfuse_thunk_ ## API, (void *)FALLBACK)) ARGS;\
+    }
+CYGFUSE_API_LIST(CYGFUSE_API_THUNK)
+#undef CYGFUSE_API_THUNK
+
+#define CYGFUSE_API_TIMED(RET, API, PARAMS, ARGS, FALLBACK)\
+    static RET cygfuse_timed_ ## API PARAMS\
+    {\
+        __attribute__ ((cleanup(cygfuse_stats_timer_stop))) struct cygfuse_stats_timer timer =\
+            cygfuse_stats_timer_start(&cygfuse_api_stats, CYGFUSE_API_INDEX_ ## API);\
+        (void)timer;\
+        return ((__typeof__(pfn_ ## API))__atomic_load_n(&cygfuse_api_bound.API,\
+            __ATOMIC_ACQUIRE)) ARGS;\
+    }
+CYGFUSE_API_LIST(CYGFUSE_API_TIMED)
+#undef CYGFUSE_API_TIMED
+
+#define CYGFUSE_API_INIT(RET, API, PARAMS, ARGS, FALLBACK)\
+    .API = (void *)cygfuse_thunk_ ## API,
+static struct cygfuse_api cygfuse_api =
+{
+    CYGFUSE_API_LIST(CYGFUSE_API_INIT)
+};
+#undef CYGFUSE_API_INIT
+
+#define CYGFUSE_API_DESC(RET, API, PARAMS, ARGS, FALLBACK)\
+    { #API, (void *)cygfuse_thunk_ ## API, (void *)FALLBACK },
+static const struct cygfuse_api_desc cygfuse_api_desc[] =
+{
+    CYGFUSE_API_LIST(CYGFUSE_API_DESC)
+};
+#undef CYGFUSE_API_DESC
+#define CYGFUSE_API_COUNT               (sizeof cygfuse_api_desc / sizeof cygfuse_api_desc[0])
+
+/*
+ * Fork safety.
+ *
+ * The prepare handler holds cygfuse_mutex across fork, so the child sees
+ * a consistent dispatch table. The child handler then revalidates the
+ * table against the WinFsp DLL (see cygfuse-fork.c); the DLL is only
+ * reloaded if fork actually broke it. This covers daemon() calls made by
+ * WinFsp through fsp_fuse_daemonize as well as any fork done by the file
+ * system itself.
+ *
+ * The signal thread started by fuse_set_signal_handlers is restarted in
+ * the child by winfsp_fuse.h.
+ */
+static void cygfuse_atfork_prepare(void)
+{
+    pthread_mutex_lock(&cygfuse_mutex);
+}
+
+static void cygfuse_atfork_parent(void)
+{
+    pthread_mutex_unlock(&cygfuse_mutex);
+}
+
+static void cygfuse_atfork_child(void)
+{
+    pthread_mutex_init(&cygfuse_mutex, 0);
+    if (!cygfuse_api_revalidate(cygfuse_handle,
+        (void **)cygfuse_api_target, cygfuse_api_desc, CYGFUSE_API_COUNT))
+        /* the old handle is unusable after fork; do not dlclose it */
+        cygfuse_handle = 0;
+}
+
+#endif
+
+__attribute__ ((constructor))
+static void cygfuse_init(void)
+{
+#if !defined(CYGFUSE_STATIC)
+    pthread_atfork(cygfuse_atfork_prepare, cygfuse_atfork_parent, cygfuse_atfork_child);
+
+    if (cygfuse_stats_init())
+    {
+        cygfuse_stats_register(&cygfuse_api_stats);
+        cygfuse_api_bound = cygfuse_api;
+        cygfuse_api_target = &cygfuse_api_bound;
+#define CYGFUSE_API_TIMED_INIT(RET, API, PARAMS, ARGS, FALLBACK)\
+        __atomic_store_n(&cygfuse_api.API, (void *)cygfuse_timed_ ## API, __ATOMIC_RELEASE);
+        CYGFUSE_API_LIST(CYGFUSE_API_TIMED_INIT)
+#undef CYGFUSE_API_TIMED_INIT
+    }
+#else
+    /* WinFsp API calls are not instrumented in this build */
+    cygfuse_stats_init();
+#endif
+}
+
 void *cygfuse_report(char *host, char *path, char *mntpoint, char *type)
 {
     char *fname = "/var/run/fuse.mounts"; // file has 80-byte records
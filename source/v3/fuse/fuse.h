@@ -96,6 +96,7 @@ struct fuse_operations
     /* _ */ int (*poll)(const char *path, struct fuse_file_info *fi,
         struct fuse_pollhandle *ph, unsigned *reventsp);
     /* FUSE 2.9 */
+    /* not adapted to read and write as in FUSE3: this table goes to WinFsp as it is */
     /* _ */ int (*write_buf)(const char *path,
         struct fuse_bufvec *buf, fuse_off_t off, struct fuse_file_info *fi);
     /* _ */ int (*read_buf)(const char *path,
@@ -335,16 +335,63 @@ static inline int fsp_fuse_daemonize(int foreground)
     return 0;
 }
 
+/*
+ * An embedding library may define FSP_FUSE_SIGNAL_DUMP to a function that
+ * is called (on the signal thread) whenever SIGUSR1 is received, e.g. to
+ * dump diagnostics. SIGUSR1 is left alone if FSP_FUSE_SIGNAL_DUMP is 0.
+ */
+#if !defined(FSP_FUSE_SIGNAL_DUMP)
+#define FSP_FUSE_SIGNAL_DUMP            ((void (*)(void))0)
+#endif
+
 static inline void *fsp_fuse_signal_thread(void *psigmask)
 {
+    void (*dump)(void);
     int sig;
 
-    if (0 == sigwait((sigset_t *)psigmask, &sig))
+    while (0 == sigwait((sigset_t *)psigmask, &sig))
+    {
+        if (SIGUSR1 == sig && 0 != (dump = FSP_FUSE_SIGNAL_DUMP))
+        {
+            dump();
+            continue;
+        }
+
         FSP_FUSE_API_CALL(fsp_fuse_signal_handler)(sig);
+        break;
+    }
 
     return 0;
 }
 
+struct fsp_fuse_signal_state
+{
+    sigset_t sigmask;
+    pthread_t sigthr;
+    int atfork;
+};
+
+static inline struct fsp_fuse_signal_state *fsp_fuse_signal_state(void)
+{
+    static struct fsp_fuse_signal_state state;
+    return &state;
+}
+
+/*
+ * Threads do not survive fork. So if the signal thread was running when a
+ * file system daemonized (e.g. fuse_set_signal_handlers was called before
+ * fuse_daemonize), restart it in the child; the signal mask it relies on
+ * is inherited by the child.
+ */
+static inline void fsp_fuse_signal_atfork_child(void)
+{
+    struct fsp_fuse_signal_state *state = fsp_fuse_signal_state();
+
+    if (0 != state->sigthr &&
+        0 != pthread_create(&state->sigthr, 0, fsp_fuse_signal_thread, &state->sigmask))
+        state->sigthr = 0;
+}
+
 static inline int fsp_fuse_set_signal_handlers(void *se)
 {
 #define FSP_FUSE_SET_SIGNAL_HANDLER(sig, newha)\
@@ -357,10 +404,9 @@ static inline int fsp_fuse_set_signal_handlers(void *se)
 #define FSP_FUSE_SIGADDSET(sig)\
     if (-1 != sigaction((sig), 0, &oldsa) &&\
         oldsa.sa_handler == SIG_DFL)\
-        sigaddset(&sigmask, (sig));
+        sigaddset(&state->sigmask, (sig));
 
-    static sigset_t sigmask;
-    static pthread_t sigthr;
+    struct fsp_fuse_signal_state *state = fsp_fuse_signal_state();
     struct sigaction oldsa, newsa;
 
     // memset instead of initializer to avoid GCC -Wmissing-field-initializers warning
@@ -368,32 +414,41 @@ static inline int fsp_fuse_set_signal_handlers(void *se)
 
     if (0 != se)
     {
-        if (0 == sigthr)
+        if (0 == state->sigthr)
         {
             FSP_FUSE_SET_SIGNAL_HANDLER(SIGPIPE, SIG_IGN);
 
-            sigemptyset(&sigmask);
+            sigemptyset(&state->sigmask);
             FSP_FUSE_SIGADDSET(SIGHUP);
             FSP_FUSE_SIGADDSET(SIGINT);
             FSP_FUSE_SIGADDSET(SIGTERM);
-            if (0 != pthread_sigmask(SIG_BLOCK, &sigmask, 0))
+            if (0 != FSP_FUSE_SIGNAL_DUMP)
+                FSP_FUSE_SIGADDSET(SIGUSR1);
+            if (0 != pthread_sigmask(SIG_BLOCK, &state->sigmask, 0))
                 return -1;
 
-            if (0 != pthread_create(&sigthr, 0, fsp_fuse_signal_thread, &sigmask))
+            if (!state->atfork)
+            {
+                if (0 != pthread_atfork(0, 0, fsp_fuse_signal_atfork_child))
+                    return -1;
+                state->atfork = 1;
+            }
+
+            if (0 != pthread_create(&state->sigthr, 0, fsp_fuse_signal_thread, &state->sigmask))
                 return -1;
         }
     }
     else
     {
-        if (0 != sigthr)
+        if (0 != state->sigthr)
         {
-            pthread_cancel(sigthr);
-            pthread_join(sigthr, 0);
-            sigthr = 0;
+            pthread_cancel(state->sigthr);
+            pthread_join(state->sigthr, 0);
+            state->sigthr = 0;
 
-            if (0 != pthread_sigmask(SIG_UNBLOCK, &sigmask, 0))
+            if (0 != pthread_sigmask(SIG_UNBLOCK, &state->sigmask, 0))
                 return -1;
-            sigemptyset(&sigmask);
+            sigemptyset(&state->sigmask);
 
             FSP_FUSE_SET_SIGNAL_HANDLER(SIGPIPE, SIG_IGN);
         }
@@ -0,0 +1,137 @@
+/**
+ * @file fuse3/cygfuse-bench-buf.c
+ * Throughput benchmark of fuse3_buf_copy in cygfuse-buf.c.
+ *
+ * Copies a file through fuse3_buf_copy in chunks of 128 KiB, as a
+ * passthrough file system does on read and write: file to memory, memory
+ * to file, and file to file in the kernel (copy_file_range or sendfile)
+ * and through a bounce buffer (FUSE_BUF_NO_SPLICE). A memory to memory
+ * copy is measured as a baseline. Runs on Cygwin and Linux; on Cygwin
+ * both file to file copies go through the bounce buffer.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+
+#define FILESIZE                        (64 * 1024 * 1024)
+#define CHUNK                           (128 * 1024)
+#define PASSES                          8
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int tempfd(void)
+{
+    FILE *file = tmpfile();
+    int fd;
+
+    if (0 == file)
+        return -1;
+    fd = dup(fileno(file));
+    fclose(file);
+
+    return fd;
+}
+
+static void setbuf_fd(struct fuse_bufvec *bufv, int fd, fuse_off_t pos)
+{
+    *bufv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(CHUNK);
+    bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+    bufv->buf[0].fd = fd;
+    bufv->buf[0].pos = pos;
+}
+
+static void setbuf_mem(struct fuse_bufvec *bufv, void *mem)
+{
+    *bufv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(CHUNK);
+    bufv->buf[0].mem = mem;
+}
+
+static void run(const char *name, int srcfd, int dstfd, char *srcmem, char *dstmem, int flags)
+{
+    struct fuse_bufvec src, dst;
+    double t0, t1;
+
+    t0 = now();
+    for (int pass = 0; PASSES > pass; pass++)
+        for (fuse_off_t off = 0; FILESIZE > off; off += CHUNK)
+        {
+            if (-1 != srcfd)
+                setbuf_fd(&src, srcfd, off);
+            else
+                setbuf_mem(&src, srcmem + off);
+            if (-1 != dstfd)
+                setbuf_fd(&dst, dstfd, off);
+            else
+                setbuf_mem(&dst, dstmem + off);
+            if (CHUNK != cygfuse_buf_copy(&dst, &src, flags))
+            {
+                fprintf(stderr, "%s: short copy\n", name);
+                return;
+            }
+        }
+    t1 = now();
+
+    printf("%-16s %8.1f MiB/s\n", name,
+        (double)FILESIZE * PASSES / (1024 * 1024) / (t1 - t0));
+}
+
+int main(int argc, char *argv[])
+{
+    char *srcmem, *dstmem;
+    int srcfd, dstfd;
+
+    srcmem = malloc(FILESIZE);
+    dstmem = malloc(FILESIZE);
+    srcfd = tempfd();
+    dstfd = tempfd();
+    if (0 == srcmem || 0 == dstmem || -1 == srcfd || -1 == dstfd)
+    {
+        fprintf(stderr, "cannot set up benchmark\n");
+        return 1;
+    }
+    for (size_t i = 0; FILESIZE > i; i++)
+        srcmem[i] = (char)(i * 31 >> 3);
+    memset(dstmem, 0, FILESIZE);
+    if (FILESIZE != pwrite(srcfd, srcmem, FILESIZE, 0) ||
+        FILESIZE != pwrite(dstfd, dstmem, FILESIZE, 0))
+    {
+        fprintf(stderr, "cannot write temporary files\n");
+        return 1;
+    }
+
+    run("mem-mem", -1, -1, srcmem, dstmem, 0);
+    run("fd-mem", srcfd, -1, 0, dstmem, 0);
+    run("mem-fd", -1, dstfd, srcmem, 0, 0);
+    run("fd-fd", srcfd, dstfd, 0, 0, 0);
+    run("fd-fd bounce", srcfd, dstfd, 0, 0, FUSE_BUF_NO_SPLICE);
+
+    close(dstfd);
+    close(srcfd);
+    free(dstmem);
+    free(srcmem);
+
+    return 0;
+}
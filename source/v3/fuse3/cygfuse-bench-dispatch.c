@@ -0,0 +1,133 @@
+/**
+ * @file fuse3/cygfuse-bench-dispatch.c
+ * Microbenchmark of the cygfuse API dispatch paths.
+ *
+ * Measures the per-call cost of fuse_get_context through the cygfuse DLL
+ * (acquire load of a dispatch table entry that a resolver thunk patched on
+ * first use, then an indirect call) against the former dispatch path (full
+ * memory barrier on every call, then an indirect call through a pfn_*
+ * pointer), which is no longer in the tree and is reproduced here. A direct
+ * call into the provider is measured as a baseline. The provider is the
+ * stub DLL, against which "make bench" builds the cygfuse DLL, so this runs
+ * on Cygwin as well as on Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef void *get_context_t(void *env);
+typedef void *fuse_get_context_t(void);
+
+static void *provider;
+
+/* former dispatch path, as it was in cygfuse.c */
+static pthread_mutex_t old_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void *old_handle = 0;
+static get_context_t *pfn_fsp_fuse3_get_context;
+
+static void *old_init_slow(void)
+{
+    void *handle;
+    pthread_mutex_lock(&old_mutex);
+    handle = old_handle;
+    if (0 == handle)
+    {
+        handle = provider;
+        pfn_fsp_fuse3_get_context = (get_context_t *)dlsym(handle, "fsp_fuse3_get_context");
+        __sync_synchronize(); /* memory barrier */
+        old_handle = handle;
+    }
+    pthread_mutex_unlock(&old_mutex);
+    return handle;
+}
+
+static inline void *old_init_fast(void)
+{
+    void *handle = old_handle;
+    __sync_synchronize(); /* memory barrier */
+    if (0 == handle)
+        handle = old_init_slow();
+    return handle;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define BENCH(name, expr)               \
+    do                                  \
+    {                                   \
+        double t0 = now();              \
+        for (long i = 0; iters > i; i++)\
+            sink = (expr);              \
+        double t1 = now();              \
+        printf("%-10s %8.3f ns/call\n", name, (t1 - t0) / iters);\
+    } while (0)
+
+static void *load(const char *path, const char *name, int mode, void **phandle)
+{
+    void *h, *p;
+
+    h = dlopen(path, RTLD_NOW | mode);
+    if (0 == h)
+    {
+        fprintf(stderr, "cannot load %s: %s\n", path, dlerror());
+        exit(1);
+    }
+    p = dlsym(h, name);
+    if (0 == p)
+    {
+        fprintf(stderr, "%s: %s not found\n", path, name);
+        exit(1);
+    }
+    if (0 != phandle)
+        *phandle = h;
+    return p;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = 1 < argc ? argv[1] : "./cygfuse-3.2.dll";
+    const char *stub_path = 2 < argc ? argv[2] : "./cygfuse-stub.dll";
+    long iters = 3 < argc ? atol(argv[3]) : 100000000;
+    get_context_t *direct;
+    fuse_get_context_t *get_context;
+    void *volatile sink;
+
+    /* have the cygfuse DLL bind to the stub provider */
+    setenv("CYGFUSE_WINFSP", stub_path, 1);
+
+    /* global: outside Cygwin the stub also supplies the Cygwin functions */
+    direct = (get_context_t *)load(stub_path, "fsp_fuse3_get_context", RTLD_GLOBAL, &provider);
+    get_context = (fuse_get_context_t *)load(path, "fuse_get_context", RTLD_LOCAL, 0);
+
+    /* bind the dispatch table entry */
+    sink = get_context();
+    if (direct(0) != sink)
+    {
+        fprintf(stderr, "%s does not call the stub provider\n", path);
+        return 1;
+    }
+
+    BENCH("direct", direct(0));
+    BENCH("old", (old_init_fast(), pfn_fsp_fuse3_get_context)(0));
+    BENCH("new", get_context());
+
+    (void)sink;
+    return 0;
+}
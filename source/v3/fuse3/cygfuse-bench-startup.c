@@ -0,0 +1,176 @@
+/**
+ * @file fuse3/cygfuse-bench-startup.c
+ * Startup latency benchmark of eager versus lazy WinFsp API binding.
+ *
+ * Each iteration loads the provider DLL afresh, binds its APIs either all
+ * at once (the former cygfuse_init_winfsp behavior) or one at a time on
+ * first use (the resolver thunks now in cygfuse.c) and then runs the
+ * provider calls that a program makes on its way to a particular point:
+ *
+ *     version     a program that only reports the FUSE version
+ *     mount       a file system on its way to its first mount
+ *
+ * The benchmark reports the number of dlsym calls and the wall time from
+ * process start (dlopen) to the end of the workload. The provider is a
+ * stub DLL so this runs on Cygwin as well as on Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *api_names[] =
+{
+    "fsp_fuse_signal_handler",
+    "fsp_fuse3_parse_conn_info_opts",
+    "fsp_fuse3_apply_conn_info_opts",
+    "fsp_fuse3_version",
+    "fsp_fuse3_pkgversion",
+    "fsp_fuse_ntstatus_from_errno",
+    "fsp_fuse3_main_real",
+    "fsp_fuse3_lib_help",
+    "fsp_fuse3_new_30",
+    "fsp_fuse3_new",
+    "fsp_fuse3_destroy",
+    "fsp_fuse3_mount",
+    "fsp_fuse3_unmount",
+    "fsp_fuse3_loop",
+    "fsp_fuse3_loop_mt_31",
+    "fsp_fuse3_loop_mt",
+    "fsp_fuse3_exit",
+    "fsp_fuse3_notify",
+    "fsp_fuse3_get_context",
+    "fsp_fuse_opt_parse",
+    "fsp_fuse_opt_add_arg",
+    "fsp_fuse_opt_insert_arg",
+    "fsp_fuse_opt_free_args",
+    "fsp_fuse_opt_add_opt",
+    "fsp_fuse_opt_add_opt_escaped",
+    "fsp_fuse_opt_match",
+};
+#define API_COUNT                       (sizeof api_names / sizeof api_names[0])
+
+static const char *workload_version[] =
+{
+    "fsp_fuse3_version",
+    0
+};
+static const char *workload_mount[] =
+{
+    "fsp_fuse_opt_parse",
+    "fsp_fuse_opt_add_arg",
+    "fsp_fuse3_parse_conn_info_opts",
+    "fsp_fuse3_new",
+    "fsp_fuse3_mount",
+    0
+};
+
+typedef int api_t();
+
+static const char *path;
+static void *handle;
+static void *table[API_COUNT];
+static int lazy;
+static unsigned long dlsym_count;
+
+static void *load(void)
+{
+    void *h = dlopen(path, RTLD_NOW);
+    if (0 == h)
+    {
+        fprintf(stderr, "cannot load %s: %s\n", path, dlerror());
+        exit(1);
+    }
+    return h;
+}
+
+static void *bind(const char *name)
+{
+    void *p = dlsym(handle, name);
+    dlsym_count++;
+    if (0 == p)
+    {
+        fprintf(stderr, "%s: %s not found\n", path, name);
+        exit(1);
+    }
+    return p;
+}
+
+static void start(void)
+{
+    memset(table, 0, sizeof table);
+    handle = 0;
+    if (!lazy)
+    {
+        handle = load();
+        for (size_t i = 0; API_COUNT > i; i++)
+            table[i] = bind(api_names[i]);
+    }
+}
+
+static void call(const char *name)
+{
+    size_t i;
+    for (i = 0; API_COUNT > i; i++)
+        if (0 == strcmp(api_names[i], name))
+            break;
+    if (0 == table[i])
+    {
+        if (0 == handle)
+            handle = load();
+        table[i] = bind(name);
+    }
+    ((api_t *)table[i])(0);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(const char *wname, const char **workload, long iters)
+{
+    for (lazy = 0; 2 > lazy; lazy++)
+    {
+        double total = 0;
+        dlsym_count = 0;
+        for (long i = 0; iters > i; i++)
+        {
+            double t0 = now();
+            start();
+            for (const char **w = workload; *w; w++)
+                call(*w);
+            total += now() - t0;
+            dlclose(handle);
+        }
+        printf("%-8s %-6s %3lu dlsym %10.1f us\n",
+            wname, lazy ? "lazy" : "eager",
+            dlsym_count / iters, total / iters / 1000);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    long iters;
+
+    path = 1 < argc ? argv[1] : "./cygfuse-stub.dll";
+    iters = 2 < argc ? atol(argv[2]) : 1000;
+
+    run("version", workload_version, iters);
+    run("mount", workload_mount, iters);
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+/**
+ * @file fuse3/cygfuse-bench-static.c
+ * Benchmark of the statically bound cygfuse build against the dynamic one.
+ *
+ * Loads the regular (dynamically bound) cygfuse DLL and the statically
+ * bound variant, both against the stub provider, and measures the per-call
+ * cost of fuse_get_context through each. "make bench" gives it copies of
+ * both built with BENCHFLAGS, as the installed DLLs would be optimized. A
+ * direct call into the provider is measured as a baseline. Runs on Cygwin
+ * and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef void *get_context_t();
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define BENCH(name, expr)               \
+    do                                  \
+    {                                   \
+        double t0 = now();              \
+        for (long i = 0; iters > i; i++)\
+            sink = (expr);              \
+        double t1 = now();              \
+        printf("%-10s %8.3f ns/call\n", name, (t1 - t0) / iters);\
+    } while (0)
+
+static get_context_t *load(const char *path, const char *name, int mode)
+{
+    void *h;
+    get_context_t *p;
+
+    h = dlopen(path, RTLD_NOW | mode);
+    if (0 == h)
+    {
+        fprintf(stderr, "cannot load %s: %s\n", path, dlerror());
+        exit(1);
+    }
+    p = (get_context_t *)dlsym(h, name);
+    if (0 == p)
+    {
+        fprintf(stderr, "%s: %s not found\n", path, name);
+        exit(1);
+    }
+    return p;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dynamic_path = 1 < argc ? argv[1] : "./cygfuse-3.2.dll";
+    const char *static_path = 2 < argc ? argv[2] : "./static/cygfuse-3.2.dll";
+    const char *stub_path = 3 < argc ? argv[3] : "./cygfuse-stub.dll";
+    long iters = 4 < argc ? atol(argv[4]) : 100000000;
+    get_context_t *direct, *dynamic_get_context, *static_get_context;
+    void *volatile sink;
+
+    /* have the dynamic build bind to the stub provider */
+    setenv("CYGFUSE_WINFSP", stub_path, 1);
+
+    /* global: outside Cygwin the stub also supplies the Cygwin functions */
+    direct = load(stub_path, "fsp_fuse3_get_context", RTLD_GLOBAL);
+    dynamic_get_context = load(dynamic_path, "fuse_get_context", RTLD_LOCAL);
+    static_get_context = load(static_path, "fuse_get_context", RTLD_LOCAL);
+
+    /* bind the dynamic build's dispatch table entry */
+    sink = dynamic_get_context();
+    if (direct(0) != sink || static_get_context() != sink)
+    {
+        fprintf(stderr, "builds do not call the same provider\n");
+        return 1;
+    }
+
+    for (int round = 0; 2 > round; round++)
+    {
+        BENCH("direct", direct(0));
+        BENCH("static", static_get_context());
+        BENCH("dynamic", dynamic_get_context());
+    }
+
+    (void)sink;
+    return 0;
+}
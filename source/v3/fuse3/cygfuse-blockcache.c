@@ -0,0 +1,975 @@
+/**
+ * @file fuse3/cygfuse-blockcache.c
+ * Persistent block cache of the operations interposer.
+ *
+ * When CYGFUSE_BLOCKCACHE names a directory, file data read from the file
+ * system is kept there in blocks of CYGFUSE_BLOCKCACHE_BLOCK bytes, one
+ * file per block, and later reads of the same blocks are served from
+ * those files (mapped into memory) instead of the file system. This is
+ * meant for file systems whose data is remote (sshfs, ftpfs, etc.), where
+ * every read the cache saves is a round trip. The directory survives
+ * unmounts and restarts, so that a file system mounted again starts with
+ * the data it had.
+ *
+ * A block is identified by the path of its file, the modification time
+ * and size of the file, and the index of the block. The modification time
+ * and size are taken from the latest getattr of the file that passed
+ * through the layer; they are forgotten when the file is opened, so that
+ * a file is revalidated on every open (as by NFS), normally by the getattr
+ * that WinFsp makes after opening it. A file whose modification time or
+ * size has changed since its blocks were cached thus gets new blocks; the
+ * old ones are no longer found and are evicted in time. Reads end at the
+ * size from the getattr, as they would have at the time. Writes, truncates
+ * etc. through the mount also remove the blocks they change, in case the
+ * modification time does not change (file systems such as sshfs keep it
+ * in seconds).
+ *
+ * The directory is limited to CYGFUSE_BLOCKCACHE_SIZE megabytes
+ * (CYGFUSE_BLOCKCACHE_MAXSIZE by default); beyond that the least recently
+ * used blocks are removed. The block files are indexed in memory when the
+ * layer starts, ordered by their modification times, which are updated
+ * when blocks are used (at most every CYGFUSE_BLOCKCACHE_TOUCH seconds per
+ * block) so that the order is kept across restarts. A directory should be
+ * used by one file system at a time.
+ *
+ * When CYGFUSE_SHMCACHE names a shared memory segment (see
+ * cygfuse-shmcache.c), blocks are also kept there, so that file systems
+ * in other processes that attach to the same segment are served the
+ * blocks that this one has read and vice versa. Either or both may be
+ * given; blocks are looked up in shared memory first, and blocks found in
+ * the directory are copied to shared memory. Blocks that one process
+ * removes because they were changed through its mount are removed from
+ * shared memory for all; changes through other mounts are seen by the
+ * modification time and size like any other change.
+ *
+ * Each block file is the data of the block, followed by the path of the
+ * file and a trailer with the rest of the key; blocks whose trailer does
+ * not match (different path with the same hash, or a damaged file) are
+ * ignored and removed. Blocks are written to a temporary file that is
+ * renamed into place, so that a crash never leaves a partial block.
+ *
+ * The index of the directory is charged to the memory budget (see
+ * cygfuse-budget.c), which removes the least recently used blocks when
+ * memory runs short; a block that cannot be indexed is removed at once.
+ * The shared memory segment is reported with the budget but not counted.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+
+#define CYGFUSE_BLOCKCACHE_MAGIC        0x314b4c4246475943ULL   /* "CYGFBLK1" */
+
+/* the key of the blocks of a file, as of its latest getattr */
+struct cygfuse_blockcache_key
+{
+    int64_t mtime;
+    int64_t mtime_nsec;
+    int64_t size;
+};
+
+/* at the end of every block file, after the data and the path */
+struct cygfuse_blockcache_trailer
+{
+    uint64_t magic;
+    uint64_t index;
+    struct cygfuse_blockcache_key key;
+    uint32_t datalen;
+    uint32_t pathlen;
+};
+
+struct cygfuse_block
+{
+    struct cygfuse_block *prev, *next;  /* LRU list; must be first */
+    struct cygfuse_block *hnext;
+    uint64_t name;
+    uint64_t disksize;
+    time_t touched;
+};
+
+static const struct fuse3_operations *cygfuse_blockcache_next;
+static char *cygfuse_blockcache_dir;
+static struct cygfuse_shmcache cygfuse_blockcache_shm;
+static uint64_t cygfuse_blockcache_max = (uint64_t)CYGFUSE_BLOCKCACHE_MAXSIZE * 1024 * 1024;
+static struct cygfuse_pathcache cygfuse_blockcache_keys;
+static int cygfuse_blockcache_keys_init;
+static unsigned cygfuse_blockcache_tmpseq;
+
+/* the index of the block files; all of it is protected by the mutex */
+static pthread_mutex_t cygfuse_blockcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cygfuse_block **cygfuse_blockcache_buckets;
+static size_t cygfuse_blockcache_nbuckets;
+static struct cygfuse_block cygfuse_blockcache_lru;
+static uint64_t cygfuse_blockcache_disksize;
+static uint64_t cygfuse_blockcache_hits, cygfuse_blockcache_misses, cygfuse_blockcache_evictions;
+
+static size_t cygfuse_blockcache_reclaim(void *ctx, size_t goal);
+static void cygfuse_blockcache_counters(void *ctx, uint64_t *hits, uint64_t *misses);
+static void cygfuse_blockcache_shm_counters(void *ctx, uint64_t *hits, uint64_t *misses);
+/* an index entry evicted takes its block with it, to be read again from the file system */
+static struct cygfuse_budget cygfuse_blockcache_budget =
+    CYGFUSE_BUDGET_INIT("blockcache", 0, CYGFUSE_BUDGET_COST(1, CYGFUSE_BLOCKCACHE_BLOCK),
+        cygfuse_blockcache_reclaim, cygfuse_blockcache_counters, 0);
+static struct cygfuse_budget cygfuse_blockcache_shm_budget =
+    CYGFUSE_BUDGET_INIT("shmcache", CYGFUSE_BUDGET_SHARED,
+        CYGFUSE_BUDGET_COST(1, CYGFUSE_BLOCKCACHE_BLOCK),
+        0, cygfuse_blockcache_shm_counters, &cygfuse_blockcache_shm);
+
+static inline uint64_t cygfuse_blockcache_mix(uint64_t hash, uint64_t value)
+{
+    /* splitmix64 finalizer over the running hash */
+    hash ^= value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+static uint64_t cygfuse_blockcache_name(const char *path,
+    const struct cygfuse_blockcache_key *key, uint64_t index)
+{
+    uint64_t name = cygfuse_hash_path(path);
+
+    name = cygfuse_blockcache_mix(name, (uint64_t)key->mtime);
+    name = cygfuse_blockcache_mix(name, (uint64_t)key->mtime_nsec);
+    name = cygfuse_blockcache_mix(name, (uint64_t)key->size);
+    name = cygfuse_blockcache_mix(name, index);
+
+    return name;
+}
+
+/* a second hash of the key, computed differently, that shared memory stores with a block */
+static uint64_t cygfuse_blockcache_check(const char *path, uint64_t name)
+{
+    uint64_t check = 0x243f6a8885a308d3ULL, word;
+    size_t len = strlen(path);
+
+    for (; 8 <= len; path += 8, len -= 8)
+    {
+        memcpy(&word, path, 8);
+        check = cygfuse_blockcache_mix(check, word);
+    }
+    word = 0;
+    memcpy(&word, path, len);
+    check = cygfuse_blockcache_mix(check, word ^ ((uint64_t)len << 56));
+
+    return cygfuse_blockcache_mix(check, name);
+}
+
+static void cygfuse_blockcache_filename(char *buf, size_t size, uint64_t name)
+{
+    snprintf(buf, size, "%s/%02x/%016llx", cygfuse_blockcache_dir,
+        (unsigned)(name >> 56), (unsigned long long)name);
+}
+
+/* index; called with the mutex held */
+static struct cygfuse_block **cygfuse_blockcache_find(uint64_t name)
+{
+    struct cygfuse_block **p;
+
+    for (p = &cygfuse_blockcache_buckets[name & (cygfuse_blockcache_nbuckets - 1)];
+        0 != *p; p = &(*p)->hnext)
+        if (name == (*p)->name)
+            break;
+
+    return p;
+}
+
+static void cygfuse_blockcache_lru_push(struct cygfuse_block *block)
+{
+    block->prev = &cygfuse_blockcache_lru;
+    block->next = cygfuse_blockcache_lru.next;
+    block->next->prev = block;
+    cygfuse_blockcache_lru.next = block;
+}
+
+static void cygfuse_blockcache_lru_unlink(struct cygfuse_block *block)
+{
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+}
+
+static void cygfuse_blockcache_remove(struct cygfuse_block **p)
+{
+    struct cygfuse_block *block = *p;
+    char filename[1024];
+
+    *p = block->hnext;
+    cygfuse_blockcache_lru_unlink(block);
+    cygfuse_blockcache_disksize -= block->disksize;
+
+    cygfuse_blockcache_filename(filename, sizeof filename, block->name);
+    unlink(filename);
+    free(block);
+    cygfuse_budget_release(&cygfuse_blockcache_budget, sizeof *block);
+}
+
+static void cygfuse_blockcache_evict(void)
+{
+    struct cygfuse_block *block;
+
+    while (cygfuse_blockcache_max < cygfuse_blockcache_disksize &&
+        &cygfuse_blockcache_lru != (block = cygfuse_blockcache_lru.prev))
+    {
+        cygfuse_blockcache_remove(cygfuse_blockcache_find(block->name));
+        cygfuse_blockcache_evictions++;
+    }
+}
+
+/* returns 0 if the block cannot be indexed */
+static int cygfuse_blockcache_add(uint64_t name, uint64_t disksize, time_t touched)
+{
+    struct cygfuse_block **p, *block;
+
+    p = cygfuse_blockcache_find(name);
+    block = *p;
+    if (0 != block)
+    {
+        cygfuse_blockcache_lru_unlink(block);
+        cygfuse_blockcache_disksize -= block->disksize;
+    }
+    else
+    {
+        if (!cygfuse_budget_charge(&cygfuse_blockcache_budget, sizeof *block))
+            return 0;
+        block = malloc(sizeof *block);
+        if (0 == block)
+        {
+            cygfuse_budget_release(&cygfuse_blockcache_budget, sizeof *block);
+            return 0;
+        }
+        block->name = name;
+        block->hnext = 0;
+        *p = block;
+    }
+    block->disksize = disksize;
+    block->touched = touched;
+    cygfuse_blockcache_lru_push(block);
+    cygfuse_blockcache_disksize += disksize;
+    return 1;
+}
+
+/* the thread that charged may hold the mutex (see cygfuse_blockcache_add); it is skipped */
+static size_t cygfuse_blockcache_reclaim(void *ctx, size_t goal)
+{
+    struct cygfuse_block *block;
+    size_t freed = 0;
+
+    if (0 != pthread_mutex_trylock(&cygfuse_blockcache_mutex))
+        return 0;
+    while (goal > freed &&
+        &cygfuse_blockcache_lru != (block = cygfuse_blockcache_lru.prev))
+    {
+        cygfuse_blockcache_remove(cygfuse_blockcache_find(block->name));
+        cygfuse_blockcache_evictions++;
+        freed += sizeof *block;
+    }
+    pthread_mutex_unlock(&cygfuse_blockcache_mutex);
+    return freed;
+}
+
+static void cygfuse_blockcache_counters(void *ctx, uint64_t *hits, uint64_t *misses)
+{
+    *hits = __atomic_load_n(&cygfuse_blockcache_hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&cygfuse_blockcache_misses, __ATOMIC_RELAXED);
+}
+
+static void cygfuse_blockcache_shm_counters(void *ctx, uint64_t *hits, uint64_t *misses)
+{
+    cygfuse_shmcache_counters(ctx, hits, misses);
+}
+
+/*
+ * The key of the blocks of a file. Returns 0 if the file is not a regular
+ * file or its getattr fails.
+ */
+static int cygfuse_blockcache_validate(const char *path, struct fuse3_file_info *fi,
+    struct cygfuse_blockcache_key *key)
+{
+    struct fuse_stat stbuf;
+    uint64_t generation;
+
+    if (cygfuse_pathcache_get(&cygfuse_blockcache_keys, path, 0, key, sizeof *key))
+        return 1;
+
+    generation = cygfuse_pathcache_generation(&cygfuse_blockcache_keys, path);
+    memset(&stbuf, 0, sizeof stbuf);
+    if (0 == cygfuse_blockcache_next->getattr ||
+        0 != cygfuse_blockcache_next->getattr(path, &stbuf, fi) ||
+        !S_ISREG(stbuf.st_mode))
+        return 0;
+
+    key->mtime = (int64_t)stbuf.st_mtim.tv_sec;
+    key->mtime_nsec = (int64_t)stbuf.st_mtim.tv_nsec;
+    key->size = (int64_t)stbuf.st_size;
+    cygfuse_pathcache_put(&cygfuse_blockcache_keys, path, generation,
+        key, sizeof *key, UINT64_MAX);
+
+    return 1;
+}
+
+/* copies from a block file, which is also copied to shared memory; returns -1 if there is none */
+static ssize_t cygfuse_blockcache_hit_disk(const char *path, const struct cygfuse_blockcache_key *key,
+    uint64_t index, uint64_t name, size_t blocklen, char *buf, size_t size, size_t boff)
+{
+    struct cygfuse_block **p, *block;
+    struct cygfuse_blockcache_trailer trailer;
+    size_t pathlen = strlen(path);
+    char filename[1024];
+    struct stat st;
+    char *map;
+    time_t now = time(0);
+    int fd, touch = 0, valid;
+
+    pthread_mutex_lock(&cygfuse_blockcache_mutex);
+    block = *cygfuse_blockcache_find(name);
+    if (0 != block)
+    {
+        cygfuse_blockcache_lru_unlink(block);
+        cygfuse_blockcache_lru_push(block);
+        touch = CYGFUSE_BLOCKCACHE_TOUCH <= now - block->touched;
+        if (touch)
+            block->touched = now;
+    }
+    pthread_mutex_unlock(&cygfuse_blockcache_mutex);
+    if (0 == block)
+        return -1;
+
+    cygfuse_blockcache_filename(filename, sizeof filename, name);
+    valid = 0;
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (-1 != fd)
+    {
+        if (0 == fstat(fd, &st) &&
+            blocklen + pathlen + sizeof trailer == (size_t)st.st_size &&
+            MAP_FAILED != (map = mmap(0, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0)))
+        {
+            /* the trailer follows the path and need not be aligned */
+            memcpy(&trailer, map + blocklen + pathlen, sizeof trailer);
+            valid = CYGFUSE_BLOCKCACHE_MAGIC == trailer.magic &&
+                index == trailer.index &&
+                0 == memcmp(key, &trailer.key, sizeof *key) &&
+                blocklen == trailer.datalen &&
+                pathlen == trailer.pathlen &&
+                0 == memcmp(map + blocklen, path, pathlen);
+            if (valid)
+            {
+                memcpy(buf, map + boff, size);
+                if (0 != cygfuse_blockcache_shm.header)
+                    cygfuse_shmcache_put(&cygfuse_blockcache_shm,
+                        name, cygfuse_blockcache_check(path, name), map, blocklen);
+            }
+            munmap(map, (size_t)st.st_size);
+        }
+        if (valid && touch)
+            futimens(fd, 0);
+        close(fd);
+    }
+
+    if (!valid)
+    {
+        pthread_mutex_lock(&cygfuse_blockcache_mutex);
+        p = cygfuse_blockcache_find(name);
+        if (0 != *p)
+            cygfuse_blockcache_remove(p);
+        pthread_mutex_unlock(&cygfuse_blockcache_mutex);
+        return -1;
+    }
+
+    return (ssize_t)size;
+}
+
+/* copies from a cached block; returns the number of bytes copied or -1 if the block is not cached */
+static ssize_t cygfuse_blockcache_hit(const char *path, const struct cygfuse_blockcache_key *key,
+    uint64_t index, size_t blocklen, char *buf, size_t size, size_t boff)
+{
+    uint64_t name = cygfuse_blockcache_name(path, key, index);
+    ssize_t result = -1;
+
+    if (0 != cygfuse_blockcache_shm.header)
+        result = cygfuse_shmcache_get(&cygfuse_blockcache_shm,
+            name, cygfuse_blockcache_check(path, name), buf, boff, size);
+    if (0 > result && 0 != cygfuse_blockcache_dir)
+        result = cygfuse_blockcache_hit_disk(path, key, index, name, blocklen, buf, size, boff);
+    if (0 <= result)
+        __atomic_add_fetch(&cygfuse_blockcache_hits, 1, __ATOMIC_RELAXED);
+
+    return result;
+}
+
+/* writes a block read from the file system to the directory and indexes it */
+static void cygfuse_blockcache_store_disk(const char *path, const struct cygfuse_blockcache_key *key,
+    uint64_t index, uint64_t name, const char *data, size_t datalen, uint64_t datagen)
+{
+    struct cygfuse_blockcache_trailer trailer;
+    size_t pathlen = strlen(path);
+    char tmpname[1024], filename[1024];
+    int fd, ok;
+
+    memset(&trailer, 0, sizeof trailer);
+    trailer.magic = CYGFUSE_BLOCKCACHE_MAGIC;
+    trailer.index = index;
+    trailer.key = *key;
+    trailer.datalen = (uint32_t)datalen;
+    trailer.pathlen = (uint32_t)pathlen;
+
+    snprintf(tmpname, sizeof tmpname, "%s/tmp.%ld.%u", cygfuse_blockcache_dir, (long)getpid(),
+        __atomic_add_fetch(&cygfuse_blockcache_tmpseq, 1, __ATOMIC_RELAXED));
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (-1 == fd)
+        return;
+    ok = (ssize_t)datalen == write(fd, data, datalen) &&
+        (ssize_t)pathlen == write(fd, path, pathlen) &&
+        (ssize_t)sizeof trailer == write(fd, &trailer, sizeof trailer);
+    close(fd);
+
+    /* a block whose data changed while it was read from the file system is dropped */
+    pthread_mutex_lock(&cygfuse_blockcache_mutex);
+    if (ok && datagen == cygfuse_handle_datagen(path))
+    {
+        cygfuse_blockcache_filename(filename, sizeof filename, name);
+        ok = 0 == rename(tmpname, filename);
+        if (ok)
+        {
+            if (!cygfuse_blockcache_add(name, datalen + pathlen + sizeof trailer, time(0)))
+                unlink(filename);
+            cygfuse_blockcache_evict();
+        }
+    }
+    else
+        ok = 0;
+    pthread_mutex_unlock(&cygfuse_blockcache_mutex);
+
+    if (!ok)
+        unlink(tmpname);
+}
+
+static void cygfuse_blockcache_store(const char *path, const struct cygfuse_blockcache_key *key,
+    uint64_t index, const char *data, size_t datalen, uint64_t datagen)
+{
+    uint64_t name = cygfuse_blockcache_name(path, key, index), check;
+
+    if (0 != cygfuse_blockcache_dir)
+        cygfuse_blockcache_store_disk(path, key, index, name, data, datalen, datagen);
+
+    /* without a mutex: a block whose data changed while it was stored is removed again */
+    if (0 != cygfuse_blockcache_shm.header && datagen == cygfuse_handle_datagen(path))
+    {
+        check = cygfuse_blockcache_check(path, name);
+        cygfuse_shmcache_put(&cygfuse_blockcache_shm, name, check, data, datalen);
+        if (datagen != cygfuse_handle_datagen(path))
+            cygfuse_shmcache_remove(&cygfuse_blockcache_shm, name);
+    }
+}
+
+/* reads a whole block from the file system; returns its length, which is short at end of file */
+static int cygfuse_blockcache_fill(const char *path, char *data, size_t blocklen, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    size_t filled = 0;
+    int result;
+
+    while (blocklen > filled)
+    {
+        result = cygfuse_blockcache_next->read(path, data + filled, blocklen - filled,
+            off + (fuse_off_t)filled, fi);
+        if (0 > result)
+            return 0 == filled ? result : (int)filled;
+        if (0 == result)
+            break;
+        filled += (size_t)result;
+    }
+
+    return (int)filled;
+}
+
+static int cygfuse_blockcache_read(const char *path, char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    struct cygfuse_blockcache_key key;
+    uint64_t index, datagen;
+    fuse_off_t pos, blockoff;
+    size_t copied = 0, blocklen, boff, n;
+    ssize_t hit;
+    char *data = 0;
+    int eof = 0, result;
+
+    if (0 == path || 0 > off || !cygfuse_blockcache_validate(path, fi, &key))
+        return cygfuse_blockcache_next->read(path, buf, size, off, fi);
+
+    while (size > copied)
+    {
+        pos = off + (fuse_off_t)copied;
+        if (key.size <= pos)
+            break;
+
+        index = (uint64_t)pos / CYGFUSE_BLOCKCACHE_BLOCK;
+        blockoff = (fuse_off_t)(index * CYGFUSE_BLOCKCACHE_BLOCK);
+        blocklen = CYGFUSE_BLOCKCACHE_BLOCK < key.size - blockoff ?
+            CYGFUSE_BLOCKCACHE_BLOCK : (size_t)(key.size - blockoff);
+        boff = (size_t)(pos - blockoff);
+        n = blocklen - boff < size - copied ? blocklen - boff : size - copied;
+
+        hit = cygfuse_blockcache_hit(path, &key, index, blocklen, buf + copied, n, boff);
+        if (0 <= hit)
+        {
+            copied += (size_t)hit;
+            continue;
+        }
+
+        __atomic_add_fetch(&cygfuse_blockcache_misses, 1, __ATOMIC_RELAXED);
+        if (0 == data && 0 == (data = malloc(CYGFUSE_BLOCKCACHE_BLOCK)))
+            break;
+        datagen = cygfuse_handle_datagen(path);
+        result = cygfuse_blockcache_fill(path, data, blocklen, blockoff, fi);
+        if (0 > result)
+        {
+            free(data);
+            return 0 == copied ? result : (int)copied;
+        }
+        if ((size_t)result == blocklen)
+            cygfuse_blockcache_store(path, &key, index, data, blocklen, datagen);
+        else
+        {
+            /* the file is shorter than it was; it is revalidated by the next read */
+            cygfuse_pathcache_remove(&cygfuse_blockcache_keys, path);
+            eof = 1;
+        }
+
+        if ((size_t)result > boff)
+        {
+            n = (size_t)result - boff < n ? (size_t)result - boff : n;
+            memcpy(buf + copied, data + boff, n);
+            copied += n;
+        }
+        if (eof)
+            break;
+    }
+    free(data);
+
+    /* reads end at the size of the file as last seen, unless out of memory */
+    if (size > copied && !eof && key.size > off + (fuse_off_t)copied)
+    {
+        result = cygfuse_blockcache_next->read(path, buf + copied, size - copied,
+            off + (fuse_off_t)copied, fi);
+        if (0 > result)
+            return 0 == copied ? result : (int)copied;
+        copied += (size_t)result;
+    }
+
+    return (int)copied;
+}
+
+/*
+ * Removes the cached blocks of a file that overlap [off, off + len), or
+ * all of them if len is -1, and forgets the key of the file.
+ */
+static void cygfuse_blockcache_forget(const char *path, fuse_off_t off, fuse_off_t len)
+{
+    struct cygfuse_blockcache_key key;
+    struct cygfuse_block **p;
+    uint64_t first, last;
+
+    if (0 == path)
+        return;
+
+    cygfuse_handle_datachanged(path);
+    if (cygfuse_pathcache_get(&cygfuse_blockcache_keys, path, 0, &key, sizeof key) &&
+        0 < key.size)
+    {
+        last = (uint64_t)(key.size - 1) / CYGFUSE_BLOCKCACHE_BLOCK;
+        first = 0;
+        if (-1 != len)
+        {
+            first = 0 < off ? (uint64_t)off / CYGFUSE_BLOCKCACHE_BLOCK : 0;
+            if (0 < len && (uint64_t)(off + len - 1) / CYGFUSE_BLOCKCACHE_BLOCK < last)
+                last = (uint64_t)(off + len - 1) / CYGFUSE_BLOCKCACHE_BLOCK;
+        }
+
+        if (0 != cygfuse_blockcache_shm.header)
+            for (uint64_t index = first; last >= index; index++)
+                cygfuse_shmcache_remove(&cygfuse_blockcache_shm,
+                    cygfuse_blockcache_name(path, &key, index));
+
+        if (0 != cygfuse_blockcache_dir)
+        {
+            pthread_mutex_lock(&cygfuse_blockcache_mutex);
+            for (uint64_t index = first; last >= index; index++)
+            {
+                p = cygfuse_blockcache_find(cygfuse_blockcache_name(path, &key, index));
+                if (0 != *p)
+                    cygfuse_blockcache_remove(p);
+            }
+            pthread_mutex_unlock(&cygfuse_blockcache_mutex);
+        }
+    }
+    cygfuse_pathcache_remove(&cygfuse_blockcache_keys, path);
+}
+
+/* getattr results passing through are the key of the blocks of the file */
+static int cygfuse_blockcache_getattr(const char *path, struct fuse_stat *stbuf,
+    struct fuse3_file_info *fi)
+{
+    struct cygfuse_blockcache_key key;
+    uint64_t generation = 0;
+    int result;
+
+    if (0 != path)
+        generation = cygfuse_pathcache_generation(&cygfuse_blockcache_keys, path);
+    result = cygfuse_blockcache_next->getattr(path, stbuf, fi);
+    if (0 == path)
+        return result;
+
+    if (0 == result && S_ISREG(stbuf->st_mode))
+    {
+        key.mtime = (int64_t)stbuf->st_mtim.tv_sec;
+        key.mtime_nsec = (int64_t)stbuf->st_mtim.tv_nsec;
+        key.size = (int64_t)stbuf->st_size;
+        cygfuse_pathcache_put(&cygfuse_blockcache_keys, path, generation,
+            &key, sizeof key, UINT64_MAX);
+    }
+    else
+        cygfuse_pathcache_remove(&cygfuse_blockcache_keys, path);
+
+    return result;
+}
+
+static int cygfuse_blockcache_open(const char *path, struct fuse3_file_info *fi)
+{
+    int result;
+
+    if (O_TRUNC & fi->flags)
+        cygfuse_blockcache_forget(path, 0, -1);
+    else if (0 != path)
+        cygfuse_pathcache_remove(&cygfuse_blockcache_keys, path);
+    result = 0 != cygfuse_blockcache_next->open ? cygfuse_blockcache_next->open(path, fi) : 0;
+
+    return result;
+}
+
+static int cygfuse_blockcache_create(const char *path, fuse_mode_t mode,
+    struct fuse3_file_info *fi)
+{
+    cygfuse_blockcache_forget(path, 0, -1);
+    return cygfuse_blockcache_next->create(path, mode, fi);
+}
+
+static int cygfuse_blockcache_rename(const char *oldpath, const char *newpath, unsigned int flags)
+{
+    int result;
+
+    result = cygfuse_blockcache_next->rename(oldpath, newpath, flags);
+    cygfuse_blockcache_forget(oldpath, 0, -1);
+    cygfuse_blockcache_forget(newpath, 0, -1);
+
+    return result;
+}
+
+/*
+ * Operations that change the data of a file; the blocks are removed after
+ * the operation, so that a concurrent read cannot cache the old data.
+ *
+ * X(OP, PARAMS, ARGS, OFF, LEN)
+ */
+#define CYGFUSE_BLOCKCACHE_DATA_LIST(X) \
+    X(unlink,                           \
+        (const char *path),             \
+        (path),                         \
+        0, -1)                          \
+    X(truncate,                         \
+        (const char *path, fuse_off_t size, struct fuse3_file_info *fi),\
+        (path, size, fi),               \
+        0, -1)                          \
+    X(write,                            \
+        (const char *path, const char *buf, size_t size, fuse_off_t off, struct fuse3_file_info *fi),\
+        (path, buf, size, off, fi),     \
+        off, (fuse_off_t)size)          \
+    X(write_buf,                        \
+        (const char *path, struct fuse3_bufvec *buf, fuse_off_t off, struct fuse3_file_info *fi),\
+        (path, buf, off, fi),           \
+        off, (fuse_off_t)cygfuse_buf_size(buf))\
+    X(fallocate,                        \
+        (const char *path, int mode, fuse_off_t off, fuse_off_t len, struct fuse3_file_info *fi),\
+        (path, mode, off, len, fi),     \
+        0, -1)
+
+#define CYGFUSE_BLOCKCACHE_WRAP(OP, PARAMS, ARGS, OFF, LEN)\
+    static int cygfuse_blockcache_ ## OP PARAMS\
+    {\
+        fuse_off_t forget_off = OFF, forget_len = LEN;\
+        int result = cygfuse_blockcache_next->OP ARGS;\
+        cygfuse_blockcache_forget(path, forget_off, forget_len);\
+        return result;\
+    }
+CYGFUSE_BLOCKCACHE_DATA_LIST(CYGFUSE_BLOCKCACHE_WRAP)
+#undef CYGFUSE_BLOCKCACHE_WRAP
+
+struct cygfuse_blockcache_scan
+{
+    uint64_t name;
+    uint64_t disksize;
+    time_t mtime;
+};
+
+static int cygfuse_blockcache_scan_compare(const void *a, const void *b)
+{
+    const struct cygfuse_blockcache_scan *x = a, *y = b;
+    return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+/* indexes the block files in the directory, oldest first, and removes stray temporary files */
+static void cygfuse_blockcache_load(void)
+{
+    struct cygfuse_blockcache_scan *scan = 0, *newscan;
+    size_t count = 0, capacity = 0;
+    char dirname[1024], filename[1024 + 256], *end;
+    unsigned long long name;
+    struct dirent *dirent;
+    struct stat st;
+    DIR *dir;
+
+    dir = opendir(cygfuse_blockcache_dir);
+    if (0 != dir)
+    {
+        while (0 != (dirent = readdir(dir)))
+            if (0 == strncmp(dirent->d_name, "tmp.", 4))
+            {
+                snprintf(filename, sizeof filename, "%s/%s", cygfuse_blockcache_dir, dirent->d_name);
+                unlink(filename);
+            }
+        closedir(dir);
+    }
+
+    for (unsigned i = 0; 256 > i; i++)
+    {
+        snprintf(dirname, sizeof dirname, "%s/%02x", cygfuse_blockcache_dir, i);
+        if (0 != mkdir(dirname, 0700) && EEXIST != errno)
+            continue;
+        dir = opendir(dirname);
+        if (0 == dir)
+            continue;
+        while (0 != (dirent = readdir(dir)))
+        {
+            if (16 != strlen(dirent->d_name))
+                continue;
+            name = strtoull(dirent->d_name, &end, 16);
+            snprintf(filename, sizeof filename, "%s/%s", dirname, dirent->d_name);
+            if ('\0' != *end || 0 != stat(filename, &st) || !S_ISREG(st.st_mode))
+                continue;
+            if (capacity == count)
+            {
+                capacity = 0 != capacity ? capacity * 2 : 1024;
+                newscan = realloc(scan, capacity * sizeof *scan);
+                if (0 == newscan)
+                    break;
+                scan = newscan;
+            }
+            scan[count].name = name;
+            scan[count].disksize = (uint64_t)st.st_size;
+            scan[count].mtime = st.st_mtime;
+            count++;
+        }
+        closedir(dir);
+    }
+
+    if (0 != count)
+        qsort(scan, count, sizeof *scan, cygfuse_blockcache_scan_compare);
+    pthread_mutex_lock(&cygfuse_blockcache_mutex);
+    for (size_t i = 0; count > i; i++)
+        if (!cygfuse_blockcache_add(scan[i].name, scan[i].disksize, scan[i].mtime))
+        {
+            cygfuse_blockcache_filename(filename, sizeof filename, scan[i].name);
+            unlink(filename);
+        }
+    cygfuse_blockcache_evict();
+    pthread_mutex_unlock(&cygfuse_blockcache_mutex);
+
+    free(scan);
+}
+
+static int cygfuse_blockcache_init_disk(const char *env)
+{
+    const char *sizeenv = getenv(CYGFUSE_BLOCKCACHE_SIZE_ENV);
+    size_t nbuckets;
+
+    if (0 != sizeenv && '\0' != sizeenv[0])
+        cygfuse_blockcache_max = strtoull(sizeenv, 0, 10) * 1024 * 1024;
+
+    if (0 != mkdir(env, 0700) && EEXIST != errno)
+    {
+        fprintf(stderr, "cygfuse: cannot create block cache %s: %s\n", env, strerror(errno));
+        return 0;
+    }
+
+    /* enough buckets for a full cache of whole blocks */
+    nbuckets = 1024;
+    while (nbuckets < cygfuse_blockcache_max / CYGFUSE_BLOCKCACHE_BLOCK && nbuckets < (1 << 24))
+        nbuckets *= 2;
+    cygfuse_blockcache_dir = strdup(env);
+    cygfuse_blockcache_buckets = calloc(nbuckets, sizeof *cygfuse_blockcache_buckets);
+    if (0 == cygfuse_blockcache_dir || 0 == cygfuse_blockcache_buckets)
+    {
+        free(cygfuse_blockcache_dir);
+        free(cygfuse_blockcache_buckets);
+        cygfuse_blockcache_dir = 0;
+        cygfuse_blockcache_buckets = 0;
+        return 0;
+    }
+    cygfuse_blockcache_nbuckets = nbuckets;
+    cygfuse_blockcache_lru.prev = cygfuse_blockcache_lru.next = &cygfuse_blockcache_lru;
+    cygfuse_blockcache_disksize = 0;
+
+    cygfuse_blockcache_load();
+
+    return 1;
+}
+
+static int cygfuse_blockcache_init_shm(const char *env)
+{
+    const char *sizeenv = getenv(CYGFUSE_SHMCACHE_SIZE_ENV);
+    const char *groupenv = getenv(CYGFUSE_SHMCACHE_GROUP_ENV);
+    uint64_t size = CYGFUSE_SHMCACHE_MAXSIZE;
+    gid_t group = (gid_t)-1;
+    struct group *grp;
+    char *end;
+
+    if (0 != sizeenv && '\0' != sizeenv[0])
+        size = strtoull(sizeenv, 0, 10);
+
+    /* a group name or number */
+    if (0 != groupenv && '\0' != groupenv[0])
+    {
+        grp = getgrnam(groupenv);
+        if (0 != grp)
+            group = grp->gr_gid;
+        else
+        {
+            group = (gid_t)strtoul(groupenv, &end, 10);
+            if ('\0' != *end)
+            {
+                fprintf(stderr, "cygfuse: unknown group: %s\n", groupenv);
+                return 0;
+            }
+        }
+    }
+
+    return cygfuse_shmcache_attach(&cygfuse_blockcache_shm, env,
+        (size_t)size * 1024 * 1024, CYGFUSE_BLOCKCACHE_BLOCK, group);
+}
+
+int cygfuse_blockcache_init(void)
+{
+    const char *env = getenv(CYGFUSE_BLOCKCACHE_ENV);
+    const char *shmenv = getenv(CYGFUSE_SHMCACHE_ENV);
+    int disk = 0, shm = 0;
+
+    if (0 != env && '\0' != env[0])
+        disk = cygfuse_blockcache_init_disk(env);
+    if (0 != shmenv && '\0' != shmenv[0])
+        shm = cygfuse_blockcache_init_shm(shmenv);
+    if (!disk && !shm)
+        return 0;
+
+    if (!cygfuse_blockcache_keys_init)
+    {
+        /* a getattr per key */
+        cygfuse_pathcache_init(&cygfuse_blockcache_keys, "block", CYGFUSE_BUDGET_COST(1, 0),
+            CYGFUSE_CACHE_ENTRIES);
+        cygfuse_blockcache_keys_init = 1;
+    }
+    cygfuse_budget_register(&cygfuse_blockcache_keys.budget);
+    if (disk)
+        cygfuse_budget_register(&cygfuse_blockcache_budget);
+    if (shm)
+    {
+        cygfuse_budget_charge(&cygfuse_blockcache_shm_budget, cygfuse_blockcache_shm.size);
+        cygfuse_budget_register(&cygfuse_blockcache_shm_budget);
+    }
+
+    return 1;
+}
+
+void cygfuse_blockcache_fini(void)
+{
+    struct cygfuse_block *block, *next;
+
+    if (0 == cygfuse_blockcache_dir && 0 == cygfuse_blockcache_shm.header)
+        return;
+
+    if (0 != cygfuse_blockcache_shm.header)
+        cygfuse_budget_release(&cygfuse_blockcache_shm_budget, cygfuse_blockcache_shm.size);
+    cygfuse_shmcache_detach(&cygfuse_blockcache_shm);
+
+    pthread_mutex_lock(&cygfuse_blockcache_mutex);
+    if (0 != cygfuse_blockcache_dir)
+    {
+        for (block = cygfuse_blockcache_lru.next; &cygfuse_blockcache_lru != block; block = next)
+        {
+            next = block->next;
+            free(block);
+            cygfuse_budget_release(&cygfuse_blockcache_budget, sizeof *block);
+        }
+        cygfuse_blockcache_lru.prev = cygfuse_blockcache_lru.next = &cygfuse_blockcache_lru;
+        free(cygfuse_blockcache_buckets);
+        cygfuse_blockcache_buckets = 0;
+        cygfuse_blockcache_nbuckets = 0;
+        cygfuse_blockcache_disksize = 0;
+        free(cygfuse_blockcache_dir);
+        cygfuse_blockcache_dir = 0;
+    }
+    pthread_mutex_unlock(&cygfuse_blockcache_mutex);
+
+    cygfuse_pathcache_clear(&cygfuse_blockcache_keys);
+}
+
+void cygfuse_blockcache_invalidate(const char *path)
+{
+    if (0 == cygfuse_blockcache_dir && 0 == cygfuse_blockcache_shm.header)
+        return;
+
+    cygfuse_blockcache_forget(path, 0, -1);
+}
+
+void cygfuse_blockcache_install(struct fuse3_operations *wrap, const struct fuse3_operations *next)
+{
+    cygfuse_blockcache_next = next;
+
+    /* nothing is cached without getattr, which provides the key of a file */
+    if (0 == next->read || 0 == next->getattr)
+        return;
+
+    wrap->read = cygfuse_blockcache_read;
+    wrap->getattr = cygfuse_blockcache_getattr;
+    wrap->open = cygfuse_blockcache_open;
+    if (0 != next->create)
+        wrap->create = cygfuse_blockcache_create;
+    if (0 != next->rename)
+        wrap->rename = cygfuse_blockcache_rename;
+#define CYGFUSE_BLOCKCACHE_INSTALL(OP, PARAMS, ARGS, OFF, LEN)\
+    if (0 != next->OP)\
+        wrap->OP = cygfuse_blockcache_ ## OP;
+    CYGFUSE_BLOCKCACHE_DATA_LIST(CYGFUSE_BLOCKCACHE_INSTALL)
+#undef CYGFUSE_BLOCKCACHE_INSTALL
+}
@@ -0,0 +1,267 @@
+/**
+ * @file fuse3/cygfuse-budget.c
+ * Memory budget of the operations interposer.
+ *
+ * Every cache of the interposer (attributes, names, listings, read-ahead
+ * data, write-back buffers, the block index) charges the memory of what it
+ * keeps to a struct cygfuse_budget of its own before it allocates it, and
+ * releases it when it frees it. All charges are counted against a single
+ * limit per process, which is given with the cygfuse_memory=SIZE mount
+ * option (see cygfuse_ops_args); without it memory is counted but not
+ * limited.
+ *
+ * When a charge takes the memory in use above CYGFUSE_BUDGET_HIGH of the
+ * limit, the caller reclaims memory down to CYGFUSE_BUDGET_LOW of it before
+ * it goes on, by asking the caches to evict. The caches are asked in order
+ * of what evicting a byte of them costs: the cost of getting an item back
+ * over the size of their items. The cost of an item is the calls into the
+ * file system and the data transferred that it takes to get it back
+ * (CYGFUSE_BUDGET_COST), with a call taken to be worth the time to
+ * transfer CYGFUSE_BUDGET_CALL KiB: a stat costs a getattr; a directory
+ * listing a single readdir, however many names it has; a block of data
+ * read ahead or kept in the block cache a read and the block itself. Large
+ * items cheap to get back per byte (data read ahead, listings) thus go
+ * before small ones (attributes), and the block index, whose entries are
+ * small but take a whole block with them, goes last.
+ * A charge that would still exceed the limit fails, and the cache goes on
+ * without keeping what it would have; the limit is never exceeded.
+ *
+ * While memory in use is above CYGFUSE_BUDGET_LOW of the limit the budget
+ * is under pressure (see cygfuse_budget_pressure); the caches then keep
+ * less of what they would otherwise keep ahead of time, such as data read
+ * ahead or written behind.
+ *
+ * Eviction callbacks run on whatever thread charged, which may hold locks
+ * of its own cache; they must skip what they cannot lock at once rather
+ * than wait for it. Caches shared with other processes (the shared memory
+ * block cache) are reported but not counted, since their memory is not
+ * that of the process.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cygfuse-internal.h"
+
+#define CYGFUSE_BUDGET_HIGH(limit)      ((limit) - (limit) / 8)
+#define CYGFUSE_BUDGET_LOW(limit)       ((limit) - (limit) / 4)
+
+static pthread_mutex_t cygfuse_budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cygfuse_budget_reclaim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cygfuse_budget *cygfuse_budget_list[CYGFUSE_BUDGET_MAX];
+static unsigned cygfuse_budget_count;
+static uint64_t cygfuse_budget_limit;
+static uint64_t cygfuse_budget_total, cygfuse_budget_peak, cygfuse_budget_reclaims;
+
+static inline void cygfuse_budget_max(uint64_t *peak, uint64_t value)
+{
+    uint64_t old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (old < value &&
+        !__atomic_compare_exchange_n(peak, &old, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* SIZE is bytes, or kilobytes, megabytes or gigabytes with a K, M or G suffix */
+int cygfuse_budget_init(const char *limit)
+{
+    unsigned long long value;
+    unsigned shift = 0;
+    char *end;
+
+    if (0 == limit || '0' > limit[0] || '9' < limit[0])
+        return -1;
+    errno = 0;
+    value = strtoull(limit, &end, 10);
+    if (0 != errno)
+        return -1;
+    switch (*end)
+    {
+    case 'k': case 'K':
+        shift = 10;
+        end++;
+        break;
+    case 'm': case 'M':
+        shift = 20;
+        end++;
+        break;
+    case 'g': case 'G':
+        shift = 30;
+        end++;
+        break;
+    }
+    if ('\0' != *end || (value << shift) >> shift != value)
+        return -1;
+
+    __atomic_store_n(&cygfuse_budget_limit, (uint64_t)value << shift, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void cygfuse_budget_register(struct cygfuse_budget *budget)
+{
+    pthread_mutex_lock(&cygfuse_budget_mutex);
+    for (unsigned i = 0; cygfuse_budget_count > i; i++)
+        if (budget == cygfuse_budget_list[i])
+            goto exit;
+    if (CYGFUSE_BUDGET_MAX > cygfuse_budget_count)
+    {
+        cygfuse_budget_list[cygfuse_budget_count] = budget;
+        __atomic_store_n(&cygfuse_budget_count, cygfuse_budget_count + 1, __ATOMIC_RELEASE);
+    }
+
+exit:
+    pthread_mutex_unlock(&cygfuse_budget_mutex);
+}
+
+/* calls into the file system per byte evicted; cheapest first */
+static double cygfuse_budget_cost(struct cygfuse_budget *budget)
+{
+    uint64_t used = __atomic_load_n(&budget->used, __ATOMIC_RELAXED);
+    uint64_t items = __atomic_load_n(&budget->items, __ATOMIC_RELAXED);
+
+    return (double)budget->cost * (double)items / (double)used;
+}
+
+/* returns the bytes freed by evicting down to CYGFUSE_BUDGET_LOW of the limit */
+size_t cygfuse_budget_reclaim(void)
+{
+    struct cygfuse_budget *victims[CYGFUSE_BUDGET_MAX], *budget;
+    double costs[CYGFUSE_BUDGET_MAX], cost;
+    unsigned count, nvictims = 0, j;
+    uint64_t limit, total, goal;
+    size_t freed = 0, n;
+
+    /* whoever comes second finds the work done */
+    pthread_mutex_lock(&cygfuse_budget_reclaim_mutex);
+
+    limit = __atomic_load_n(&cygfuse_budget_limit, __ATOMIC_RELAXED);
+    total = __atomic_load_n(&cygfuse_budget_total, __ATOMIC_RELAXED);
+    if (0 == limit || CYGFUSE_BUDGET_LOW(limit) >= total)
+        goto exit;
+    goal = total - CYGFUSE_BUDGET_LOW(limit);
+
+    count = __atomic_load_n(&cygfuse_budget_count, __ATOMIC_ACQUIRE);
+    for (unsigned i = 0; count > i; i++)
+    {
+        budget = cygfuse_budget_list[i];
+        if (0 == budget->evict || (budget->flags & CYGFUSE_BUDGET_SHARED) ||
+            0 == __atomic_load_n(&budget->used, __ATOMIC_RELAXED))
+            continue;
+        cost = cygfuse_budget_cost(budget);
+        for (j = nvictims; 0 < j && costs[j - 1] > cost; j--)
+        {
+            victims[j] = victims[j - 1];
+            costs[j] = costs[j - 1];
+        }
+        victims[j] = budget;
+        costs[j] = cost;
+        nvictims++;
+    }
+
+    for (unsigned i = 0; nvictims > i && goal > freed; i++)
+    {
+        n = victims[i]->evict(victims[i]->ctx, goal - freed);
+        __atomic_add_fetch(&victims[i]->evicted, n, __ATOMIC_RELAXED);
+        freed += n;
+    }
+    __atomic_add_fetch(&cygfuse_budget_reclaims, 1, __ATOMIC_RELAXED);
+
+exit:
+    pthread_mutex_unlock(&cygfuse_budget_reclaim_mutex);
+    return freed;
+}
+
+/*
+ * Returns 1 if size bytes may be allocated and 0 if that would exceed the
+ * limit even after reclaiming. Must not be called with a lock held that an
+ * eviction callback waits for.
+ */
+int cygfuse_budget_charge(struct cygfuse_budget *budget, size_t size)
+{
+    uint64_t limit = __atomic_load_n(&cygfuse_budget_limit, __ATOMIC_RELAXED), total;
+
+    if (!(budget->flags & CYGFUSE_BUDGET_SHARED))
+    {
+        total = __atomic_add_fetch(&cygfuse_budget_total, size, __ATOMIC_RELAXED);
+        if (0 != limit && CYGFUSE_BUDGET_HIGH(limit) < total)
+        {
+            cygfuse_budget_reclaim();
+            if (limit < __atomic_load_n(&cygfuse_budget_total, __ATOMIC_RELAXED))
+            {
+                __atomic_sub_fetch(&cygfuse_budget_total, size, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&budget->refused, 1, __ATOMIC_RELAXED);
+                return 0;
+            }
+        }
+        cygfuse_budget_max(&cygfuse_budget_peak, total);
+    }
+
+    cygfuse_budget_max(&budget->peak,
+        __atomic_add_fetch(&budget->used, size, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&budget->items, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void cygfuse_budget_release(struct cygfuse_budget *budget, size_t size)
+{
+    if (!(budget->flags & CYGFUSE_BUDGET_SHARED))
+        __atomic_sub_fetch(&cygfuse_budget_total, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&budget->used, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&budget->items, 1, __ATOMIC_RELAXED);
+}
+
+int cygfuse_budget_pressure(void)
+{
+    uint64_t limit = __atomic_load_n(&cygfuse_budget_limit, __ATOMIC_RELAXED);
+
+    return 0 != limit &&
+        CYGFUSE_BUDGET_LOW(limit) < __atomic_load_n(&cygfuse_budget_total, __ATOMIC_RELAXED);
+}
+
+uint64_t cygfuse_budget_used(void)
+{
+    return __atomic_load_n(&cygfuse_budget_total, __ATOMIC_RELAXED);
+}
+
+/* written with the statistics (see cygfuse-stats.c) */
+void cygfuse_budget_report(FILE *file)
+{
+    unsigned count = __atomic_load_n(&cygfuse_budget_count, __ATOMIC_ACQUIRE);
+    struct cygfuse_budget *budget;
+    uint64_t hits, misses;
+
+    fprintf(file, "[memory]\n");
+    fprintf(file, "# limit %llu, used %llu, peak %llu, reclaims %llu\n",
+        (unsigned long long)__atomic_load_n(&cygfuse_budget_limit, __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&cygfuse_budget_total, __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&cygfuse_budget_peak, __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&cygfuse_budget_reclaims, __ATOMIC_RELAXED));
+    fprintf(file, "%-32s %12s %12s %10s %12s %8s %10s %10s\n",
+        "# name", "used", "peak", "items", "evicted", "refused", "hits", "misses");
+    for (unsigned i = 0; count > i; i++)
+    {
+        budget = cygfuse_budget_list[i];
+        hits = misses = 0;
+        if (0 != budget->counters)
+            budget->counters(budget->ctx, &hits, &misses);
+        fprintf(file, "%-32s %12llu %12llu %10llu %12llu %8llu %10llu %10llu\n",
+            budget->name,
+            (unsigned long long)__atomic_load_n(&budget->used, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&budget->peak, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&budget->items, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&budget->evicted, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&budget->refused, __ATOMIC_RELAXED),
+            (unsigned long long)hits, (unsigned long long)misses);
+    }
+    fprintf(file, "\n");
+}
@@ -0,0 +1,381 @@
+/**
+ * @file fuse3/cygfuse-buf.c
+ * Implementation of fuse3_buf_size and fuse3_buf_copy.
+ *
+ * WinFsp has no buffer API of its own, so the FUSE3 buffer functions are
+ * implemented here, following libfuse. A buffer is either memory or a
+ * file descriptor (FUSE_BUF_IS_FD), read or written at its current offset
+ * or, with FUSE_BUF_FD_SEEK, at its pos. FUSE_BUF_FD_RETRY repeats short
+ * reads and writes until the requested size is reached or a read returns
+ * end of file.
+ *
+ * Copies between a descriptor and memory go straight to or from the
+ * memory with read/pread and write/pwrite. Copies between descriptors
+ * are done in the kernel with copy_file_range or sendfile where the
+ * system has them (Linux), unless FUSE_BUF_NO_SPLICE is given; they go
+ * through a bounce buffer otherwise, and when the kernel refuses the
+ * pair of descriptors.
+ *
+ * The same file also adapts the read_buf and write_buf operations of a
+ * file system to read and write, which are all that WinFsp calls.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sys/sendfile.h>
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+
+#define CYGFUSE_BUF_BOUNCE              (64 * 1024)
+
+size_t cygfuse_buf_size(const struct fuse3_bufvec *bufv)
+{
+    size_t size = 0;
+
+    for (size_t i = 0; bufv->count > i; i++)
+    {
+        if (SIZE_MAX - size <= bufv->buf[i].size)
+            return SIZE_MAX;
+        size += bufv->buf[i].size;
+    }
+
+    return size;
+}
+
+static ssize_t cygfuse_buf_read(const struct fuse3_buf *src, size_t srcoff,
+    void *mem, size_t len)
+{
+    size_t copied = 0;
+    ssize_t result;
+
+    while (len > copied)
+    {
+        if (src->flags & FUSE_BUF_FD_SEEK)
+            result = pread(src->fd, (char *)mem + copied, len - copied,
+                src->pos + (fuse_off_t)(srcoff + copied));
+        else
+            result = read(src->fd, (char *)mem + copied, len - copied);
+        if (-1 == result)
+        {
+            if (EINTR == errno)
+                continue;
+            if (0 == copied)
+                return -errno;
+            break;
+        }
+        if (0 == result)
+            break;
+        copied += (size_t)result;
+        if (!(src->flags & FUSE_BUF_FD_RETRY))
+            break;
+    }
+
+    return (ssize_t)copied;
+}
+
+static ssize_t cygfuse_buf_write(const struct fuse3_buf *dst, size_t dstoff,
+    const void *mem, size_t len)
+{
+    size_t copied = 0;
+    ssize_t result;
+
+    while (len > copied)
+    {
+        if (dst->flags & FUSE_BUF_FD_SEEK)
+            result = pwrite(dst->fd, (const char *)mem + copied, len - copied,
+                dst->pos + (fuse_off_t)(dstoff + copied));
+        else
+            result = write(dst->fd, (const char *)mem + copied, len - copied);
+        if (-1 == result)
+        {
+            if (EINTR == errno)
+                continue;
+            if (0 == copied)
+                return -errno;
+            break;
+        }
+        if (0 == result)
+            break;
+        copied += (size_t)result;
+        if (!(dst->flags & FUSE_BUF_FD_RETRY))
+            break;
+    }
+
+    return (ssize_t)copied;
+}
+
+#if defined(__linux__)
+/*
+ * Copy in the kernel. Returns -EXDEV if the kernel cannot copy between
+ * the descriptors before anything was copied, so that the caller can fall
+ * back to a bounce buffer.
+ */
+static ssize_t cygfuse_buf_kernel(const struct fuse3_buf *dst, size_t dstoff,
+    const struct fuse3_buf *src, size_t srcoff, size_t len)
+{
+    loff_t srcpos, dstpos;
+    off_t sendpos;
+    size_t copied = 0;
+    ssize_t result;
+    int usesendfile = 0;
+
+    srcpos = src->pos + (loff_t)srcoff;
+    dstpos = dst->pos + (loff_t)dstoff;
+
+    while (len > copied)
+    {
+        if (!usesendfile)
+        {
+            result = copy_file_range(src->fd, (src->flags & FUSE_BUF_FD_SEEK) ? &srcpos : 0,
+                dst->fd, (dst->flags & FUSE_BUF_FD_SEEK) ? &dstpos : 0,
+                len - copied, 0);
+            if (-1 == result && 0 == copied &&
+                (EXDEV == errno || EINVAL == errno || ENOSYS == errno || EOPNOTSUPP == errno ||
+                EBADF == errno))
+            {
+                /* sendfile writes at the current offset of the destination only */
+                if (dst->flags & FUSE_BUF_FD_SEEK)
+                    return -EXDEV;
+                usesendfile = 1;
+                continue;
+            }
+        }
+        else
+        {
+            sendpos = (off_t)srcpos;
+            result = sendfile(dst->fd, src->fd, (src->flags & FUSE_BUF_FD_SEEK) ? &sendpos : 0,
+                len - copied);
+            if (-1 == result && 0 == copied && (EINVAL == errno || ENOSYS == errno))
+                return -EXDEV;
+            if (0 < result)
+                srcpos += result;
+        }
+        if (-1 == result)
+        {
+            if (EINTR == errno)
+                continue;
+            if (0 == copied)
+                return -errno;
+            break;
+        }
+        if (0 == result)
+            break;
+        copied += (size_t)result;
+        if (!((src->flags | dst->flags) & FUSE_BUF_FD_RETRY))
+            break;
+    }
+
+    return (ssize_t)copied;
+}
+#endif
+
+static ssize_t cygfuse_buf_bounce(const struct fuse3_buf *dst, size_t dstoff,
+    const struct fuse3_buf *src, size_t srcoff, size_t len)
+{
+    char stackbuf[4096], *buf;
+    size_t bufsize, copied = 0;
+    ssize_t result = 0, written;
+
+    bufsize = CYGFUSE_BUF_BOUNCE < len ? CYGFUSE_BUF_BOUNCE : len;
+    buf = sizeof stackbuf < bufsize ? malloc(bufsize) : 0;
+    if (0 == buf)
+    {
+        buf = stackbuf;
+        bufsize = sizeof stackbuf < bufsize ? sizeof stackbuf : bufsize;
+    }
+
+    while (len > copied)
+    {
+        result = cygfuse_buf_read(src, srcoff + copied, buf,
+            bufsize < len - copied ? bufsize : len - copied);
+        if (0 >= result)
+            break;
+
+        written = cygfuse_buf_write(dst, dstoff + copied, buf, (size_t)result);
+        if (0 > written)
+        {
+            result = written;
+            break;
+        }
+        copied += (size_t)written;
+        if ((size_t)written < (size_t)result)
+            break;
+    }
+
+    if (stackbuf != buf)
+        free(buf);
+
+    return 0 == copied && 0 > result ? result : (ssize_t)copied;
+}
+
+static ssize_t cygfuse_buf_copy_one(const struct fuse3_buf *dst, size_t dstoff,
+    const struct fuse3_buf *src, size_t srcoff, size_t len, int flags)
+{
+    int srcfd = !!(src->flags & FUSE_BUF_IS_FD);
+    int dstfd = !!(dst->flags & FUSE_BUF_IS_FD);
+
+    if (!srcfd && !dstfd)
+    {
+        char *d = (char *)dst->mem + dstoff;
+        const char *s = (const char *)src->mem + srcoff;
+        if (d != s)
+            memmove(d, s, len);
+        return (ssize_t)len;
+    }
+    else if (!srcfd)
+        return cygfuse_buf_write(dst, dstoff, (const char *)src->mem + srcoff, len);
+    else if (!dstfd)
+        return cygfuse_buf_read(src, srcoff, (char *)dst->mem + dstoff, len);
+    else
+    {
+#if defined(__linux__)
+        if (!(flags & FUSE_BUF_NO_SPLICE))
+        {
+            ssize_t result = cygfuse_buf_kernel(dst, dstoff, src, srcoff, len);
+            if (-EXDEV != result)
+                return result;
+        }
+#else
+        (void)flags;
+#endif
+        return cygfuse_buf_bounce(dst, dstoff, src, srcoff, len);
+    }
+}
+
+static const struct fuse3_buf *cygfuse_bufvec_current(struct fuse3_bufvec *bufv)
+{
+    return bufv->count > bufv->idx ? &bufv->buf[bufv->idx] : 0;
+}
+
+static int cygfuse_bufvec_advance(struct fuse3_bufvec *bufv, size_t len)
+{
+    const struct fuse3_buf *buf = cygfuse_bufvec_current(bufv);
+
+    if (0 == buf)
+        return 0;
+
+    bufv->off += len;
+    if (buf->size == bufv->off)
+    {
+        bufv->idx++;
+        if (bufv->count == bufv->idx)
+            return 0;
+        bufv->off = 0;
+    }
+
+    return 1;
+}
+
+ssize_t cygfuse_buf_copy(struct fuse3_bufvec *dstv, struct fuse3_bufvec *srcv, int flags)
+{
+    const struct fuse3_buf *src, *dst;
+    size_t copied = 0, len;
+    ssize_t result;
+    int more;
+
+    if (dstv == srcv)
+        return (ssize_t)cygfuse_buf_size(dstv);
+
+    for (;;)
+    {
+        src = cygfuse_bufvec_current(srcv);
+        dst = cygfuse_bufvec_current(dstv);
+        if (0 == src || 0 == dst)
+            break;
+
+        len = src->size - srcv->off;
+        if (dst->size - dstv->off < len)
+            len = dst->size - dstv->off;
+
+        result = cygfuse_buf_copy_one(dst, dstv->off, src, srcv->off, len, flags);
+        if (0 > result)
+        {
+            if (0 == copied)
+                return result;
+            break;
+        }
+        copied += (size_t)result;
+
+        /* advance both, so that each vector can be used to continue from where it stopped */
+        more = cygfuse_bufvec_advance(srcv, (size_t)result);
+        more = cygfuse_bufvec_advance(dstv, (size_t)result) && more;
+        if (!more)
+            break;
+        if ((size_t)result < len)
+            break;
+    }
+
+    return (ssize_t)copied;
+}
+
+/*
+ * WinFsp calls read and write only. For a file system that implements
+ * read_buf or write_buf these are adapted to read and write, which are
+ * then used instead of its own (as libfuse does). The buffer returned by
+ * read_buf is copied straight into the buffer of the read, so that a file
+ * system that returns descriptors is read with a single pread into it;
+ * the buffer of a write is passed to write_buf as it is.
+ */
+static const struct fuse3_operations *cygfuse_buf_next;
+
+static void cygfuse_buf_free(struct fuse3_bufvec *bufv)
+{
+    if (0 == bufv)
+        return;
+
+    for (size_t i = 0; bufv->count > i; i++)
+        if (!(bufv->buf[i].flags & FUSE_BUF_IS_FD))
+            free(bufv->buf[i].mem);
+    free(bufv);
+}
+
+static int cygfuse_buf_read_op(const char *path, char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    struct fuse3_bufvec *src = 0, dst = FUSE_BUFVEC_INIT(size);
+    ssize_t result;
+
+    dst.buf[0].mem = buf;
+    result = cygfuse_buf_next->read_buf(path, &src, size, off, fi);
+    if (0 == result && 0 != src)
+        result = cygfuse_buf_copy(&dst, src, 0);
+    cygfuse_buf_free(src);
+
+    return (int)result;
+}
+
+static int cygfuse_buf_write_op(const char *path, const char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    struct fuse3_bufvec src = FUSE_BUFVEC_INIT(size);
+
+    src.buf[0].mem = (void *)buf;
+    return cygfuse_buf_next->write_buf(path, &src, off, fi);
+}
+
+void cygfuse_buf_install(struct fuse3_operations *wrap, const struct fuse3_operations *next)
+{
+    cygfuse_buf_next = next;
+    if (0 != next->read_buf)
+        wrap->read = cygfuse_buf_read_op;
+    if (0 != next->write_buf)
+        wrap->write = cygfuse_buf_write_op;
+}
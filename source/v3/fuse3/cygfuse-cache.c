@@ -0,0 +1,676 @@
+/**
+ * @file fuse3/cygfuse-cache.c
+ * Caching layer of the operations interposer.
+ *
+ * The caches are enabled by listing them, separated by commas, in the
+ * CYGFUSE_CACHE environment variable:
+ *
+ * - attr: getattr results are cached by path for the attr_timeout (or
+ * entry_timeout, if that is shorter) of the file system configuration,
+ * so that repeated getattr calls for a path do not reach the file system.
+ *
+ * - neg: getattr calls that fail with ENOENT are remembered for the
+ * negative_timeout of the file system configuration, so that the names
+ * that Windows probes for (desktop.ini, autorun.inf, etc.) and that usually
+ * do not exist are looked up in the file system only once per timeout.
+ * Most getattr calls are for names that do exist, so the cache has a
+ * Bloom filter in front of it to let those pass without locking.
+ *
+ * - dir: complete directory listings returned by readdir, together with
+ * the stats of the entries if the file system supplied them, are cached
+ * by path for the entry_timeout of the file system configuration and
+ * replayed on later readdir calls for the same directory. Listings that
+ * the file system returns in pieces (using nonzero offsets) or that do not
+ * fit in the buffer are not cached.
+ *
+ * - write: writes through an open file are buffered and merged into
+ * writes of up to max_write bytes (see cygfuse-writeback.c). This is also
+ * what the file system gets if it asks for FUSE_CAP_WRITEBACK_CACHE, which
+ * is offered and wanted by default when write is listed; a file system
+ * that removes it from conn->want in its init turns write-back off.
+ *
+ * The timeouts are taken from the struct fuse3_config that the file
+ * system's init operation sees (and may change); nothing is cached before
+ * init or if the timeouts are 0. While the file system runs, the cleanup
+ * thread (see cygfuse-cleanup.c) removes entries as they expire. What the
+ * caches keep is charged to the memory budget (see cygfuse-budget.c),
+ * which evicts from them when memory runs short.
+ *
+ * Operations that modify a file or directory invalidate what is cached for
+ * it, and operations that add or remove names also invalidate the parent
+ * directory. The listing of the parent directory is invalidated by any
+ * change, since it may include the stats of its entries. Renaming a
+ * directory invalidates everything under it. The
+ * caches cannot see changes made other than through this mount, unless
+ * the file system reports them with fuse3_notify or fuse3_invalidate_path
+ * (see cygfuse_ops_invalidate).
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+
+#define CYGFUSE_CACHE_ATTR              0x0001
+#define CYGFUSE_CACHE_NEG               0x0002
+#define CYGFUSE_CACHE_DIR               0x0004
+#define CYGFUSE_CACHE_WRITE             0x0008
+
+static unsigned cygfuse_cache_enabled;
+static const struct fuse3_operations *cygfuse_cache_next;
+static uint64_t cygfuse_attr_ttl, cygfuse_neg_ttl, cygfuse_dir_ttl;
+static struct cygfuse_pathcache cygfuse_attr_cache, cygfuse_neg_cache, cygfuse_dir_cache;
+static int cygfuse_cache_cleanup;
+
+static inline void cygfuse_cache_remove(const char *path, unsigned flags, unsigned caches)
+{
+    void (*remove)(struct cygfuse_pathcache *cache, const char *path) =
+        (flags & CYGFUSE_INVALIDATE_TREE) ?
+            cygfuse_pathcache_remove_tree : cygfuse_pathcache_remove;
+
+    caches &= cygfuse_cache_enabled;
+    if (caches & CYGFUSE_CACHE_ATTR)
+        remove(&cygfuse_attr_cache, path);
+    if (caches & CYGFUSE_CACHE_NEG)
+        remove(&cygfuse_neg_cache, path);
+    if (caches & CYGFUSE_CACHE_DIR)
+        remove(&cygfuse_dir_cache, path);
+}
+
+void cygfuse_cache_invalidate(const char *path, unsigned flags)
+{
+    char buf[256], *parent;
+    size_t len;
+
+    if (0 == path)
+        return;
+
+    cygfuse_cache_remove(path, flags, ~0U);
+
+    /* the listing of the parent may include the stats of path */
+    if ((flags & CYGFUSE_INVALIDATE_PARENT) || (cygfuse_cache_enabled & CYGFUSE_CACHE_DIR))
+    {
+        const char *slash = strrchr(path, '/');
+        if (0 == slash)
+            return;
+
+        len = slash - path;
+        if (0 == len)
+            len = 1;                    /* the root directory */
+        parent = sizeof buf > len ? buf : malloc(len + 1);
+        if (0 == parent)
+        {
+            cygfuse_cache_invalidate("/", CYGFUSE_INVALIDATE_TREE);
+            return;
+        }
+        memcpy(parent, path, len);
+        parent[len] = '\0';
+
+        cygfuse_cache_remove(parent, 0,
+            (flags & CYGFUSE_INVALIDATE_PARENT) ? ~0U : CYGFUSE_CACHE_DIR);
+
+        if (buf != parent)
+            free(parent);
+    }
+}
+
+/* nothing cached after now expires before now + ttl */
+static uint64_t cygfuse_cache_clean_one(struct cygfuse_pathcache *cache, uint64_t ttl,
+    uint64_t now, uint64_t next, size_t *pfreed)
+{
+    uint64_t expiry;
+
+    if (0 == ttl)
+        return next;
+    expiry = cygfuse_pathcache_expire(cache, now, pfreed);
+    if (expiry > now + ttl)
+        expiry = now + ttl;
+    return next < expiry ? next : expiry;
+}
+
+static uint64_t cygfuse_cache_clean(uint64_t now, size_t *pfreed)
+{
+    uint64_t next = UINT64_MAX;
+
+    next = cygfuse_cache_clean_one(&cygfuse_attr_cache, cygfuse_attr_ttl, now, next, pfreed);
+    next = cygfuse_cache_clean_one(&cygfuse_neg_cache, cygfuse_neg_ttl, now, next, pfreed);
+    next = cygfuse_cache_clean_one(&cygfuse_dir_cache, cygfuse_dir_ttl, now, next, pfreed);
+
+    return next;
+}
+
+static void *cygfuse_cache_init_op(struct fuse3_conn_info *conn, struct fuse3_config *conf)
+{
+    void *data;
+    double timeout;
+
+    /* the write-back buffer is what FUSE_CAP_WRITEBACK_CACHE gets; the file system may turn it off */
+    if (0 != conn && (cygfuse_cache_enabled & CYGFUSE_CACHE_WRITE))
+    {
+        conn->capable |= FUSE_CAP_WRITEBACK_CACHE;
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    }
+
+    if (0 != cygfuse_cache_next->init)
+        data = cygfuse_cache_next->init(conn, conf);
+    else
+        data = fuse3_get_context()->private_data;
+
+    if (cygfuse_cache_enabled & CYGFUSE_CACHE_WRITE)
+    {
+        if (0 == conn)
+            cygfuse_writeback_setup(cygfuse_cache_next, 0);
+        else if (conn->want & FUSE_CAP_WRITEBACK_CACHE)
+            cygfuse_writeback_setup(cygfuse_cache_next, conn->max_write);
+        if (0 != conn)
+        {
+            conn->capable &= ~FUSE_CAP_WRITEBACK_CACHE;
+            conn->want &= ~FUSE_CAP_WRITEBACK_CACHE;
+        }
+    }
+
+    if (0 != conf)
+    {
+        timeout = conf->attr_timeout < conf->entry_timeout ?
+            conf->attr_timeout : conf->entry_timeout;
+        if (0 < timeout && (cygfuse_cache_enabled & CYGFUSE_CACHE_ATTR))
+            cygfuse_attr_ttl = (uint64_t)(timeout * 1e9);
+        if (0 < conf->negative_timeout && (cygfuse_cache_enabled & CYGFUSE_CACHE_NEG))
+            cygfuse_neg_ttl = (uint64_t)(conf->negative_timeout * 1e9);
+        if (0 < conf->entry_timeout && (cygfuse_cache_enabled & CYGFUSE_CACHE_DIR))
+            cygfuse_dir_ttl = (uint64_t)(conf->entry_timeout * 1e9);
+    }
+
+    if (0 != cygfuse_attr_ttl || 0 != cygfuse_neg_ttl || 0 != cygfuse_dir_ttl)
+        cygfuse_cache_cleanup = 0 == cygfuse_cleanup_start();
+
+    return data;
+}
+
+static void cygfuse_cache_destroy_op(void *data)
+{
+    if (cygfuse_cache_cleanup)
+    {
+        cygfuse_cleanup_stop();
+        cygfuse_cache_cleanup = 0;
+    }
+
+    if (0 != cygfuse_cache_next->destroy)
+        cygfuse_cache_next->destroy(data);
+}
+
+static int cygfuse_cache_getattr(const char *path, struct fuse_stat *stbuf,
+    struct fuse3_file_info *fi)
+{
+    uint64_t now, attr_generation = 0, neg_generation = 0;
+    int result;
+
+    /*
+     * A file with buffered writes has the size and modification time it
+     * will have once they are written out. These stats are not cached,
+     * since writing out does not invalidate them.
+     */
+    if (0 == path || (0 == cygfuse_attr_ttl && 0 == cygfuse_neg_ttl))
+    {
+        result = cygfuse_cache_next->getattr(path, stbuf, fi);
+        if (0 == result)
+            cygfuse_writeback_getattr(path, fi, stbuf);
+        return result;
+    }
+
+    now = cygfuse_now();
+    if (0 != cygfuse_attr_ttl)
+    {
+        if (cygfuse_pathcache_get(&cygfuse_attr_cache, path, now, stbuf, sizeof *stbuf))
+        {
+            cygfuse_writeback_getattr(path, fi, stbuf);
+            return 0;
+        }
+        attr_generation = cygfuse_pathcache_generation(&cygfuse_attr_cache, path);
+    }
+    if (0 != cygfuse_neg_ttl)
+    {
+        if (cygfuse_pathcache_get(&cygfuse_neg_cache, path, now, 0, 0))
+            return -ENOENT;
+        neg_generation = cygfuse_pathcache_generation(&cygfuse_neg_cache, path);
+    }
+
+    result = cygfuse_cache_next->getattr(path, stbuf, fi);
+    if (0 == result)
+    {
+        if (!cygfuse_writeback_getattr(path, fi, stbuf) && 0 != cygfuse_attr_ttl)
+            cygfuse_pathcache_put(&cygfuse_attr_cache, path, attr_generation,
+                stbuf, sizeof *stbuf, now + cygfuse_attr_ttl);
+    }
+    else if (-ENOENT == result && 0 != cygfuse_neg_ttl)
+        cygfuse_pathcache_put(&cygfuse_neg_cache, path, neg_generation,
+            0, 0, now + cygfuse_neg_ttl);
+
+    return result;
+}
+
+/*
+ * A cached listing is a struct cygfuse_dir_listing followed by its
+ * entries, each a struct cygfuse_dir_entry, the stats of the entry if it
+ * has them, and the name, padded to a multiple of 8 bytes.
+ */
+struct cygfuse_dir_listing
+{
+    uint32_t flags;                     /* enum fuse3_readdir_flags */
+    uint32_t count;
+};
+struct cygfuse_dir_entry
+{
+    uint32_t size;                      /* of the entry, including stats and name */
+    uint16_t flags;                     /* enum fuse3_fill_dir_flags */
+    uint16_t hasstat;
+};
+
+struct cygfuse_dir_fill
+{
+    void *buf;
+    fuse3_fill_dir_t filler;
+    char *listing;
+    size_t size, capacity;
+    int cacheable;
+};
+
+static int cygfuse_dir_filler(void *buf, const char *name,
+    const struct fuse_stat *stbuf, fuse_off_t off,
+    enum fuse3_fill_dir_flags flags)
+{
+    struct cygfuse_dir_fill *fill = buf;
+    struct cygfuse_dir_entry *entry;
+    size_t namelen, size;
+    char *listing;
+    int result;
+
+    result = fill->filler(fill->buf, name, stbuf, off, flags);
+    if (0 != result || 0 != off)
+        fill->cacheable = 0;
+    if (!fill->cacheable)
+        return result;
+
+    namelen = strlen(name);
+    size = (sizeof *entry + (0 != stbuf ? sizeof *stbuf : 0) + namelen + 1 + 7) & ~(size_t)7;
+    if (fill->capacity - fill->size < size)
+    {
+        size_t capacity = 0 != fill->capacity ? fill->capacity * 2 : 4096;
+        while (capacity - fill->size < size)
+            capacity *= 2;
+        if (CYGFUSE_CACHE_DIRSIZE < capacity ||
+            0 == (listing = realloc(fill->listing, capacity)))
+        {
+            fill->cacheable = 0;
+            return result;
+        }
+        fill->listing = listing;
+        fill->capacity = capacity;
+    }
+
+    entry = (struct cygfuse_dir_entry *)(fill->listing + fill->size);
+    entry->size = (uint32_t)size;
+    entry->flags = (uint16_t)flags;
+    entry->hasstat = 0 != stbuf;
+    if (0 != stbuf)
+        memcpy(entry + 1, stbuf, sizeof *stbuf);
+    memcpy((char *)(entry + 1) + (0 != stbuf ? sizeof *stbuf : 0), name, namelen + 1);
+    fill->size += size;
+    ((struct cygfuse_dir_listing *)fill->listing)->count++;
+
+    return result;
+}
+
+static int cygfuse_dir_copy(void *ctx, const void *value, size_t size)
+{
+    void **plisting = ctx;
+
+    *plisting = malloc(size);
+    if (0 == *plisting)
+        return 1;
+    memcpy(*plisting, value, size);
+    return 0;
+}
+
+static int cygfuse_cache_readdir(const char *path, void *buf, fuse3_fill_dir_t filler, fuse_off_t off,
+    struct fuse3_file_info *fi, enum fuse3_readdir_flags flags)
+{
+    struct cygfuse_dir_fill fill;
+    struct cygfuse_dir_listing *listing;
+    struct cygfuse_dir_entry *entry;
+    const struct fuse_stat *stbuf;
+    uint64_t now, generation;
+    int result;
+
+    if (0 == path || 0 != off || 0 == cygfuse_dir_ttl)
+        return cygfuse_cache_next->readdir(path, buf, filler, off, fi, flags);
+
+    /* the listing is copied so that the filler is not called with the shard mutex held */
+    now = cygfuse_now();
+    listing = 0;
+    if (0 == cygfuse_pathcache_visit(&cygfuse_dir_cache, path, now, cygfuse_dir_copy, &listing))
+    {
+        if ((uint32_t)flags == listing->flags)
+        {
+            entry = (struct cygfuse_dir_entry *)(listing + 1);
+            for (uint32_t i = 0; listing->count > i; i++)
+            {
+                stbuf = entry->hasstat ? (const struct fuse_stat *)(entry + 1) : 0;
+                if (0 != filler(buf, (const char *)(entry + 1) + (0 != stbuf ? sizeof *stbuf : 0),
+                    stbuf, 0, (enum fuse3_fill_dir_flags)entry->flags))
+                    break;
+                entry = (struct cygfuse_dir_entry *)((char *)entry + entry->size);
+            }
+            free(listing);
+            return 0;
+        }
+        free(listing);
+    }
+
+    memset(&fill, 0, sizeof fill);
+    fill.buf = buf;
+    fill.filler = filler;
+    fill.size = sizeof(struct cygfuse_dir_listing);
+    fill.capacity = 4096;
+    fill.listing = malloc(fill.capacity);
+    fill.cacheable = 0 != fill.listing;
+    if (fill.cacheable)
+    {
+        listing = (struct cygfuse_dir_listing *)fill.listing;
+        listing->flags = (uint32_t)flags;
+        listing->count = 0;
+    }
+
+    generation = cygfuse_pathcache_generation(&cygfuse_dir_cache, path);
+    result = cygfuse_cache_next->readdir(path, &fill, cygfuse_dir_filler, off, fi, flags);
+    if (0 == result && fill.cacheable)
+        cygfuse_pathcache_put(&cygfuse_dir_cache, path, generation,
+            fill.listing, fill.size, now + cygfuse_dir_ttl);
+    free(fill.listing);
+
+    return result;
+}
+
+/*
+ * Invalidating wrappers. Operations that could observe or be affected by
+ * data in the write-back buffers of the file first write them out.
+ *
+ * X(OP, PARAMS, ARGS, FLUSH, INVALIDATE)
+ */
+#define CYGFUSE_CACHE_INVALIDATE_LIST(X)\
+    X(mknod,                            \
+        (const char *path, fuse_mode_t mode, fuse_dev_t dev),\
+        (path, mode, dev),              \
+        (void)0,                        \
+        cygfuse_cache_invalidate(path, CYGFUSE_INVALIDATE_PARENT))\
+    X(mkdir,                            \
+        (const char *path, fuse_mode_t mode),\
+        (path, mode),                   \
+        (void)0,                        \
+        cygfuse_cache_invalidate(path, CYGFUSE_INVALIDATE_PARENT))\
+    X(unlink,                           \
+        (const char *path),             \
+        (path),                         \
+        cygfuse_writeback_flush_file(path, 0),\
+        cygfuse_cache_invalidate(path, CYGFUSE_INVALIDATE_PARENT))\
+    X(rmdir,                            \
+        (const char *path),             \
+        (path),                         \
+        (void)0,                        \
+        cygfuse_cache_invalidate(path, CYGFUSE_INVALIDATE_TREE | CYGFUSE_INVALIDATE_PARENT))\
+    X(symlink,                          \
+        (const char *dstpath, const char *srcpath),\
+        (dstpath, srcpath),             \
+        (void)0,                        \
+        cygfuse_cache_invalidate(srcpath, CYGFUSE_INVALIDATE_PARENT))\
+    X(rename,                           \
+        (const char *oldpath, const char *newpath, unsigned int flags),\
+        (oldpath, newpath, flags),      \
+        (cygfuse_writeback_flush_file(oldpath, 0),\
+        cygfuse_writeback_flush_file(newpath, 0)),\
+        (cygfuse_cache_invalidate(oldpath, CYGFUSE_INVALIDATE_TREE | CYGFUSE_INVALIDATE_PARENT),\
+        cygfuse_cache_invalidate(newpath, CYGFUSE_INVALIDATE_TREE | CYGFUSE_INVALIDATE_PARENT)))\
+    X(link,                             \
+        (const char *srcpath, const char *dstpath),\
+        (srcpath, dstpath),             \
+        (void)0,                        \
+        (cygfuse_cache_invalidate(srcpath, 0),\
+        cygfuse_cache_invalidate(dstpath, CYGFUSE_INVALIDATE_PARENT)))\
+    X(chmod,                            \
+        (const char *path, fuse_mode_t mode, struct fuse3_file_info *fi),\
+        (path, mode, fi),               \
+        (void)0,                        \
+        cygfuse_cache_invalidate(path, 0))\
+    X(chown,                            \
+        (const char *path, fuse_uid_t uid, fuse_gid_t gid, struct fuse3_file_info *fi),\
+        (path, uid, gid, fi),           \
+        (void)0,                        \
+        cygfuse_cache_invalidate(path, 0))\
+    X(truncate,                         \
+        (const char *path, fuse_off_t size, struct fuse3_file_info *fi),\
+        (path, size, fi),               \
+        cygfuse_writeback_flush_file(path, fi),\
+        cygfuse_cache_invalidate(path, 0))\
+    X(setxattr,                         \
+        (const char *path, const char *name, const char *value, size_t size, int flags),\
+        (path, name, value, size, flags),\
+        (void)0,                        \
+        cygfuse_cache_invalidate(path, 0))\
+    X(removexattr,                      \
+        (const char *path, const char *name),\
+        (path, name),                   \
+        (void)0,                        \
+        cygfuse_cache_invalidate(path, 0))\
+    X(utimens,                          \
+        (const char *path, const struct fuse_timespec tv[2], struct fuse3_file_info *fi),\
+        (path, tv, fi),                 \
+        cygfuse_writeback_flush_file(path, fi),\
+        cygfuse_cache_invalidate(path, 0))\
+    X(write_buf,                        \
+        (const char *path, struct fuse3_bufvec *buf, fuse_off_t off, struct fuse3_file_info *fi),\
+        (path, buf, off, fi),           \
+        cygfuse_writeback_flush_file(path, fi),\
+        cygfuse_cache_invalidate(path, 0))\
+    X(fallocate,                        \
+        (const char *path, int mode, fuse_off_t off, fuse_off_t len, struct fuse3_file_info *fi),\
+        (path, mode, off, len, fi),     \
+        cygfuse_writeback_flush_file(path, fi),\
+        cygfuse_cache_invalidate(path, 0))
+
+/* invalidate whether or not the operation succeeds; it may have partially succeeded */
+#define CYGFUSE_CACHE_WRAP(OP, PARAMS, ARGS, FLUSH, INVALIDATE)\
+    static int cygfuse_cache_ ## OP PARAMS\
+    {\
+        int result;\
+        FLUSH;\
+        result = cygfuse_cache_next->OP ARGS;\
+        INVALIDATE;\
+        return result;\
+    }
+CYGFUSE_CACHE_INVALIDATE_LIST(CYGFUSE_CACHE_WRAP)
+#undef CYGFUSE_CACHE_WRAP
+
+/*
+ * Open files are tracked for the write-back buffer (see
+ * cygfuse-writeback.c) if it is enabled. open, release, flush and fsync
+ * are installed whether the file system has them or not.
+ */
+static int cygfuse_cache_open(const char *path, struct fuse3_file_info *fi)
+{
+    int result;
+
+    if (O_TRUNC & fi->flags)
+        cygfuse_writeback_flush_file(path, 0);
+    result = 0 != cygfuse_cache_next->open ? cygfuse_cache_next->open(path, fi) : 0;
+    if (O_TRUNC & fi->flags)
+        cygfuse_cache_invalidate(path, 0);
+    if (0 == result && cygfuse_writeback_enabled())
+        cygfuse_writeback_open(path, fi);
+
+    return result;
+}
+
+static int cygfuse_cache_create(const char *path, fuse_mode_t mode, struct fuse3_file_info *fi)
+{
+    int result;
+
+    result = cygfuse_cache_next->create(path, mode, fi);
+    cygfuse_cache_invalidate(path, CYGFUSE_INVALIDATE_PARENT);
+    if (0 == result && cygfuse_writeback_enabled())
+        cygfuse_writeback_open(path, fi);
+
+    return result;
+}
+
+static int cygfuse_cache_write(const char *path, const char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    int result;
+
+    if (cygfuse_writeback_enabled())
+        result = cygfuse_writeback_write(path, buf, size, off, fi);
+    else
+        result = cygfuse_cache_next->write(path, buf, size, off, fi);
+    cygfuse_cache_invalidate(path, 0);
+
+    return result;
+}
+
+static int cygfuse_cache_read(const char *path, char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    cygfuse_writeback_flush_file(path, fi);
+    return cygfuse_cache_next->read(path, buf, size, off, fi);
+}
+
+static int cygfuse_cache_flush(const char *path, struct fuse3_file_info *fi)
+{
+    int result, error;
+
+    error = cygfuse_writeback_flush(path, fi);
+    result = 0 != cygfuse_cache_next->flush ? cygfuse_cache_next->flush(path, fi) : 0;
+
+    return 0 != error ? error : result;
+}
+
+static int cygfuse_cache_fsync(const char *path, int datasync, struct fuse3_file_info *fi)
+{
+    int result, error;
+
+    error = cygfuse_writeback_flush(path, fi);
+    result = 0 != cygfuse_cache_next->fsync ? cygfuse_cache_next->fsync(path, datasync, fi) : 0;
+
+    return 0 != error ? error : result;
+}
+
+static int cygfuse_cache_release(const char *path, struct fuse3_file_info *fi)
+{
+    cygfuse_writeback_release(path, fi);
+    return 0 != cygfuse_cache_next->release ? cygfuse_cache_next->release(path, fi) : 0;
+}
+
+int cygfuse_cache_init(void)
+{
+    const char *env = getenv(CYGFUSE_CACHE_ENV);
+    char *list, *name, *save;
+
+    if (0 == env || '\0' == env[0])
+        return 0;
+
+    list = strdup(env);
+    if (0 == list)
+        return 0;
+    for (name = strtok_r(list, ",", &save); 0 != name; name = strtok_r(0, ",", &save))
+    {
+        if (0 == strcmp(name, "attr"))
+            cygfuse_cache_enabled |= CYGFUSE_CACHE_ATTR;
+        else if (0 == strcmp(name, "neg"))
+            cygfuse_cache_enabled |= CYGFUSE_CACHE_NEG;
+        else if (0 == strcmp(name, "dir"))
+            cygfuse_cache_enabled |= CYGFUSE_CACHE_DIR;
+        else if (0 == strcmp(name, "write"))
+            cygfuse_cache_enabled |= CYGFUSE_CACHE_WRITE;
+        else
+            fprintf(stderr, "cygfuse: unknown cache: %s\n", name);
+    }
+    free(list);
+
+    if (cygfuse_cache_enabled & CYGFUSE_CACHE_ATTR)
+    {
+        /* a getattr per stat */
+        cygfuse_pathcache_init(&cygfuse_attr_cache, "attr", CYGFUSE_BUDGET_COST(1, 0),
+            CYGFUSE_CACHE_ENTRIES);
+        cygfuse_budget_register(&cygfuse_attr_cache.budget);
+    }
+    if (cygfuse_cache_enabled & CYGFUSE_CACHE_NEG)
+    {
+        cygfuse_pathcache_init(&cygfuse_neg_cache, "neg", CYGFUSE_BUDGET_COST(1, 0),
+            CYGFUSE_CACHE_ENTRIES);
+        if (!cygfuse_pathcache_filter(&cygfuse_neg_cache))
+            cygfuse_cache_enabled &= ~CYGFUSE_CACHE_NEG;
+        else
+            cygfuse_budget_register(&cygfuse_neg_cache.budget);
+    }
+    if (cygfuse_cache_enabled & CYGFUSE_CACHE_DIR)
+    {
+        /* a readdir per listing, however many names it has */
+        cygfuse_pathcache_init(&cygfuse_dir_cache, "dir", CYGFUSE_BUDGET_COST(1, 0),
+            CYGFUSE_CACHE_DIRS);
+        cygfuse_budget_register(&cygfuse_dir_cache.budget);
+    }
+    if (cygfuse_cache_enabled & (CYGFUSE_CACHE_ATTR | CYGFUSE_CACHE_NEG | CYGFUSE_CACHE_DIR))
+        cygfuse_cleanup_register(cygfuse_cache_clean);
+
+    return 0 != cygfuse_cache_enabled;
+}
+
+void cygfuse_cache_install(struct fuse3_operations *wrap, const struct fuse3_operations *next)
+{
+    cygfuse_cache_next = next;
+
+    wrap->init = cygfuse_cache_init_op;
+    wrap->destroy = cygfuse_cache_destroy_op;
+    if (0 != next->getattr &&
+        (cygfuse_cache_enabled & (CYGFUSE_CACHE_ATTR | CYGFUSE_CACHE_NEG | CYGFUSE_CACHE_WRITE)))
+        wrap->getattr = cygfuse_cache_getattr;
+    if (0 != next->readdir && (cygfuse_cache_enabled & CYGFUSE_CACHE_DIR))
+        wrap->readdir = cygfuse_cache_readdir;
+
+#define CYGFUSE_CACHE_INSTALL(OP, PARAMS, ARGS, FLUSH, INVALIDATE)\
+    if (0 != next->OP)\
+        wrap->OP = cygfuse_cache_ ## OP;
+    CYGFUSE_CACHE_INVALIDATE_LIST(CYGFUSE_CACHE_INSTALL)
+#undef CYGFUSE_CACHE_INSTALL
+    if (0 != next->open)
+        wrap->open = cygfuse_cache_open;
+    if (0 != next->create)
+        wrap->create = cygfuse_cache_create;
+    if (0 != next->write)
+        wrap->write = cygfuse_cache_write;
+
+    if (0 != next->write && (cygfuse_cache_enabled & CYGFUSE_CACHE_WRITE))
+    {
+        if (0 != next->read)
+            wrap->read = cygfuse_cache_read;
+        wrap->open = cygfuse_cache_open;
+        wrap->flush = cygfuse_cache_flush;
+        wrap->fsync = cygfuse_cache_fsync;
+        wrap->release = cygfuse_cache_release;
+    }
+}
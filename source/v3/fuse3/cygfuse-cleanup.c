@@ -0,0 +1,192 @@
+/**
+ * @file fuse3/cygfuse-cleanup.c
+ * Cleanup thread of the operations interposer.
+ *
+ * Layers that keep things that expire (see cygfuse-cache.c and
+ * cygfuse-prefetch.c) register a cleaner, which frees what has expired
+ * and returns when the next of what it still keeps expires. Expired
+ * entries are otherwise only dropped when they are looked up again or
+ * evicted, so without cleaning a long-running mount holds on to what it
+ * once cached for as long as it runs.
+ *
+ * cygfuse_cleanup_run, which is what fuse3_clean_cache does, runs all
+ * cleaners, gives the memory they freed back to the OS and returns the
+ * seconds until the next expiry (CYGFUSE_CLEANUP_MAXDELAY if nothing
+ * expires sooner). The cleanup thread runs it and then sleeps for as long
+ * as it says. The thread is started by fuse3_start_cleanup_thread and by
+ * the layers when the file system is initialized, and is stopped when
+ * each start has been matched by a stop; WinFsp itself never starts it.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cygfuse-internal.h"
+
+static pthread_once_t cygfuse_cleanup_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t cygfuse_cleanup_control = PTHREAD_MUTEX_INITIALIZER;   /* start and stop */
+static pthread_mutex_t cygfuse_cleanup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cygfuse_cleanup_cond;
+static pthread_t cygfuse_cleanup_thread;
+static unsigned cygfuse_cleanup_starts;
+static int cygfuse_cleanup_running, cygfuse_cleanup_stopping;
+static uint64_t (*cygfuse_cleanup_list[CYGFUSE_CLEANUP_MAX])(uint64_t now, size_t *pfreed);
+static unsigned cygfuse_cleanup_count;
+
+void cygfuse_cleanup_register(uint64_t (*clean)(uint64_t now, size_t *pfreed))
+{
+    pthread_mutex_lock(&cygfuse_cleanup_mutex);
+    for (unsigned i = 0; cygfuse_cleanup_count > i; i++)
+        if (clean == cygfuse_cleanup_list[i])
+            goto exit;
+    if (CYGFUSE_CLEANUP_MAX > cygfuse_cleanup_count)
+    {
+        cygfuse_cleanup_list[cygfuse_cleanup_count] = clean;
+        __atomic_store_n(&cygfuse_cleanup_count, cygfuse_cleanup_count + 1, __ATOMIC_RELEASE);
+    }
+
+exit:
+    pthread_mutex_unlock(&cygfuse_cleanup_mutex);
+}
+
+int cygfuse_cleanup_run(void)
+{
+    unsigned count = __atomic_load_n(&cygfuse_cleanup_count, __ATOMIC_ACQUIRE);
+    uint64_t now = cygfuse_now(), next = UINT64_MAX, expiry;
+    size_t freed = 0;
+
+    for (unsigned i = 0; count > i; i++)
+    {
+        expiry = cygfuse_cleanup_list[i](now, &freed);
+        if (next > expiry)
+            next = expiry;
+    }
+
+    /* freed memory stays with the process unless it is trimmed */
+    if (0 != freed)
+        malloc_trim(0);
+
+    if (next <= now)
+        return 1;
+    if ((uint64_t)CYGFUSE_CLEANUP_MAXDELAY * 1000000000 <= next - now)
+        return CYGFUSE_CLEANUP_MAXDELAY;
+    return (int)((next - now + 999999999) / 1000000000);
+}
+
+static void *cygfuse_cleanup_worker(void *arg)
+{
+    struct timespec deadline;
+    int delay;
+
+    (void)arg;
+    pthread_mutex_lock(&cygfuse_cleanup_mutex);
+    while (!cygfuse_cleanup_stopping)
+    {
+        pthread_mutex_unlock(&cygfuse_cleanup_mutex);
+        delay = cygfuse_cleanup_run();
+        pthread_mutex_lock(&cygfuse_cleanup_mutex);
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += delay;
+        while (!cygfuse_cleanup_stopping &&
+            0 == pthread_cond_timedwait(&cygfuse_cleanup_cond, &cygfuse_cleanup_mutex, &deadline))
+            ;
+    }
+    pthread_mutex_unlock(&cygfuse_cleanup_mutex);
+
+    return 0;
+}
+
+static void cygfuse_cleanup_atfork_prepare(void)
+{
+    pthread_mutex_lock(&cygfuse_cleanup_control);
+    pthread_mutex_lock(&cygfuse_cleanup_mutex);
+}
+
+static void cygfuse_cleanup_atfork_parent(void)
+{
+    pthread_mutex_unlock(&cygfuse_cleanup_mutex);
+    pthread_mutex_unlock(&cygfuse_cleanup_control);
+}
+
+/* the child has no thread; the next start starts one if there are starts outstanding */
+static void cygfuse_cleanup_atfork_child(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_mutex_init(&cygfuse_cleanup_control, 0);
+    pthread_mutex_init(&cygfuse_cleanup_mutex, 0);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cygfuse_cleanup_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    cygfuse_cleanup_running = 0;
+    cygfuse_cleanup_stopping = 0;
+}
+
+static void cygfuse_cleanup_initonce(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cygfuse_cleanup_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_atfork(cygfuse_cleanup_atfork_prepare, cygfuse_cleanup_atfork_parent,
+        cygfuse_cleanup_atfork_child);
+}
+
+int cygfuse_cleanup_start(void)
+{
+    int result = 0;
+
+    pthread_once(&cygfuse_cleanup_once, cygfuse_cleanup_initonce);
+
+    pthread_mutex_lock(&cygfuse_cleanup_control);
+    if (!cygfuse_cleanup_running)
+    {
+        if (0 != pthread_create(&cygfuse_cleanup_thread, 0, cygfuse_cleanup_worker, 0))
+        {
+            result = -1;
+            goto exit;
+        }
+        cygfuse_cleanup_running = 1;
+    }
+    cygfuse_cleanup_starts++;
+
+exit:
+    pthread_mutex_unlock(&cygfuse_cleanup_control);
+    return result;
+}
+
+void cygfuse_cleanup_stop(void)
+{
+    pthread_mutex_lock(&cygfuse_cleanup_control);
+    if (0 == cygfuse_cleanup_starts || 0 != --cygfuse_cleanup_starts || !cygfuse_cleanup_running)
+        goto exit;
+
+    pthread_mutex_lock(&cygfuse_cleanup_mutex);
+    cygfuse_cleanup_stopping = 1;
+    pthread_cond_broadcast(&cygfuse_cleanup_cond);
+    pthread_mutex_unlock(&cygfuse_cleanup_mutex);
+
+    pthread_join(cygfuse_cleanup_thread, 0);
+
+    cygfuse_cleanup_stopping = 0;
+    cygfuse_cleanup_running = 0;
+
+exit:
+    pthread_mutex_unlock(&cygfuse_cleanup_control);
+}
@@ -0,0 +1,225 @@
+/**
+ * @file fuse3/cygfuse-handle.c
+ * Open file handles of the operations interposer.
+ *
+ * Layers of the interposer that keep state per open file (readahead,
+ * write-back, passthrough) find it through a table of handles that is
+ * filled by open and create and emptied by release. The file handle (fh)
+ * that the file system returns is opaque to cygfuse and is left alone;
+ * handles are looked up by the fh if the file system sets one and by path
+ * otherwise. In the latter case all opens of a file share a handle, and
+ * handles are rekeyed when the file is renamed.
+ *
+ * A handle is reference counted; the table holds a reference for as long
+ * as the file is open, and lookups and asynchronous work hold their own.
+ *
+ * The table also keeps a generation per hashed path that is incremented
+ * whenever the data of a file may have changed, so that data kept on
+ * behalf of one handle can be checked against changes made through
+ * another.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+
+#define CYGFUSE_HANDLE_BUCKETS          256
+#define CYGFUSE_HANDLE_DATAGENS         1024
+
+static pthread_mutex_t cygfuse_handle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cygfuse_handle *cygfuse_handle_buckets[CYGFUSE_HANDLE_BUCKETS];
+static uint64_t cygfuse_handle_datagens[CYGFUSE_HANDLE_DATAGENS];
+
+/* fh keys have the low bit set; path keys are hashes with the low bit clear */
+static inline uint64_t cygfuse_handle_key(const char *path, uint64_t fh)
+{
+    if (0 != fh)
+        return (fh << 1) | 1;
+    return 0 != path ? cygfuse_hash_path(path) & ~(uint64_t)1 : 0;
+}
+
+static struct cygfuse_handle **cygfuse_handle_find(uint64_t key)
+{
+    struct cygfuse_handle **p;
+
+    for (p = &cygfuse_handle_buckets[key % CYGFUSE_HANDLE_BUCKETS]; 0 != *p; p = &(*p)->hnext)
+        if (key == (*p)->key)
+            break;
+
+    return p;
+}
+
+struct cygfuse_handle *cygfuse_handle_open(const char *path, const struct fuse3_file_info *fi)
+{
+    uint64_t key = cygfuse_handle_key(path, fi->fh);
+    struct cygfuse_handle **p, *handle;
+
+    if (0 == key)
+        return 0;
+
+    pthread_mutex_lock(&cygfuse_handle_mutex);
+    p = cygfuse_handle_find(key);
+    handle = *p;
+    if (0 == handle)
+    {
+        handle = calloc(1, sizeof *handle);
+        if (0 == handle)
+            goto exit;
+        handle->key = key;
+        handle->refcount = 1;
+        handle->backingfd = -1;
+        pthread_mutex_init(&handle->mutex, 0);
+        pthread_cond_init(&handle->cond, 0);
+        *p = handle;
+    }
+    handle->opens++;
+    __atomic_add_fetch(&handle->refcount, 1, __ATOMIC_RELAXED);
+
+exit:
+    pthread_mutex_unlock(&cygfuse_handle_mutex);
+    return handle;
+}
+
+struct cygfuse_handle *cygfuse_handle_get(const char *path, const struct fuse3_file_info *fi)
+{
+    uint64_t key;
+    struct cygfuse_handle *handle;
+
+    if (0 == fi)
+        return 0;
+    key = cygfuse_handle_key(path, fi->fh);
+    if (0 == key)
+        return 0;
+
+    pthread_mutex_lock(&cygfuse_handle_mutex);
+    handle = *cygfuse_handle_find(key);
+    if (0 != handle)
+        __atomic_add_fetch(&handle->refcount, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cygfuse_handle_mutex);
+
+    return handle;
+}
+
+void cygfuse_handle_put(struct cygfuse_handle *handle)
+{
+    if (0 != __atomic_sub_fetch(&handle->refcount, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    /* the state of the layers goes with the last reference, which may outlive the last close */
+    free(handle->readahead);
+    cygfuse_writeback_free(handle->writeback);
+    if (-1 != handle->backingfd)
+        close(handle->backingfd);
+    pthread_mutex_destroy(&handle->mutex);
+    pthread_cond_destroy(&handle->cond);
+    free(handle);
+}
+
+int cygfuse_handle_close(struct cygfuse_handle *handle)
+{
+    struct cygfuse_handle **p;
+    int last;
+
+    pthread_mutex_lock(&cygfuse_handle_mutex);
+    last = 0 == --handle->opens;
+    if (last)
+    {
+        p = cygfuse_handle_find(handle->key);
+        if (handle == *p)
+            *p = handle->hnext;
+    }
+    pthread_mutex_unlock(&cygfuse_handle_mutex);
+
+    if (last)
+        cygfuse_handle_put(handle);
+    return last;
+}
+
+void cygfuse_handle_rename(const char *oldpath, const char *newpath)
+{
+    uint64_t oldkey = cygfuse_handle_key(oldpath, 0), newkey = cygfuse_handle_key(newpath, 0);
+    struct cygfuse_handle **p, *handle;
+
+    if (0 == oldkey || 0 == newkey)
+        return;
+
+    pthread_mutex_lock(&cygfuse_handle_mutex);
+    p = cygfuse_handle_find(oldkey);
+    handle = *p;
+    if (0 != handle && 0 == *cygfuse_handle_find(newkey))
+    {
+        *p = handle->hnext;
+        handle->key = newkey;
+        p = &cygfuse_handle_buckets[newkey % CYGFUSE_HANDLE_BUCKETS];
+        handle->hnext = *p;
+        *p = handle;
+    }
+    pthread_mutex_unlock(&cygfuse_handle_mutex);
+}
+
+/* fn is called without the table mutex and with a reference to the handle */
+void cygfuse_handle_foreach(void (*fn)(struct cygfuse_handle *handle, void *ctx), void *ctx)
+{
+    struct cygfuse_handle **handles, *handle;
+    size_t max = 0, count = 0, i;
+
+    pthread_mutex_lock(&cygfuse_handle_mutex);
+    for (i = 0; CYGFUSE_HANDLE_BUCKETS > i; i++)
+        for (handle = cygfuse_handle_buckets[i]; 0 != handle; handle = handle->hnext)
+            max++;
+    pthread_mutex_unlock(&cygfuse_handle_mutex);
+    if (0 == max)
+        return;
+
+    /* handles opened in between are left for the next time */
+    handles = malloc(max * sizeof *handles);
+    if (0 == handles)
+        return;
+    pthread_mutex_lock(&cygfuse_handle_mutex);
+    for (i = 0; CYGFUSE_HANDLE_BUCKETS > i; i++)
+        for (handle = cygfuse_handle_buckets[i]; 0 != handle && max > count; handle = handle->hnext)
+        {
+            __atomic_add_fetch(&handle->refcount, 1, __ATOMIC_RELAXED);
+            handles[count++] = handle;
+        }
+    pthread_mutex_unlock(&cygfuse_handle_mutex);
+
+    for (i = 0; count > i; i++)
+    {
+        fn(handles[i], ctx);
+        cygfuse_handle_put(handles[i]);
+    }
+    free(handles);
+}
+
+uint64_t cygfuse_handle_datagen(const char *path)
+{
+    if (0 == path)
+        return 0;
+    return __atomic_load_n(&cygfuse_handle_datagens[
+        cygfuse_hash_path(path) % CYGFUSE_HANDLE_DATAGENS], __ATOMIC_ACQUIRE);
+}
+
+void cygfuse_handle_datachanged(const char *path)
+{
+    if (0 == path)
+        return;
+    __atomic_add_fetch(&cygfuse_handle_datagens[
+        cygfuse_hash_path(path) % CYGFUSE_HANDLE_DATAGENS], 1, __ATOMIC_RELEASE);
+}
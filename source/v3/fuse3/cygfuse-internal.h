@@ -0,0 +1,413 @@
+/**
+ * @file fuse3/cygfuse-internal.h
+ * Declarations shared between the cygfuse source files.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#ifndef CYGFUSE_INTERNAL_H_INCLUDED
+#define CYGFUSE_INTERNAL_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* cygfuse-locate.c */
+#define CYGFUSE_WINFSP_REGPATH          \
+    "/proc/registry32/HKEY_LOCAL_MACHINE/Software/WinFsp/InstallDir"
+#define CYGFUSE_WINFSP_CACHE            "/var/run/cygfuse-winfsp"
+#define CYGFUSE_WINFSP_ENV              "CYGFUSE_WINFSP"
+void *cygfuse_locate_winfsp(const char *name, const char *regpath, const char *cachepath);
+
+/* cygfuse-fork.c */
+struct cygfuse_api_desc
+{
+    const char *name;
+    void *thunk;
+    void *fallback;
+};
+void cygfuse_api_reset(void **table, const struct cygfuse_api_desc *desc, size_t count);
+int cygfuse_api_revalidate(void *handle, void **table,
+    const struct cygfuse_api_desc *desc, size_t count);
+
+/*
+ * Per-thread data, such as the counters of cygfuse-stats.c and the rings
+ * of cygfuse-record.c and cygfuse-trace.c. The data of a thread is found
+ * through a thread key whose destructor is cygfuse_tls_retire, and is
+ * also kept on a list, which is never shrunk, for readers that go through
+ * the data of all threads. The data of an exited thread is reused by the
+ * next new thread. The struct cygfuse_tls must be the first member.
+ */
+struct cygfuse_tls
+{
+    struct cygfuse_tls *next;
+    int free;
+};
+static inline void cygfuse_tls_retire(void *data)
+{
+    __atomic_store_n(&((struct cygfuse_tls *)data)->free, 1, __ATOMIC_RELEASE);
+}
+/* returns the data of the calling thread or 0; *passigned is set if it was assigned just now */
+static inline void *cygfuse_tls_get(pthread_key_t key, struct cygfuse_tls **list, size_t size,
+    int *passigned)
+{
+    struct cygfuse_tls *tls;
+
+    *passigned = 0;
+    tls = pthread_getspecific(key);
+    if (0 != tls)
+        return tls;
+
+    for (tls = __atomic_load_n(list, __ATOMIC_ACQUIRE); 0 != tls; tls = tls->next)
+        if (__atomic_exchange_n(&tls->free, 0, __ATOMIC_ACQ_REL))
+            break;
+
+    if (0 == tls)
+    {
+        tls = calloc(1, size);
+        if (0 == tls)
+            return 0;
+        tls->next = __atomic_load_n(list, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(list, &tls->next, tls,
+            1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    if (0 != pthread_setspecific(key, tls))
+    {
+        cygfuse_tls_retire(tls);
+        return 0;
+    }
+    *passigned = 1;
+    return tls;
+}
+
+/* cygfuse-stats.c */
+#define CYGFUSE_STATS_ENV               "CYGFUSE_STATS"
+#define CYGFUSE_HIST_SUBBITS            2
+#define CYGFUSE_HIST_SUB                (1 << CYGFUSE_HIST_SUBBITS)
+#define CYGFUSE_HIST_MAXBIT             47  /* ~39 hours */
+#define CYGFUSE_HIST_BUCKETS            \
+    ((CYGFUSE_HIST_MAXBIT - CYGFUSE_HIST_SUBBITS + 2) * CYGFUSE_HIST_SUB)
+struct cygfuse_stat
+{
+    uint64_t count;
+    uint64_t errors;
+    uint64_t sum;
+    uint64_t hist[CYGFUSE_HIST_BUCKETS];
+};
+struct cygfuse_stats
+{
+    const char *title;
+    const char *const *names;
+    size_t count;
+    pthread_key_t key;
+    struct cygfuse_tls *shards;
+    struct cygfuse_stats *next;
+};
+#define CYGFUSE_STATS_INIT(title, names)\
+    { title, names, sizeof names / sizeof names[0] }
+struct cygfuse_stats_timer
+{
+    struct cygfuse_stats *stats;
+    size_t index;
+    uint64_t start;
+    int error;
+};
+unsigned cygfuse_hist_bucket(uint64_t ns);
+uint64_t cygfuse_hist_upper(unsigned bucket);
+int cygfuse_stats_init(void);
+int cygfuse_stats_enabled(void);
+void cygfuse_stats_register(struct cygfuse_stats *stats);
+void cygfuse_stats_record(struct cygfuse_stats *stats, size_t index, uint64_t ns, int error);
+void cygfuse_stats_merge(struct cygfuse_stats *stats, size_t index, struct cygfuse_stat *out);
+void cygfuse_stats_dump(struct cygfuse_stats *stats, FILE *file);
+void cygfuse_stats_report(void (*report)(FILE *file));
+void cygfuse_dump_register(void (*dump)(void));
+int cygfuse_dump_enabled(void);
+void cygfuse_dump(void);
+static inline uint64_t cygfuse_hash_path(const char *path)
+{
+    /* FNV-1a */
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++)
+        hash = (hash ^ *p) * 0x100000001b3ULL;
+    return hash;
+}
+static inline uint64_t cygfuse_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+static inline struct cygfuse_stats_timer cygfuse_stats_timer_start(
+    struct cygfuse_stats *stats, size_t index)
+{
+    struct cygfuse_stats_timer timer = { stats, index, cygfuse_now(), 0 };
+    return timer;
+}
+static inline void cygfuse_stats_timer_stop(struct cygfuse_stats_timer *timer)
+{
+    cygfuse_stats_record(timer->stats, timer->index, cygfuse_now() - timer->start, timer->error);
+}
+
+/* cygfuse-record.c */
+#define CYGFUSE_RECORD_ENV              "CYGFUSE_RECORD"
+#define CYGFUSE_RECORD_ENTRIES          256 /* per thread; power of 2 */
+struct cygfuse_record_entry
+{
+    uint64_t seq;
+    uint32_t op;
+    int32_t result;
+    uint64_t path;
+    uint64_t fh;
+    uint64_t size;
+    int64_t offset;
+    uint64_t start;
+    uint64_t end;
+};
+uint64_t cygfuse_record_hash(const char *path);
+int cygfuse_record_init(const char *const *names, size_t count);
+int cygfuse_record_enabled(void);
+struct cygfuse_record_entry *cygfuse_record_begin(unsigned op,
+    const char *path, uint64_t fh, uint64_t size, int64_t offset, uint64_t start);
+void cygfuse_record_end(struct cygfuse_record_entry *entry, int result, uint64_t end,
+    uint64_t fh);
+void cygfuse_record_dump(FILE *file);
+
+/* cygfuse-trace.c */
+#define CYGFUSE_TRACE_ENV               "CYGFUSE_TRACE"
+#define CYGFUSE_TRACE_ENTRIES           1024/* per thread; power of 2 */
+#define CYGFUSE_TRACE_PATHMAX           104
+#define CYGFUSE_TRACE_INTERVAL          50  /* ms */
+int cygfuse_trace_init(const char *const *names, size_t count);
+int cygfuse_trace_enabled(void);
+void cygfuse_trace_span(unsigned op, const char *path, int result, uint64_t start, uint64_t end);
+void cygfuse_trace_fini(void);
+
+/* cygfuse-budget.c */
+#define CYGFUSE_BUDGET_MAX              16  /* caches */
+#define CYGFUSE_BUDGET_SHARED           0x0001  /* shared with other processes; not counted */
+#define CYGFUSE_BUDGET_CALL             64  /* KiB that could be transferred in the time of a call */
+#define CYGFUSE_BUDGET_COST(calls, bytes)\
+    ((calls) * CYGFUSE_BUDGET_CALL + (bytes) / 1024)
+struct cygfuse_budget
+{
+    const char *name;
+    unsigned flags;
+    unsigned cost;                      /* of getting an item back; see CYGFUSE_BUDGET_COST */
+    size_t (*evict)(void *ctx, size_t goal);    /* returns the bytes freed; optional */
+    void (*counters)(void *ctx, uint64_t *hits, uint64_t *misses);  /* optional */
+    void *ctx;
+    uint64_t used, items, peak, evicted, refused;
+};
+#define CYGFUSE_BUDGET_INIT(name, flags, cost, evict, counters, ctx)\
+    { name, flags, cost, evict, counters, ctx }
+int cygfuse_budget_init(const char *limit);
+void cygfuse_budget_register(struct cygfuse_budget *budget);
+int cygfuse_budget_charge(struct cygfuse_budget *budget, size_t size);
+void cygfuse_budget_release(struct cygfuse_budget *budget, size_t size);
+size_t cygfuse_budget_reclaim(void);
+int cygfuse_budget_pressure(void);
+uint64_t cygfuse_budget_used(void);
+void cygfuse_budget_report(FILE *file);
+
+/* cygfuse-pathcache.c */
+#define CYGFUSE_PATHCACHE_SHARDS        16  /* power of 2 */
+struct cygfuse_pathcache_lru
+{
+    struct cygfuse_pathcache_lru *prev, *next;
+};
+struct cygfuse_pathcache_entry;
+struct cygfuse_pathcache_shard
+{
+    pthread_mutex_t mutex;
+    struct cygfuse_pathcache_entry **buckets;
+    size_t nbuckets;
+    size_t count;
+    uint64_t generation;
+    struct cygfuse_pathcache_lru lru;
+} __attribute__ ((aligned(64)));
+struct cygfuse_pathcache
+{
+    const char *name;
+    size_t max_entries;                 /* per shard */
+    uint64_t entries, hits, misses, evictions, expirations;
+    uint64_t *filter;                   /* optional Bloom filter */
+    size_t filter_mask;
+    uint64_t filter_count;
+    int filter_rebuild;
+    struct cygfuse_budget budget;
+    struct cygfuse_pathcache_shard shard[CYGFUSE_PATHCACHE_SHARDS];
+};
+void cygfuse_pathcache_init(struct cygfuse_pathcache *cache, const char *name, unsigned cost,
+    size_t max_entries);
+int cygfuse_pathcache_filter(struct cygfuse_pathcache *cache);
+uint64_t cygfuse_pathcache_generation(struct cygfuse_pathcache *cache, const char *path);
+int cygfuse_pathcache_visit(struct cygfuse_pathcache *cache, const char *path, uint64_t now,
+    int (*fn)(void *ctx, const void *value, size_t size), void *ctx);
+int cygfuse_pathcache_get(struct cygfuse_pathcache *cache, const char *path, uint64_t now,
+    void *value, size_t size);
+int cygfuse_pathcache_put(struct cygfuse_pathcache *cache, const char *path, uint64_t generation,
+    const void *value, size_t size, uint64_t expiry);
+void cygfuse_pathcache_remove(struct cygfuse_pathcache *cache, const char *path);
+void cygfuse_pathcache_remove_tree(struct cygfuse_pathcache *cache, const char *path);
+void cygfuse_pathcache_clear(struct cygfuse_pathcache *cache);
+uint64_t cygfuse_pathcache_expire(struct cygfuse_pathcache *cache, uint64_t now, size_t *pfreed);
+
+/* cygfuse-pool.c */
+#define CYGFUSE_POOL_THREADS            16
+#define CYGFUSE_POOL_QUEUE              256
+#define CYGFUSE_POOL_IDLE               10  /* seconds */
+int cygfuse_pool_submit(void (*fn)(void *arg), void *arg);
+
+/* cygfuse-shmcache.c */
+#define CYGFUSE_SHMCACHE_WAYS           8
+struct cygfuse_shmcache_header;
+struct cygfuse_shmcache
+{
+    struct cygfuse_shmcache_header *header;
+    size_t size;
+};
+int cygfuse_shmcache_attach(struct cygfuse_shmcache *cache, const char *name,
+    uint64_t size, uint32_t blocksize, gid_t group);
+void cygfuse_shmcache_detach(struct cygfuse_shmcache *cache);
+int cygfuse_shmcache_unlink(const char *name);
+void cygfuse_shmcache_counters(struct cygfuse_shmcache *cache, uint64_t *hits, uint64_t *misses);
+ssize_t cygfuse_shmcache_get(struct cygfuse_shmcache *cache, uint64_t name, uint64_t check,
+    void *buf, size_t off, size_t size);
+void cygfuse_shmcache_put(struct cygfuse_shmcache *cache, uint64_t name, uint64_t check,
+    const void *data, size_t datalen);
+void cygfuse_shmcache_remove(struct cygfuse_shmcache *cache, uint64_t name);
+
+/* cygfuse-ops.c (fuse3 only) */
+#define CYGFUSE_OPT_MEMORY              "cygfuse_memory="
+struct fuse_args;
+struct fuse_operations;
+const struct fuse_operations *cygfuse_ops_interpose(const struct fuse_operations *ops,
+    size_t *popsize);
+int cygfuse_ops_args(struct fuse_args *args);
+void cygfuse_ops_invalidate(const char *path, uint32_t action);
+
+/* cygfuse-cache.c (fuse3 only) */
+#define CYGFUSE_CACHE_ENV               "CYGFUSE_CACHE"
+#define CYGFUSE_CACHE_ENTRIES           65536
+#define CYGFUSE_CACHE_DIRS              1024
+#define CYGFUSE_CACHE_DIRSIZE           (16 * 1024 * 1024)  /* largest cached listing */
+#define CYGFUSE_INVALIDATE_PARENT       0x0001  /* also the parent directory */
+#define CYGFUSE_INVALIDATE_TREE         0x0002  /* also everything under a directory */
+int cygfuse_cache_init(void);
+void cygfuse_cache_install(struct fuse_operations *wrap, const struct fuse_operations *next);
+void cygfuse_cache_invalidate(const char *path, unsigned flags);
+
+/* cygfuse-cleanup.c (fuse3 only) */
+#define CYGFUSE_CLEANUP_MAX             4
+#define CYGFUSE_CLEANUP_MAXDELAY        600 /* seconds */
+void cygfuse_cleanup_register(uint64_t (*clean)(uint64_t now, size_t *pfreed));
+int cygfuse_cleanup_run(void);
+int cygfuse_cleanup_start(void);
+void cygfuse_cleanup_stop(void);
+
+/* cygfuse-handle.c (fuse3 only) */
+struct fuse_file_info;
+struct fuse_stat;
+struct cygfuse_readahead;
+struct cygfuse_writeback;
+struct cygfuse_handle
+{
+    struct cygfuse_handle *hnext;
+    uint64_t key;
+    unsigned refcount;
+    unsigned opens;
+    pthread_mutex_t mutex;              /* protects the per-layer state below */
+    pthread_cond_t cond;
+    struct cygfuse_readahead *readahead;
+    struct cygfuse_writeback *writeback;
+    int backingfd;                      /* passthrough descriptor or -1 */
+};
+struct cygfuse_handle *cygfuse_handle_open(const char *path, const struct fuse_file_info *fi);
+struct cygfuse_handle *cygfuse_handle_get(const char *path, const struct fuse_file_info *fi);
+void cygfuse_handle_put(struct cygfuse_handle *handle);
+int cygfuse_handle_close(struct cygfuse_handle *handle);
+void cygfuse_handle_rename(const char *oldpath, const char *newpath);
+void cygfuse_handle_foreach(void (*fn)(struct cygfuse_handle *handle, void *ctx), void *ctx);
+uint64_t cygfuse_handle_datagen(const char *path);
+void cygfuse_handle_datachanged(const char *path);
+
+/* cygfuse-writeback.c (fuse3 only) */
+#define CYGFUSE_WRITEBACK_CHUNK         (128 * 1024)    /* if max_write is 0 */
+#define CYGFUSE_WRITEBACK_BUDGET        (64 * 1024 * 1024)
+int cygfuse_writeback_enabled(void);
+void cygfuse_writeback_setup(const struct fuse_operations *next, size_t max_write);
+int cygfuse_writeback_write(const char *path, const char *buf, size_t size, int64_t off,
+    struct fuse_file_info *fi);
+void cygfuse_writeback_flush_file(const char *path, const struct fuse_file_info *fi);
+int cygfuse_writeback_getattr(const char *path, const struct fuse_file_info *fi,
+    struct fuse_stat *stbuf);
+int cygfuse_writeback_flush(const char *path, struct fuse_file_info *fi);
+void cygfuse_writeback_open(const char *path, struct fuse_file_info *fi);
+int cygfuse_writeback_release(const char *path, struct fuse_file_info *fi);
+void cygfuse_writeback_free(struct cygfuse_writeback *wb);
+
+/* cygfuse-blockcache.c (fuse3 only) */
+#define CYGFUSE_BLOCKCACHE_ENV          "CYGFUSE_BLOCKCACHE"
+#define CYGFUSE_BLOCKCACHE_SIZE_ENV     "CYGFUSE_BLOCKCACHE_SIZE"
+#define CYGFUSE_BLOCKCACHE_BLOCK        (128 * 1024)
+#define CYGFUSE_BLOCKCACHE_MAXSIZE      1024    /* MiB, if CYGFUSE_BLOCKCACHE_SIZE is not set */
+#define CYGFUSE_BLOCKCACHE_TOUCH        60      /* seconds */
+#define CYGFUSE_SHMCACHE_ENV            "CYGFUSE_SHMCACHE"
+#define CYGFUSE_SHMCACHE_SIZE_ENV       "CYGFUSE_SHMCACHE_SIZE"
+#define CYGFUSE_SHMCACHE_GROUP_ENV      "CYGFUSE_SHMCACHE_GROUP"
+#define CYGFUSE_SHMCACHE_MAXSIZE        256     /* MiB, if CYGFUSE_SHMCACHE_SIZE is not set */
+int cygfuse_blockcache_init(void);
+void cygfuse_blockcache_fini(void);
+void cygfuse_blockcache_invalidate(const char *path);
+void cygfuse_blockcache_install(struct fuse_operations *wrap, const struct fuse_operations *next);
+
+/* cygfuse-passthrough.c (fuse3 only) */
+#define CYGFUSE_PASSTHROUGH_ENV         "CYGFUSE_PASSTHROUGH"
+int cygfuse_passthrough_init(void);
+int cygfuse_passthrough_open(struct fuse_file_info *fi, int fd);
+void cygfuse_passthrough_install(struct fuse_operations *wrap, const struct fuse_operations *next);
+
+/* cygfuse-notify.c (fuse3 only) */
+#define CYGFUSE_NOTIFY_ENV              "CYGFUSE_NOTIFY"
+#define CYGFUSE_NOTIFY_QUEUE            65536   /* paths */
+#define CYGFUSE_NOTIFY_MAXDELAY         10000   /* ms */
+#define CYGFUSE_NOTIFY_ATTRS            (FSP_FUSE_NOTIFY_CHMOD | FSP_FUSE_NOTIFY_CHOWN |\
+    FSP_FUSE_NOTIFY_UTIME | FSP_FUSE_NOTIFY_CHFLAGS | FSP_FUSE_NOTIFY_TRUNCATE)
+struct fuse;
+int cygfuse_notify_init(void);
+void cygfuse_notify_install(struct fuse_operations *wrap, const struct fuse_operations *next);
+int cygfuse_notify_queue(struct fuse *f, const char *path, uint32_t action,
+    int (*deliver)(struct fuse *f, const char *path, uint32_t action));
+
+/* cygfuse-prefetch.c (fuse3 only) */
+#define CYGFUSE_PREFETCH_ENV            "CYGFUSE_PREFETCH"
+#define CYGFUSE_PREFETCH_GETATTR        8   /* getattr tasks per readdir */
+#define CYGFUSE_READAHEAD_CHUNK         (128 * 1024)
+#define CYGFUSE_READAHEAD_MAX           (1024 * 1024)   /* if max_readahead is 0 */
+#define CYGFUSE_READAHEAD_SLOTS         64
+#define CYGFUSE_READAHEAD_IDLE          30  /* seconds */
+int cygfuse_prefetch_init(void);
+void cygfuse_prefetch_install(struct fuse_operations *wrap, const struct fuse_operations *next,
+    const struct fuse_operations *top);
+
+/* cygfuse-buf.c (fuse3 only) */
+struct fuse_bufvec;
+size_t cygfuse_buf_size(const struct fuse_bufvec *bufv);
+ssize_t cygfuse_buf_copy(struct fuse_bufvec *dst, struct fuse_bufvec *src, int flags);
+void cygfuse_buf_install(struct fuse_operations *wrap, const struct fuse_operations *next);
+
+#endif
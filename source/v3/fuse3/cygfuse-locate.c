@@ -0,0 +1,196 @@
+/**
+ * @file fuse3/cygfuse-locate.c
+ * Locate and load the WinFsp DLL.
+ *
+ * The WinFsp DLL is found in this order:
+ *
+ * - The path in the CYGFUSE_WINFSP environment variable, if set. No other
+ *   location is tried in this case.
+ * - The path remembered in the provider location cache, provided that the
+ *   WinFsp InstallDir registry value has not changed since it was written.
+ * - The DLL name alone, i.e. the regular DLL search path.
+ * - The bin directory under the WinFsp InstallDir registry value. A path
+ *   found this way is remembered in the provider location cache.
+ *
+ * The cache saves the registry read and path conversion that would
+ * otherwise be needed on every process start (and again after every
+ * daemonization) when WinFsp is not on the DLL search path. It is a
+ * per-user file that holds the modification time of the registry value
+ * and the POSIX path of the DLL; it is ignored unless it is owned by the
+ * current user and writable by no one else.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cygfuse-internal.h"
+
+#if defined(__CYGWIN__) && !defined(CYGFUSE_STUB_BUILD)
+#include <sys/cygwin.h>
+
+static char *cygfuse_winpath_to_posix(const char *winpath)
+{
+    return (char *)cygwin_create_path(CCP_WIN_A_TO_POSIX | CCP_PROC_CYGDRIVE, winpath);
+}
+#else
+/*
+ * Allow the lookup to be exercised on other POSIX systems against a fake
+ * registry tree whose "Windows" paths are POSIX paths with backslashes.
+ */
+static char *cygfuse_winpath_to_posix(const char *winpath)
+{
+    char *psxpath = strdup(winpath);
+    if (0 != psxpath)
+        for (char *p = psxpath; *p; p++)
+            if ('\\' == *p)
+                *p = '/';
+    return psxpath;
+}
+#endif
+
+#define CYGFUSE_WINFSP_BINDIR           "bin\\"
+
+static void cygfuse_cache_name(char *buf, size_t size, const char *cachepath)
+{
+    snprintf(buf, size, "%s.%u.cache", cachepath, (unsigned)getuid());
+}
+
+static int cygfuse_cache_read(const char *cachepath, const struct stat *regst,
+    char *psxpath, size_t size)
+{
+    char name[PATH_MAX], line[64];
+    long long sec;
+    long nsec;
+    struct stat st;
+    FILE *f;
+    int found = 0;
+
+    cygfuse_cache_name(name, sizeof name, cachepath);
+    f = fopen(name, "r");
+    if (0 == f)
+        return 0;
+
+    if (-1 == fstat(fileno(f), &st) ||
+        st.st_uid != getuid() || 0 != (st.st_mode & (S_IWGRP | S_IWOTH)))
+        goto exit;
+
+    if (0 == fgets(line, sizeof line, f) ||
+        2 != sscanf(line, "%lld %ld", &sec, &nsec) ||
+        sec != (long long)regst->st_mtim.tv_sec || nsec != (long)regst->st_mtim.tv_nsec)
+        goto exit;
+
+    if (0 == fgets(psxpath, size, f))
+        goto exit;
+    psxpath[strcspn(psxpath, "\n")] = '\0';
+    found = '/' == psxpath[0];
+
+exit:
+    fclose(f);
+    return found;
+}
+
+static void cygfuse_cache_write(const char *cachepath, const struct stat *regst,
+    const char *psxpath)
+{
+    char name[PATH_MAX], tmpname[PATH_MAX + 16];
+    FILE *f;
+    int fd, ok;
+
+    cygfuse_cache_name(name, sizeof name, cachepath);
+    snprintf(tmpname, sizeof tmpname, "%s.%d", name, (int)getpid());
+
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (-1 == fd)
+        return;
+    f = fdopen(fd, "w");
+    if (0 == f)
+    {
+        close(fd);
+        unlink(tmpname);
+        return;
+    }
+
+    fprintf(f, "%lld %ld\n%s\n",
+        (long long)regst->st_mtim.tv_sec, (long)regst->st_mtim.tv_nsec, psxpath);
+    ok = !ferror(f);
+    if (0 != fclose(f))
+        ok = 0;
+
+    if (!ok || -1 == rename(tmpname, name))
+        unlink(tmpname);
+}
+
+static char *cygfuse_registry_read(const char *regpath, const char *name)
+{
+    char winpath[PATH_MAX];
+    size_t namelen = strlen(name);
+    int regfd, bytes;
+
+    regfd = open(regpath, O_RDONLY);
+    if (-1 == regfd)
+        return 0;
+
+    bytes = read(regfd, winpath,
+        sizeof winpath - sizeof CYGFUSE_WINFSP_BINDIR - namelen);
+    close(regfd);
+    if (-1 == bytes || 0 == bytes)
+        return 0;
+
+    if ('\0' == winpath[bytes - 1])
+        bytes--;
+    memcpy(winpath + bytes, CYGFUSE_WINFSP_BINDIR, sizeof CYGFUSE_WINFSP_BINDIR - 1);
+    bytes += sizeof CYGFUSE_WINFSP_BINDIR - 1;
+    memcpy(winpath + bytes, name, namelen + 1);
+
+    return cygfuse_winpath_to_posix(winpath);
+}
+
+void *cygfuse_locate_winfsp(const char *name, const char *regpath, const char *cachepath)
+{
+    char cached[PATH_MAX], *psxpath;
+    struct stat regst;
+    int have_regst;
+    void *h;
+
+    psxpath = getenv(CYGFUSE_WINFSP_ENV);
+    if (0 != psxpath && '\0' != psxpath[0])
+        return dlopen(psxpath, RTLD_NOW);
+
+    have_regst = 0 == stat(regpath, &regst);
+    if (have_regst && cygfuse_cache_read(cachepath, &regst, cached, sizeof cached))
+    {
+        h = dlopen(cached, RTLD_NOW);
+        if (0 != h)
+            return h;
+    }
+
+    h = dlopen(name, RTLD_NOW);
+    if (0 != h)
+        return h;
+
+    psxpath = cygfuse_registry_read(regpath, name);
+    if (0 == psxpath)
+        return 0;
+
+    h = dlopen(psxpath, RTLD_NOW);
+    if (0 != h && have_regst)
+        cygfuse_cache_write(cachepath, &regst, psxpath);
+    free(psxpath);
+
+    return h;
+}
@@ -0,0 +1,357 @@
+/**
+ * @file fuse3/cygfuse-notify.c
+ * Batched change notifications of the operations interposer.
+ *
+ * When CYGFUSE_NOTIFY is set, changes that the file system reports with
+ * fuse3_notify_queue are queued rather than passed to WinFsp one at a
+ * time. A thread delivers them in batches: it waits CYGFUSE_NOTIFY
+ * milliseconds after the first change of a batch for more to arrive, and
+ * then delivers all that are queued, in the order in which their paths
+ * were first queued.
+ *
+ * Changes to the same path are merged while they are queued. The
+ * attribute changes (FSP_FUSE_NOTIFY_CHMOD, CHOWN, UTIME, CHFLAGS and
+ * TRUNCATE) are delivered together in one notification. A path that is
+ * created and then removed before it is delivered is not delivered at
+ * all, and attribute changes of a path that is being created or removed
+ * are not delivered separately. A path that is removed and created again
+ * is delivered as both. So a bulk extraction into the mount, which
+ * creates every file and then sets its times and modes, results in one
+ * notification per file rather than several.
+ *
+ * At most CYGFUSE_NOTIFY_QUEUE paths are queued; callers wait for the
+ * thread when the queue is full. What the interposer caches about a path
+ * is dropped when the change is queued, not when it is delivered, so the
+ * file system sees its own changes at once (see cygfuse_ops_invalidate).
+ * Only changes of the interposed file system are queued; the queue is
+ * delivered in full before the file system is destroyed.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+
+#define CYGFUSE_NOTIFY_ADDED            (FSP_FUSE_NOTIFY_MKDIR | FSP_FUSE_NOTIFY_CREATE)
+#define CYGFUSE_NOTIFY_REMOVED          (FSP_FUSE_NOTIFY_RMDIR | FSP_FUSE_NOTIFY_UNLINK)
+#define CYGFUSE_NOTIFY_CHANGED          0x80000000  /* action 0: not known what changed */
+#define CYGFUSE_NOTIFY_BUCKETS          (CYGFUSE_NOTIFY_QUEUE / 4)
+
+struct cygfuse_notify_event
+{
+    struct cygfuse_notify_event *next, *hnext;
+    uint64_t hash;
+    uint32_t removed;                   /* delivered first: RMDIR or UNLINK, or 0 */
+    uint32_t added;                     /* delivered next: MKDIR or CREATE, or 0 */
+    uint32_t attrs;                     /* delivered last, if nothing is added */
+    char path[];
+};
+
+static const struct fuse3_operations *cygfuse_notify_next;
+static unsigned cygfuse_notify_delay;   /* ms */
+static struct fuse3 *cygfuse_notify_fuse;
+static int (*cygfuse_notify_deliver)(struct fuse3 *f, const char *path, uint32_t action);
+static pthread_once_t cygfuse_notify_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t cygfuse_notify_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cygfuse_notify_work, cygfuse_notify_room;
+static pthread_t cygfuse_notify_thread;
+static int cygfuse_notify_running, cygfuse_notify_stop;
+static struct cygfuse_notify_event *cygfuse_notify_head, **cygfuse_notify_tail = &cygfuse_notify_head;
+static struct cygfuse_notify_event *cygfuse_notify_buckets[CYGFUSE_NOTIFY_BUCKETS];
+static size_t cygfuse_notify_count;
+
+static struct cygfuse_notify_event **cygfuse_notify_find(const char *path, uint64_t hash)
+{
+    struct cygfuse_notify_event **p;
+
+    for (p = &cygfuse_notify_buckets[hash % CYGFUSE_NOTIFY_BUCKETS]; 0 != *p; p = &(*p)->hnext)
+        if (hash == (*p)->hash && 0 == strcmp(path, (*p)->path))
+            break;
+    return p;
+}
+
+/* merges a change into the queued changes of its path */
+static void cygfuse_notify_merge(struct cygfuse_notify_event *event, uint32_t action)
+{
+    if (0 == action)
+        action = CYGFUSE_NOTIFY_CHANGED;
+
+    if (action & CYGFUSE_NOTIFY_REMOVED)
+    {
+        if (0 != event->added)
+            event->added = 0;           /* never seen: removed (again) or not there at all */
+        else
+            event->removed = action & CYGFUSE_NOTIFY_REMOVED;
+        event->attrs = 0;
+    }
+    else if (action & CYGFUSE_NOTIFY_ADDED)
+    {
+        event->added = action & CYGFUSE_NOTIFY_ADDED;
+        event->attrs = 0;
+    }
+    else if (0 == event->added && 0 == event->removed)
+        event->attrs |= action;
+}
+
+static void cygfuse_notify_deliver_event(struct fuse3 *f,
+    int (*deliver)(struct fuse3 *f, const char *path, uint32_t action),
+    struct cygfuse_notify_event *event)
+{
+    if (0 != event->removed)
+        deliver(f, event->path, event->removed);
+    if (0 != event->added)
+        deliver(f, event->path, event->added);
+    if (0 != (event->attrs & CYGFUSE_NOTIFY_ATTRS))
+        deliver(f, event->path, event->attrs & CYGFUSE_NOTIFY_ATTRS);
+    if (0 != (event->attrs & CYGFUSE_NOTIFY_CHANGED))
+        deliver(f, event->path, 0);
+}
+
+static void *cygfuse_notify_worker(void *arg)
+{
+    struct cygfuse_notify_event *batch, *event, *next;
+    struct fuse3 *f;
+    int (*deliver)(struct fuse3 *f, const char *path, uint32_t action);
+    struct timespec deadline;
+
+    (void)arg;
+    pthread_mutex_lock(&cygfuse_notify_mutex);
+    for (;;)
+    {
+        while (0 == cygfuse_notify_head && !cygfuse_notify_stop)
+            pthread_cond_wait(&cygfuse_notify_work, &cygfuse_notify_mutex);
+        if (0 == cygfuse_notify_head)
+            break;
+
+        /* let the batch fill, unless the queue is full or must be delivered now */
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += cygfuse_notify_delay / 1000;
+        deadline.tv_nsec += (long)(cygfuse_notify_delay % 1000) * 1000000;
+        if (1000000000 <= deadline.tv_nsec)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (CYGFUSE_NOTIFY_QUEUE > cygfuse_notify_count && !cygfuse_notify_stop &&
+            0 == pthread_cond_timedwait(&cygfuse_notify_work, &cygfuse_notify_mutex, &deadline))
+            ;
+
+        batch = cygfuse_notify_head;
+        cygfuse_notify_head = 0;
+        cygfuse_notify_tail = &cygfuse_notify_head;
+        for (event = batch; 0 != event; event = event->next)
+            *cygfuse_notify_find(event->path, event->hash) = event->hnext;
+        cygfuse_notify_count = 0;
+        f = cygfuse_notify_fuse;
+        deliver = cygfuse_notify_deliver;
+        pthread_cond_broadcast(&cygfuse_notify_room);
+        pthread_mutex_unlock(&cygfuse_notify_mutex);
+
+        for (event = batch; 0 != event; event = next)
+        {
+            next = event->next;
+            cygfuse_notify_deliver_event(f, deliver, event);
+            free(event);
+        }
+
+        pthread_mutex_lock(&cygfuse_notify_mutex);
+    }
+    pthread_mutex_unlock(&cygfuse_notify_mutex);
+
+    return 0;
+}
+
+static void cygfuse_notify_atfork_prepare(void)
+{
+    pthread_mutex_lock(&cygfuse_notify_mutex);
+}
+
+static void cygfuse_notify_atfork_parent(void)
+{
+    pthread_mutex_unlock(&cygfuse_notify_mutex);
+}
+
+/* the child has no thread; one is started for what is queued when more is queued */
+static void cygfuse_notify_atfork_child(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_mutex_init(&cygfuse_notify_mutex, 0);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cygfuse_notify_work, &attr);
+    pthread_cond_init(&cygfuse_notify_room, &attr);
+    pthread_condattr_destroy(&attr);
+    cygfuse_notify_running = 0;
+}
+
+static void cygfuse_notify_initonce(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cygfuse_notify_work, &attr);
+    pthread_cond_init(&cygfuse_notify_room, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_atfork(cygfuse_notify_atfork_prepare, cygfuse_notify_atfork_parent,
+        cygfuse_notify_atfork_child);
+}
+
+int cygfuse_notify_queue(struct fuse3 *f, const char *path, uint32_t action,
+    int (*deliver)(struct fuse3 *f, const char *path, uint32_t action))
+{
+    struct cygfuse_notify_event **p, *event;
+    uint64_t hash;
+    size_t pathlen;
+    int result = 0;
+
+    if (0 == f || 0 == path)
+        return 0;
+
+    hash = cygfuse_hash_path(path);
+    pathlen = strlen(path);
+
+    pthread_mutex_lock(&cygfuse_notify_mutex);
+    if (f != cygfuse_notify_fuse || cygfuse_notify_stop)
+        goto exit;
+
+    if (!cygfuse_notify_running)
+    {
+        if (0 != pthread_create(&cygfuse_notify_thread, 0, cygfuse_notify_worker, 0))
+            goto exit;
+        cygfuse_notify_running = 1;
+    }
+    cygfuse_notify_deliver = deliver;
+
+    p = cygfuse_notify_find(path, hash);
+    if (0 != *p)
+    {
+        /* merged changes that cancel out are still delivered, but as nothing */
+        cygfuse_notify_merge(*p, action);
+        result = 1;
+        goto exit;
+    }
+
+    while (CYGFUSE_NOTIFY_QUEUE <= cygfuse_notify_count && !cygfuse_notify_stop)
+    {
+        pthread_cond_signal(&cygfuse_notify_work);
+        pthread_cond_wait(&cygfuse_notify_room, &cygfuse_notify_mutex);
+    }
+    if (cygfuse_notify_stop)
+        goto exit;
+    p = cygfuse_notify_find(path, hash);
+    if (0 != *p)
+    {
+        cygfuse_notify_merge(*p, action);
+        result = 1;
+        goto exit;
+    }
+
+    event = malloc(sizeof *event + pathlen + 1);
+    if (0 == event)
+        goto exit;
+    memset(event, 0, sizeof *event);
+    event->hash = hash;
+    memcpy(event->path, path, pathlen + 1);
+    cygfuse_notify_merge(event, action);
+
+    *p = event;
+    *cygfuse_notify_tail = event;
+    cygfuse_notify_tail = &event->next;
+    if (0 == cygfuse_notify_count++)
+        pthread_cond_signal(&cygfuse_notify_work);
+    result = 1;
+
+exit:
+    pthread_mutex_unlock(&cygfuse_notify_mutex);
+    return result;
+}
+
+/* delivers what is queued, stops the thread and takes no more changes */
+static void cygfuse_notify_flush(void)
+{
+    int running;
+
+    pthread_mutex_lock(&cygfuse_notify_mutex);
+    cygfuse_notify_stop = 1;
+    running = cygfuse_notify_running;
+    cygfuse_notify_running = 0;
+    pthread_cond_broadcast(&cygfuse_notify_work);
+    pthread_cond_broadcast(&cygfuse_notify_room);
+    pthread_mutex_unlock(&cygfuse_notify_mutex);
+
+    if (running)
+        pthread_join(cygfuse_notify_thread, 0);
+
+    pthread_mutex_lock(&cygfuse_notify_mutex);
+    cygfuse_notify_fuse = 0;
+    cygfuse_notify_stop = 0;
+    pthread_mutex_unlock(&cygfuse_notify_mutex);
+}
+
+static void *cygfuse_notify_init_op(struct fuse3_conn_info *conn, struct fuse3_config *conf)
+{
+    struct fuse3_context *context = fuse3_get_context();
+    void *data;
+
+    if (0 != cygfuse_notify_next->init)
+        data = cygfuse_notify_next->init(conn, conf);
+    else
+        data = context->private_data;
+
+    pthread_mutex_lock(&cygfuse_notify_mutex);
+    cygfuse_notify_fuse = context->fuse;
+    pthread_mutex_unlock(&cygfuse_notify_mutex);
+
+    return data;
+}
+
+static void cygfuse_notify_destroy_op(void *data)
+{
+    cygfuse_notify_flush();
+
+    if (0 != cygfuse_notify_next->destroy)
+        cygfuse_notify_next->destroy(data);
+}
+
+int cygfuse_notify_init(void)
+{
+    const char *env = getenv(CYGFUSE_NOTIFY_ENV);
+
+    if (0 == env || '\0' == env[0])
+        return 0;
+
+    cygfuse_notify_delay = (unsigned)strtoul(env, 0, 10);
+    if (CYGFUSE_NOTIFY_MAXDELAY < cygfuse_notify_delay)
+        cygfuse_notify_delay = CYGFUSE_NOTIFY_MAXDELAY;
+    pthread_once(&cygfuse_notify_once, cygfuse_notify_initonce);
+
+    return 1;
+}
+
+void cygfuse_notify_install(struct fuse3_operations *wrap, const struct fuse3_operations *next)
+{
+    cygfuse_notify_next = next;
+
+    wrap->init = cygfuse_notify_init_op;
+    wrap->destroy = cygfuse_notify_destroy_op;
+}
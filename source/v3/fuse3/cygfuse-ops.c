@@ -0,0 +1,464 @@
+/**
+ * @file fuse3/cygfuse-ops.c
+ * Interposer for the file system operations.
+ *
+ * When enabled, the struct fuse3_operations passed by the file system to
+ * fuse_main, fuse_new and friends is replaced by a table of wrappers that
+ * forward to the file system's own callbacks. Operations the file system
+ * does not implement are left NULL (except for init and destroy, which
+ * the caching and prefetching layers need), so WinFsp sees the same set of
+ * supported operations.
+ *
+ * The interposer has several layers. The instrumentation wrappers count
+ * every call into the file system and record its latency and whether it
+ * failed (see cygfuse-stats.c), enter it into the flight recorder (see
+ * cygfuse-record.c) and/or write it to a trace (see cygfuse-trace.c). The
+ * block cache on top of them (see cygfuse-blockcache.c) keeps file data
+ * in a local directory and/or shared memory. The passthrough layer on top
+ * of that (see cygfuse-passthrough.c) does the I/O of files that have a
+ * backing descriptor itself. The prefetching layer on top of that (see
+ * cygfuse-prefetch.c) issues calls that are known to be needed soon ahead
+ * of time, and the caching layer on top (see cygfuse-cache.c) serves what
+ * it can without calling the file system at all. Underneath them all,
+ * the read_buf and write_buf operations of the file system, if any, are
+ * adapted to the read and write operations that WinFsp calls (see
+ * cygfuse-buf.c). The interposer is only installed when one of these is
+ * enabled or needed. Only the first file system created in a process is
+ * interposed; any others are passed through unmodified.
+ *
+ * Changes that the file system reports with fuse3_notify or
+ * fuse3_invalidate_path drop what the layers cache about the path before
+ * WinFsp is told (see cygfuse_ops_invalidate), so that file systems that
+ * learn about remote changes can run with long timeouts. Changes reported
+ * with fuse3_notify_queue are told to WinFsp in batches (see
+ * cygfuse-notify.c).
+ *
+ * The memory that the layers keep is limited by the cygfuse_memory=SIZE
+ * mount option, which is taken out of the arguments of fuse_main and
+ * fuse_new before WinFsp sees them (see cygfuse_ops_args and
+ * cygfuse-budget.c).
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+
+/*
+ * X(OP, PARAMS, ARGS, REC)
+ *
+ * Operations that return an int (negative errno on failure). The init and
+ * destroy operations are wrapped separately. REC is (path, fi, size, offset)
+ * as recorded by the flight recorder.
+ */
+#define CYGFUSE_OPS_LIST(X)             \
+    X(getattr,                          \
+        (const char *path, struct fuse_stat *stbuf, struct fuse3_file_info *fi),\
+        (path, stbuf, fi),              \
+        (path, fi, 0, 0))               \
+    X(readlink,                         \
+        (const char *path, char *buf, size_t size),\
+        (path, buf, size),              \
+        (path, 0, size, 0))             \
+    X(mknod,                            \
+        (const char *path, fuse_mode_t mode, fuse_dev_t dev),\
+        (path, mode, dev),              \
+        (path, 0, 0, 0))                \
+    X(mkdir,                            \
+        (const char *path, fuse_mode_t mode),\
+        (path, mode),                   \
+        (path, 0, 0, 0))                \
+    X(unlink,                           \
+        (const char *path),             \
+        (path),                         \
+        (path, 0, 0, 0))                \
+    X(rmdir,                            \
+        (const char *path),             \
+        (path),                         \
+        (path, 0, 0, 0))                \
+    X(symlink,                          \
+        (const char *dstpath, const char *srcpath),\
+        (dstpath, srcpath),             \
+        (srcpath, 0, 0, 0))             \
+    X(rename,                           \
+        (const char *oldpath, const char *newpath, unsigned int flags),\
+        (oldpath, newpath, flags),      \
+        (oldpath, 0, 0, 0))             \
+    X(link,                             \
+        (const char *srcpath, const char *dstpath),\
+        (srcpath, dstpath),             \
+        (dstpath, 0, 0, 0))             \
+    X(chmod,                            \
+        (const char *path, fuse_mode_t mode, struct fuse3_file_info *fi),\
+        (path, mode, fi),               \
+        (path, fi, 0, 0))               \
+    X(chown,                            \
+        (const char *path, fuse_uid_t uid, fuse_gid_t gid, struct fuse3_file_info *fi),\
+        (path, uid, gid, fi),           \
+        (path, fi, 0, 0))               \
+    X(truncate,                         \
+        (const char *path, fuse_off_t size, struct fuse3_file_info *fi),\
+        (path, size, fi),               \
+        (path, fi, 0, size))            \
+    X(open,                             \
+        (const char *path, struct fuse3_file_info *fi),\
+        (path, fi),                     \
+        (path, fi, 0, 0))               \
+    X(read,                             \
+        (const char *path, char *buf, size_t size, fuse_off_t off, struct fuse3_file_info *fi),\
+        (path, buf, size, off, fi),     \
+        (path, fi, size, off))          \
+    X(write,                            \
+        (const char *path, const char *buf, size_t size, fuse_off_t off, struct fuse3_file_info *fi),\
+        (path, buf, size, off, fi),     \
+        (path, fi, size, off))          \
+    X(statfs,                           \
+        (const char *path, struct fuse_statvfs *stbuf),\
+        (path, stbuf),                  \
+        (path, 0, 0, 0))                \
+    X(flush,                            \
+        (const char *path, struct fuse3_file_info *fi),\
+        (path, fi),                     \
+        (path, fi, 0, 0))               \
+    X(release,                          \
+        (const char *path, struct fuse3_file_info *fi),\
+        (path, fi),                     \
+        (path, fi, 0, 0))               \
+    X(fsync,                            \
+        (const char *path, int datasync, struct fuse3_file_info *fi),\
+        (path, datasync, fi),           \
+        (path, fi, 0, 0))               \
+    X(setxattr,                         \
+        (const char *path, const char *name, const char *value, size_t size, int flags),\
+        (path, name, value, size, flags),\
+        (path, 0, size, 0))             \
+    X(getxattr,                         \
+        (const char *path, const char *name, char *value, size_t size),\
+        (path, name, value, size),      \
+        (path, 0, size, 0))             \
+    X(listxattr,                        \
+        (const char *path, char *namebuf, size_t size),\
+        (path, namebuf, size),          \
+        (path, 0, size, 0))             \
+    X(removexattr,                      \
+        (const char *path, const char *name),\
+        (path, name),                   \
+        (path, 0, 0, 0))                \
+    X(opendir,                          \
+        (const char *path, struct fuse3_file_info *fi),\
+        (path, fi),                     \
+        (path, fi, 0, 0))               \
+    X(readdir,                          \
+        (const char *path, void *buf, fuse3_fill_dir_t filler, fuse_off_t off,\
+            struct fuse3_file_info *fi, enum fuse3_readdir_flags flags),\
+        (path, buf, filler, off, fi, flags),\
+        (path, fi, 0, off))             \
+    X(releasedir,                       \
+        (const char *path, struct fuse3_file_info *fi),\
+        (path, fi),                     \
+        (path, fi, 0, 0))               \
+    X(fsyncdir,                         \
+        (const char *path, int datasync, struct fuse3_file_info *fi),\
+        (path, datasync, fi),           \
+        (path, fi, 0, 0))               \
+    X(access,                           \
+        (const char *path, int mask),   \
+        (path, mask),                   \
+        (path, 0, 0, 0))                \
+    X(create,                           \
+        (const char *path, fuse_mode_t mode, struct fuse3_file_info *fi),\
+        (path, mode, fi),               \
+        (path, fi, 0, 0))               \
+    X(lock,                             \
+        (const char *path, struct fuse3_file_info *fi, int cmd, struct fuse_flock *lock),\
+        (path, fi, cmd, lock),          \
+        (path, fi, 0, 0))               \
+    X(utimens,                          \
+        (const char *path, const struct fuse_timespec tv[2], struct fuse3_file_info *fi),\
+        (path, tv, fi),                 \
+        (path, fi, 0, 0))               \
+    X(bmap,                             \
+        (const char *path, size_t blocksize, uint64_t *idx),\
+        (path, blocksize, idx),         \
+        (path, 0, 0, 0))                \
+    X(ioctl,                            \
+        (const char *path, int cmd, void *arg, struct fuse3_file_info *fi,\
+            unsigned int flags, void *data),\
+        (path, cmd, arg, fi, flags, data),\
+        (path, fi, 0, 0))               \
+    X(poll,                             \
+        (const char *path, struct fuse3_file_info *fi, struct fuse3_pollhandle *ph,\
+            unsigned *reventsp),        \
+        (path, fi, ph, reventsp),       \
+        (path, fi, 0, 0))               \
+    X(write_buf,                        \
+        (const char *path, struct fuse3_bufvec *buf, fuse_off_t off, struct fuse3_file_info *fi),\
+        (path, buf, off, fi),           \
+        (path, fi, 0, off))             \
+    X(read_buf,                         \
+        (const char *path, struct fuse3_bufvec **bufp, size_t size, fuse_off_t off,\
+            struct fuse3_file_info *fi),\
+        (path, bufp, size, off, fi),    \
+        (path, fi, size, off))          \
+    X(flock,                            \
+        (const char *path, struct fuse3_file_info *fi, int op),\
+        (path, fi, op),                 \
+        (path, fi, 0, 0))               \
+    X(fallocate,                        \
+        (const char *path, int mode, fuse_off_t off, fuse_off_t len, struct fuse3_file_info *fi),\
+        (path, mode, off, len, fi),     \
+        (path, fi, len, off))
+
+enum
+{
+#define CYGFUSE_OP_INDEX(OP, PARAMS, ARGS, REC)\
+    CYGFUSE_OP_INDEX_ ## OP,
+    CYGFUSE_OPS_LIST(CYGFUSE_OP_INDEX)
+#undef CYGFUSE_OP_INDEX
+    CYGFUSE_OP_INDEX_init,
+    CYGFUSE_OP_INDEX_destroy,
+};
+
+static const char *const cygfuse_ops_names[] =
+{
+#define CYGFUSE_OP_NAME(OP, PARAMS, ARGS, REC)\
+    #OP,
+    CYGFUSE_OPS_LIST(CYGFUSE_OP_NAME)
+#undef CYGFUSE_OP_NAME
+    "init",
+    "destroy",
+};
+static struct cygfuse_stats cygfuse_ops_stats = CYGFUSE_STATS_INIT("operations", cygfuse_ops_names);
+
+/*
+ * The file system's operations; the same with instrumentation wrappers
+ * where instrumentation is enabled and read and write adapted to read_buf
+ * and write_buf where needed; the same with the block cache (see
+ * cygfuse-blockcache.c) on top; the same with the passthrough layer (see
+ * cygfuse-passthrough.c) on top of that; the same with the prefetching layer
+ * (see cygfuse-prefetch.c) on top of that; the same with the caching layer
+ * (see cygfuse-cache.c) on top of that; and the operations passed to
+ * WinFsp, which add the batching of notifications (see cygfuse-notify.c)
+ * on top.
+ */
+static struct fuse3_operations cygfuse_ops_user;
+static struct fuse3_operations cygfuse_ops_next;
+static struct fuse3_operations cygfuse_ops_blockcache;
+static struct fuse3_operations cygfuse_ops_passthrough;
+static struct fuse3_operations cygfuse_ops_prefetch;
+static struct fuse3_operations cygfuse_ops_cache;
+static struct fuse3_operations cygfuse_ops_wrap;
+static int cygfuse_ops_installed;
+static int cygfuse_ops_stats_enabled;
+static int cygfuse_ops_record_enabled;
+static int cygfuse_ops_trace_enabled;
+
+struct cygfuse_op_frame
+{
+    size_t index;
+    uint64_t start;
+    const char *path;
+    struct fuse3_file_info *fi;
+    struct cygfuse_record_entry *entry;
+};
+
+static inline void cygfuse_op_enter(struct cygfuse_op_frame *frame, size_t index,
+    const char *path, struct fuse3_file_info *fi, uint64_t size, int64_t offset)
+{
+    frame->index = index;
+    frame->start = cygfuse_now();
+    frame->path = path;
+    frame->fi = fi;
+    frame->entry = cygfuse_ops_record_enabled ?
+        cygfuse_record_begin(index, path, 0 != fi ? fi->fh : 0, size, offset, frame->start) : 0;
+}
+
+static inline void cygfuse_op_leave(struct cygfuse_op_frame *frame, int result)
+{
+    uint64_t end = cygfuse_now();
+
+    if (cygfuse_ops_stats_enabled)
+        cygfuse_stats_record(&cygfuse_ops_stats, frame->index, end - frame->start, 0 > result);
+    if (0 != frame->entry)
+        /* open and create assign the file handle */
+        cygfuse_record_end(frame->entry, result, end, 0 != frame->fi ? frame->fi->fh : 0);
+    if (cygfuse_ops_trace_enabled)
+        cygfuse_trace_span(frame->index, frame->path, result, frame->start, end);
+}
+
+#define CYGFUSE_OP_WRAP(OP, PARAMS, ARGS, REC)\
+    static int cygfuse_op_ ## OP PARAMS\
+    {\
+        struct cygfuse_op_frame frame;\
+        int result;\
+        cygfuse_op_enter(&frame, CYGFUSE_OP_INDEX_ ## OP, CYGFUSE_OP_REC REC);\
+        result = cygfuse_ops_user.OP ARGS;\
+        cygfuse_op_leave(&frame, result);\
+        return result;\
+    }
+#define CYGFUSE_OP_REC(path, fi, size, offset)\
+    (path), (fi), (size), (offset)
+CYGFUSE_OPS_LIST(CYGFUSE_OP_WRAP)
+#undef CYGFUSE_OP_WRAP
+
+static void *cygfuse_op_init(struct fuse3_conn_info *conn, struct fuse3_config *conf)
+{
+    struct cygfuse_op_frame frame;
+    void *result;
+    cygfuse_op_enter(&frame, CYGFUSE_OP_INDEX_init, 0, 0, 0, 0);
+    result = cygfuse_ops_user.init(conn, conf);
+    cygfuse_op_leave(&frame, 0);
+    return result;
+}
+
+static void cygfuse_op_destroy(void *data)
+{
+    struct cygfuse_op_frame frame;
+    cygfuse_op_enter(&frame, CYGFUSE_OP_INDEX_destroy, 0, 0, 0, 0);
+    cygfuse_ops_user.destroy(data);
+    cygfuse_op_leave(&frame, 0);
+}
+
+const struct fuse3_operations *cygfuse_ops_interpose(const struct fuse3_operations *ops,
+    size_t *popsize)
+{
+    size_t opsize = *popsize;
+    int instrument, blockcache, passthrough, prefetch, cache, notify, buf;
+
+    if (0 == ops)
+        return ops;
+    if (__atomic_exchange_n(&cygfuse_ops_installed, 1, __ATOMIC_ACQ_REL))
+        return ops;
+
+    cygfuse_ops_stats_enabled = cygfuse_stats_enabled();
+    cygfuse_ops_record_enabled = cygfuse_record_init(cygfuse_ops_names,
+        sizeof cygfuse_ops_names / sizeof cygfuse_ops_names[0]);
+    cygfuse_ops_trace_enabled = cygfuse_trace_init(cygfuse_ops_names,
+        sizeof cygfuse_ops_names / sizeof cygfuse_ops_names[0]);
+    instrument = cygfuse_ops_stats_enabled || cygfuse_ops_record_enabled || cygfuse_ops_trace_enabled;
+    blockcache = cygfuse_blockcache_init();
+    passthrough = cygfuse_passthrough_init();
+    prefetch = cygfuse_prefetch_init();
+    cache = cygfuse_cache_init();
+    notify = cygfuse_notify_init();
+
+    /* older file systems may pass a shorter table; the rest is unsupported */
+    memcpy(&cygfuse_ops_user, ops,
+        sizeof cygfuse_ops_user < opsize ? sizeof cygfuse_ops_user : opsize);
+    buf = 0 != cygfuse_ops_user.read_buf || 0 != cygfuse_ops_user.write_buf;
+    if (!instrument && !blockcache && !passthrough && !prefetch && !cache && !notify && !buf)
+        return ops;
+    cygfuse_ops_next = cygfuse_ops_user;
+
+    if (instrument)
+    {
+#define CYGFUSE_OP_INSTALL(OP, PARAMS, ARGS, REC)\
+        if (0 != cygfuse_ops_user.OP)\
+            cygfuse_ops_next.OP = cygfuse_op_ ## OP;
+        CYGFUSE_OPS_LIST(CYGFUSE_OP_INSTALL)
+        CYGFUSE_OP_INSTALL(init, (), (), ())
+        CYGFUSE_OP_INSTALL(destroy, (), (), ())
+#undef CYGFUSE_OP_INSTALL
+    }
+
+    /* the layers above see read and write whether the file system has them or the buf variants */
+    if (buf)
+        cygfuse_buf_install(&cygfuse_ops_next, &cygfuse_ops_next);
+
+    /* prefetched getattr calls go through the whole interposer, including the caches */
+    cygfuse_ops_blockcache = cygfuse_ops_next;
+    if (blockcache)
+        cygfuse_blockcache_install(&cygfuse_ops_blockcache, &cygfuse_ops_next);
+    cygfuse_ops_passthrough = cygfuse_ops_blockcache;
+    if (passthrough)
+        cygfuse_passthrough_install(&cygfuse_ops_passthrough, &cygfuse_ops_blockcache);
+    cygfuse_ops_prefetch = cygfuse_ops_passthrough;
+    if (prefetch)
+        cygfuse_prefetch_install(&cygfuse_ops_prefetch, &cygfuse_ops_passthrough, &cygfuse_ops_wrap);
+    cygfuse_ops_cache = cygfuse_ops_prefetch;
+    if (cache)
+        cygfuse_cache_install(&cygfuse_ops_cache, &cygfuse_ops_prefetch);
+    cygfuse_ops_wrap = cygfuse_ops_cache;
+    if (notify)
+        cygfuse_notify_install(&cygfuse_ops_wrap, &cygfuse_ops_cache);
+
+    if (cygfuse_ops_stats_enabled)
+    {
+        cygfuse_stats_register(&cygfuse_ops_stats);
+        cygfuse_stats_report(cygfuse_budget_report);
+    }
+
+    *popsize = sizeof cygfuse_ops_wrap;
+    return &cygfuse_ops_wrap;
+}
+
+static int cygfuse_ops_opt(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+    if (0 != key)
+        return 1;
+    if (0 != cygfuse_budget_init(arg + sizeof CYGFUSE_OPT_MEMORY - 1))
+    {
+        fprintf(stderr, "cygfuse: invalid option: %s\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+/* takes the options of the interposer out of args; returns -1 if one is invalid */
+int cygfuse_ops_args(struct fuse_args *args)
+{
+    static const struct fuse_opt opts[] =
+    {
+        FUSE_OPT_KEY(CYGFUSE_OPT_MEMORY, 0),
+        FUSE_OPT_END,
+    };
+    int i;
+
+    if (0 == args)
+        return 0;
+
+    /* leave the arguments alone unless there is something to take out */
+    for (i = 1; args->argc > i; i++)
+        if (0 != strstr(args->argv[i], CYGFUSE_OPT_MEMORY))
+            break;
+    if (args->argc <= i)
+        return 0;
+
+    return 0 == fuse_opt_parse(args, 0, opts, cygfuse_ops_opt) ? 0 : -1;
+}
+
+/* drops what the layers cache about path, after a change that the file system notified */
+void cygfuse_ops_invalidate(const char *path, uint32_t action)
+{
+    unsigned flags;
+
+    if (0 == path)
+        return;
+
+    /* actions may be merged (see cygfuse-notify.c); 0 means not known what changed */
+    if (action & FSP_FUSE_NOTIFY_RMDIR)
+        flags = CYGFUSE_INVALIDATE_TREE | CYGFUSE_INVALIDATE_PARENT;
+    else if (0 == action || (action & ~CYGFUSE_NOTIFY_ATTRS))
+        /* names may have come or gone */
+        flags = CYGFUSE_INVALIDATE_PARENT;
+    else
+        flags = 0;
+
+    cygfuse_cache_invalidate(path, flags);
+    cygfuse_blockcache_invalidate(path);
+    cygfuse_handle_datachanged(path);
+}
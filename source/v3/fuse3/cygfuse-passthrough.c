@@ -0,0 +1,279 @@
+/**
+ * @file fuse3/cygfuse-passthrough.c
+ * Passthrough of file I/O to backing files.
+ *
+ * When CYGFUSE_PASSTHROUGH is set, the open and create operations of a
+ * file system may hand a descriptor of the file that backs the opened file
+ * to fuse3_passthrough_open. Reads, writes, fsyncs and truncates (through
+ * an open file) of that file are then done on the descriptor by cygfuse,
+ * without calling the file system, much as Linux FUSE passthrough does in
+ * the kernel. Everything else, including flush and release, still goes to
+ * the file system. fuse3_passthrough_open fails with ENOSYS when
+ * passthrough is not enabled, so a file system can fall back to doing its
+ * own I/O.
+ *
+ * The descriptor is duplicated, so the file system may close its own
+ * descriptor at any time; the duplicate is closed when the file is
+ * released. The file system must set the file handle (fh) before it calls
+ * fuse3_passthrough_open, which fails with EINVAL otherwise: opens without
+ * an fh are told apart only by path, and would share the descriptor of the
+ * first open whatever its access mode. Handles of such opens are still
+ * tracked, and are rekeyed when the file is renamed.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+
+static const struct fuse3_operations *cygfuse_passthrough_next;
+static int cygfuse_passthrough_enabled;
+
+/* the open or create in progress on this thread and the descriptor it registered */
+static __thread struct fuse3_file_info *cygfuse_passthrough_fi;
+static __thread int cygfuse_passthrough_fd = -1;
+
+int cygfuse_passthrough_init(void)
+{
+    const char *env = getenv(CYGFUSE_PASSTHROUGH_ENV);
+
+    cygfuse_passthrough_enabled = 0 != env && '\0' != env[0] && 0 != strcmp(env, "0");
+    return cygfuse_passthrough_enabled;
+}
+
+int cygfuse_passthrough_open(struct fuse3_file_info *fi, int fd)
+{
+    int newfd;
+
+    if (!cygfuse_passthrough_enabled)
+        return -ENOSYS;
+    if (0 == fi || fi != cygfuse_passthrough_fi || 0 == fi->fh || 0 > fd)
+        return -EINVAL;
+
+    newfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (-1 == newfd)
+        return -errno;
+
+    if (-1 != cygfuse_passthrough_fd)
+        close(cygfuse_passthrough_fd);
+    cygfuse_passthrough_fd = newfd;
+
+    return 0;
+}
+
+static void cygfuse_passthrough_begin(struct fuse3_file_info *fi)
+{
+    cygfuse_passthrough_fi = fi;
+    cygfuse_passthrough_fd = -1;
+}
+
+static void cygfuse_passthrough_end(const char *path, struct fuse3_file_info *fi, int result)
+{
+    struct cygfuse_handle *handle;
+    int fd = cygfuse_passthrough_fd;
+
+    cygfuse_passthrough_fi = 0;
+    cygfuse_passthrough_fd = -1;
+
+    /* every open is tracked, so that opens and releases pair up in handles shared by path */
+    handle = 0 == result ? cygfuse_handle_open(path, fi) : 0;
+    if (0 != handle)
+    {
+        /* the descriptor is kept only by its own open; the fh may have been reset or reused */
+        pthread_mutex_lock(&handle->mutex);
+        if (-1 != fd && 0 != fi->fh && -1 == handle->backingfd)
+        {
+            __atomic_store_n(&handle->backingfd, fd, __ATOMIC_RELEASE);
+            fd = -1;
+        }
+        pthread_mutex_unlock(&handle->mutex);
+        cygfuse_handle_put(handle);
+    }
+    if (-1 != fd)
+        close(fd);
+}
+
+/* returns the backing descriptor of an open file or -1; the handle is returned in *phandle */
+static int cygfuse_passthrough_get(const char *path, struct fuse3_file_info *fi,
+    struct cygfuse_handle **phandle)
+{
+    struct cygfuse_handle *handle;
+    int fd;
+
+    *phandle = 0;
+    handle = cygfuse_handle_get(path, fi);
+    if (0 == handle)
+        return -1;
+
+    fd = __atomic_load_n(&handle->backingfd, __ATOMIC_ACQUIRE);
+    if (-1 == fd)
+    {
+        cygfuse_handle_put(handle);
+        return -1;
+    }
+
+    *phandle = handle;
+    return fd;
+}
+
+static int cygfuse_passthrough_open_op(const char *path, struct fuse3_file_info *fi)
+{
+    int result;
+
+    cygfuse_passthrough_begin(fi);
+    result = 0 != cygfuse_passthrough_next->open ? cygfuse_passthrough_next->open(path, fi) : 0;
+    cygfuse_passthrough_end(path, fi, result);
+
+    return result;
+}
+
+static int cygfuse_passthrough_create(const char *path, fuse_mode_t mode,
+    struct fuse3_file_info *fi)
+{
+    int result;
+
+    cygfuse_passthrough_begin(fi);
+    result = cygfuse_passthrough_next->create(path, mode, fi);
+    cygfuse_passthrough_end(path, fi, result);
+
+    return result;
+}
+
+static int cygfuse_passthrough_read(const char *path, char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    struct cygfuse_handle *handle;
+    struct fuse3_bufvec src = FUSE_BUFVEC_INIT(size), dst = FUSE_BUFVEC_INIT(size);
+    int fd, result;
+
+    fd = cygfuse_passthrough_get(path, fi, &handle);
+    if (-1 == fd)
+        return 0 != cygfuse_passthrough_next->read ?
+            cygfuse_passthrough_next->read(path, buf, size, off, fi) : -ENOSYS;
+
+    src.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+    src.buf[0].fd = fd;
+    src.buf[0].pos = off;
+    dst.buf[0].mem = buf;
+    result = (int)cygfuse_buf_copy(&dst, &src, 0);
+
+    cygfuse_handle_put(handle);
+    return result;
+}
+
+static int cygfuse_passthrough_write(const char *path, const char *buf, size_t size,
+    fuse_off_t off, struct fuse3_file_info *fi)
+{
+    struct cygfuse_handle *handle;
+    struct fuse3_bufvec src = FUSE_BUFVEC_INIT(size), dst = FUSE_BUFVEC_INIT(size);
+    int fd, result;
+
+    fd = cygfuse_passthrough_get(path, fi, &handle);
+    if (-1 == fd)
+        return 0 != cygfuse_passthrough_next->write ?
+            cygfuse_passthrough_next->write(path, buf, size, off, fi) : -ENOSYS;
+
+    src.buf[0].mem = (void *)buf;
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+    dst.buf[0].fd = fd;
+    dst.buf[0].pos = off;
+    result = (int)cygfuse_buf_copy(&dst, &src, 0);
+
+    cygfuse_handle_put(handle);
+    return result;
+}
+
+static int cygfuse_passthrough_fsync(const char *path, int datasync, struct fuse3_file_info *fi)
+{
+    struct cygfuse_handle *handle;
+    int fd, result;
+
+    fd = cygfuse_passthrough_get(path, fi, &handle);
+    if (-1 == fd)
+        return 0 != cygfuse_passthrough_next->fsync ?
+            cygfuse_passthrough_next->fsync(path, datasync, fi) : 0;
+
+    result = -1 != (datasync ? fdatasync(fd) : fsync(fd)) ? 0 : -errno;
+
+    cygfuse_handle_put(handle);
+    return result;
+}
+
+static int cygfuse_passthrough_truncate(const char *path, fuse_off_t size,
+    struct fuse3_file_info *fi)
+{
+    struct cygfuse_handle *handle;
+    int fd, result;
+
+    fd = cygfuse_passthrough_get(path, fi, &handle);
+    if (-1 == fd)
+        return 0 != cygfuse_passthrough_next->truncate ?
+            cygfuse_passthrough_next->truncate(path, size, fi) : -ENOSYS;
+
+    result = -1 != ftruncate(fd, size) ? 0 : -errno;
+
+    cygfuse_handle_put(handle);
+    return result;
+}
+
+/* handles of opens without an fh are keyed by path */
+static int cygfuse_passthrough_rename(const char *oldpath, const char *newpath, unsigned int flags)
+{
+    int result;
+
+    result = cygfuse_passthrough_next->rename(oldpath, newpath, flags);
+    if (0 == result)
+        cygfuse_handle_rename(oldpath, newpath);
+
+    return result;
+}
+
+/* the descriptor is closed when the handle is freed (see cygfuse-handle.c) */
+static int cygfuse_passthrough_release(const char *path, struct fuse3_file_info *fi)
+{
+    struct cygfuse_handle *handle;
+
+    handle = cygfuse_handle_get(path, fi);
+    if (0 != handle)
+    {
+        cygfuse_handle_close(handle);
+        cygfuse_handle_put(handle);
+    }
+
+    return 0 != cygfuse_passthrough_next->release ?
+        cygfuse_passthrough_next->release(path, fi) : 0;
+}
+
+void cygfuse_passthrough_install(struct fuse3_operations *wrap,
+    const struct fuse3_operations *next)
+{
+    cygfuse_passthrough_next = next;
+
+    /* read, write, fsync and truncate work on passthrough files whether the file system has them or not */
+    wrap->open = cygfuse_passthrough_open_op;
+    if (0 != next->create)
+        wrap->create = cygfuse_passthrough_create;
+    wrap->read = cygfuse_passthrough_read;
+    wrap->write = cygfuse_passthrough_write;
+    wrap->fsync = cygfuse_passthrough_fsync;
+    wrap->truncate = cygfuse_passthrough_truncate;
+    wrap->release = cygfuse_passthrough_release;
+    if (0 != next->rename)
+        wrap->rename = cygfuse_passthrough_rename;
+}
@@ -0,0 +1,604 @@
+/**
+ * @file fuse3/cygfuse-pathcache.c
+ * Sharded cache keyed by path.
+ *
+ * The cache is split into CYGFUSE_PATHCACHE_SHARDS shards by path hash,
+ * each with its own mutex, hash table and LRU list, so that threads
+ * looking up different paths rarely contend. Every entry carries a copy
+ * of its value and an expiry time; expired entries are never returned.
+ * When a shard is full its least recently used entry is evicted.
+ *
+ * A lookup that misses is typically followed by a call into the file
+ * system and an insert of the result. To avoid inserting a value that an
+ * invalidation running concurrently with that call has made stale, every
+ * shard has a generation that each invalidation increments: the caller
+ * takes the generation before calling the file system and the insert is
+ * dropped if it has changed since.
+ *
+ * A cache that is expected to miss most of the time (such as a cache of
+ * names that do not exist) can have a Bloom filter in front of it. Lookups
+ * whose path is not in the filter miss without taking the shard mutex.
+ * Entries cannot be removed from a Bloom filter, so when enough entries
+ * have been inserted since the filter was last built it is rebuilt from
+ * the entries currently in the cache.
+ *
+ * Expired entries are removed when they are looked up, and otherwise stay
+ * until they are evicted. cygfuse_pathcache_expire removes all of them at
+ * once and shrinks the hash tables of shards that have emptied, for the
+ * cleanup thread (see cygfuse-cleanup.c).
+ *
+ * The memory of the entries is charged to the budget of the cache (see
+ * cygfuse-budget.c); a put that the budget refuses is dropped. When the
+ * budget reclaims memory from the cache, least recently used entries are
+ * evicted from each shard in turn.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cygfuse-internal.h"
+
+struct cygfuse_pathcache_entry
+{
+    struct cygfuse_pathcache_lru lru;   /* must be first */
+    struct cygfuse_pathcache_entry *hnext;
+    uint64_t hash;
+    uint64_t expiry;
+    size_t keylen;
+    size_t size;
+    char *value;
+    char key[];
+};
+
+#define CYGFUSE_PATHCACHE_MINBUCKETS    64
+#define CYGFUSE_PATHCACHE_FILTER_BITS   16  /* filter bits per entry */
+#define CYGFUSE_PATHCACHE_FILTER_HASHES 4
+
+/* value is stored after the key, suitably aligned */
+static inline size_t cygfuse_pathcache_offset(size_t keylen)
+{
+    return (sizeof(struct cygfuse_pathcache_entry) + keylen + 1 + 15) & ~(size_t)15;
+}
+
+static inline struct cygfuse_pathcache_shard *cygfuse_pathcache_shard(
+    struct cygfuse_pathcache *cache, uint64_t hash)
+{
+    return &cache->shard[(hash >> 32) & (CYGFUSE_PATHCACHE_SHARDS - 1)];
+}
+
+static inline void cygfuse_pathcache_lru_push(struct cygfuse_pathcache_shard *shard,
+    struct cygfuse_pathcache_entry *entry)
+{
+    entry->lru.next = shard->lru.next;
+    entry->lru.prev = &shard->lru;
+    shard->lru.next->prev = &entry->lru;
+    shard->lru.next = &entry->lru;
+}
+
+/*
+ * The filter bits of a path are derived from its hash by double hashing;
+ * the low bits of the hash select the bucket and the high bits the shard,
+ * so the two halves are combined differently for each bit.
+ */
+static inline void cygfuse_pathcache_filter_set(struct cygfuse_pathcache *cache, uint64_t hash)
+{
+    uint64_t h = hash, d = (hash >> 29) | 1;
+    for (unsigned i = 0; CYGFUSE_PATHCACHE_FILTER_HASHES > i; i++, h += d)
+    {
+        size_t bit = h & cache->filter_mask;
+        __atomic_or_fetch(&cache->filter[bit / 64], (uint64_t)1 << (bit % 64), __ATOMIC_RELAXED);
+    }
+}
+
+static inline int cygfuse_pathcache_filter_test(struct cygfuse_pathcache *cache, uint64_t hash)
+{
+    uint64_t h = hash, d = (hash >> 29) | 1;
+    for (unsigned i = 0; CYGFUSE_PATHCACHE_FILTER_HASHES > i; i++, h += d)
+    {
+        size_t bit = h & cache->filter_mask;
+        if (0 == (__atomic_load_n(&cache->filter[bit / 64], __ATOMIC_RELAXED) &
+            ((uint64_t)1 << (bit % 64))))
+            return 0;
+    }
+    return 1;
+}
+
+static void cygfuse_pathcache_unlink(struct cygfuse_pathcache_shard *shard,
+    struct cygfuse_pathcache_entry *entry)
+{
+    struct cygfuse_pathcache_entry **p;
+
+    for (p = &shard->buckets[entry->hash & (shard->nbuckets - 1)]; *p != entry; p = &(*p)->hnext)
+        ;
+    *p = entry->hnext;
+
+    entry->lru.prev->next = entry->lru.next;
+    entry->lru.next->prev = entry->lru.prev;
+    shard->count--;
+}
+
+static void cygfuse_pathcache_free(struct cygfuse_pathcache *cache,
+    struct cygfuse_pathcache_entry *entry)
+{
+    __atomic_sub_fetch(&cache->entries, 1, __ATOMIC_RELAXED);
+    cygfuse_budget_release(&cache->budget, cygfuse_pathcache_offset(entry->keylen) + entry->size);
+    free(entry);
+}
+
+static struct cygfuse_pathcache_entry *cygfuse_pathcache_find(
+    struct cygfuse_pathcache_shard *shard, const char *path, size_t keylen, uint64_t hash)
+{
+    struct cygfuse_pathcache_entry *entry;
+
+    if (0 == shard->nbuckets)
+        return 0;
+
+    for (entry = shard->buckets[hash & (shard->nbuckets - 1)]; 0 != entry; entry = entry->hnext)
+        if (hash == entry->hash && keylen == entry->keylen && 0 == memcmp(path, entry->key, keylen))
+            return entry;
+
+    return 0;
+}
+
+static void cygfuse_pathcache_resize(struct cygfuse_pathcache_shard *shard, size_t nbuckets)
+{
+    struct cygfuse_pathcache_entry **buckets, *entry, *next;
+
+    buckets = calloc(nbuckets, sizeof *buckets);
+    if (0 == buckets)
+        return;
+
+    for (size_t i = 0; shard->nbuckets > i; i++)
+        for (entry = shard->buckets[i]; 0 != entry; entry = next)
+        {
+            next = entry->hnext;
+            entry->hnext = buckets[entry->hash & (nbuckets - 1)];
+            buckets[entry->hash & (nbuckets - 1)] = entry;
+        }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = nbuckets;
+}
+
+static size_t cygfuse_pathcache_evict(void *ctx, size_t goal);
+static void cygfuse_pathcache_counters(void *ctx, uint64_t *hits, uint64_t *misses);
+
+void cygfuse_pathcache_init(struct cygfuse_pathcache *cache, const char *name, unsigned cost,
+    size_t max_entries)
+{
+    struct cygfuse_budget budget = CYGFUSE_BUDGET_INIT(name, 0, cost,
+        cygfuse_pathcache_evict, cygfuse_pathcache_counters, cache);
+
+    memset(cache, 0, sizeof *cache);
+    cache->name = name;
+    cache->budget = budget;
+    cache->max_entries = (max_entries + CYGFUSE_PATHCACHE_SHARDS - 1) / CYGFUSE_PATHCACHE_SHARDS;
+    for (unsigned i = 0; CYGFUSE_PATHCACHE_SHARDS > i; i++)
+    {
+        struct cygfuse_pathcache_shard *shard = &cache->shard[i];
+        pthread_mutex_init(&shard->mutex, 0);
+        shard->lru.prev = shard->lru.next = &shard->lru;
+    }
+}
+
+int cygfuse_pathcache_filter(struct cygfuse_pathcache *cache)
+{
+    size_t nbits = 64 * 64;
+
+    /* the filter is sized for the cache, which must therefore be bounded */
+    if (0 == cache->max_entries)
+        return 0;
+    while (nbits < cache->max_entries * CYGFUSE_PATHCACHE_SHARDS * CYGFUSE_PATHCACHE_FILTER_BITS)
+        nbits *= 2;
+    cache->filter = calloc(nbits / 64, sizeof(uint64_t));
+    if (0 == cache->filter)
+        return 0;
+    cache->filter_mask = nbits - 1;
+    return 1;
+}
+
+/*
+ * The filter is rebuilt with every shard mutex held, so that puts (which
+ * set filter bits with their shard mutex held) cannot set bits that are
+ * then cleared. Lookups read the filter without a mutex and may see it
+ * partly cleared; they then miss, which is harmless.
+ */
+static void cygfuse_pathcache_filter_rebuild(struct cygfuse_pathcache *cache)
+{
+    struct cygfuse_pathcache_lru *lru;
+
+    if (__atomic_exchange_n(&cache->filter_rebuild, 1, __ATOMIC_ACQUIRE))
+        return;
+
+    for (unsigned i = 0; CYGFUSE_PATHCACHE_SHARDS > i; i++)
+        pthread_mutex_lock(&cache->shard[i].mutex);
+
+    for (size_t i = 0; (cache->filter_mask + 1) / 64 > i; i++)
+        __atomic_store_n(&cache->filter[i], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&cache->filter_count, 0, __ATOMIC_RELAXED);
+    for (unsigned i = 0; CYGFUSE_PATHCACHE_SHARDS > i; i++)
+        for (lru = cache->shard[i].lru.next; &cache->shard[i].lru != lru; lru = lru->next)
+        {
+            cygfuse_pathcache_filter_set(cache, ((struct cygfuse_pathcache_entry *)lru)->hash);
+            cache->filter_count++;
+        }
+
+    for (unsigned i = CYGFUSE_PATHCACHE_SHARDS; 0 < i; i--)
+        pthread_mutex_unlock(&cache->shard[i - 1].mutex);
+
+    __atomic_store_n(&cache->filter_rebuild, 0, __ATOMIC_RELEASE);
+}
+
+uint64_t cygfuse_pathcache_generation(struct cygfuse_pathcache *cache, const char *path)
+{
+    struct cygfuse_pathcache_shard *shard = cygfuse_pathcache_shard(cache, cygfuse_hash_path(path));
+    return __atomic_load_n(&shard->generation, __ATOMIC_ACQUIRE);
+}
+
+int cygfuse_pathcache_visit(struct cygfuse_pathcache *cache, const char *path, uint64_t now,
+    int (*fn)(void *ctx, const void *value, size_t size), void *ctx)
+{
+    uint64_t hash = cygfuse_hash_path(path);
+    size_t keylen = strlen(path);
+    struct cygfuse_pathcache_shard *shard = cygfuse_pathcache_shard(cache, hash);
+    struct cygfuse_pathcache_entry *entry;
+    int result = -1;
+
+    if (0 != cache->filter && !cygfuse_pathcache_filter_test(cache, hash))
+    {
+        __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    entry = cygfuse_pathcache_find(shard, path, keylen, hash);
+    if (0 != entry && now >= entry->expiry)
+    {
+        cygfuse_pathcache_unlink(shard, entry);
+        cygfuse_pathcache_free(cache, entry);
+        entry = 0;
+    }
+    if (0 != entry)
+    {
+        /* move to the front of the LRU list */
+        entry->lru.prev->next = entry->lru.next;
+        entry->lru.next->prev = entry->lru.prev;
+        cygfuse_pathcache_lru_push(shard, entry);
+
+        result = fn(ctx, entry->value, entry->size);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    __atomic_add_fetch(0 <= result ? &cache->hits : &cache->misses, 1, __ATOMIC_RELAXED);
+    return result;
+}
+
+struct cygfuse_pathcache_copy
+{
+    void *value;
+    size_t size;
+};
+
+static int cygfuse_pathcache_copy(void *ctx, const void *value, size_t size)
+{
+    struct cygfuse_pathcache_copy *copy = ctx;
+    if (0 != copy->size)
+        memcpy(copy->value, value, size < copy->size ? size : copy->size);
+    return 0;
+}
+
+int cygfuse_pathcache_get(struct cygfuse_pathcache *cache, const char *path, uint64_t now,
+    void *value, size_t size)
+{
+    struct cygfuse_pathcache_copy copy = { value, size };
+    return 0 == cygfuse_pathcache_visit(cache, path, now, cygfuse_pathcache_copy, &copy);
+}
+
+int cygfuse_pathcache_put(struct cygfuse_pathcache *cache, const char *path, uint64_t generation,
+    const void *value, size_t size, uint64_t expiry)
+{
+    uint64_t hash = cygfuse_hash_path(path);
+    size_t keylen = strlen(path);
+    struct cygfuse_pathcache_shard *shard = cygfuse_pathcache_shard(cache, hash);
+    struct cygfuse_pathcache_entry *entry, *old, *victim = 0;
+    size_t offset = cygfuse_pathcache_offset(keylen);
+    int rebuild = 0;
+
+    if (!cygfuse_budget_charge(&cache->budget, offset + size))
+        return 0;
+    entry = malloc(offset + size);
+    if (0 == entry)
+    {
+        cygfuse_budget_release(&cache->budget, offset + size);
+        return 0;
+    }
+    entry->hash = hash;
+    entry->expiry = expiry;
+    entry->keylen = keylen;
+    entry->size = size;
+    entry->value = (char *)entry + offset;
+    memcpy(entry->key, path, keylen + 1);
+    if (0 != size)
+        memcpy(entry->value, value, size);
+
+    pthread_mutex_lock(&shard->mutex);
+    if (generation != shard->generation)
+    {
+        pthread_mutex_unlock(&shard->mutex);
+        cygfuse_budget_release(&cache->budget, offset + size);
+        free(entry);
+        return 0;
+    }
+
+    old = cygfuse_pathcache_find(shard, path, keylen, hash);
+    if (0 != old)
+        cygfuse_pathcache_unlink(shard, old);
+    else if (0 != cache->max_entries && cache->max_entries <= shard->count)
+    {
+        victim = (struct cygfuse_pathcache_entry *)shard->lru.prev;
+        cygfuse_pathcache_unlink(shard, victim);
+    }
+
+    if (shard->nbuckets <= shard->count)
+        cygfuse_pathcache_resize(shard,
+            0 != shard->nbuckets ? shard->nbuckets * 2 : CYGFUSE_PATHCACHE_MINBUCKETS);
+    if (0 == shard->nbuckets)
+    {
+        pthread_mutex_unlock(&shard->mutex);
+        cygfuse_budget_release(&cache->budget, offset + size);
+        free(entry);
+        if (0 != old)
+            cygfuse_pathcache_free(cache, old);
+        return 0;
+    }
+
+    entry->hnext = shard->buckets[hash & (shard->nbuckets - 1)];
+    shard->buckets[hash & (shard->nbuckets - 1)] = entry;
+    cygfuse_pathcache_lru_push(shard, entry);
+    shard->count++;
+    __atomic_add_fetch(&cache->entries, 1, __ATOMIC_RELAXED);
+    if (0 != cache->filter)
+    {
+        cygfuse_pathcache_filter_set(cache, hash);
+        /* rebuild when there are twice as many filter entries as the cache can hold */
+        rebuild = (cache->filter_mask + 1) / (CYGFUSE_PATHCACHE_FILTER_BITS / 2) <
+            __atomic_add_fetch(&cache->filter_count, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (rebuild)
+        cygfuse_pathcache_filter_rebuild(cache);
+
+    if (0 != old)
+        cygfuse_pathcache_free(cache, old);
+    if (0 != victim)
+    {
+        cygfuse_pathcache_free(cache, victim);
+        __atomic_add_fetch(&cache->evictions, 1, __ATOMIC_RELAXED);
+    }
+
+    return 1;
+}
+
+void cygfuse_pathcache_remove(struct cygfuse_pathcache *cache, const char *path)
+{
+    uint64_t hash = cygfuse_hash_path(path);
+    size_t keylen = strlen(path);
+    struct cygfuse_pathcache_shard *shard = cygfuse_pathcache_shard(cache, hash);
+    struct cygfuse_pathcache_entry *entry;
+
+    pthread_mutex_lock(&shard->mutex);
+    __atomic_add_fetch(&shard->generation, 1, __ATOMIC_RELEASE);
+    entry = cygfuse_pathcache_find(shard, path, keylen, hash);
+    if (0 != entry)
+        cygfuse_pathcache_unlink(shard, entry);
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (0 != entry)
+        cygfuse_pathcache_free(cache, entry);
+}
+
+/*
+ * Remove entries for which match returns nonzero from every shard. The
+ * generation of every shard is incremented, whether it had a match or not.
+ */
+static void cygfuse_pathcache_remove_if(struct cygfuse_pathcache *cache,
+    int (*match)(const struct cygfuse_pathcache_entry *entry, const void *ctx), const void *ctx)
+{
+    for (unsigned i = 0; CYGFUSE_PATHCACHE_SHARDS > i; i++)
+    {
+        struct cygfuse_pathcache_shard *shard = &cache->shard[i];
+        struct cygfuse_pathcache_entry *entry, *next, *list = 0;
+
+        pthread_mutex_lock(&shard->mutex);
+        __atomic_add_fetch(&shard->generation, 1, __ATOMIC_RELEASE);
+        for (entry = (struct cygfuse_pathcache_entry *)shard->lru.next;
+            &shard->lru != &entry->lru; entry = next)
+        {
+            next = (struct cygfuse_pathcache_entry *)entry->lru.next;
+            if (match(entry, ctx))
+            {
+                cygfuse_pathcache_unlink(shard, entry);
+                entry->hnext = list;
+                list = entry;
+            }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+
+        for (entry = list; 0 != entry; entry = next)
+        {
+            next = entry->hnext;
+            cygfuse_pathcache_free(cache, entry);
+        }
+    }
+}
+
+struct cygfuse_pathcache_prefix
+{
+    const char *path;
+    size_t len;
+};
+
+static int cygfuse_pathcache_match_tree(const struct cygfuse_pathcache_entry *entry, const void *ctx)
+{
+    const struct cygfuse_pathcache_prefix *prefix = ctx;
+
+    /* the root directory is "/"; other directories do not end in a slash */
+    if (1 == prefix->len && '/' == prefix->path[0])
+        return 1;
+    return entry->keylen >= prefix->len &&
+        0 == memcmp(entry->key, prefix->path, prefix->len) &&
+        ('\0' == entry->key[prefix->len] || '/' == entry->key[prefix->len]);
+}
+
+void cygfuse_pathcache_remove_tree(struct cygfuse_pathcache *cache, const char *path)
+{
+    struct cygfuse_pathcache_prefix prefix = { path, strlen(path) };
+    cygfuse_pathcache_remove_if(cache, cygfuse_pathcache_match_tree, &prefix);
+}
+
+static int cygfuse_pathcache_match_all(const struct cygfuse_pathcache_entry *entry, const void *ctx)
+{
+    (void)entry;
+    (void)ctx;
+    return 1;
+}
+
+void cygfuse_pathcache_clear(struct cygfuse_pathcache *cache)
+{
+    cygfuse_pathcache_remove_if(cache, cygfuse_pathcache_match_all, 0);
+}
+
+/*
+ * Remove the expired entries of every shard. The generations are left
+ * alone: an insert racing with the expiry inserts a value that is not
+ * expired and so is not stale either.
+ */
+uint64_t cygfuse_pathcache_expire(struct cygfuse_pathcache *cache, uint64_t now, size_t *pfreed)
+{
+    uint64_t next = UINT64_MAX;
+    size_t freed = 0;
+
+    for (unsigned i = 0; CYGFUSE_PATHCACHE_SHARDS > i; i++)
+    {
+        struct cygfuse_pathcache_shard *shard = &cache->shard[i];
+        struct cygfuse_pathcache_entry *entry, *lnext, *list = 0;
+
+        pthread_mutex_lock(&shard->mutex);
+        for (entry = (struct cygfuse_pathcache_entry *)shard->lru.next;
+            &shard->lru != &entry->lru; entry = lnext)
+        {
+            lnext = (struct cygfuse_pathcache_entry *)entry->lru.next;
+            if (now >= entry->expiry)
+            {
+                cygfuse_pathcache_unlink(shard, entry);
+                entry->hnext = list;
+                list = entry;
+            }
+            else if (next > entry->expiry)
+                next = entry->expiry;
+        }
+
+        /* the table is grown when as full as it has buckets; shrink it when a quarter as full */
+        if (0 == shard->count)
+        {
+            free(shard->buckets);
+            shard->buckets = 0;
+            shard->nbuckets = 0;
+        }
+        else if (CYGFUSE_PATHCACHE_MINBUCKETS < shard->nbuckets && shard->nbuckets / 4 > shard->count)
+        {
+            size_t nbuckets = shard->nbuckets;
+            while (CYGFUSE_PATHCACHE_MINBUCKETS < nbuckets && nbuckets / 4 > shard->count)
+                nbuckets /= 2;
+            cygfuse_pathcache_resize(shard, nbuckets);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+
+        for (entry = list; 0 != entry; entry = lnext)
+        {
+            lnext = entry->hnext;
+            cygfuse_pathcache_free(cache, entry);
+            freed++;
+        }
+    }
+
+    /* the filter still has the bits of the expired entries */
+    if (0 != freed && 0 != cache->filter)
+        cygfuse_pathcache_filter_rebuild(cache);
+
+    __atomic_add_fetch(&cache->expirations, freed, __ATOMIC_RELAXED);
+    if (0 != pfreed)
+        *pfreed += freed;
+    return next;
+}
+
+/*
+ * Evict least recently used entries from each shard in turn until goal
+ * bytes are freed, for the budget (see cygfuse-budget.c). Shards whose
+ * mutex is held are skipped, since the thread that charged the budget
+ * may hold it.
+ */
+static size_t cygfuse_pathcache_evict(void *ctx, size_t goal)
+{
+    struct cygfuse_pathcache *cache = ctx;
+    size_t freed = 0, quota, bytes, evicted = 0;
+    int progress;
+
+    do
+    {
+        progress = 0;
+        for (unsigned i = 0; CYGFUSE_PATHCACHE_SHARDS > i && goal > freed; i++)
+        {
+            struct cygfuse_pathcache_shard *shard = &cache->shard[i];
+            struct cygfuse_pathcache_entry *entry, *next, *list = 0;
+
+            /* a share of what is left, so that no shard is emptied before the others */
+            quota = (goal - freed + CYGFUSE_PATHCACHE_SHARDS - 1) / CYGFUSE_PATHCACHE_SHARDS;
+            bytes = 0;
+            if (0 != pthread_mutex_trylock(&shard->mutex))
+                continue;
+            while (quota > bytes && &shard->lru != shard->lru.prev)
+            {
+                entry = (struct cygfuse_pathcache_entry *)shard->lru.prev;
+                cygfuse_pathcache_unlink(shard, entry);
+                entry->hnext = list;
+                list = entry;
+                bytes += cygfuse_pathcache_offset(entry->keylen) + entry->size;
+            }
+            pthread_mutex_unlock(&shard->mutex);
+
+            for (entry = list; 0 != entry; entry = next)
+            {
+                next = entry->hnext;
+                cygfuse_pathcache_free(cache, entry);
+                evicted++;
+            }
+            freed += bytes;
+            progress |= 0 != bytes;
+        }
+    } while (goal > freed && progress);
+
+    /* the filter keeps the bits of the evicted entries until it is next rebuilt */
+    __atomic_add_fetch(&cache->evictions, evicted, __ATOMIC_RELAXED);
+    return freed;
+}
+
+static void cygfuse_pathcache_counters(void *ctx, uint64_t *hits, uint64_t *misses)
+{
+    struct cygfuse_pathcache *cache = ctx;
+
+    *hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+}
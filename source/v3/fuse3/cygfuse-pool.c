@@ -0,0 +1,151 @@
+/**
+ * @file fuse3/cygfuse-pool.c
+ * Bounded worker pool.
+ *
+ * Tasks are queued in a fixed size queue and run by at most
+ * CYGFUSE_POOL_THREADS detached threads. Threads are created on demand
+ * when a task is queued and no thread is idle, and exit after being idle
+ * for CYGFUSE_POOL_IDLE seconds, so that the pool costs nothing when
+ * unused and survives the fork done by fuse_daemonize.
+ *
+ * Submitting never blocks: if the queue is full (or no thread can be
+ * created) the task is not queued and the caller is expected to run it
+ * itself. Users of the pool are therefore structured so that the calling
+ * thread can do all of the work if it has to.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cygfuse-internal.h"
+
+struct cygfuse_pool_task
+{
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+static pthread_once_t cygfuse_pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t cygfuse_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cygfuse_pool_cond;
+static struct cygfuse_pool_task cygfuse_pool_queue[CYGFUSE_POOL_QUEUE];
+static size_t cygfuse_pool_head, cygfuse_pool_tail;
+static unsigned cygfuse_pool_threads, cygfuse_pool_idle;
+
+static void *cygfuse_pool_worker(void *arg)
+{
+    struct cygfuse_pool_task task;
+    struct timespec deadline;
+
+    (void)arg;
+    pthread_mutex_lock(&cygfuse_pool_mutex);
+    for (;;)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += CYGFUSE_POOL_IDLE;
+        while (cygfuse_pool_head == cygfuse_pool_tail)
+        {
+            int error;
+            cygfuse_pool_idle++;
+            error = pthread_cond_timedwait(&cygfuse_pool_cond, &cygfuse_pool_mutex, &deadline);
+            cygfuse_pool_idle--;
+            if (0 != error && cygfuse_pool_head == cygfuse_pool_tail)
+            {
+                cygfuse_pool_threads--;
+                pthread_mutex_unlock(&cygfuse_pool_mutex);
+                return 0;
+            }
+        }
+
+        task = cygfuse_pool_queue[cygfuse_pool_tail % CYGFUSE_POOL_QUEUE];
+        cygfuse_pool_tail++;
+        pthread_mutex_unlock(&cygfuse_pool_mutex);
+
+        task.fn(task.arg);
+
+        pthread_mutex_lock(&cygfuse_pool_mutex);
+    }
+}
+
+static void cygfuse_pool_atfork_prepare(void)
+{
+    pthread_mutex_lock(&cygfuse_pool_mutex);
+}
+
+static void cygfuse_pool_atfork_parent(void)
+{
+    pthread_mutex_unlock(&cygfuse_pool_mutex);
+}
+
+/* the child has none of the threads; queued tasks are dropped */
+static void cygfuse_pool_atfork_child(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_mutex_init(&cygfuse_pool_mutex, 0);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cygfuse_pool_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    cygfuse_pool_head = cygfuse_pool_tail = 0;
+    cygfuse_pool_threads = cygfuse_pool_idle = 0;
+}
+
+static void cygfuse_pool_initonce(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cygfuse_pool_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_atfork(cygfuse_pool_atfork_prepare, cygfuse_pool_atfork_parent,
+        cygfuse_pool_atfork_child);
+}
+
+int cygfuse_pool_submit(void (*fn)(void *arg), void *arg)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int result = 0;
+
+    pthread_once(&cygfuse_pool_once, cygfuse_pool_initonce);
+
+    pthread_mutex_lock(&cygfuse_pool_mutex);
+    if (CYGFUSE_POOL_QUEUE == cygfuse_pool_head - cygfuse_pool_tail)
+        goto exit;
+
+    /* if no thread is idle, start one; if that fails there must be a thread to run the task */
+    if (cygfuse_pool_idle <= cygfuse_pool_head - cygfuse_pool_tail &&
+        CYGFUSE_POOL_THREADS > cygfuse_pool_threads)
+    {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (0 == pthread_create(&thread, &attr, cygfuse_pool_worker, 0))
+            cygfuse_pool_threads++;
+        pthread_attr_destroy(&attr);
+    }
+    if (0 == cygfuse_pool_threads)
+        goto exit;
+
+    cygfuse_pool_queue[cygfuse_pool_head % CYGFUSE_POOL_QUEUE].fn = fn;
+    cygfuse_pool_queue[cygfuse_pool_head % CYGFUSE_POOL_QUEUE].arg = arg;
+    cygfuse_pool_head++;
+    pthread_cond_signal(&cygfuse_pool_cond);
+    result = 1;
+
+exit:
+    pthread_mutex_unlock(&cygfuse_pool_mutex);
+    return result;
+}
@@ -0,0 +1,887 @@
+/**
+ * @file fuse3/cygfuse-prefetch.c
+ * Prefetching layer of the operations interposer.
+ *
+ * The prefetching layer sits between the caching layer (see
+ * cygfuse-cache.c) and the file system and is enabled by listing what to
+ * prefetch, separated by commas, in the CYGFUSE_PREFETCH environment
+ * variable:
+ *
+ * - readdir: when WinFsp asks for a directory listing with stats
+ * (FUSE_READDIR_PLUS) and the file system's readdir returns plain entries,
+ * the stats of the entries are fetched by calling getattr for up to
+ * CYGFUSE_PREFETCH_GETATTR entries at a time on the worker pool (see
+ * cygfuse-pool.c), and the entries are passed on with their stats
+ * (FUSE_FILL_DIR_PLUS). This replaces the getattr per entry that WinFsp
+ * would otherwise make one at a time after the listing. The getattr calls
+ * go through the caching layer, so they are served from and fill the
+ * attribute cache when it is enabled.
+ *
+ * - read: reads of an open file are checked for sequential access; while
+ * a file is read sequentially, the data following the last read is read
+ * ahead on the worker pool in CYGFUSE_READAHEAD_CHUNK pieces, and later
+ * reads are served from it. The amount read ahead starts at one piece and
+ * doubles with every sequential read up to the max_readahead of the
+ * connection (CYGFUSE_READAHEAD_MAX if that is 0). Data read ahead is
+ * discarded when a write, truncate, etc. through any handle may have
+ * changed the file, and by the cleanup thread (see cygfuse-cleanup.c)
+ * when the file has not been read for CYGFUSE_READAHEAD_IDLE seconds.
+ * It is charged to the memory budget (see cygfuse-budget.c), which
+ * discards it first when memory runs short; while the budget is under
+ * pressure, reads ahead do not grow beyond one piece. The file system
+ * must implement open, and its read must allow concurrent calls for the
+ * same file handle, as it must for WinFsp's own concurrent reads anyway.
+ *
+ * Worker threads run with a copy of the fuse context of the thread that
+ * called readdir, so that file systems that look at their private data or
+ * the caller's uid/gid in getattr see what they would have seen.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+
+#define CYGFUSE_PREFETCH_READDIR        0x0001
+#define CYGFUSE_PREFETCH_READ           0x0002
+
+static unsigned cygfuse_prefetch_enabled;
+static const struct fuse3_operations *cygfuse_prefetch_next, *cygfuse_prefetch_top;
+static size_t cygfuse_readahead_max = CYGFUSE_READAHEAD_MAX;
+static int cygfuse_prefetch_cleanup;
+static size_t cygfuse_readahead_evict(void *ctx, size_t goal);
+static struct cygfuse_budget cygfuse_readahead_budget =
+    CYGFUSE_BUDGET_INIT("readahead", 0, CYGFUSE_BUDGET_COST(1, CYGFUSE_READAHEAD_CHUNK),
+        cygfuse_readahead_evict, 0, 0);
+
+static void *cygfuse_prefetch_init_op(struct fuse3_conn_info *conn, struct fuse3_config *conf)
+{
+    void *data;
+
+    if (0 != cygfuse_prefetch_next->init)
+        data = cygfuse_prefetch_next->init(conn, conf);
+    else
+        data = fuse3_get_context()->private_data;
+
+    /* listings with stats are what the readdir prefetch produces */
+    if (0 != conn && (cygfuse_prefetch_enabled & CYGFUSE_PREFETCH_READDIR) &&
+        (conn->capable & FUSE_CAP_READDIRPLUS))
+        conn->want |= FUSE_CAP_READDIRPLUS;
+    if (0 != conn && 0 != conn->max_readahead)
+        cygfuse_readahead_max = conn->max_readahead;
+
+    if (0 != cygfuse_prefetch_next->read && (cygfuse_prefetch_enabled & CYGFUSE_PREFETCH_READ))
+        cygfuse_prefetch_cleanup = 0 == cygfuse_cleanup_start();
+
+    return data;
+}
+
+static void cygfuse_prefetch_destroy_op(void *data)
+{
+    if (cygfuse_prefetch_cleanup)
+    {
+        cygfuse_cleanup_stop();
+        cygfuse_prefetch_cleanup = 0;
+    }
+
+    if (0 != cygfuse_prefetch_next->destroy)
+        cygfuse_prefetch_next->destroy(data);
+}
+
+/*
+ * Entries are buffered until the file system's readdir returns; those
+ * without stats then have their path formed and getattr called for them.
+ * The batch is shared by the calling thread and the pool tasks helping it
+ * and is freed by whichever of them is last done with it.
+ */
+struct cygfuse_plus_entry
+{
+    char *name;                         /* into names */
+    char *path;                         /* 0 if the entry needs no getattr */
+    struct fuse_stat stbuf;
+    int hasstat;
+    enum fuse3_fill_dir_flags flags;
+};
+
+struct cygfuse_plus_batch
+{
+    unsigned refcount;
+    struct fuse3_context context;
+    struct cygfuse_plus_entry *entries;
+    size_t count, capacity;
+    size_t *pending;                    /* indices of entries that need getattr */
+    size_t npending, next, done;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+struct cygfuse_plus_fill
+{
+    void *buf;
+    fuse3_fill_dir_t filler;
+    struct cygfuse_plus_batch *batch;
+    int passthru;
+    int error;
+};
+
+static void cygfuse_plus_release(struct cygfuse_plus_batch *batch)
+{
+    if (0 != __atomic_sub_fetch(&batch->refcount, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    for (size_t i = 0; batch->count > i; i++)
+    {
+        free(batch->entries[i].name);
+        free(batch->entries[i].path);
+    }
+    free(batch->entries);
+    free(batch->pending);
+    pthread_mutex_destroy(&batch->mutex);
+    pthread_cond_destroy(&batch->cond);
+    free(batch);
+}
+
+static void cygfuse_plus_work(struct cygfuse_plus_batch *batch)
+{
+    struct cygfuse_plus_entry *entry;
+    size_t i;
+
+    while (batch->npending > (i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)))
+    {
+        entry = &batch->entries[batch->pending[i]];
+        entry->hasstat = 0 == cygfuse_prefetch_top->getattr(entry->path, &entry->stbuf, 0);
+        if (entry->hasstat)
+            entry->flags |= FUSE_FILL_DIR_PLUS;
+
+        if (batch->npending == __atomic_add_fetch(&batch->done, 1, __ATOMIC_ACQ_REL))
+        {
+            pthread_mutex_lock(&batch->mutex);
+            pthread_cond_signal(&batch->cond);
+            pthread_mutex_unlock(&batch->mutex);
+        }
+    }
+}
+
+static void cygfuse_plus_task(void *arg)
+{
+    struct cygfuse_plus_batch *batch = arg;
+    struct fuse3_context *context = fuse3_get_context();
+
+    if (0 != context)
+        *context = batch->context;
+    cygfuse_plus_work(batch);
+    cygfuse_plus_release(batch);
+}
+
+static int cygfuse_plus_flush(struct cygfuse_plus_fill *fill)
+{
+    struct cygfuse_plus_batch *batch = fill->batch;
+    struct cygfuse_plus_entry *entry;
+    int result = 0;
+
+    for (size_t i = 0; batch->count > i && 0 == result; i++)
+    {
+        entry = &batch->entries[i];
+        result = fill->filler(fill->buf, entry->name,
+            entry->hasstat ? &entry->stbuf : 0, 0, entry->flags);
+    }
+
+    return result;
+}
+
+static int cygfuse_plus_filler(void *buf, const char *name,
+    const struct fuse_stat *stbuf, fuse_off_t off,
+    enum fuse3_fill_dir_flags flags)
+{
+    struct cygfuse_plus_fill *fill = buf;
+    struct cygfuse_plus_batch *batch = fill->batch;
+    struct cygfuse_plus_entry *entry;
+
+    if (fill->passthru)
+        return fill->filler(fill->buf, name, stbuf, off, flags);
+
+    /* a file system that uses offsets returns its listing in pieces that cannot be buffered */
+    if (0 != off)
+    {
+        fill->passthru = 1;
+        if (0 != cygfuse_plus_flush(fill))
+            return 1;
+        for (size_t i = 0; batch->count > i; i++)
+            free(batch->entries[i].name);
+        batch->count = 0;
+        return fill->filler(fill->buf, name, stbuf, off, flags);
+    }
+
+    if (0 != fill->error)
+        return 1;
+
+    if (batch->capacity == batch->count)
+    {
+        size_t capacity = 0 != batch->capacity ? batch->capacity * 2 : 64;
+        entry = realloc(batch->entries, capacity * sizeof *entry);
+        if (0 == entry)
+        {
+            fill->error = -ENOMEM;
+            return 1;
+        }
+        batch->entries = entry;
+        batch->capacity = capacity;
+    }
+
+    entry = &batch->entries[batch->count];
+    memset(entry, 0, sizeof *entry);
+    entry->name = strdup(name);
+    if (0 == entry->name)
+    {
+        fill->error = -ENOMEM;
+        return 1;
+    }
+    entry->flags = flags;
+    if (0 != stbuf)
+    {
+        entry->stbuf = *stbuf;
+        entry->hasstat = 1;
+    }
+    batch->count++;
+
+    return 0;
+}
+
+static int cygfuse_prefetch_readdir(const char *path, void *buf, fuse3_fill_dir_t filler,
+    fuse_off_t off, struct fuse3_file_info *fi, enum fuse3_readdir_flags flags)
+{
+    struct cygfuse_plus_fill fill;
+    struct cygfuse_plus_batch *batch;
+    struct cygfuse_plus_entry *entry;
+    struct fuse3_context *context;
+    size_t pathlen, namelen, helpers;
+    int result;
+
+    if (0 == path || 0 != off || !(flags & FUSE_READDIR_PLUS))
+        return cygfuse_prefetch_next->readdir(path, buf, filler, off, fi, flags);
+
+    batch = calloc(1, sizeof *batch);
+    if (0 == batch)
+        return cygfuse_prefetch_next->readdir(path, buf, filler, off, fi, flags);
+    batch->refcount = 1;
+    pthread_mutex_init(&batch->mutex, 0);
+    pthread_cond_init(&batch->cond, 0);
+
+    memset(&fill, 0, sizeof fill);
+    fill.buf = buf;
+    fill.filler = filler;
+    fill.batch = batch;
+
+    result = cygfuse_prefetch_next->readdir(path, &fill, cygfuse_plus_filler, off, fi, flags);
+    if (0 == result)
+        result = fill.error;
+    if (0 != result || fill.passthru)
+        goto exit;
+
+    /* entries with complete stats, "." and ".." need no getattr */
+    batch->pending = malloc(batch->count * sizeof *batch->pending + 1);
+    if (0 == batch->pending)
+        goto flush;
+    pathlen = strlen(path);
+    if (1 == pathlen && '/' == path[0])
+        pathlen = 0;
+    for (size_t i = 0; batch->count > i; i++)
+    {
+        entry = &batch->entries[i];
+        if ((entry->flags & FUSE_FILL_DIR_PLUS) ||
+            0 == strcmp(entry->name, ".") || 0 == strcmp(entry->name, ".."))
+            continue;
+        namelen = strlen(entry->name);
+        entry->path = malloc(pathlen + 1 + namelen + 1);
+        if (0 == entry->path)
+            continue;
+        memcpy(entry->path, path, pathlen);
+        entry->path[pathlen] = '/';
+        memcpy(entry->path + pathlen + 1, entry->name, namelen + 1);
+        batch->pending[batch->npending++] = i;
+    }
+    if (0 == batch->npending)
+        goto flush;
+
+    context = fuse3_get_context();
+    if (0 != context)
+        batch->context = *context;
+
+    /* the calling thread works too, so it is fine if fewer helpers than asked for are started */
+    helpers = batch->npending - 1;
+    if (CYGFUSE_PREFETCH_GETATTR - 1 < helpers)
+        helpers = CYGFUSE_PREFETCH_GETATTR - 1;
+    for (size_t i = 0; helpers > i; i++)
+    {
+        __atomic_add_fetch(&batch->refcount, 1, __ATOMIC_RELAXED);
+        if (!cygfuse_pool_submit(cygfuse_plus_task, batch))
+        {
+            __atomic_sub_fetch(&batch->refcount, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    cygfuse_plus_work(batch);
+
+    pthread_mutex_lock(&batch->mutex);
+    while (batch->npending != __atomic_load_n(&batch->done, __ATOMIC_ACQUIRE))
+        pthread_cond_wait(&batch->cond, &batch->mutex);
+    pthread_mutex_unlock(&batch->mutex);
+
+flush:
+    cygfuse_plus_flush(&fill);
+
+exit:
+    cygfuse_plus_release(batch);
+    return result;
+}
+
+/*
+ * The data read ahead for a handle is a ring of slots covering the
+ * contiguous range from the offset of the first slot to end; slots are
+ * added at the end and consumed from the front. A slot whose read is
+ * still in progress when it is discarded is orphaned: it is marked empty
+ * and the task that reads it frees its buffer.
+ */
+enum
+{
+    CYGFUSE_SLOT_EMPTY = 0,
+    CYGFUSE_SLOT_PENDING,
+    CYGFUSE_SLOT_READY,
+};
+
+struct cygfuse_readahead_slot
+{
+    fuse_off_t off;
+    size_t size;
+    int result;
+    int state;
+    char *data;
+    uint64_t datagen;
+};
+
+struct cygfuse_readahead
+{
+    fuse_off_t next;                    /* offset of the next sequential read */
+    fuse_off_t end;
+    uint64_t used;                      /* time of the last read */
+    size_t window;
+    unsigned inflight;
+    unsigned first, count;
+    struct cygfuse_readahead_slot slot[CYGFUSE_READAHEAD_SLOTS];
+};
+
+struct cygfuse_readahead_task
+{
+    struct cygfuse_handle *handle;
+    struct cygfuse_readahead_slot *slot;
+    char *data;
+    fuse_off_t off;
+    char *path;
+    struct fuse3_file_info fi;
+    struct fuse3_context context;
+};
+
+static void cygfuse_readahead_drop(struct cygfuse_readahead *ra, unsigned count)
+{
+    struct cygfuse_readahead_slot *slot;
+
+    for (; 0 < count && 0 < ra->count; count--)
+    {
+        slot = &ra->slot[ra->first];
+        if (CYGFUSE_SLOT_PENDING != slot->state)
+        {
+            free(slot->data);
+            cygfuse_budget_release(&cygfuse_readahead_budget, CYGFUSE_READAHEAD_CHUNK);
+        }
+        slot->data = 0;
+        slot->state = CYGFUSE_SLOT_EMPTY;
+        ra->first = (ra->first + 1) % CYGFUSE_READAHEAD_SLOTS;
+        ra->count--;
+    }
+}
+
+static void cygfuse_readahead_task(void *arg)
+{
+    struct cygfuse_readahead_task *task = arg;
+    struct cygfuse_handle *handle = task->handle;
+    struct cygfuse_readahead_slot *slot = task->slot;
+    struct fuse3_context *context = fuse3_get_context();
+    int result;
+
+    if (0 != context)
+        *context = task->context;
+    /* the slot may have been orphaned and reused already; only the task's own fields are safe */
+    result = cygfuse_prefetch_next->read(task->path, task->data, CYGFUSE_READAHEAD_CHUNK, task->off,
+        &task->fi);
+
+    pthread_mutex_lock(&handle->mutex);
+    if (CYGFUSE_SLOT_PENDING == slot->state && task->data == slot->data)
+    {
+        slot->result = result;
+        slot->state = CYGFUSE_SLOT_READY;
+    }
+    else
+    {
+        free(task->data);
+        cygfuse_budget_release(&cygfuse_readahead_budget, CYGFUSE_READAHEAD_CHUNK);
+    }
+    handle->readahead->inflight--;
+    pthread_cond_broadcast(&handle->cond);
+    pthread_mutex_unlock(&handle->mutex);
+
+    cygfuse_handle_put(handle);
+    free(task->path);
+    free(task);
+}
+
+/* called with the handle mutex held */
+static void cygfuse_readahead_issue(struct cygfuse_handle *handle,
+    const char *path, const struct fuse3_file_info *fi, uint64_t datagen)
+{
+    struct cygfuse_readahead *ra = handle->readahead;
+    struct cygfuse_readahead_slot *slot;
+    struct cygfuse_readahead_task *task;
+    struct fuse3_context *context = 0;
+
+    if (0 == ra->count)
+        ra->end = ra->next;
+
+    while (ra->next + (fuse_off_t)ra->window > ra->end && CYGFUSE_READAHEAD_SLOTS > ra->count)
+    {
+        if (!cygfuse_budget_charge(&cygfuse_readahead_budget, CYGFUSE_READAHEAD_CHUNK))
+            break;
+        task = malloc(sizeof *task);
+        if (0 == task)
+        {
+            cygfuse_budget_release(&cygfuse_readahead_budget, CYGFUSE_READAHEAD_CHUNK);
+            break;
+        }
+        task->data = malloc(CYGFUSE_READAHEAD_CHUNK);
+        task->path = 0 != path ? strdup(path) : 0;
+        if (0 == task->data || (0 != path && 0 == task->path))
+        {
+            free(task->data);
+            free(task->path);
+            free(task);
+            cygfuse_budget_release(&cygfuse_readahead_budget, CYGFUSE_READAHEAD_CHUNK);
+            break;
+        }
+        if (0 == context)
+            context = fuse3_get_context();
+        if (0 != context)
+            task->context = *context;
+        else
+            memset(&task->context, 0, sizeof task->context);
+        task->fi = *fi;
+        task->handle = handle;
+
+        slot = &ra->slot[(ra->first + ra->count) % CYGFUSE_READAHEAD_SLOTS];
+        slot->off = ra->end;
+        slot->size = CYGFUSE_READAHEAD_CHUNK;
+        slot->result = 0;
+        slot->state = CYGFUSE_SLOT_PENDING;
+        slot->data = task->data;
+        slot->datagen = datagen;
+        task->slot = slot;
+        task->off = slot->off;
+
+        __atomic_add_fetch(&handle->refcount, 1, __ATOMIC_RELAXED);
+        if (!cygfuse_pool_submit(cygfuse_readahead_task, task))
+        {
+            __atomic_sub_fetch(&handle->refcount, 1, __ATOMIC_RELAXED);
+            slot->data = 0;
+            slot->state = CYGFUSE_SLOT_EMPTY;
+            free(task->data);
+            free(task->path);
+            free(task);
+            cygfuse_budget_release(&cygfuse_readahead_budget, CYGFUSE_READAHEAD_CHUNK);
+            break;
+        }
+        ra->inflight++;
+        ra->count++;
+        ra->end += CYGFUSE_READAHEAD_CHUNK;
+    }
+}
+
+static int cygfuse_prefetch_read(const char *path, char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    struct cygfuse_handle *handle;
+    struct cygfuse_readahead *ra;
+    struct cygfuse_readahead_slot *slot;
+    uint64_t datagen, now;
+    fuse_off_t pos;
+    size_t copied = 0, n;
+    int sequential, eof = 0, result;
+
+    handle = cygfuse_handle_get(path, fi);
+    if (0 == handle)
+        return cygfuse_prefetch_next->read(path, buf, size, off, fi);
+
+    datagen = cygfuse_handle_datagen(path);
+    now = cygfuse_now();
+    pthread_mutex_lock(&handle->mutex);
+
+    ra = handle->readahead;
+    if (0 == ra)
+    {
+        ra = handle->readahead = calloc(1, sizeof *ra);
+        if (0 == ra)
+        {
+            pthread_mutex_unlock(&handle->mutex);
+            cygfuse_handle_put(handle);
+            return cygfuse_prefetch_next->read(path, buf, size, off, fi);
+        }
+    }
+
+    ra->used = now;
+
+    /* concurrent sequential reads may arrive out of order; anything within the range is sequential */
+    sequential = off == ra->next ||
+        (0 != ra->count && ra->slot[ra->first].off <= off && ra->end > off);
+    if (!sequential)
+    {
+        cygfuse_readahead_drop(ra, ra->count);
+        ra->window = 0;
+    }
+
+    while (0 != ra->count && size > copied)
+    {
+        slot = &ra->slot[ra->first];
+        pos = off + (fuse_off_t)copied;
+        if (slot->off > pos)
+            break;
+        if (slot->off + (fuse_off_t)slot->size <= pos)
+        {
+            cygfuse_readahead_drop(ra, 1);
+            continue;
+        }
+        if (CYGFUSE_SLOT_PENDING == slot->state)
+        {
+            pthread_cond_wait(&handle->cond, &handle->mutex);
+            continue;
+        }
+        if (datagen != slot->datagen || 0 > slot->result)
+        {
+            cygfuse_readahead_drop(ra, ra->count);
+            break;
+        }
+        if (slot->off + slot->result <= pos)
+        {
+            eof = 1;
+            break;
+        }
+
+        n = (size_t)(slot->off + slot->result - pos);
+        if (size - copied < n)
+            n = size - copied;
+        memcpy(buf + copied, slot->data + (pos - slot->off), n);
+        copied += n;
+    }
+
+    if (size > copied && !eof)
+    {
+        pthread_mutex_unlock(&handle->mutex);
+        result = cygfuse_prefetch_next->read(path, buf + copied, size - copied,
+            off + (fuse_off_t)copied, fi);
+        pthread_mutex_lock(&handle->mutex);
+        if (0 > result)
+        {
+            if (0 == copied)
+            {
+                cygfuse_readahead_drop(ra, ra->count);
+                ra->window = 0;
+                ra->next = -1;
+                pthread_mutex_unlock(&handle->mutex);
+                cygfuse_handle_put(handle);
+                return result;
+            }
+        }
+        else
+        {
+            if (size - copied > (size_t)result)
+                eof = 1;
+            copied += (size_t)result;
+        }
+    }
+
+    /* a read elsewhere starts over from where it ended */
+    if (!sequential || ra->next < off + (fuse_off_t)copied)
+        ra->next = off + (fuse_off_t)copied;
+    if (sequential && !eof)
+    {
+        ra->window = 0 != ra->window ? ra->window * 2 : CYGFUSE_READAHEAD_CHUNK;
+        if (cygfuse_readahead_max < ra->window)
+            ra->window = cygfuse_readahead_max;
+        if (cygfuse_budget_pressure())
+            ra->window = CYGFUSE_READAHEAD_CHUNK;
+        cygfuse_readahead_issue(handle, path, fi, datagen);
+    }
+
+    pthread_mutex_unlock(&handle->mutex);
+    cygfuse_handle_put(handle);
+
+    return (int)copied;
+}
+
+static int cygfuse_prefetch_open(const char *path, struct fuse3_file_info *fi)
+{
+    struct cygfuse_handle *handle;
+    int result;
+
+    result = 0 != cygfuse_prefetch_next->open ? cygfuse_prefetch_next->open(path, fi) : 0;
+    if (0 == result)
+    {
+        if (O_TRUNC & fi->flags)
+            cygfuse_handle_datachanged(path);
+        handle = cygfuse_handle_open(path, fi);
+        if (0 != handle)
+            cygfuse_handle_put(handle);
+    }
+
+    return result;
+}
+
+static int cygfuse_prefetch_create(const char *path, fuse_mode_t mode, struct fuse3_file_info *fi)
+{
+    struct cygfuse_handle *handle;
+    int result;
+
+    result = cygfuse_prefetch_next->create(path, mode, fi);
+    if (0 == result)
+    {
+        cygfuse_handle_datachanged(path);
+        handle = cygfuse_handle_open(path, fi);
+        if (0 != handle)
+            cygfuse_handle_put(handle);
+    }
+
+    return result;
+}
+
+/* outstanding reads ahead must be done before the file system closes its file handle */
+static int cygfuse_prefetch_release(const char *path, struct fuse3_file_info *fi)
+{
+    struct cygfuse_handle *handle;
+    struct cygfuse_readahead *ra;
+
+    handle = cygfuse_handle_get(path, fi);
+    if (0 != handle)
+    {
+        pthread_mutex_lock(&handle->mutex);
+        ra = handle->readahead;
+        if (0 != ra)
+        {
+            cygfuse_readahead_drop(ra, ra->count);
+            while (0 != ra->inflight)
+                pthread_cond_wait(&handle->cond, &handle->mutex);
+        }
+        pthread_mutex_unlock(&handle->mutex);
+
+        /* the readahead state is freed with the handle, when its last reference goes */
+        cygfuse_handle_close(handle);
+        cygfuse_handle_put(handle);
+    }
+
+    return 0 != cygfuse_prefetch_next->release ? cygfuse_prefetch_next->release(path, fi) : 0;
+}
+
+struct cygfuse_readahead_clean
+{
+    uint64_t now, next;
+    size_t freed;
+};
+
+/* the struct cygfuse_readahead stays; a read may be using it without the handle mutex */
+static void cygfuse_readahead_clean_handle(struct cygfuse_handle *handle, void *ctx)
+{
+    struct cygfuse_readahead_clean *clean = ctx;
+    struct cygfuse_readahead *ra;
+    uint64_t expiry;
+
+    pthread_mutex_lock(&handle->mutex);
+    ra = handle->readahead;
+    if (0 != ra && 0 != ra->count)
+    {
+        expiry = ra->used + (uint64_t)CYGFUSE_READAHEAD_IDLE * 1000000000;
+        if (clean->now >= expiry)
+        {
+            clean->freed += ra->count;
+            cygfuse_readahead_drop(ra, ra->count);
+            ra->window = 0;
+        }
+        else if (clean->next > expiry)
+            clean->next = expiry;
+    }
+    pthread_mutex_unlock(&handle->mutex);
+}
+
+/* nothing read after now goes idle before now + CYGFUSE_READAHEAD_IDLE */
+static uint64_t cygfuse_readahead_clean(uint64_t now, size_t *pfreed)
+{
+    struct cygfuse_readahead_clean clean =
+        { now, now + (uint64_t)CYGFUSE_READAHEAD_IDLE * 1000000000, 0 };
+
+    cygfuse_handle_foreach(cygfuse_readahead_clean_handle, &clean);
+    *pfreed += clean.freed;
+    return clean.next;
+}
+
+struct cygfuse_readahead_evict
+{
+    size_t goal, freed;
+};
+
+/* data still being read is freed by its task once it is done */
+static void cygfuse_readahead_evict_handle(struct cygfuse_handle *handle, void *ctx)
+{
+    struct cygfuse_readahead_evict *evict = ctx;
+    struct cygfuse_readahead *ra;
+
+    /* the handle of the thread that charged the budget is held; it is skipped */
+    if (evict->goal <= evict->freed || 0 != pthread_mutex_trylock(&handle->mutex))
+        return;
+    ra = handle->readahead;
+    if (0 != ra && 0 != ra->count)
+    {
+        for (unsigned i = 0; ra->count > i; i++)
+            if (CYGFUSE_SLOT_READY == ra->slot[(ra->first + i) % CYGFUSE_READAHEAD_SLOTS].state)
+                evict->freed += CYGFUSE_READAHEAD_CHUNK;
+        cygfuse_readahead_drop(ra, ra->count);
+        ra->window = 0;
+    }
+    pthread_mutex_unlock(&handle->mutex);
+}
+
+static size_t cygfuse_readahead_evict(void *ctx, size_t goal)
+{
+    struct cygfuse_readahead_evict evict = { goal, 0 };
+
+    (void)ctx;
+    cygfuse_handle_foreach(cygfuse_readahead_evict_handle, &evict);
+    return evict.freed;
+}
+
+static int cygfuse_prefetch_rename(const char *oldpath, const char *newpath, unsigned int flags)
+{
+    int result;
+
+    result = cygfuse_prefetch_next->rename(oldpath, newpath, flags);
+    cygfuse_handle_datachanged(oldpath);
+    cygfuse_handle_datachanged(newpath);
+    if (0 == result)
+        cygfuse_handle_rename(oldpath, newpath);
+
+    return result;
+}
+
+/*
+ * Operations that may change the data of a file.
+ *
+ * X(OP, PARAMS, ARGS)
+ */
+#define CYGFUSE_PREFETCH_DATA_LIST(X)   \
+    X(unlink,                           \
+        (const char *path),             \
+        (path))                         \
+    X(truncate,                         \
+        (const char *path, fuse_off_t size, struct fuse3_file_info *fi),\
+        (path, size, fi))               \
+    X(write,                            \
+        (const char *path, const char *buf, size_t size, fuse_off_t off, struct fuse3_file_info *fi),\
+        (path, buf, size, off, fi))     \
+    X(write_buf,                        \
+        (const char *path, struct fuse3_bufvec *buf, fuse_off_t off, struct fuse3_file_info *fi),\
+        (path, buf, off, fi))           \
+    X(fallocate,                        \
+        (const char *path, int mode, fuse_off_t off, fuse_off_t len, struct fuse3_file_info *fi),\
+        (path, mode, off, len, fi))
+
+#define CYGFUSE_PREFETCH_WRAP(OP, PARAMS, ARGS)\
+    static int cygfuse_prefetch_ ## OP PARAMS\
+    {\
+        int result = cygfuse_prefetch_next->OP ARGS;\
+        cygfuse_handle_datachanged(path);\
+        return result;\
+    }
+CYGFUSE_PREFETCH_DATA_LIST(CYGFUSE_PREFETCH_WRAP)
+#undef CYGFUSE_PREFETCH_WRAP
+
+int cygfuse_prefetch_init(void)
+{
+    const char *env = getenv(CYGFUSE_PREFETCH_ENV);
+    char *list, *name, *save;
+
+    if (0 == env || '\0' == env[0])
+        return 0;
+
+    list = strdup(env);
+    if (0 == list)
+        return 0;
+    for (name = strtok_r(list, ",", &save); 0 != name; name = strtok_r(0, ",", &save))
+    {
+        if (0 == strcmp(name, "readdir"))
+            cygfuse_prefetch_enabled |= CYGFUSE_PREFETCH_READDIR;
+        else if (0 == strcmp(name, "read"))
+            cygfuse_prefetch_enabled |= CYGFUSE_PREFETCH_READ;
+        else
+            fprintf(stderr, "cygfuse: unknown prefetch: %s\n", name);
+    }
+    free(list);
+
+    if (cygfuse_prefetch_enabled & CYGFUSE_PREFETCH_READ)
+    {
+        cygfuse_cleanup_register(cygfuse_readahead_clean);
+        cygfuse_budget_register(&cygfuse_readahead_budget);
+    }
+
+    return 0 != cygfuse_prefetch_enabled;
+}
+
+void cygfuse_prefetch_install(struct fuse3_operations *wrap, const struct fuse3_operations *next,
+    const struct fuse3_operations *top)
+{
+    cygfuse_prefetch_next = next;
+    cygfuse_prefetch_top = top;
+
+    wrap->init = cygfuse_prefetch_init_op;
+    wrap->destroy = cygfuse_prefetch_destroy_op;
+    if (0 != next->readdir && 0 != next->getattr &&
+        (cygfuse_prefetch_enabled & CYGFUSE_PREFETCH_READDIR))
+        wrap->readdir = cygfuse_prefetch_readdir;
+
+    /* open and release are needed to track handles, whether the file system has them or not */
+    if (0 != next->read && (cygfuse_prefetch_enabled & CYGFUSE_PREFETCH_READ))
+    {
+        wrap->read = cygfuse_prefetch_read;
+        wrap->open = cygfuse_prefetch_open;
+        wrap->release = cygfuse_prefetch_release;
+        if (0 != next->create)
+            wrap->create = cygfuse_prefetch_create;
+        if (0 != next->rename)
+            wrap->rename = cygfuse_prefetch_rename;
+#define CYGFUSE_PREFETCH_INSTALL(OP, PARAMS, ARGS)\
+        if (0 != next->OP)\
+            wrap->OP = cygfuse_prefetch_ ## OP;
+        CYGFUSE_PREFETCH_DATA_LIST(CYGFUSE_PREFETCH_INSTALL)
+#undef CYGFUSE_PREFETCH_INSTALL
+    }
+}
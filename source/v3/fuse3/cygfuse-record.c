@@ -0,0 +1,234 @@
+/**
+ * @file fuse3/cygfuse-record.c
+ * Flight recorder of recent file system operations.
+ *
+ * Every thread that calls into the file system gets a ring of the last
+ * CYGFUSE_RECORD_ENTRIES operations it performed: operation, hash of the
+ * path, file handle, size, offset, start and end times and result. An
+ * operation is entered into the ring when it starts and completed when it
+ * ends, so operations that are stuck show up with no end time.
+ *
+ * Rings are allocated once per thread and reused after the thread exits;
+ * recording itself neither allocates nor locks. Each entry is protected by
+ * a sequence count (odd while being written), so the rings can be dumped
+ * while the file system keeps serving; entries that change during the dump
+ * are skipped.
+ *
+ * The recorder is enabled by setting the CYGFUSE_RECORD environment
+ * variable to the path of a file. The rings are written to that file,
+ * merged in start time order, at exit and whenever the file system
+ * receives SIGUSR1.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cygfuse-internal.h"
+
+struct cygfuse_record_ring
+{
+    struct cygfuse_tls tls;
+    unsigned thread;
+    uint64_t head;
+    struct cygfuse_record_entry entry[CYGFUSE_RECORD_ENTRIES];
+};
+
+struct cygfuse_record_item
+{
+    unsigned thread;
+    struct cygfuse_record_entry entry;
+};
+
+static const char *const *cygfuse_record_names;
+static size_t cygfuse_record_count;
+static char *cygfuse_record_path;
+static pthread_key_t cygfuse_record_key;
+static struct cygfuse_tls *cygfuse_record_rings;
+static unsigned cygfuse_record_threads;
+
+uint64_t cygfuse_record_hash(const char *path)
+{
+    return 0 != path ? cygfuse_hash_path(path) : 0;
+}
+
+static struct cygfuse_record_ring *cygfuse_record_ring(void)
+{
+    struct cygfuse_record_ring *ring;
+    int assigned;
+
+    ring = cygfuse_tls_get(cygfuse_record_key, &cygfuse_record_rings, sizeof *ring, &assigned);
+
+    /* a reused ring keeps its history but is labeled with the new thread */
+    if (assigned)
+        __atomic_store_n(&ring->thread,
+            __atomic_add_fetch(&cygfuse_record_threads, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    return ring;
+}
+
+struct cygfuse_record_entry *cygfuse_record_begin(unsigned op,
+    const char *path, uint64_t fh, uint64_t size, int64_t offset, uint64_t start)
+{
+    struct cygfuse_record_ring *ring = cygfuse_record_ring();
+    struct cygfuse_record_entry *entry;
+    uint64_t seq;
+
+    if (0 == ring)
+        return 0;
+
+    entry = &ring->entry[ring->head & (CYGFUSE_RECORD_ENTRIES - 1)];
+    seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    entry->op = op;
+    entry->result = 0;
+    entry->path = cygfuse_record_hash(path);
+    entry->fh = fh;
+    entry->size = size;
+    entry->offset = offset;
+    entry->start = start;
+    entry->end = 0;
+    __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+
+    return entry;
+}
+
+void cygfuse_record_end(struct cygfuse_record_entry *entry, int result, uint64_t end,
+    uint64_t fh)
+{
+    uint64_t seq;
+
+    if (0 == entry)
+        return;
+
+    seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    entry->result = result;
+    entry->fh = fh;
+    entry->end = end;
+    __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static int cygfuse_record_read(const struct cygfuse_record_entry *entry,
+    struct cygfuse_record_entry *copy)
+{
+    uint64_t seq;
+
+    seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+    if (0 == seq || 0 != (seq & 1))
+        return 0;
+    memcpy(copy, entry, sizeof *copy);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return seq == __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+}
+
+static int cygfuse_record_compare(const void *a, const void *b)
+{
+    const struct cygfuse_record_item *x = a, *y = b;
+    return (x->entry.start > y->entry.start) - (x->entry.start < y->entry.start);
+}
+
+void cygfuse_record_dump(FILE *file)
+{
+    struct cygfuse_record_item *items;
+    size_t count = 0, capacity = 0;
+    uint64_t now = cygfuse_now();
+
+    for (struct cygfuse_tls *tls = __atomic_load_n(&cygfuse_record_rings, __ATOMIC_ACQUIRE);
+        0 != tls; tls = tls->next)
+        capacity += CYGFUSE_RECORD_ENTRIES;
+
+    items = malloc((capacity ? capacity : 1) * sizeof *items);
+    if (0 == items)
+        return;
+
+    for (struct cygfuse_tls *tls = __atomic_load_n(&cygfuse_record_rings, __ATOMIC_ACQUIRE);
+        0 != tls && capacity > count; tls = tls->next)
+    {
+        struct cygfuse_record_ring *ring = (struct cygfuse_record_ring *)tls;
+        for (unsigned i = 0; CYGFUSE_RECORD_ENTRIES > i && capacity > count; i++)
+            if (cygfuse_record_read(&ring->entry[i], &items[count].entry))
+            {
+                items[count].thread = __atomic_load_n(&ring->thread, __ATOMIC_RELAXED);
+                count++;
+            }
+    }
+
+    qsort(items, count, sizeof *items, cygfuse_record_compare);
+
+    /* times are in microseconds relative to the time of the dump */
+    fprintf(file, "%-6s %-12s %-16s %-16s %10s %12s %14s %12s %8s\n",
+        "# tid", "op", "path_hash", "fh", "size", "offset", "start_us", "duration_us", "result");
+    for (size_t i = 0; count > i; i++)
+    {
+        struct cygfuse_record_entry *entry = &items[i].entry;
+
+        fprintf(file, "%-6u %-12s %016llx %016llx %10llu %12lld %14.3f ",
+            items[i].thread,
+            cygfuse_record_count > entry->op ? cygfuse_record_names[entry->op] : "?",
+            (unsigned long long)entry->path, (unsigned long long)entry->fh,
+            (unsigned long long)entry->size, (long long)entry->offset,
+            -((double)(now - entry->start) / 1000.0));
+        if (0 != entry->end)
+            fprintf(file, "%12.3f %8d\n", (entry->end - entry->start) / 1000.0, entry->result);
+        else
+            fprintf(file, "%12s %8s\n", "-", "-");
+    }
+
+    free(items);
+}
+
+static void cygfuse_record_write(void)
+{
+    FILE *file;
+
+    file = fopen(cygfuse_record_path, "w");
+    if (0 == file)
+        return;
+
+    fprintf(file, "# cygfuse flight recorder: pid %d, time %lld\n\n",
+        (int)getpid(), (long long)time(0));
+    cygfuse_record_dump(file);
+
+    fclose(file);
+}
+
+int cygfuse_record_enabled(void)
+{
+    return 0 != cygfuse_record_path;
+}
+
+int cygfuse_record_init(const char *const *names, size_t count)
+{
+    const char *path = getenv(CYGFUSE_RECORD_ENV);
+
+    if (0 == path || '\0' == path[0])
+        return 0;
+
+    if (0 != pthread_key_create(&cygfuse_record_key, cygfuse_tls_retire))
+        return 0;
+
+    cygfuse_record_path = strdup(path);
+    if (0 == cygfuse_record_path)
+        return 0;
+
+    cygfuse_record_names = names;
+    cygfuse_record_count = count;
+    cygfuse_dump_register(cygfuse_record_write);
+    return 1;
+}
@@ -0,0 +1,404 @@
+/**
+ * @file fuse3/cygfuse-shmcache.c
+ * Block cache in shared memory.
+ *
+ * A segment of POSIX shared memory holds a fixed number of slots of one
+ * block each, so that several processes on the same host (typically file
+ * systems that mount the same remote tree) can serve reads from blocks
+ * that any of them has read. A process attaches to a segment by name; the
+ * first to attach creates it with its own size, and later ones use the
+ * size it has.
+ *
+ * The segment is created with mode 0600, so that only processes of the
+ * user that creates it can attach; with a group it is created with mode
+ * 0660 and given to the group, so that file systems run by other users in
+ * the group can attach as well. A process that can attach can read every
+ * block in the segment, whatever the permissions of the files they were
+ * read from, and can put blocks that the others will serve: the check
+ * hash guards against collisions, not against forgery. A segment should
+ * be shared only by file systems that trust each other.
+ *
+ * The slots form a set-associative hash index: a block is identified by a
+ * 64-bit name and can be kept in any of the CYGFUSE_SHMCACHE_WAYS slots of
+ * the set that its name hashes to. A second 64-bit hash (check) is stored
+ * with the block and must match as well. When a set is full, the least
+ * recently used slot in it is replaced.
+ *
+ * There are no locks, since a process may die at any point while it is
+ * attached. Each slot has a sequence number that is odd while the slot is
+ * written: a writer takes a slot by changing its sequence number from
+ * even to odd (and gives up on slots that are already odd), and a reader
+ * copies the data and checks that the sequence number was even and has
+ * not changed in the meantime. A process that dies while writing a slot
+ * leaves the slot unusable until the segment is removed.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cygfuse-internal.h"
+
+#define CYGFUSE_SHMCACHE_MAGIC          0x314d485346475943ULL   /* "CYGFSHM1" */
+#define CYGFUSE_SHMCACHE_VERSION        1
+#define CYGFUSE_SHMCACHE_SLOTHDR        64
+#define CYGFUSE_SHMCACHE_WAIT           1000    /* ms to wait for another process to create a segment */
+
+struct cygfuse_shmcache_header
+{
+    uint64_t magic;                     /* set last by the process that creates the segment */
+    uint32_t version;
+    uint32_t blocksize;
+    uint64_t nsets;
+    uint64_t slotsize;
+    uint64_t clock;
+    uint64_t hits, misses, evictions;
+} __attribute__ ((aligned(64)));
+
+struct cygfuse_shmcache_slot
+{
+    uint64_t seq;                       /* odd while the slot is written */
+    uint64_t name;                      /* 0 if the slot is empty */
+    uint64_t check;
+    uint64_t used;
+    uint32_t datalen;
+    /* the data follows at CYGFUSE_SHMCACHE_SLOTHDR */
+};
+
+static void cygfuse_shmcache_segname(char *buf, size_t size, const char *name)
+{
+    snprintf(buf, size, "/cygfuse-%s", name);
+}
+
+static inline struct cygfuse_shmcache_slot *cygfuse_shmcache_slot(
+    struct cygfuse_shmcache *cache, uint64_t index)
+{
+    return (struct cygfuse_shmcache_slot *)
+        ((char *)cache->header + sizeof *cache->header + index * cache->header->slotsize);
+}
+
+static inline char *cygfuse_shmcache_data(struct cygfuse_shmcache_slot *slot)
+{
+    return (char *)slot + CYGFUSE_SHMCACHE_SLOTHDR;
+}
+
+static inline uint64_t cygfuse_shmcache_set(struct cygfuse_shmcache *cache, uint64_t name)
+{
+    return (name % cache->header->nsets) * CYGFUSE_SHMCACHE_WAYS;
+}
+
+/* waits for the process that creates a segment to size and initialize it */
+static struct cygfuse_shmcache_header *cygfuse_shmcache_wait(int fd)
+{
+    struct cygfuse_shmcache_header *header;
+    struct timespec ts = { 0, 1000000 };
+    struct stat st;
+
+    for (int i = 0; CYGFUSE_SHMCACHE_WAIT > i; i++, nanosleep(&ts, 0))
+    {
+        if (0 != fstat(fd, &st))
+            return 0;
+        if ((off_t)sizeof *header > st.st_size)
+            continue;
+
+        header = mmap(0, sizeof *header, PROT_READ, MAP_SHARED, fd, 0);
+        if (MAP_FAILED == header)
+            return 0;
+        if (CYGFUSE_SHMCACHE_MAGIC == __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE))
+            return header;
+        munmap(header, sizeof *header);
+    }
+
+    return 0;
+}
+
+int cygfuse_shmcache_attach(struct cygfuse_shmcache *cache, const char *name,
+    uint64_t size, uint32_t blocksize, gid_t group)
+{
+    struct cygfuse_shmcache_header *header, geometry;
+    char segname[256];
+    struct stat st;
+    uint64_t nslots;
+    int fd, created = 0;
+
+    memset(cache, 0, sizeof *cache);
+    cygfuse_shmcache_segname(segname, sizeof segname, name);
+
+    memset(&geometry, 0, sizeof geometry);
+    fd = shm_open(segname, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (-1 != fd)
+    {
+        created = 1;
+        /* the mode is set again, since shm_open applies the umask */
+        if ((gid_t)-1 != group &&
+            (0 != fchown(fd, (uid_t)-1, group) || 0 != fchmod(fd, 0660)))
+            goto fail;
+        geometry.version = CYGFUSE_SHMCACHE_VERSION;
+        geometry.blocksize = blocksize;
+        geometry.slotsize = (CYGFUSE_SHMCACHE_SLOTHDR + blocksize + 63) & ~(uint64_t)63;
+        nslots = size > sizeof geometry ? (size - sizeof geometry) / geometry.slotsize : 0;
+        geometry.nsets = nslots / CYGFUSE_SHMCACHE_WAYS;
+        if (0 == geometry.nsets)
+            geometry.nsets = 1;
+        cache->size = sizeof geometry +
+            geometry.nsets * CYGFUSE_SHMCACHE_WAYS * geometry.slotsize;
+        if (0 != ftruncate(fd, (off_t)cache->size))
+            goto fail;
+    }
+    else if (EEXIST == errno && -1 != (fd = shm_open(segname, O_RDWR, 0)))
+    {
+        header = cygfuse_shmcache_wait(fd);
+        if (0 == header)
+        {
+            errno = ETIMEDOUT;
+            goto fail;
+        }
+        geometry = *header;
+        munmap(header, sizeof *header);
+        if (CYGFUSE_SHMCACHE_VERSION != geometry.version || blocksize != geometry.blocksize)
+        {
+            errno = EINVAL;
+            goto fail;
+        }
+        cache->size = sizeof geometry +
+            geometry.nsets * CYGFUSE_SHMCACHE_WAYS * geometry.slotsize;
+        if (0 != fstat(fd, &st) || (off_t)cache->size > st.st_size)
+        {
+            errno = EINVAL;
+            goto fail;
+        }
+    }
+    else
+        goto fail;
+
+    cache->header = mmap(0, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == cache->header)
+    {
+        cache->header = 0;
+        goto fail;
+    }
+    close(fd);
+
+    /* a new segment is zero filled: all slots are empty */
+    if (created)
+    {
+        cache->header->version = geometry.version;
+        cache->header->blocksize = geometry.blocksize;
+        cache->header->slotsize = geometry.slotsize;
+        cache->header->nsets = geometry.nsets;
+        __atomic_store_n(&cache->header->magic, CYGFUSE_SHMCACHE_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    return 1;
+
+fail:
+    fprintf(stderr, "cygfuse: cannot attach to shared memory cache %s: %s\n",
+        segname, strerror(errno));
+    if (created)
+        shm_unlink(segname);
+    close(fd);
+    return 0;
+}
+
+void cygfuse_shmcache_detach(struct cygfuse_shmcache *cache)
+{
+    if (0 != cache->header)
+        munmap(cache->header, cache->size);
+    cache->header = 0;
+    cache->size = 0;
+}
+
+/* counted by all the processes attached */
+void cygfuse_shmcache_counters(struct cygfuse_shmcache *cache, uint64_t *hits, uint64_t *misses)
+{
+    if (0 == cache->header)
+    {
+        *hits = *misses = 0;
+        return;
+    }
+    *hits = __atomic_load_n(&cache->header->hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&cache->header->misses, __ATOMIC_RELAXED);
+}
+
+int cygfuse_shmcache_unlink(const char *name)
+{
+    char segname[256];
+
+    cygfuse_shmcache_segname(segname, sizeof segname, name);
+    return 0 == shm_unlink(segname) || ENOENT == errno;
+}
+
+ssize_t cygfuse_shmcache_get(struct cygfuse_shmcache *cache, uint64_t name, uint64_t check,
+    void *buf, size_t off, size_t size)
+{
+    struct cygfuse_shmcache_slot *slot;
+    uint64_t set, seq;
+    uint32_t datalen;
+
+    if (0 == name)
+        return -1;
+
+    set = cygfuse_shmcache_set(cache, name);
+    for (unsigned way = 0; CYGFUSE_SHMCACHE_WAYS > way; way++)
+    {
+        slot = cygfuse_shmcache_slot(cache, set + way);
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if ((seq & 1) ||
+            name != __atomic_load_n(&slot->name, __ATOMIC_RELAXED) ||
+            check != __atomic_load_n(&slot->check, __ATOMIC_RELAXED))
+            continue;
+        datalen = __atomic_load_n(&slot->datalen, __ATOMIC_RELAXED);
+        if (datalen < off + size)
+            continue;
+
+        memcpy(buf, cygfuse_shmcache_data(slot) + off, size);
+
+        /* the copy is good only if no writer took the slot meanwhile */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED))
+            continue;
+
+        __atomic_store_n(&slot->used,
+            __atomic_add_fetch(&cache->header->clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        __atomic_add_fetch(&cache->header->hits, 1, __ATOMIC_RELAXED);
+        return (ssize_t)size;
+    }
+
+    __atomic_add_fetch(&cache->header->misses, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+/*
+ * takes a slot for writing, provided that it has not been written since its
+ * sequence number was seq; returns 0 if the slot is busy or has been written
+ */
+static int cygfuse_shmcache_take(struct cygfuse_shmcache_slot *slot, uint64_t seq)
+{
+    if ((seq & 1) ||
+        !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+
+    /* readers that see the odd sequence number must not see the writes that follow before it */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return 1;
+}
+
+static void cygfuse_shmcache_give(struct cygfuse_shmcache_slot *slot, uint64_t seq)
+{
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void cygfuse_shmcache_put(struct cygfuse_shmcache *cache, uint64_t name, uint64_t check,
+    const void *data, size_t datalen)
+{
+    struct cygfuse_shmcache_slot *slot, *victim;
+    uint64_t set, seq, victimseq, used, oldname;
+
+    if (0 == name || cache->header->blocksize < datalen)
+        return;
+
+    set = cygfuse_shmcache_set(cache, name);
+    for (int attempt = 0; CYGFUSE_SHMCACHE_WAYS > attempt; attempt++)
+    {
+        /* the slot with the same name, else an empty slot, else the least recently used */
+        victim = 0;
+        victimseq = 1;
+        used = UINT64_MAX;
+        for (unsigned way = 0; CYGFUSE_SHMCACHE_WAYS > way; way++)
+        {
+            slot = cygfuse_shmcache_slot(cache, set + way);
+            seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1)
+                continue;
+            oldname = __atomic_load_n(&slot->name, __ATOMIC_RELAXED);
+            if (name == oldname)
+            {
+                victim = slot;
+                victimseq = seq;
+                break;
+            }
+            if (0 == oldname)
+            {
+                if (0 != used)
+                {
+                    victim = slot;
+                    victimseq = seq;
+                    used = 0;
+                }
+            }
+            else if (used > __atomic_load_n(&slot->used, __ATOMIC_RELAXED))
+            {
+                victim = slot;
+                victimseq = seq;
+                used = __atomic_load_n(&slot->used, __ATOMIC_RELAXED);
+            }
+        }
+        if (0 == victim)
+            return;
+
+        /* the slot must still be the one chosen; another process may have filled it meanwhile */
+        seq = victimseq;
+        if (!cygfuse_shmcache_take(victim, seq))
+            continue;
+
+        oldname = __atomic_load_n(&victim->name, __ATOMIC_RELAXED);
+        if (0 != oldname && name != oldname)
+            __atomic_add_fetch(&cache->header->evictions, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&victim->name, name, __ATOMIC_RELAXED);
+        __atomic_store_n(&victim->check, check, __ATOMIC_RELAXED);
+        __atomic_store_n(&victim->datalen, (uint32_t)datalen, __ATOMIC_RELAXED);
+        __atomic_store_n(&victim->used,
+            __atomic_add_fetch(&cache->header->clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        memcpy(cygfuse_shmcache_data(victim), data, datalen);
+        cygfuse_shmcache_give(victim, seq);
+        return;
+    }
+}
+
+void cygfuse_shmcache_remove(struct cygfuse_shmcache *cache, uint64_t name)
+{
+    struct cygfuse_shmcache_slot *slot;
+    uint64_t set, seq;
+
+    if (0 == name)
+        return;
+
+    set = cygfuse_shmcache_set(cache, name);
+    for (unsigned way = 0; CYGFUSE_SHMCACHE_WAYS > way; way++)
+    {
+        slot = cygfuse_shmcache_slot(cache, set + way);
+
+        /* a slot that is being written may be getting the block; wait for the writer */
+        for (int spin = 0; 1000 > spin; spin++)
+        {
+            seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            if (name != __atomic_load_n(&slot->name, __ATOMIC_RELAXED) && !(seq & 1))
+                break;
+            if (!cygfuse_shmcache_take(slot, seq))
+            {
+                sched_yield();
+                continue;
+            }
+            if (name == __atomic_load_n(&slot->name, __ATOMIC_RELAXED))
+                __atomic_store_n(&slot->name, 0, __ATOMIC_RELAXED);
+            cygfuse_shmcache_give(slot, seq);
+            break;
+        }
+    }
+}
@@ -0,0 +1,272 @@
+/**
+ * @file fuse3/cygfuse-stats.c
+ * Call counters and latency histograms.
+ *
+ * A statistics domain (e.g. the WinFsp API entry points) is a fixed set
+ * of named entries. Every thread records into its own shard of counters,
+ * so recording never takes a lock and never contends with other threads;
+ * shards are only merged when the statistics are dumped. The shard of an
+ * exiting thread is kept (so its counts are not lost) and is reused by
+ * the next new thread.
+ *
+ * Latencies are kept in log-linear histograms: each power of two range
+ * of nanoseconds is split into CYGFUSE_HIST_SUB linear sub-buckets, which
+ * bounds the relative error of any reported percentile to 25%.
+ *
+ * Statistics are enabled by setting the CYGFUSE_STATS environment
+ * variable to the path of a file. They are written to that file at exit
+ * and whenever the file system receives SIGUSR1 (see cygfuse_dump),
+ * followed by the reports that other facilities register to describe
+ * their state (such as memory use).
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cygfuse-internal.h"
+
+struct cygfuse_stats_shard
+{
+    struct cygfuse_tls tls;
+    struct cygfuse_stat stat[];
+};
+
+static pthread_mutex_t cygfuse_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cygfuse_stats *cygfuse_stats_list;
+static char *cygfuse_stats_path;
+
+unsigned cygfuse_hist_bucket(uint64_t ns)
+{
+    unsigned msb;
+
+    if (CYGFUSE_HIST_SUB > ns)
+        return (unsigned)ns;
+
+    msb = 63 - __builtin_clzll(ns);
+    if (CYGFUSE_HIST_MAXBIT < msb)
+        return CYGFUSE_HIST_BUCKETS - 1;
+
+    return (msb - CYGFUSE_HIST_SUBBITS + 1) * CYGFUSE_HIST_SUB +
+        (unsigned)((ns >> (msb - CYGFUSE_HIST_SUBBITS)) & (CYGFUSE_HIST_SUB - 1));
+}
+
+uint64_t cygfuse_hist_upper(unsigned bucket)
+{
+    unsigned msb, sub;
+
+    if (CYGFUSE_HIST_SUB > bucket)
+        return bucket;
+
+    msb = bucket / CYGFUSE_HIST_SUB + CYGFUSE_HIST_SUBBITS - 1;
+    sub = bucket % CYGFUSE_HIST_SUB;
+    return ((uint64_t)(CYGFUSE_HIST_SUB + sub + 1) << (msb - CYGFUSE_HIST_SUBBITS)) - 1;
+}
+
+static struct cygfuse_stats_shard *cygfuse_stats_shard(struct cygfuse_stats *stats)
+{
+    int assigned;
+
+    return cygfuse_tls_get(stats->key, &stats->shards,
+        sizeof(struct cygfuse_stats_shard) + stats->count * sizeof(struct cygfuse_stat), &assigned);
+}
+
+/* single writer per shard: relaxed load/store suffices and keeps readers untorn */
+#define CYGFUSE_STATS_ADD(p, v)         \
+    __atomic_store_n((p), __atomic_load_n((p), __ATOMIC_RELAXED) + (v), __ATOMIC_RELAXED)
+
+void cygfuse_stats_record(struct cygfuse_stats *stats, size_t index, uint64_t ns, int error)
+{
+    struct cygfuse_stats_shard *shard = cygfuse_stats_shard(stats);
+    struct cygfuse_stat *stat;
+
+    if (0 == shard)
+        return;
+
+    stat = &shard->stat[index];
+    CYGFUSE_STATS_ADD(&stat->count, 1);
+    CYGFUSE_STATS_ADD(&stat->errors, !!error);
+    CYGFUSE_STATS_ADD(&stat->sum, ns);
+    CYGFUSE_STATS_ADD(&stat->hist[cygfuse_hist_bucket(ns)], 1);
+}
+
+void cygfuse_stats_merge(struct cygfuse_stats *stats, size_t index, struct cygfuse_stat *out)
+{
+    memset(out, 0, sizeof *out);
+    for (struct cygfuse_tls *tls = __atomic_load_n(&stats->shards, __ATOMIC_ACQUIRE);
+        0 != tls; tls = tls->next)
+    {
+        struct cygfuse_stat *stat = &((struct cygfuse_stats_shard *)tls)->stat[index];
+        out->count += __atomic_load_n(&stat->count, __ATOMIC_RELAXED);
+        out->errors += __atomic_load_n(&stat->errors, __ATOMIC_RELAXED);
+        out->sum += __atomic_load_n(&stat->sum, __ATOMIC_RELAXED);
+        for (unsigned b = 0; CYGFUSE_HIST_BUCKETS > b; b++)
+            out->hist[b] += __atomic_load_n(&stat->hist[b], __ATOMIC_RELAXED);
+    }
+}
+
+static double cygfuse_stats_percentile(const struct cygfuse_stat *stat, double p)
+{
+    uint64_t rank = (uint64_t)(stat->count * p), seen = 0;
+    for (unsigned b = 0; CYGFUSE_HIST_BUCKETS > b; b++)
+    {
+        seen += stat->hist[b];
+        if (seen > rank)
+            return cygfuse_hist_upper(b) / 1000.0;
+    }
+    return 0;
+}
+
+void cygfuse_stats_dump(struct cygfuse_stats *stats, FILE *file)
+{
+    struct cygfuse_stat stat;
+
+    fprintf(file, "[%s]\n", stats->title);
+    fprintf(file, "%-32s %10s %8s %12s %12s %12s %12s %12s\n",
+        "# name", "count", "errors", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+    for (size_t i = 0; stats->count > i; i++)
+    {
+        cygfuse_stats_merge(stats, i, &stat);
+        if (0 == stat.count)
+            continue;
+
+        unsigned last = 0;
+        for (unsigned b = 0; CYGFUSE_HIST_BUCKETS > b; b++)
+            if (0 != stat.hist[b])
+                last = b;
+
+        fprintf(file, "%-32s %10llu %8llu %12.3f %12.3f %12.3f %12.3f %12.3f\n",
+            stats->names[i],
+            (unsigned long long)stat.count, (unsigned long long)stat.errors,
+            stat.sum / 1000.0 / stat.count,
+            cygfuse_stats_percentile(&stat, 0.50),
+            cygfuse_stats_percentile(&stat, 0.90),
+            cygfuse_stats_percentile(&stat, 0.99),
+            cygfuse_hist_upper(last) / 1000.0);
+
+        /* histogram as "upper_bound_ns:count" pairs */
+        fprintf(file, "  hist");
+        for (unsigned b = 0; CYGFUSE_HIST_BUCKETS > b; b++)
+            if (0 != stat.hist[b])
+                fprintf(file, " %llu:%llu",
+                    (unsigned long long)cygfuse_hist_upper(b), (unsigned long long)stat.hist[b]);
+        fprintf(file, "\n");
+    }
+    fprintf(file, "\n");
+}
+
+void cygfuse_stats_register(struct cygfuse_stats *stats)
+{
+    if (0 != pthread_key_create(&stats->key, cygfuse_tls_retire))
+        return;
+
+    pthread_mutex_lock(&cygfuse_stats_mutex);
+    stats->next = cygfuse_stats_list;
+    cygfuse_stats_list = stats;
+    pthread_mutex_unlock(&cygfuse_stats_mutex);
+}
+
+#define CYGFUSE_STATS_REPORTS           4
+static void (*cygfuse_stats_reports[CYGFUSE_STATS_REPORTS])(FILE *file);
+static unsigned cygfuse_stats_nreports;
+
+void cygfuse_stats_report(void (*report)(FILE *file))
+{
+    pthread_mutex_lock(&cygfuse_stats_mutex);
+    for (unsigned i = 0; cygfuse_stats_nreports > i; i++)
+        if (report == cygfuse_stats_reports[i])
+            goto exit;
+    if (CYGFUSE_STATS_REPORTS > cygfuse_stats_nreports)
+        cygfuse_stats_reports[cygfuse_stats_nreports++] = report;
+
+exit:
+    pthread_mutex_unlock(&cygfuse_stats_mutex);
+}
+
+int cygfuse_stats_enabled(void)
+{
+    return 0 != cygfuse_stats_path;
+}
+
+static void cygfuse_stats_write(void)
+{
+    FILE *file;
+
+    file = fopen(cygfuse_stats_path, "w");
+    if (0 == file)
+        return;
+
+    fprintf(file, "# cygfuse statistics: pid %d, time %lld\n\n",
+        (int)getpid(), (long long)time(0));
+    pthread_mutex_lock(&cygfuse_stats_mutex);
+    for (struct cygfuse_stats *stats = cygfuse_stats_list; 0 != stats; stats = stats->next)
+        cygfuse_stats_dump(stats, file);
+    for (unsigned i = 0; cygfuse_stats_nreports > i; i++)
+        cygfuse_stats_reports[i](file);
+    pthread_mutex_unlock(&cygfuse_stats_mutex);
+
+    fclose(file);
+}
+
+int cygfuse_stats_init(void)
+{
+    const char *path = getenv(CYGFUSE_STATS_ENV);
+
+    if (0 == path || '\0' == path[0])
+        return 0;
+
+    cygfuse_stats_path = strdup(path);
+    if (0 == cygfuse_stats_path)
+        return 0;
+
+    cygfuse_dump_register(cygfuse_stats_write);
+    return 1;
+}
+
+/*
+ * Diagnostics dump.
+ *
+ * Diagnostic facilities register a dump function, and cygfuse_dump calls
+ * all of them. It runs at exit and on SIGUSR1 (on the signal thread).
+ */
+#define CYGFUSE_DUMP_MAX                4
+static void (*cygfuse_dump_list[CYGFUSE_DUMP_MAX])(void);
+static unsigned cygfuse_dump_count;
+
+void cygfuse_dump_register(void (*dump)(void))
+{
+    pthread_mutex_lock(&cygfuse_stats_mutex);
+    if (CYGFUSE_DUMP_MAX > cygfuse_dump_count)
+    {
+        if (0 == cygfuse_dump_count)
+            atexit(cygfuse_dump);
+        cygfuse_dump_list[cygfuse_dump_count] = dump;
+        __atomic_store_n(&cygfuse_dump_count, cygfuse_dump_count + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&cygfuse_stats_mutex);
+}
+
+int cygfuse_dump_enabled(void)
+{
+    return 0 != __atomic_load_n(&cygfuse_dump_count, __ATOMIC_ACQUIRE);
+}
+
+void cygfuse_dump(void)
+{
+    unsigned count = __atomic_load_n(&cygfuse_dump_count, __ATOMIC_ACQUIRE);
+
+    for (unsigned i = 0; count > i; i++)
+        cygfuse_dump_list[i]();
+}
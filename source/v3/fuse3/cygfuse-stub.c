@@ -0,0 +1,121 @@
+/**
+ * @file fuse3/cygfuse-stub.c
+ * Stub FUSE provider for the cygfuse tests and benchmarks.
+ *
+ * This DLL exports the WinFsp FUSE3 entry points with trivial
+ * implementations so that the cost of the cygfuse dispatch machinery can
+ * be measured without WinFsp (or even Cygwin) being present. cygfuse
+ * itself can also be built against it outside Cygwin.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+struct fsp_fuse_env;
+
+#define STUB_API                        __attribute__ ((visibility("default")))
+#define STUB(n)                         STUB_API int n() { return 0; }
+
+static struct
+{
+    void *fuse;
+    unsigned uid, gid;
+    int pid;
+    void *private_data;
+    unsigned umask;
+} stub_context;
+
+static int stub_fuse;
+
+/* the last signal passed to WinFsp, for the fork test */
+STUB_API volatile int stub_signal;
+
+STUB_API
+void *fsp_fuse3_get_context(struct fsp_fuse_env *env)
+{
+    (void)env;
+    return &stub_context;
+}
+
+STUB_API
+int fsp_fuse3_version(struct fsp_fuse_env *env)
+{
+    (void)env;
+    return 32;
+}
+
+STUB_API
+const char *fsp_fuse3_pkgversion(struct fsp_fuse_env *env)
+{
+    (void)env;
+    return "3.2";
+}
+
+STUB_API
+void fsp_fuse_signal_handler(int sig)
+{
+    stub_signal = sig;
+}
+
+STUB_API
+void *fsp_fuse3_new(struct fsp_fuse_env *env)
+{
+    (void)env;
+    return &stub_fuse;
+}
+
+STUB_API
+void *fsp_fuse3_new_30(struct fsp_fuse_env *env)
+{
+    (void)env;
+    return &stub_fuse;
+}
+
+STUB(fsp_fuse3_parse_conn_info_opts)
+STUB(fsp_fuse3_apply_conn_info_opts)
+STUB(fsp_fuse_ntstatus_from_errno)
+STUB(fsp_fuse3_main_real)
+STUB(fsp_fuse3_lib_help)
+STUB(fsp_fuse3_destroy)
+STUB(fsp_fuse3_mount)
+STUB(fsp_fuse3_unmount)
+STUB(fsp_fuse3_loop)
+STUB(fsp_fuse3_loop_mt_31)
+STUB(fsp_fuse3_loop_mt)
+STUB(fsp_fuse3_exit)
+STUB(fsp_fuse3_notify)
+STUB(fsp_fuse_opt_parse)
+STUB(fsp_fuse_opt_add_arg)
+STUB(fsp_fuse_opt_insert_arg)
+STUB(fsp_fuse_opt_free_args)
+STUB(fsp_fuse_opt_add_opt)
+STUB(fsp_fuse_opt_add_opt_escaped)
+STUB(fsp_fuse_opt_match)
+
+#if !defined(__CYGWIN__)
+/*
+ * Cygwin functions referenced by the WinFsp headers, for cygfuse DLLs
+ * built against this stub outside Cygwin (see the Makefile).
+ */
+#include <stdlib.h>
+#include <string.h>
+
+STUB_API
+void *cygwin_create_path(unsigned what, const void *from)
+{
+    (void)what;
+    return strdup(from);
+}
+
+STUB_API
+int cygwin_winpid_to_pid(int winpid)
+{
+    return winpid;
+}
+#endif
@@ -0,0 +1,309 @@
+/**
+ * @file fuse3/cygfuse-test-blockcache.c
+ * Test of the persistent block cache in cygfuse-blockcache.c.
+ *
+ * A file system that keeps its files in memory and counts its reads is
+ * put under the block cache, with the cache in a temporary directory.
+ * Checks that data read once is served from the directory afterwards,
+ * also after the cache is restarted; that changes to a file, whether seen
+ * by getattr or made through the mount without changing its modification
+ * time, are never served stale; that blocks are dropped when the file
+ * system invalidates their file; that damaged blocks are ignored; and
+ * that the directory stays within its size. Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define FILESIZE                        (3 * CYGFUSE_BLOCKCACHE_BLOCK + 1000)
+#define BIGSIZE                         (4 * 1024 * 1024)
+
+static char root[] = "/tmp/cygfuse-test-XXXXXX";
+static char *file_data, *big_data;
+static time_t file_mtime = 1000000000;
+static unsigned calls_read;
+
+static void fill(char *p, size_t size, unsigned seed)
+{
+    for (size_t i = 0; size > i; i++)
+        p[i] = (char)((i * 31 + seed) >> 3);
+}
+
+/* "/file" and "/big" in memory; writes do not change the modification time */
+static int mem_file(const char *path, char **data, size_t *size)
+{
+    if (0 == strcmp(path, "/file"))
+    {
+        *data = file_data;
+        *size = FILESIZE;
+        return 1;
+    }
+    if (0 == strcmp(path, "/big"))
+    {
+        *data = big_data;
+        *size = BIGSIZE;
+        return 1;
+    }
+    return 0;
+}
+
+static int mem_getattr(const char *path, struct fuse_stat *stbuf, struct fuse3_file_info *fi)
+{
+    char *data;
+    size_t size;
+
+    memset(stbuf, 0, sizeof *stbuf);
+    if (0 == strcmp(path, "/"))
+    {
+        stbuf->st_mode = S_IFDIR | 0755;
+        return 0;
+    }
+    if (!mem_file(path, &data, &size))
+        return -ENOENT;
+    stbuf->st_mode = S_IFREG | 0644;
+    stbuf->st_size = (fuse_off_t)size;
+    stbuf->st_mtim.tv_sec = file_mtime;
+    return 0;
+}
+
+static int mem_open(const char *path, struct fuse3_file_info *fi)
+{
+    char *data;
+    size_t size;
+
+    return mem_file(path, &data, &size) ? 0 : -ENOENT;
+}
+
+static int mem_read(const char *path, char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    char *data;
+    size_t filesize;
+
+    calls_read++;
+    if (!mem_file(path, &data, &filesize))
+        return -ENOENT;
+    if ((fuse_off_t)filesize <= off)
+        return 0;
+    if (filesize - (size_t)off < size)
+        size = filesize - (size_t)off;
+    memcpy(buf, data + off, size);
+    return (int)size;
+}
+
+static int mem_write(const char *path, const char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    char *data;
+    size_t filesize;
+
+    if (!mem_file(path, &data, &filesize) || filesize < off + size)
+        return -ENOSPC;
+    memcpy(data + off, buf, size);
+    return (int)size;
+}
+
+static const struct fuse3_operations mem_ops =
+{
+    .getattr = mem_getattr,
+    .open = mem_open,
+    .read = mem_read,
+    .write = mem_write,
+};
+
+static struct fuse3_operations ops;
+
+static void start(void)
+{
+    memset(&ops, 0, sizeof ops);
+    CHECK(cygfuse_blockcache_init());
+    ops = mem_ops;
+    cygfuse_blockcache_install(&ops, &mem_ops);
+}
+
+/* opens and reads a file in pieces of odd sizes, as WinFsp does after getattr */
+static int read_file(const char *path, char *buf, size_t size)
+{
+    struct fuse3_file_info fi;
+    struct fuse_stat stbuf;
+    size_t off = 0;
+    int result;
+
+    memset(&fi, 0, sizeof fi);
+    if (0 != ops.open(path, &fi) || 0 != ops.getattr(path, &stbuf, &fi))
+        return 0;
+    while (size > off)
+    {
+        result = ops.read(path, buf + off, 50000 < size - off ? 50000 : size - off,
+            (fuse_off_t)off, &fi);
+        if (0 >= result)
+            break;
+        off += (size_t)result;
+    }
+    return size == off && 0 == ops.read(path, buf, 100, (fuse_off_t)size, &fi);
+}
+
+static uint64_t dir_size, dir_files;
+
+static int dir_visit(const char *name, const struct stat *st, int type, struct FTW *ftw)
+{
+    if (FTW_F == type)
+    {
+        dir_size += (uint64_t)st->st_size;
+        dir_files++;
+    }
+    return 0;
+}
+
+static int rm_visit(const char *name, const struct stat *st, int type, struct FTW *ftw)
+{
+    return remove(name);
+}
+
+/* damages one block file of the cache */
+static int damage_visit(const char *name, const struct stat *st, int type, struct FTW *ftw)
+{
+    if (FTW_F != type)
+        return 0;
+    return 0 == truncate(name, st->st_size / 2) ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char *buf = malloc(BIGSIZE), *expect = malloc(BIGSIZE);
+
+    file_data = malloc(FILESIZE);
+    big_data = malloc(BIGSIZE);
+    if (0 == mkdtemp(root))
+    {
+        fprintf(stderr, "cannot create temporary directory\n");
+        return 1;
+    }
+    fill(file_data, FILESIZE, 1);
+    fill(big_data, BIGSIZE, 2);
+
+    /* not enabled */
+    unsetenv(CYGFUSE_BLOCKCACHE_ENV);
+    unsetenv(CYGFUSE_SHMCACHE_ENV);
+    CHECK(!cygfuse_blockcache_init());
+
+    setenv(CYGFUSE_BLOCKCACHE_ENV, root, 1);
+    unsetenv(CYGFUSE_BLOCKCACHE_SIZE_ENV);
+    start();
+
+    /* cold, then warm */
+    calls_read = 0;
+    CHECK(read_file("/file", buf, FILESIZE));
+    CHECK(0 == memcmp(buf, file_data, FILESIZE));
+    CHECK(0 != calls_read);
+    calls_read = 0;
+    CHECK(read_file("/file", buf, FILESIZE));
+    CHECK(0 == memcmp(buf, file_data, FILESIZE));
+    CHECK(0 == calls_read);
+
+    /* warm after a restart */
+    cygfuse_blockcache_fini();
+    start();
+    calls_read = 0;
+    memset(buf, 0, FILESIZE);
+    CHECK(read_file("/file", buf, FILESIZE));
+    CHECK(0 == memcmp(buf, file_data, FILESIZE));
+    CHECK(0 == calls_read);
+
+    /* invalidated by the file system */
+    cygfuse_blockcache_invalidate("/file");
+    calls_read = 0;
+    CHECK(read_file("/file", buf, FILESIZE));
+    CHECK(0 == memcmp(buf, file_data, FILESIZE));
+    CHECK(0 != calls_read);
+
+    /* changed elsewhere: the new modification time is seen by getattr after open */
+    fill(file_data, FILESIZE, 3);
+    file_mtime++;
+    calls_read = 0;
+    CHECK(read_file("/file", buf, FILESIZE));
+    CHECK(0 == memcmp(buf, file_data, FILESIZE));
+    CHECK(0 != calls_read);
+
+    /* changed through the mount, with the same modification time and size */
+    {
+        struct fuse3_file_info fi;
+        memset(&fi, 0, sizeof fi);
+        fill(expect, 5000, 4);
+        CHECK(0 == ops.open("/file", &fi));
+        CHECK(1000 == ops.read("/file", buf, 1000, CYGFUSE_BLOCKCACHE_BLOCK - 2000, &fi));
+        CHECK(5000 == ops.write("/file", expect, 5000, CYGFUSE_BLOCKCACHE_BLOCK - 2500, &fi));
+        CHECK(1000 == ops.read("/file", buf, 1000, CYGFUSE_BLOCKCACHE_BLOCK - 2000, &fi));
+        CHECK(0 == memcmp(buf, expect + 500, 1000));
+    }
+    CHECK(read_file("/file", buf, FILESIZE));
+    CHECK(0 == memcmp(buf, file_data, FILESIZE));
+
+    /* damaged blocks are read from the file system again */
+    cygfuse_blockcache_fini();
+    nftw(root, damage_visit, 16, FTW_PHYS);
+    start();
+    calls_read = 0;
+    CHECK(read_file("/file", buf, FILESIZE));
+    CHECK(0 == memcmp(buf, file_data, FILESIZE));
+    CHECK(0 != calls_read);
+
+    /* bounded size; the most recently read blocks are kept */
+    cygfuse_blockcache_fini();
+    setenv(CYGFUSE_BLOCKCACHE_SIZE_ENV, "1", 1);
+    start();
+    CHECK(read_file("/big", buf, BIGSIZE));
+    CHECK(0 == memcmp(buf, big_data, BIGSIZE));
+    dir_size = dir_files = 0;
+    nftw(root, dir_visit, 16, FTW_PHYS);
+    CHECK(1024 * 1024 >= dir_size);
+    CHECK(0 != dir_files);
+    {
+        struct fuse3_file_info fi;
+        memset(&fi, 0, sizeof fi);
+        calls_read = 0;
+        CHECK(0 == ops.open("/big", &fi));
+        CHECK(1000 == ops.read("/big", buf, 1000, BIGSIZE - 1000, &fi));
+        CHECK(0 == calls_read);
+        CHECK(0 == memcmp(buf, big_data + BIGSIZE - 1000, 1000));
+    }
+
+    cygfuse_blockcache_fini();
+    nftw(root, rm_visit, 16, FTW_DEPTH | FTW_PHYS);
+
+    free(big_data);
+    free(file_data);
+    free(expect);
+    free(buf);
+
+    if (0 != failures)
+    {
+        fprintf(stderr, "cygfuse-test-blockcache: %d failures\n", failures);
+        return 1;
+    }
+    printf("cygfuse-test-blockcache: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,286 @@
+/**
+ * @file fuse3/cygfuse-test-budget.c
+ * Test of the memory budget in cygfuse-budget.c.
+ *
+ * Checks that limits are parsed with and without suffixes and that bad
+ * ones are refused; that charges and releases are accounted per cache and
+ * in total, except for shared caches; that a charge that would exceed the
+ * limit is refused when nothing can be evicted, and pressure is signalled
+ * above the low mark; that reclaiming evicts from the path cache whose
+ * bytes are cheapest to get back and leaves the other alone, whether it
+ * is cheaper for the size of its items or for their cost; and that the
+ * report lists every cache. Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define PATHS                           100
+#define BIGSIZE                         4096
+
+static struct cygfuse_budget fixed =
+    CYGFUSE_BUDGET_INIT("fixed", 0, CYGFUSE_BUDGET_COST(1, 0), 0, 0, 0);
+static struct cygfuse_budget shared =
+    CYGFUSE_BUDGET_INIT("shared", CYGFUSE_BUDGET_SHARED, CYGFUSE_BUDGET_COST(1, 0), 0, 0, 0);
+static struct cygfuse_pathcache big, small, cheap, dear;
+
+static int limit(uint64_t value)
+{
+    char buf[32];
+
+    snprintf(buf, sizeof buf, "%llu", (unsigned long long)value);
+    return cygfuse_budget_init(buf);
+}
+
+static void test_init(void)
+{
+    CHECK(0 == cygfuse_budget_init("0"));
+    CHECK(0 == cygfuse_budget_init("4096"));
+    CHECK(0 == cygfuse_budget_init("64k"));
+    CHECK(0 == cygfuse_budget_init("16M"));
+    CHECK(0 == cygfuse_budget_init("2G"));
+
+    CHECK(-1 == cygfuse_budget_init(0));
+    CHECK(-1 == cygfuse_budget_init(""));
+    CHECK(-1 == cygfuse_budget_init("M"));
+    CHECK(-1 == cygfuse_budget_init("-1"));
+    CHECK(-1 == cygfuse_budget_init("12x"));
+    CHECK(-1 == cygfuse_budget_init("16MB"));
+    CHECK(-1 == cygfuse_budget_init("99999999999999999999"));
+    CHECK(-1 == cygfuse_budget_init("17179869184G"));
+
+    /* unlimited for what follows */
+    CHECK(0 == cygfuse_budget_init("0"));
+}
+
+static void test_account(void)
+{
+    uint64_t used = cygfuse_budget_used();
+
+    CHECK(cygfuse_budget_charge(&fixed, 100));
+    CHECK(cygfuse_budget_charge(&fixed, 50));
+    CHECK(150 == fixed.used);
+    CHECK(2 == fixed.items);
+    CHECK(used + 150 == cygfuse_budget_used());
+    cygfuse_budget_release(&fixed, 100);
+    CHECK(50 == fixed.used);
+    CHECK(1 == fixed.items);
+    CHECK(150 == fixed.peak);
+    cygfuse_budget_release(&fixed, 50);
+    CHECK(0 == fixed.used);
+    CHECK(used == cygfuse_budget_used());
+
+    /* shared memory is reported, not counted */
+    CHECK(cygfuse_budget_charge(&shared, 1 << 20));
+    CHECK(1 << 20 == shared.used);
+    CHECK(used == cygfuse_budget_used());
+    CHECK(0 == cygfuse_budget_pressure());
+}
+
+static void test_limit(void)
+{
+    uint64_t used = cygfuse_budget_used();
+
+    /* low mark 6000, high mark 7000; nothing can be evicted */
+    CHECK(0 == limit(used + 8000));
+    CHECK(cygfuse_budget_charge(&fixed, 6000));
+    CHECK(0 == cygfuse_budget_pressure());
+    CHECK(cygfuse_budget_charge(&fixed, 1000));
+    CHECK(cygfuse_budget_pressure());
+    CHECK(!cygfuse_budget_charge(&fixed, 2000));
+    CHECK(1 == fixed.refused);
+    CHECK(used + 7000 == cygfuse_budget_used());
+    CHECK(cygfuse_budget_charge(&fixed, 1000));
+    CHECK(!cygfuse_budget_charge(&fixed, 1));
+    CHECK(used + 8000 == cygfuse_budget_used());
+
+    /* shared memory is not limited either */
+    CHECK(cygfuse_budget_charge(&shared, 1 << 20));
+
+    cygfuse_budget_release(&fixed, 6000);
+    cygfuse_budget_release(&fixed, 1000);
+    cygfuse_budget_release(&fixed, 1000);
+    CHECK(0 == cygfuse_budget_pressure());
+    CHECK(used == cygfuse_budget_used());
+    CHECK(0 == cygfuse_budget_init("0"));
+}
+
+static void test_reclaim(void)
+{
+    static char value[BIGSIZE];
+    uint64_t used, smallused, lim, small8 = 8;
+    char path[32];
+    int hits;
+
+    /* data read ahead and attributes */
+    cygfuse_pathcache_init(&big, "big", CYGFUSE_BUDGET_COST(1, BIGSIZE), 0);
+    cygfuse_pathcache_init(&small, "small", CYGFUSE_BUDGET_COST(1, 0), 0);
+    cygfuse_budget_register(&big.budget);
+    cygfuse_budget_register(&small.budget);
+
+    for (unsigned i = 0; PATHS > i; i++)
+    {
+        snprintf(path, sizeof path, "/big%u", i);
+        CHECK(cygfuse_pathcache_put(&big, path,
+            cygfuse_pathcache_generation(&big, path), value, sizeof value, UINT64_MAX));
+        snprintf(path, sizeof path, "/small%u", i);
+        CHECK(cygfuse_pathcache_put(&small, path,
+            cygfuse_pathcache_generation(&small, path), &small8, sizeof small8, UINT64_MAX));
+    }
+    CHECK(PATHS == big.entries);
+    CHECK(PATHS == small.entries);
+    CHECK(PATHS == big.budget.items);
+    CHECK(PATHS * BIGSIZE < big.budget.used);
+    used = cygfuse_budget_used();
+    smallused = small.budget.used;
+
+    /* between the low and high marks; the next big entry takes it above */
+    lim = used + used / 7 + 1;
+    CHECK(0 == limit(lim));
+    CHECK(cygfuse_budget_pressure());
+    CHECK(cygfuse_pathcache_put(&big, "/big",
+        cygfuse_pathcache_generation(&big, "/big"), value, sizeof value, UINT64_MAX));
+    CHECK(cygfuse_budget_used() <= lim - lim / 4);
+    CHECK(0 == cygfuse_budget_pressure());
+    CHECK(PATHS + 1 > big.entries);
+    CHECK(0 != big.evictions);
+    CHECK(big.entries == big.budget.items);
+    CHECK(0 != big.budget.evicted);
+
+    /* the small entries are more expensive per byte and are kept */
+    CHECK(PATHS == small.entries);
+    CHECK(smallused == small.budget.used);
+    CHECK(0 == small.evictions);
+    hits = 0;
+    for (unsigned i = 0; PATHS > i; i++)
+    {
+        snprintf(path, sizeof path, "/small%u", i);
+        hits += cygfuse_pathcache_get(&small, path, 0, &small8, sizeof small8);
+    }
+    CHECK(PATHS == hits);
+
+    /* the most recently used entries are kept */
+    CHECK(cygfuse_pathcache_get(&big, "/big", 0, value, sizeof value));
+
+    CHECK(0 == cygfuse_budget_init("0"));
+    cygfuse_pathcache_clear(&big);
+    CHECK(0 == big.budget.used);
+    CHECK(0 == big.budget.items);
+}
+
+static void test_cost(void)
+{
+    uint64_t used, dearused, lim, value = 8;
+    char path[32];
+
+    /* items of the same size, a getattr each and a remote block each */
+    cygfuse_pathcache_init(&cheap, "cheap", CYGFUSE_BUDGET_COST(1, 0), 0);
+    cygfuse_pathcache_init(&dear, "dear", CYGFUSE_BUDGET_COST(1, CYGFUSE_BLOCKCACHE_BLOCK), 0);
+    cygfuse_budget_register(&dear.budget);
+    cygfuse_budget_register(&cheap.budget);
+
+    for (unsigned i = 0; PATHS > i; i++)
+    {
+        snprintf(path, sizeof path, "/cheap%u", i);
+        CHECK(cygfuse_pathcache_put(&cheap, path,
+            cygfuse_pathcache_generation(&cheap, path), &value, sizeof value, UINT64_MAX));
+        snprintf(path, sizeof path, "/dear%u", i);
+        CHECK(cygfuse_pathcache_put(&dear, path,
+            cygfuse_pathcache_generation(&dear, path), &value, sizeof value, UINT64_MAX));
+    }
+    CHECK(cheap.budget.used == dear.budget.used);
+    cygfuse_pathcache_clear(&small);
+    used = cygfuse_budget_used();
+    dearused = dear.budget.used;
+
+    /* between the low and high marks; more entries take it above */
+    lim = used + used / 7 + 1;
+    CHECK(0 == limit(lim));
+    for (unsigned i = 0; PATHS > i && 0 == cheap.evictions; i++)
+    {
+        snprintf(path, sizeof path, "/cheap-%u", i);
+        CHECK(cygfuse_pathcache_put(&cheap, path,
+            cygfuse_pathcache_generation(&cheap, path), &value, sizeof value, UINT64_MAX));
+    }
+    CHECK(cygfuse_budget_used() <= lim - lim / 4);
+    CHECK(0 != cheap.evictions);
+    CHECK(0 == dear.evictions);
+    CHECK(PATHS == dear.entries);
+    CHECK(dearused == dear.budget.used);
+
+    CHECK(0 == cygfuse_budget_init("0"));
+    cygfuse_pathcache_clear(&cheap);
+    cygfuse_pathcache_clear(&dear);
+    CHECK(0 == cheap.budget.used && 0 == dear.budget.used);
+}
+
+static void test_report(void)
+{
+    char buf[4096], *p;
+    size_t size;
+    FILE *file;
+
+    file = tmpfile();
+    CHECK(0 != file);
+    if (0 == file)
+        return;
+    cygfuse_budget_report(file);
+    rewind(file);
+    size = fread(buf, 1, sizeof buf - 1, file);
+    buf[size] = '\0';
+    fclose(file);
+
+    CHECK(buf == strstr(buf, "[memory]\n# limit 0, used "));
+    CHECK(0 != strstr(buf, "\nfixed "));
+    CHECK(0 != strstr(buf, "\nshared "));
+    CHECK(0 != strstr(buf, "\nbig "));
+
+    /* the small cache was looked up PATHS times, all hits */
+    p = strstr(buf, "\nsmall ");
+    CHECK(0 != p);
+    if (0 != p)
+    {
+        unsigned long long used, peak, items, evicted, refused, hits, misses;
+        CHECK(7 == sscanf(p + 7, "%llu %llu %llu %llu %llu %llu %llu",
+            &used, &peak, &items, &evicted, &refused, &hits, &misses));
+        CHECK(PATHS == items);
+        CHECK(PATHS == hits);
+        CHECK(0 == misses);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    cygfuse_budget_register(&fixed);
+    cygfuse_budget_register(&fixed);
+    cygfuse_budget_register(&shared);
+
+    test_init();
+    test_account();
+    test_limit();
+    test_reclaim();
+    test_report();
+    test_cost();
+
+    if (0 != failures)
+    {
+        fprintf(stderr, "cygfuse-test-budget: %d failures\n", failures);
+        return 1;
+    }
+    printf("cygfuse-test-budget: all tests passed\n");
+    return 0;
+}
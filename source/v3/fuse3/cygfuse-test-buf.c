@@ -0,0 +1,429 @@
+/**
+ * @file fuse3/cygfuse-test-buf.c
+ * Test of fuse3_buf_size and fuse3_buf_copy in cygfuse-buf.c.
+ *
+ * Copies between memory buffers, between memory and files read and
+ * written at their offsets or at a position (FUSE_BUF_FD_SEEK), and
+ * between files with and without FUSE_BUF_NO_SPLICE, and checks short
+ * copies at end of file, FUSE_BUF_FD_RETRY on a pipe and errors.
+ *
+ * The adapter of read_buf and write_buf to read and write is installed
+ * over a file system that returns memory or descriptors from read_buf.
+ * A descriptor must be read with a single pread into the buffer of the
+ * read, errors of read_buf must be returned as they are, and write_buf
+ * must be passed the buffer of the write without a copy. pread is
+ * replaced to see how descriptors are read. Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define FILESIZE                        (1024 * 1024 + 777)
+
+static unsigned calls_pread;
+static void *pread_buf;                 /* of the last pread */
+
+struct bufvec4
+{
+    struct fuse_bufvec vec;
+    struct fuse_buf more[3];
+};
+
+ssize_t pread(int fd, void *buf, size_t size, off_t off)
+{
+    off_t save;
+    ssize_t result;
+
+    calls_pread++;
+    pread_buf = buf;
+    save = lseek(fd, 0, SEEK_CUR);
+    if (-1 == save || -1 == lseek(fd, off, SEEK_SET))
+        return -1;
+    result = read(fd, buf, size);
+    lseek(fd, save, SEEK_SET);
+
+    return result;
+}
+
+static void fill(char *p, size_t size, unsigned seed)
+{
+    for (size_t i = 0; size > i; i++)
+        p[i] = (char)((i * 31 + seed) >> 3);
+}
+
+static int tempfd(const char *data, size_t size)
+{
+    FILE *file = tmpfile();
+    int fd;
+
+    if (0 == file)
+        return -1;
+    fd = dup(fileno(file));
+    fclose(file);
+    if (0 != size && (ssize_t)size != pwrite(fd, data, size, 0))
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void test_size(void)
+{
+    struct bufvec4 v;
+    struct fuse_buf *b = v.vec.buf;
+
+    memset(&v, 0, sizeof v);
+    v.vec.count = 3;
+    b[0].size = 10;
+    b[1].size = 20;
+    b[2].size = 30;
+    CHECK(60 == cygfuse_buf_size(&v.vec));
+
+    b[1].size = SIZE_MAX - 5;
+    CHECK(SIZE_MAX == cygfuse_buf_size(&v.vec));
+}
+
+static void test_mem(void)
+{
+    char src[100], dst[100], a[30], b[30], c[40];
+    struct bufvec4 sv, dv;
+    struct fuse_bufvec one;
+    struct fuse_buf *d = dv.vec.buf;
+
+    fill(src, sizeof src, 1);
+
+    /* one buffer into three */
+    memset(&dv, 0, sizeof dv);
+    sv.vec = (struct fuse_bufvec)FUSE_BUFVEC_INIT(sizeof src);
+    sv.vec.buf[0].mem = src;
+    dv.vec.count = 3;
+    d[0].size = sizeof a;
+    d[0].mem = a;
+    d[1].size = sizeof b;
+    d[1].mem = b;
+    d[2].size = sizeof c;
+    d[2].mem = c;
+    CHECK(100 == cygfuse_buf_copy(&dv.vec, &sv.vec, 0));
+    CHECK(0 == memcmp(a, src, 30) && 0 == memcmp(b, src + 30, 30) && 0 == memcmp(c, src + 60, 40));
+    CHECK(3 == dv.vec.idx && 1 == sv.vec.idx);
+
+    /* three into one, starting part way into the source */
+    memset(dst, 0, sizeof dst);
+    dv.vec.idx = 1;
+    dv.vec.off = 5;
+    one = (struct fuse_bufvec)FUSE_BUFVEC_INIT(sizeof dst);
+    one.buf[0].mem = dst;
+    CHECK(65 == cygfuse_buf_copy(&one, &dv.vec, 0));
+    CHECK(0 == memcmp(dst, src + 35, 65));
+    CHECK(65 == one.off && 0 == one.idx);
+
+    /* overlapping */
+    memcpy(dst, src, sizeof dst);
+    sv.vec = (struct fuse_bufvec)FUSE_BUFVEC_INIT(50);
+    sv.vec.buf[0].mem = dst;
+    one = (struct fuse_bufvec)FUSE_BUFVEC_INIT(50);
+    one.buf[0].mem = dst + 10;
+    CHECK(50 == cygfuse_buf_copy(&one, &sv.vec, 0));
+    CHECK(0 == memcmp(dst + 10, src, 50));
+
+    /* same vector */
+    CHECK(50 == cygfuse_buf_copy(&one, &one, 0));
+}
+
+static void test_fd_mem(void)
+{
+    char *data = malloc(FILESIZE), *buf = malloc(FILESIZE);
+    struct fuse_bufvec sv, dv;
+    int fd;
+
+    fill(data, FILESIZE, 2);
+    fd = tempfd(data, FILESIZE);
+    CHECK(-1 != fd);
+
+    /* at a position; the file offset is left alone */
+    lseek(fd, 100, SEEK_SET);
+    sv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(FILESIZE);
+    sv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+    sv.buf[0].fd = fd;
+    sv.buf[0].pos = 5000;
+    dv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(FILESIZE);
+    dv.buf[0].mem = buf;
+    CHECK(FILESIZE - 5000 == cygfuse_buf_copy(&dv, &sv, 0));
+    CHECK(0 == memcmp(buf, data + 5000, FILESIZE - 5000));
+    CHECK(100 == lseek(fd, 0, SEEK_CUR));
+
+    /* at the file offset */
+    sv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(1000);
+    sv.buf[0].flags = FUSE_BUF_IS_FD;
+    sv.buf[0].fd = fd;
+    dv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(1000);
+    dv.buf[0].mem = buf;
+    CHECK(1000 == cygfuse_buf_copy(&dv, &sv, 0));
+    CHECK(0 == memcmp(buf, data + 100, 1000));
+    CHECK(1100 == lseek(fd, 0, SEEK_CUR));
+
+    /* memory into the file at a position */
+    fill(buf, 4096, 3);
+    sv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(4096);
+    sv.buf[0].mem = buf;
+    dv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(4096);
+    dv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dv.buf[0].fd = fd;
+    dv.buf[0].pos = FILESIZE - 1000;
+    CHECK(4096 == cygfuse_buf_copy(&dv, &sv, 0));
+    CHECK(FILESIZE + 3096 == lseek(fd, 0, SEEK_END));
+    CHECK(4096 == pread(fd, data, 4096, FILESIZE - 1000));
+    CHECK(0 == memcmp(data, buf, 4096));
+
+    close(fd);
+
+    /* errors */
+    sv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(10);
+    sv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    sv.buf[0].fd = fd;
+    dv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(10);
+    dv.buf[0].mem = buf;
+    CHECK(-EBADF == cygfuse_buf_copy(&dv, &sv, 0));
+
+    free(buf);
+    free(data);
+}
+
+static void test_fd_fd(int flags)
+{
+    char *data = malloc(FILESIZE), *buf = malloc(FILESIZE);
+    struct fuse_bufvec sv, dv;
+    int srcfd, dstfd;
+
+    fill(data, FILESIZE, 4);
+    srcfd = tempfd(data, FILESIZE);
+    dstfd = tempfd(0, 0);
+    CHECK(-1 != srcfd && -1 != dstfd);
+
+    /* both at a position; short at end of file */
+    sv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(FILESIZE);
+    sv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+    sv.buf[0].fd = srcfd;
+    sv.buf[0].pos = 333;
+    dv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(FILESIZE);
+    dv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+    dv.buf[0].fd = dstfd;
+    dv.buf[0].pos = 10;
+    CHECK(FILESIZE - 333 == cygfuse_buf_copy(&dv, &sv, flags));
+    CHECK(FILESIZE - 323 == lseek(dstfd, 0, SEEK_END));
+    CHECK(FILESIZE - 333 == pread(dstfd, buf, FILESIZE, 10));
+    CHECK(0 == memcmp(buf, data + 333, FILESIZE - 333));
+
+    /* both at the file offsets */
+    lseek(srcfd, 0, SEEK_SET);
+    lseek(dstfd, 0, SEEK_SET);
+    sv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(200000);
+    sv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_RETRY;
+    sv.buf[0].fd = srcfd;
+    dv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(200000);
+    dv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_RETRY;
+    dv.buf[0].fd = dstfd;
+    CHECK(200000 == cygfuse_buf_copy(&dv, &sv, flags));
+    CHECK(200000 == lseek(srcfd, 0, SEEK_CUR) && 200000 == lseek(dstfd, 0, SEEK_CUR));
+    CHECK(200000 == pread(dstfd, buf, 200000, 0));
+    CHECK(0 == memcmp(buf, data, 200000));
+
+    close(dstfd);
+    close(srcfd);
+    free(buf);
+    free(data);
+}
+
+static int pipefds[2];
+
+static void *pipe_writer(void *arg)
+{
+    char chunk[1000];
+
+    fill(chunk, sizeof chunk, 5);
+    for (int i = 0; 10 > i; i++)
+    {
+        usleep(2000);
+        if (sizeof chunk != write(pipefds[1], chunk, sizeof chunk))
+            break;
+    }
+    close(pipefds[1]);
+
+    return 0;
+}
+
+static void test_retry(int retry)
+{
+    char buf[20000], chunk[1000];
+    struct fuse_bufvec sv, dv;
+    pthread_t thread;
+    ssize_t result;
+
+    fill(chunk, sizeof chunk, 5);
+    CHECK(0 == pipe(pipefds));
+    pthread_create(&thread, 0, pipe_writer, 0);
+
+    sv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(sizeof buf);
+    sv.buf[0].flags = FUSE_BUF_IS_FD | (retry ? FUSE_BUF_FD_RETRY : 0);
+    sv.buf[0].fd = pipefds[0];
+    dv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(sizeof buf);
+    dv.buf[0].mem = buf;
+    result = cygfuse_buf_copy(&dv, &sv, 0);
+    CHECK(retry ? 10000 == result : 0 < result && 10000 > result);
+    CHECK(0 == memcmp(buf, chunk, sizeof chunk));
+
+    pthread_join(thread, 0);
+    close(pipefds[0]);
+}
+
+/* read_buf returns memory, a descriptor or an error, as set */
+static enum { READ_MEM, READ_FD, READ_ERROR } read_mode;
+static char *file_data;
+static int file_fd;
+static unsigned calls_write_buf;
+static struct fuse_bufvec write_bufv;   /* of the last write_buf */
+static fuse_off_t write_off;
+
+static int fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, fuse_off_t off,
+    struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *bufv;
+
+    if (READ_ERROR == read_mode)
+        return -EIO;
+    bufv = malloc(sizeof *bufv);
+    if (0 == bufv)
+        return -ENOMEM;
+    *bufv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(size);
+    if (READ_FD == read_mode)
+    {
+        bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufv->buf[0].fd = file_fd;
+        bufv->buf[0].pos = off;
+    }
+    else
+    {
+        if (FILESIZE - off < (fuse_off_t)size)
+            bufv->buf[0].size = size = (size_t)(FILESIZE - off);
+        bufv->buf[0].mem = malloc(size);
+        if (0 == bufv->buf[0].mem)
+        {
+            free(bufv);
+            return -ENOMEM;
+        }
+        memcpy(bufv->buf[0].mem, file_data + off, size);
+    }
+    *bufp = bufv;
+    return 0;
+}
+
+static int fs_write_buf(const char *path, struct fuse_bufvec *bufv, fuse_off_t off,
+    struct fuse_file_info *fi)
+{
+    calls_write_buf++;
+    write_bufv = *bufv;
+    write_off = off;
+    return (int)cygfuse_buf_size(bufv);
+}
+
+static void test_adapter(void)
+{
+    static const struct fuse_operations fs_ops =
+    {
+        .read_buf = fs_read_buf,
+        .write_buf = fs_write_buf,
+    };
+    struct fuse_operations ops;
+    char *buf = malloc(FILESIZE);
+
+    file_data = malloc(FILESIZE);
+    fill(file_data, FILESIZE, 6);
+    file_fd = tempfd(file_data, FILESIZE);
+    CHECK(-1 != file_fd);
+
+    /* nothing to adapt */
+    memset(&ops, 0, sizeof ops);
+    cygfuse_buf_install(&ops, &ops);
+    CHECK(0 == ops.read && 0 == ops.write);
+
+    memset(&ops, 0, sizeof ops);
+    cygfuse_buf_install(&ops, &fs_ops);
+    CHECK(0 != ops.read && 0 != ops.write);
+
+    /* memory */
+    read_mode = READ_MEM;
+    calls_pread = 0;
+    CHECK(5000 == ops.read("/file", buf, 5000, 777, 0));
+    CHECK(0 == memcmp(buf, file_data + 777, 5000));
+    CHECK(1000 == ops.read("/file", buf, 5000, FILESIZE - 1000, 0));
+    CHECK(0 == memcmp(buf, file_data + FILESIZE - 1000, 1000));
+    CHECK(0 == calls_pread);
+
+    /* a descriptor; short at end of file */
+    read_mode = READ_FD;
+    calls_pread = 0;
+    CHECK(300000 == ops.read("/file", buf, 300000, 4096, 0));
+    CHECK(1 == calls_pread && buf == pread_buf);
+    CHECK(0 == memcmp(buf, file_data + 4096, 300000));
+    calls_pread = 0;
+    CHECK(1000 == ops.read("/file", buf, 5000, FILESIZE - 1000, 0));
+    CHECK(buf == pread_buf);
+    CHECK(0 == memcmp(buf, file_data + FILESIZE - 1000, 1000));
+
+    /* an error */
+    read_mode = READ_ERROR;
+    CHECK(-EIO == ops.read("/file", buf, 5000, 0, 0));
+
+    /* the buffer of the write as it is */
+    calls_write_buf = 0;
+    CHECK(5000 == ops.write("/file", buf, 5000, 333, 0));
+    CHECK(1 == calls_write_buf && 333 == write_off);
+    CHECK(1 == write_bufv.count && 5000 == write_bufv.buf[0].size);
+    CHECK(buf == write_bufv.buf[0].mem && !(write_bufv.buf[0].flags & FUSE_BUF_IS_FD));
+
+    close(file_fd);
+    free(file_data);
+    free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    test_size();
+    test_mem();
+    test_fd_mem();
+    test_fd_fd(0);
+    test_fd_fd(FUSE_BUF_NO_SPLICE);
+    test_retry(0);
+    test_retry(1);
+    test_adapter();
+
+    if (0 != failures)
+    {
+        fprintf(stderr, "cygfuse-test-buf: %d failures\n", failures);
+        return 1;
+    }
+    printf("cygfuse-test-buf: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,442 @@
+/**
+ * @file fuse3/cygfuse-test-cache.c
+ * Test of the attribute and negative lookup caches in cygfuse-cache.c.
+ *
+ * A file system of a few files and directories kept in memory is stat'ed
+ * through the caching layer with the attr and neg caches enabled. The
+ * stats of a path must be served from the cache until an operation
+ * through the mount changes them: chmod, chown, truncate, utimens and
+ * write of the path, rename of the path, to the path or of a directory
+ * above it, and unlink. The stats returned afterwards must be those of
+ * the file system. Likewise a path that does not exist must be known not
+ * to exist until create, mknod, mkdir, symlink, link or rename makes it.
+ * Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define FILES                           16
+
+static struct fuse3_context context;
+static struct
+{
+    char path[32];
+    struct fuse_stat stbuf;
+} files[FILES];
+static unsigned calls_getattr;
+
+struct fuse3_context *fuse3_get_context(void)
+{
+    return &context;
+}
+
+/* up to FILES paths with their stats; an empty path is a free slot */
+static int index_of(const char *path)
+{
+    for (int i = 0; FILES > i; i++)
+        if (0 == strcmp(files[i].path, path))
+            return i;
+    return -1;
+}
+
+static struct fuse_stat *lookup(const char *path)
+{
+    int i = index_of(path);
+
+    return -1 != i ? &files[i].stbuf : 0;
+}
+
+static int add(const char *path, fuse_mode_t mode)
+{
+    if (-1 != index_of(path))
+        return -EEXIST;
+    for (int i = 0; FILES > i; i++)
+        if ('\0' == files[i].path[0])
+        {
+            snprintf(files[i].path, sizeof files[i].path, "%s", path);
+            memset(&files[i].stbuf, 0, sizeof files[i].stbuf);
+            files[i].stbuf.st_mode = mode;
+            return 0;
+        }
+    return -ENOSPC;
+}
+
+static int del(const char *path)
+{
+    int i = index_of(path);
+
+    if (-1 == i)
+        return -ENOENT;
+    files[i].path[0] = '\0';
+    return 0;
+}
+
+static void *mem_init(struct fuse3_conn_info *conn, struct fuse3_config *conf)
+{
+    return &context;
+}
+
+static int mem_getattr(const char *path, struct fuse_stat *stbuf, struct fuse3_file_info *fi)
+{
+    struct fuse_stat *found = lookup(path);
+
+    calls_getattr++;
+    if (0 == found)
+        return -ENOENT;
+    *stbuf = *found;
+    return 0;
+}
+
+static int mem_open(const char *path, struct fuse3_file_info *fi)
+{
+    return 0 != lookup(path) ? 0 : -ENOENT;
+}
+
+static int mem_write(const char *path, const char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    struct fuse_stat *stbuf = lookup(path);
+
+    if (0 == stbuf)
+        return -ENOENT;
+    if (stbuf->st_size < off + (fuse_off_t)size)
+        stbuf->st_size = off + (fuse_off_t)size;
+    return (int)size;
+}
+
+static int mem_create(const char *path, fuse_mode_t mode, struct fuse3_file_info *fi)
+{
+    return add(path, mode);
+}
+
+static int mem_mknod(const char *path, fuse_mode_t mode, fuse_dev_t dev)
+{
+    return add(path, mode);
+}
+
+static int mem_mkdir(const char *path, fuse_mode_t mode)
+{
+    return add(path, S_IFDIR | mode);
+}
+
+static int mem_symlink(const char *dstpath, const char *srcpath)
+{
+    return add(srcpath, S_IFLNK | 0777);
+}
+
+static int mem_link(const char *srcpath, const char *dstpath)
+{
+    struct fuse_stat *stbuf = lookup(srcpath);
+    int result;
+
+    if (0 == stbuf)
+        return -ENOENT;
+    result = add(dstpath, stbuf->st_mode);
+    if (0 == result)
+        *lookup(dstpath) = *lookup(srcpath);
+    return result;
+}
+
+static int mem_unlink(const char *path)
+{
+    return del(path);
+}
+
+static int mem_rmdir(const char *path)
+{
+    return del(path);
+}
+
+/* renames path and, if it is a directory, everything under it */
+static int mem_rename(const char *oldpath, const char *newpath, unsigned int flags)
+{
+    size_t oldlen = strlen(oldpath);
+    char path[sizeof files[0].path];
+
+    if (0 == lookup(oldpath))
+        return -ENOENT;
+    del(newpath);
+    for (int i = 0; FILES > i; i++)
+        if (0 == strncmp(files[i].path, oldpath, oldlen) &&
+            ('\0' == files[i].path[oldlen] || '/' == files[i].path[oldlen]))
+        {
+            snprintf(path, sizeof path, "%s%s", newpath, files[i].path + oldlen);
+            memcpy(files[i].path, path, sizeof path);
+        }
+    return 0;
+}
+
+static int mem_chmod(const char *path, fuse_mode_t mode, struct fuse3_file_info *fi)
+{
+    struct fuse_stat *stbuf = lookup(path);
+
+    if (0 == stbuf)
+        return -ENOENT;
+    stbuf->st_mode = (stbuf->st_mode & S_IFMT) | mode;
+    return 0;
+}
+
+static int mem_chown(const char *path, fuse_uid_t uid, fuse_gid_t gid, struct fuse3_file_info *fi)
+{
+    struct fuse_stat *stbuf = lookup(path);
+
+    if (0 == stbuf)
+        return -ENOENT;
+    stbuf->st_uid = uid;
+    stbuf->st_gid = gid;
+    return 0;
+}
+
+static int mem_truncate(const char *path, fuse_off_t size, struct fuse3_file_info *fi)
+{
+    struct fuse_stat *stbuf = lookup(path);
+
+    if (0 == stbuf)
+        return -ENOENT;
+    stbuf->st_size = size;
+    return 0;
+}
+
+static int mem_utimens(const char *path, const struct fuse_timespec tv[2],
+    struct fuse3_file_info *fi)
+{
+    struct fuse_stat *stbuf = lookup(path);
+
+    if (0 == stbuf)
+        return -ENOENT;
+    stbuf->st_atim.tv_sec = tv[0].tv_sec;
+    stbuf->st_mtim.tv_sec = tv[1].tv_sec;
+    return 0;
+}
+
+static const struct fuse3_operations mem_ops =
+{
+    .init = mem_init,
+    .getattr = mem_getattr,
+    .open = mem_open,
+    .write = mem_write,
+    .create = mem_create,
+    .mknod = mem_mknod,
+    .mkdir = mem_mkdir,
+    .symlink = mem_symlink,
+    .link = mem_link,
+    .unlink = mem_unlink,
+    .rmdir = mem_rmdir,
+    .rename = mem_rename,
+    .chmod = mem_chmod,
+    .chown = mem_chown,
+    .truncate = mem_truncate,
+    .utimens = mem_utimens,
+};
+
+static struct fuse3_operations ops;
+
+/* stats path and checks the result and whether the file system was asked */
+static void check_stat(const char *path, int result, int cached)
+{
+    struct fuse_stat stbuf, *found = lookup(path);
+    unsigned calls = calls_getattr;
+
+    CHECK(result == ops.getattr(path, &stbuf, 0));
+    CHECK((cached ? calls : calls + 1) == calls_getattr);
+    CHECK(0 != result || (0 != found && 0 == memcmp(&stbuf, found, sizeof stbuf)));
+}
+
+static void test_attr(void)
+{
+    struct fuse3_file_info fi;
+    struct fuse_timespec tv[2];
+
+    check_stat("/f", 0, 0);
+    check_stat("/f", 0, 1);
+
+    CHECK(0 == ops.chmod("/f", 0600, 0));
+    check_stat("/f", 0, 0);
+    check_stat("/f", 0, 1);
+
+    CHECK(0 == ops.chown("/f", 11, 12, 0));
+    check_stat("/f", 0, 0);
+    check_stat("/f", 0, 1);
+
+    CHECK(0 == ops.truncate("/f", 1000, 0));
+    check_stat("/f", 0, 0);
+    check_stat("/f", 0, 1);
+
+    memset(tv, 0, sizeof tv);
+    tv[0].tv_sec = 100;
+    tv[1].tv_sec = 200;
+    CHECK(0 == ops.utimens("/f", tv, 0));
+    check_stat("/f", 0, 0);
+    check_stat("/f", 0, 1);
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR;
+    CHECK(0 == ops.open("/f", &fi));
+    CHECK(10 == ops.write("/f", "0123456789", 10, 2000, &fi));
+    check_stat("/f", 0, 0);
+    check_stat("/f", 0, 1);
+
+    /* not other paths */
+    check_stat("/g", 0, 0);
+    CHECK(0 == ops.chmod("/f", 0644, 0));
+    check_stat("/g", 0, 1);
+}
+
+static void test_rename(void)
+{
+    /* the old path and the new */
+    check_stat("/f", 0, 0);
+    check_stat("/g", 0, 1);
+    CHECK(0 == ops.rename("/f", "/g", 0));
+    check_stat("/f", -ENOENT, 0);
+    check_stat("/g", 0, 0);
+    check_stat("/g", 0, 1);
+
+    /* everything under a directory */
+    check_stat("/d", 0, 0);
+    check_stat("/d/x", 0, 0);
+    check_stat("/d/s/y", 0, 0);
+    check_stat("/d/x", 0, 1);
+    check_stat("/d/s/y", 0, 1);
+    CHECK(0 == ops.rename("/d", "/e", 0));
+    check_stat("/d", -ENOENT, 0);
+    check_stat("/d/x", -ENOENT, 0);
+    check_stat("/d/s/y", -ENOENT, 0);
+    check_stat("/e/x", 0, 0);
+    check_stat("/e/s/y", 0, 0);
+    check_stat("/e/x", 0, 1);
+
+    /* and into it */
+    CHECK(0 == ops.rename("/e", "/d", 0));
+    check_stat("/e/x", -ENOENT, 0);
+    check_stat("/e/s/y", -ENOENT, 0);
+    check_stat("/d/x", 0, 0);
+    check_stat("/d/s/y", 0, 0);
+}
+
+static void test_unlink(void)
+{
+    check_stat("/g", 0, 1);
+    CHECK(0 == ops.unlink("/g"));
+    check_stat("/g", -ENOENT, 0);
+
+    /* the parent directory, even if the operation fails */
+    check_stat("/d", 0, 0);
+    check_stat("/d", 0, 1);
+    CHECK(-ENOENT == ops.unlink("/d/nonexistent"));
+    check_stat("/d", 0, 0);
+    check_stat("/d/x", 0, 1);
+}
+
+/* a path known not to exist until op makes it */
+static void check_negative(const char *path, int op)
+{
+    struct fuse3_file_info fi;
+
+    check_stat(path, -ENOENT, 0);
+    check_stat(path, -ENOENT, 1);
+
+    memset(&fi, 0, sizeof fi);
+    switch (op)
+    {
+    case 'c':
+        CHECK(0 == ops.create(path, S_IFREG | 0644, &fi));
+        break;
+    case 'n':
+        CHECK(0 == ops.mknod(path, S_IFIFO | 0644, 0));
+        break;
+    case 'd':
+        CHECK(0 == ops.mkdir(path, 0755));
+        break;
+    case 's':
+        CHECK(0 == ops.symlink("/d/x", path));
+        break;
+    case 'l':
+        CHECK(0 == ops.link("/d/x", path));
+        break;
+    case 'r':
+        CHECK(0 == ops.rename("/d/x", path, 0));
+        break;
+    }
+    check_stat(path, 0, 0);
+    check_stat(path, 0, 1);
+}
+
+static void test_negative(void)
+{
+    check_negative("/n", 'c');
+    CHECK(0 == ops.unlink("/n"));
+    check_negative("/n", 'n');
+    CHECK(0 == ops.unlink("/n"));
+    check_negative("/n", 'd');
+    CHECK(0 == ops.rmdir("/n"));
+    check_negative("/n", 's');
+    CHECK(0 == ops.unlink("/n"));
+    check_negative("/n", 'l');
+    CHECK(0 == ops.unlink("/n"));
+    check_negative("/d/n", 'r');
+    CHECK(0 == ops.rename("/d/n", "/d/x", 0));
+
+    /* failed operations invalidate all the same; the path may exist now */
+    check_stat("/n", -ENOENT, 0);
+    check_stat("/n", -ENOENT, 1);
+    CHECK(-ENOENT == ops.link("/nonexistent", "/n"));
+    check_stat("/n", -ENOENT, 0);
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse3_config conf;
+
+    add("/f", S_IFREG | 0644);
+    add("/g", S_IFREG | 0644);
+    add("/d", S_IFDIR | 0755);
+    add("/d/x", S_IFREG | 0644);
+    add("/d/s", S_IFDIR | 0755);
+    add("/d/s/y", S_IFREG | 0644);
+
+    setenv(CYGFUSE_CACHE_ENV, "attr,neg", 1);
+    CHECK(cygfuse_cache_init());
+    ops = mem_ops;
+    cygfuse_cache_install(&ops, &mem_ops);
+
+    memset(&conf, 0, sizeof conf);
+    conf.attr_timeout = conf.entry_timeout = conf.negative_timeout = 60;
+    CHECK(&context == ops.init(0, &conf));
+
+    test_attr();
+    test_rename();
+    test_unlink();
+    test_negative();
+
+    ops.destroy(&context);
+
+    if (0 != failures)
+    {
+        fprintf(stderr, "cygfuse-test-cache: %d failures\n", failures);
+        return 1;
+    }
+    printf("cygfuse-test-cache: all tests passed\n");
+    return 0;
+}
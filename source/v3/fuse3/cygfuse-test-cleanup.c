@@ -0,0 +1,200 @@
+/**
+ * @file fuse3/cygfuse-test-cleanup.c
+ * Test of the cleanup thread in cygfuse-cleanup.c.
+ *
+ * Checks that cleaning runs every cleaner once and returns the seconds
+ * until the earliest expiry they report, within bounds; that the thread
+ * cleans at once and then again when that time has come, and runs until
+ * every start has been matched by a stop; and that the caching layer
+ * starts the thread when the file system is initialized, has the entries
+ * it cached removed when they expire, and stops the thread when the file
+ * system is destroyed. Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define PATHS                           100
+
+static struct fuse3_context context;
+static uint64_t fake_next;              /* relative to now, or 0 */
+static unsigned fake_calls;
+static size_t fake_freed;               /* freed by the cleaners before it, as last seen */
+static unsigned calls_getattr;
+
+struct fuse3_context *fuse3_get_context(void)
+{
+    return &context;
+}
+
+/* cleaners run in the order they are registered and add to the same count */
+static uint64_t fake_clean(uint64_t now, size_t *pfreed)
+{
+    __atomic_add_fetch(&fake_calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&fake_freed, *pfreed, __ATOMIC_RELAXED);
+    if (UINT64_MAX == fake_next)
+        return UINT64_MAX;
+    return now + fake_next;
+}
+
+static unsigned calls(void)
+{
+    return __atomic_load_n(&fake_calls, __ATOMIC_RELAXED);
+}
+
+/* "/fileN" exist, nothing else */
+static int mem_getattr(const char *path, struct fuse_stat *stbuf, struct fuse3_file_info *fi)
+{
+    __atomic_add_fetch(&calls_getattr, 1, __ATOMIC_RELAXED);
+    memset(stbuf, 0, sizeof *stbuf);
+    if (0 != strncmp(path, "/file", 5))
+        return -ENOENT;
+    stbuf->st_mode = S_IFREG | 0644;
+    return 0;
+}
+
+static void *mem_init(struct fuse3_conn_info *conn, struct fuse3_config *conf)
+{
+    conf->attr_timeout = 1;
+    conf->entry_timeout = 1;
+    conf->negative_timeout = 1;
+    return &context;
+}
+
+static const struct fuse3_operations mem_ops =
+{
+    .getattr = mem_getattr,
+    .init = mem_init,
+};
+
+static void test_run(void)
+{
+    /* registered twice, called once */
+    cygfuse_cleanup_register(fake_clean);
+    cygfuse_cleanup_register(fake_clean);
+
+    fake_next = 2500000000ULL;
+    CHECK(3 == cygfuse_cleanup_run());
+    CHECK(1 == calls());
+    fake_next = 1;
+    CHECK(1 == cygfuse_cleanup_run());
+    fake_next = (uint64_t)CYGFUSE_CLEANUP_MAXDELAY * 2000000000;
+    CHECK(CYGFUSE_CLEANUP_MAXDELAY == cygfuse_cleanup_run());
+    fake_next = UINT64_MAX;
+    CHECK(CYGFUSE_CLEANUP_MAXDELAY == cygfuse_cleanup_run());
+    CHECK(4 == calls());
+}
+
+static void test_thread(void)
+{
+    unsigned n;
+
+    /* cleans at once, then after the second it was told */
+    fake_next = 1000000000;
+    fake_calls = 0;
+    CHECK(0 == cygfuse_cleanup_start());
+    usleep(300000);
+    CHECK(1 == calls());
+    usleep(1000000);
+    CHECK(2 == calls());
+
+    /* runs until the last stop */
+    CHECK(0 == cygfuse_cleanup_start());
+    cygfuse_cleanup_stop();
+    n = calls();
+    usleep(1100000);
+    CHECK(n < calls());
+    cygfuse_cleanup_stop();
+    n = calls();
+    usleep(1100000);
+    CHECK(n == calls());
+
+    /* an unmatched stop does nothing */
+    cygfuse_cleanup_stop();
+}
+
+static void test_cache(void)
+{
+    struct fuse3_operations ops;
+    struct fuse3_config conf;
+    struct fuse_stat stbuf;
+    char path[32];
+    unsigned n;
+
+    fake_next = UINT64_MAX;
+    fake_calls = 0;
+    fake_freed = 0;
+
+    ops = mem_ops;
+    cygfuse_cache_install(&ops, &mem_ops);
+    memset(&conf, 0, sizeof conf);
+    CHECK(&context == ops.init(0, &conf));
+    usleep(300000);
+    CHECK(1 == calls());
+
+    for (unsigned i = 0; PATHS > i; i++)
+    {
+        snprintf(path, sizeof path, "/file%u", i);
+        CHECK(0 == ops.getattr(path, &stbuf, 0));
+        snprintf(path, sizeof path, "/missing%u", i);
+        CHECK(-ENOENT == ops.getattr(path, &stbuf, 0));
+    }
+    CHECK(2 * PATHS == calls_getattr);
+    CHECK(0 == ops.getattr("/file0", &stbuf, 0));
+    CHECK(2 * PATHS == calls_getattr);
+
+    /* the thread wakes when the entries expire, not when it was last told */
+    for (int i = 0; 30 > i && 2 * PATHS > __atomic_load_n(&fake_freed, __ATOMIC_RELAXED); i++)
+        usleep(100000);
+    CHECK(2 * PATHS == __atomic_load_n(&fake_freed, __ATOMIC_RELAXED));
+    CHECK(0 == ops.getattr("/file0", &stbuf, 0));
+    CHECK(2 * PATHS + 1 == calls_getattr);
+
+    ops.destroy(&context);
+    n = calls();
+    usleep(1100000);
+    CHECK(n == calls());
+}
+
+int main(int argc, char *argv[])
+{
+    /* nothing to clean */
+    CHECK(CYGFUSE_CLEANUP_MAXDELAY == cygfuse_cleanup_run());
+
+    /* the cache cleaner goes first, so that the fake one sees what it freed */
+    setenv(CYGFUSE_CACHE_ENV, "attr,neg", 1);
+    CHECK(cygfuse_cache_init());
+    CHECK(CYGFUSE_CLEANUP_MAXDELAY == cygfuse_cleanup_run());
+
+    test_run();
+    test_thread();
+    test_cache();
+
+    if (0 != failures)
+    {
+        fprintf(stderr, "cygfuse-test-cleanup: %d failures\n", failures);
+        return 1;
+    }
+    printf("cygfuse-test-cleanup: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,352 @@
+/**
+ * @file fuse3/cygfuse-test-dircache.c
+ * Test of the directory listing cache in cygfuse-cache.c.
+ *
+ * A file system of two directories kept in memory is listed through the
+ * caching layer with the dir cache enabled. A listing must be replayed
+ * from the cache, with its stats and flags, until an operation that adds,
+ * removes or changes a name in the directory invalidates it; changes in
+ * another directory must leave it cached. Listings asked for with other
+ * flags, returned in pieces (using nonzero offsets) or cut short by the
+ * filler must not be replayed. Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define NAMES                           8
+
+static struct fuse3_context context;
+static struct
+{
+    const char *path;
+    char names[NAMES][16];
+    fuse_mode_t modes[NAMES];
+} dirs[] = { { "/d" }, { "/e" } };
+static unsigned calls_readdir;
+static int readdir_offsets;
+
+struct fuse3_context *fuse3_get_context(void)
+{
+    return &context;
+}
+
+/* the directories /d and /e of up to NAMES files each; the first is listed with stats */
+static int lookup(const char *path, int *pdir, int *pname)
+{
+    const char *slash = strrchr(path, '/');
+
+    for (int d = 0; sizeof dirs / sizeof dirs[0] > (size_t)d; d++)
+    {
+        size_t len = strlen(dirs[d].path);
+        if ((size_t)(slash - path) != len || 0 != strncmp(path, dirs[d].path, len))
+            continue;
+        *pdir = d;
+        *pname = -1;
+        for (int i = 0; NAMES > i; i++)
+            if (0 == strcmp(dirs[d].names[i], slash + 1))
+                *pname = i;
+        return 0;
+    }
+    return -ENOENT;
+}
+
+static int add(const char *path, fuse_mode_t mode)
+{
+    int d, n;
+
+    if (0 != lookup(path, &d, &n))
+        return -ENOENT;
+    if (-1 != n)
+        return -EEXIST;
+    for (int i = 0; NAMES > i; i++)
+        if ('\0' == dirs[d].names[i][0])
+        {
+            snprintf(dirs[d].names[i], sizeof dirs[d].names[i], "%s", strrchr(path, '/') + 1);
+            dirs[d].modes[i] = mode;
+            return 0;
+        }
+    return -ENOSPC;
+}
+
+static int del(const char *path)
+{
+    int d, n;
+
+    if (0 != lookup(path, &d, &n) || -1 == n)
+        return -ENOENT;
+    dirs[d].names[n][0] = '\0';
+    return 0;
+}
+
+static void *mem_init(struct fuse3_conn_info *conn, struct fuse3_config *conf)
+{
+    return &context;
+}
+
+static int mem_readdir(const char *path, void *buf, fuse3_fill_dir_t filler, fuse_off_t off,
+    struct fuse3_file_info *fi, enum fuse3_readdir_flags flags)
+{
+    struct fuse_stat stbuf;
+    fuse_off_t n = 0;
+    int d;
+
+    for (d = 0; sizeof dirs / sizeof dirs[0] > (size_t)d; d++)
+        if (0 == strcmp(path, dirs[d].path))
+            break;
+    if (sizeof dirs / sizeof dirs[0] == (size_t)d)
+        return -ENOENT;
+    calls_readdir++;
+
+    /* with offsets, the entries from off on */
+    for (int i = 0; NAMES > i; i++)
+    {
+        if ('\0' == dirs[d].names[i][0])
+            continue;
+        if (readdir_offsets && ++n <= off)
+            continue;
+        memset(&stbuf, 0, sizeof stbuf);
+        stbuf.st_mode = dirs[d].modes[i];
+        stbuf.st_size = i;
+        if (filler(buf, dirs[d].names[i], 0 == i ? &stbuf : 0,
+            readdir_offsets ? n : 0, 0 == i ? FUSE_FILL_DIR_PLUS : 0))
+            break;
+    }
+    return 0;
+}
+
+static int mem_create(const char *path, fuse_mode_t mode, struct fuse3_file_info *fi)
+{
+    return add(path, mode);
+}
+
+static int mem_mkdir(const char *path, fuse_mode_t mode)
+{
+    return add(path, S_IFDIR | mode);
+}
+
+static int mem_unlink(const char *path)
+{
+    return del(path);
+}
+
+static int mem_rename(const char *oldpath, const char *newpath, unsigned int flags)
+{
+    int d, n, result;
+
+    if (0 != lookup(oldpath, &d, &n) || -1 == n)
+        return -ENOENT;
+    result = add(newpath, dirs[d].modes[n]);
+    if (0 == result)
+        del(oldpath);
+    return result;
+}
+
+static int mem_chmod(const char *path, fuse_mode_t mode, struct fuse3_file_info *fi)
+{
+    int d, n;
+
+    if (0 != lookup(path, &d, &n) || -1 == n)
+        return -ENOENT;
+    dirs[d].modes[n] = (dirs[d].modes[n] & S_IFMT) | mode;
+    return 0;
+}
+
+static const struct fuse3_operations mem_ops =
+{
+    .init = mem_init,
+    .readdir = mem_readdir,
+    .create = mem_create,
+    .mkdir = mem_mkdir,
+    .unlink = mem_unlink,
+    .rename = mem_rename,
+    .chmod = mem_chmod,
+};
+
+static struct fuse3_operations ops;
+
+struct listing
+{
+    unsigned count, limit;
+    struct
+    {
+        char name[16];
+        int hasstat;
+        fuse_mode_t mode;
+        fuse_off_t off;
+        enum fuse3_fill_dir_flags flags;
+    } entries[NAMES];
+};
+
+static int list_filler(void *buf, const char *name, const struct fuse_stat *stbuf, fuse_off_t off,
+    enum fuse3_fill_dir_flags flags)
+{
+    struct listing *listing = buf;
+
+    if (listing->limit == listing->count)
+        return 1;
+    snprintf(listing->entries[listing->count].name, sizeof listing->entries[0].name, "%s", name);
+    listing->entries[listing->count].hasstat = 0 != stbuf;
+    listing->entries[listing->count].mode = 0 != stbuf ? stbuf->st_mode : 0;
+    listing->entries[listing->count].off = off;
+    listing->entries[listing->count].flags = flags;
+    listing->count++;
+    return 0;
+}
+
+/* lists path and checks that the result matches dirs[d] and whether the file system was asked */
+static void check_list(const char *path, int d, enum fuse3_readdir_flags flags, int cached)
+{
+    struct listing listing;
+    unsigned calls = calls_readdir, j = 0;
+
+    memset(&listing, 0, sizeof listing);
+    listing.limit = NAMES;
+    CHECK(0 == ops.readdir(path, &listing, list_filler, 0, 0, flags));
+    CHECK((cached ? calls : calls + 1) == calls_readdir);
+    for (int i = 0; NAMES > i; i++)
+    {
+        if ('\0' == dirs[d].names[i][0])
+            continue;
+        CHECK(listing.count > j && 0 == strcmp(dirs[d].names[i], listing.entries[j].name));
+        CHECK((0 == i) == listing.entries[j].hasstat);
+        CHECK(0 != i || dirs[d].modes[i] == listing.entries[j].mode);
+        CHECK((0 == i) == !!(listing.entries[j].flags & FUSE_FILL_DIR_PLUS));
+        j++;
+    }
+    CHECK(j == listing.count);
+}
+
+static void test_cached(void)
+{
+    check_list("/d", 0, 0, 0);
+    check_list("/d", 0, 0, 1);
+    check_list("/e", 1, 0, 0);
+    check_list("/e", 1, 0, 1);
+
+    /* other flags */
+    check_list("/d", 0, FUSE_READDIR_PLUS, 0);
+    check_list("/d", 0, FUSE_READDIR_PLUS, 1);
+    check_list("/d", 0, 0, 0);
+}
+
+static void test_invalidate(void)
+{
+    struct fuse3_file_info fi;
+
+    check_list("/d", 0, 0, 1);
+    check_list("/e", 1, 0, 1);
+
+    /* adding and removing names */
+    memset(&fi, 0, sizeof fi);
+    CHECK(0 == ops.create("/d/c", S_IFREG | 0644, &fi));
+    check_list("/d", 0, 0, 0);
+    check_list("/d", 0, 0, 1);
+    CHECK(0 == ops.mkdir("/d/m", 0755));
+    check_list("/d", 0, 0, 0);
+    CHECK(0 == ops.unlink("/d/c"));
+    check_list("/d", 0, 0, 0);
+
+    /* both directories of a rename */
+    CHECK(0 == ops.rename("/d/m", "/e/m", 0));
+    check_list("/d", 0, 0, 0);
+    check_list("/e", 1, 0, 0);
+
+    /* the stats of an entry */
+    CHECK(0 == ops.chmod("/d/a", 0600, 0));
+    check_list("/d", 0, 0, 0);
+
+    /* not the other directory */
+    CHECK(0 == ops.unlink("/e/m"));
+    check_list("/d", 0, 0, 1);
+    check_list("/e", 1, 0, 0);
+
+    /* a failed operation is no change, but invalidates all the same */
+    CHECK(-EEXIST == ops.mkdir("/d/a", 0755));
+    check_list("/d", 0, 0, 0);
+}
+
+static void test_uncached(void)
+{
+    struct listing listing;
+    unsigned calls;
+
+    CHECK(0 == ops.chmod("/d/a", 0644, 0));
+
+    /* in pieces */
+    readdir_offsets = 1;
+    check_list("/d", 0, 0, 0);
+    check_list("/d", 0, 0, 0);
+    memset(&listing, 0, sizeof listing);
+    listing.limit = 1;
+    calls = calls_readdir;
+    CHECK(0 == ops.readdir("/d", &listing, list_filler, 1, 0, 0));
+    CHECK(calls + 1 == calls_readdir);
+    CHECK(1 == listing.count && 2 == listing.entries[0].off);
+    CHECK(0 == strcmp(dirs[0].names[1], listing.entries[0].name));
+    readdir_offsets = 0;
+
+    /* cut short */
+    memset(&listing, 0, sizeof listing);
+    listing.limit = 1;
+    CHECK(0 == ops.readdir("/d", &listing, list_filler, 0, 0, 0));
+    CHECK(1 == listing.count);
+    check_list("/d", 0, 0, 0);
+    check_list("/d", 0, 0, 1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse3_config conf;
+
+    snprintf(dirs[0].names[0], sizeof dirs[0].names[0], "a");
+    snprintf(dirs[0].names[1], sizeof dirs[0].names[1], "b");
+    snprintf(dirs[1].names[0], sizeof dirs[1].names[0], "x");
+    dirs[0].modes[0] = dirs[0].modes[1] = dirs[1].modes[0] = S_IFREG | 0644;
+
+    setenv(CYGFUSE_CACHE_ENV, "dir", 1);
+    CHECK(cygfuse_cache_init());
+    ops = mem_ops;
+    cygfuse_cache_install(&ops, &mem_ops);
+
+    /* nothing is cached before init */
+    check_list("/d", 0, 0, 0);
+    check_list("/d", 0, 0, 0);
+
+    memset(&conf, 0, sizeof conf);
+    conf.entry_timeout = 60;
+    CHECK(&context == ops.init(0, &conf));
+
+    test_cached();
+    test_invalidate();
+    test_uncached();
+
+    ops.destroy(&context);
+
+    if (0 != failures)
+    {
+        fprintf(stderr, "cygfuse-test-dircache: %d failures\n", failures);
+        return 1;
+    }
+    printf("cygfuse-test-dircache: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,263 @@
+/**
+ * @file fuse3/cygfuse-test-fork.c
+ * Fork test of the cygfuse DLL.
+ *
+ * Loads the cygfuse DLL built against the stub provider and forks
+ * repeatedly while other threads keep calling into the provider through
+ * it, so that the fork handlers of cygfuse.c run as they do for a file
+ * system. Each child checks that the dispatch table it inherited was kept,
+ * and that an API first used in the child is bound through the provider
+ * handle that was kept with it. Another child sets up the signal handlers
+ * and then daemonizes through fuse_daemonize; the daemon checks the same,
+ * and that the signal thread of winfsp_fuse.h was restarted in it.
+ *
+ * A fork on Linux leaves the provider where it was, so there the child
+ * handler always keeps the table. The reset of a table with a stale entry
+ * is checked by calling cygfuse_api_revalidate directly. Runs on Cygwin
+ * and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define THREADS                         4
+#define FORKS                           500
+#define TIMEOUT                         5000 /* ms */
+
+/* where a forked process would have to load the provider again */
+#define NOWINFSP                        "/nonexistent/cygfuse-stub.dll"
+
+static struct
+{
+    void *(*get_context)(void);
+    int (*version)(void);
+    const char *(*pkgversion)(void);
+    int (*set_signal_handlers)(void *se);
+    int (*daemonize)(int foreground);
+} fuse;
+static void *stub, *context;
+static volatile int *stub_signal;
+static volatile int stop;
+
+static void *sym(void *h, const char *path, const char *name)
+{
+    void *p = dlsym(h, name);
+    if (0 == p)
+    {
+        fprintf(stderr, "%s: %s not found\n", path, name);
+        exit(1);
+    }
+    return p;
+}
+
+static void *worker(void *arg)
+{
+    (void)arg;
+    while (!stop)
+    {
+        fuse.get_context();
+        fuse.version();
+    }
+    return 0;
+}
+
+/*
+ * Checks of a forked process. The provider cannot be loaded again from
+ * here, so an API that is not bound through the handle kept by the child
+ * handler ends the process with status 1 (see cygfuse_init_fail).
+ */
+static int child_main(void)
+{
+    const char *pkgversion;
+
+    setenv("CYGFUSE_WINFSP", NOWINFSP, 1);
+
+    /* bound in the parent */
+    if (context != fuse.get_context() || 32 != fuse.version())
+        return 2;
+
+    /* first used here */
+    pkgversion = fuse.pkgversion();
+    if (0 == pkgversion || 0 != strcmp("3.2", pkgversion))
+        return 3;
+
+    return 0;
+}
+
+/* the signal thread passes SIGTERM to the provider */
+static int signal_main(void)
+{
+    *stub_signal = 0;
+    if (-1 == kill(getpid(), SIGTERM))
+        return 4;
+    for (int i = 0; TIMEOUT > i && SIGTERM != *stub_signal; i++)
+        usleep(1000);
+    return SIGTERM == *stub_signal ? 0 : 5;
+}
+
+static void test_forks(void)
+{
+    pthread_t threads[THREADS];
+
+    for (int i = 0; THREADS > i; i++)
+        pthread_create(&threads[i], 0, worker, 0);
+
+    for (int i = 0; FORKS > i; i++)
+    {
+        int status;
+        pid_t pid = fork();
+        if (-1 == pid)
+        {
+            perror("fork");
+            exit(1);
+        }
+        if (0 == pid)
+            _exit(child_main());
+        if (-1 == waitpid(pid, &status, 0) || !WIFEXITED(status) || 0 != WEXITSTATUS(status))
+        {
+            fprintf(stderr, "fork %d: child failed with status %d\n",
+                i, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+            failures++;
+        }
+    }
+
+    stop = 1;
+    for (int i = 0; THREADS > i; i++)
+        pthread_join(threads[i], 0);
+}
+
+static void test_daemonize(void)
+{
+    int fds[2], status;
+    char result = -1;
+    pid_t pid;
+
+    if (-1 == pipe(fds))
+    {
+        perror("pipe");
+        exit(1);
+    }
+    pid = fork();
+    if (-1 == pid)
+    {
+        perror("fork");
+        exit(1);
+    }
+    if (0 == pid)
+    {
+        /* as a file system that sets up its signal handlers first */
+        close(fds[0]);
+        if (0 != fuse.set_signal_handlers(&result) || 0 != fuse.daemonize(0))
+            _exit(1);
+
+        /* the daemon */
+        result = child_main();
+        if (0 == result)
+            result = signal_main();
+        if (1 != write(fds[1], &result, 1))
+            _exit(1);
+        _exit(0);
+    }
+    close(fds[1]);
+    CHECK(-1 != waitpid(pid, &status, 0) && WIFEXITED(status) && 0 == WEXITSTATUS(status));
+
+    /* closed without a result if the daemon exits early */
+    CHECK(1 == read(fds[0], &result, 1));
+    close(fds[0]);
+    if (0 != result)
+        fprintf(stderr, "daemon failed with status %d\n", result);
+    CHECK(0 == result);
+}
+
+typedef int api_t(void *env);
+
+static int thunk0(void *env) { (void)env; return -1; }
+static int thunk1(void *env) { (void)env; return -1; }
+static int thunk2(void *env) { (void)env; return -1; }
+static int fallback2(void *env) { (void)env; return 0; }
+
+static const struct cygfuse_api_desc desc[] =
+{
+    { "fsp_fuse3_version", (void *)thunk0, 0 },
+    { "fsp_fuse3_mount", (void *)thunk1, 0 },
+    { "fsp_fuse3_nonexistent", (void *)thunk2, (void *)fallback2 },
+};
+#define COUNT                           (sizeof desc / sizeof desc[0])
+
+static void test_revalidate(void)
+{
+    void *table[COUNT];
+
+    table[0] = dlsym(stub, desc[0].name);
+    table[1] = dlsym(stub, desc[1].name);
+    table[2] = desc[2].fallback;
+    CHECK(cygfuse_api_revalidate(stub, table, desc, COUNT));
+    CHECK(32 == ((api_t *)table[0])(0) && 0 == ((api_t *)table[2])(0));
+
+    /* a stale entry resets the whole table */
+    table[1] = (void *)thunk0;
+    CHECK(!cygfuse_api_revalidate(stub, table, desc, COUNT));
+    for (size_t i = 0; COUNT > i; i++)
+        CHECK(table[i] == desc[i].thunk);
+
+    /* no handle: nothing is bound, nothing to revalidate */
+    CHECK(!cygfuse_api_revalidate(0, table, desc, COUNT));
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = 1 < argc ? argv[1] : "./cygfuse-3.2.dll";
+    const char *stub_path = 2 < argc ? argv[2] : "./cygfuse-stub.dll";
+    void *dll;
+
+    /* global: outside Cygwin the stub also supplies the Cygwin functions */
+    setenv("CYGFUSE_WINFSP", stub_path, 1);
+    stub = dlopen(stub_path, RTLD_NOW | RTLD_GLOBAL);
+    if (0 == stub)
+    {
+        fprintf(stderr, "cannot load %s: %s\n", stub_path, dlerror());
+        return 1;
+    }
+    dll = dlopen(path, RTLD_NOW);
+    if (0 == dll)
+    {
+        fprintf(stderr, "cannot load %s: %s\n", path, dlerror());
+        return 1;
+    }
+    fuse.get_context = sym(dll, path, "fuse_get_context");
+    fuse.version = sym(dll, path, "fuse_version");
+    fuse.pkgversion = sym(dll, path, "fuse_pkgversion");
+    fuse.set_signal_handlers = sym(dll, path, "fuse_set_signal_handlers");
+    fuse.daemonize = sym(dll, path, "fuse_daemonize");
+    stub_signal = sym(stub, stub_path, "stub_signal");
+    context = ((void *(*)(void *))sym(stub, stub_path, "fsp_fuse3_get_context"))(0);
+
+    test_revalidate();
+
+    /* bind what the workers call; pkgversion is left to the children */
+    CHECK(context == fuse.get_context() && 32 == fuse.version());
+    test_forks();
+    test_daemonize();
+
+    if (0 == failures)
+        printf("cygfuse-test-fork: all tests passed\n");
+    return !!failures;
+}
@@ -0,0 +1,189 @@
+/**
+ * @file fuse3/cygfuse-test-locate.c
+ * Test of the WinFsp DLL lookup and provider location cache.
+ *
+ * Builds a fake registry tree and WinFsp installation under a temporary
+ * directory (using the stub provider as the WinFsp DLL) and runs the
+ * lookup in cygfuse-locate.c against it. Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define TEST_NAME                       "cygfuse-test-winfsp.dll"
+
+static char root[PATH_MAX], regpath[PATH_MAX], cachepath[PATH_MAX];
+static char binpath[PATH_MAX], altpath[PATH_MAX];
+
+static char *join(char *buf, const char *prefix, const char *suffix)
+{
+    if (PATH_MAX <= strlen(prefix) + strlen(suffix))
+        exit(1);
+    strcpy(buf, prefix);
+    strcat(buf, suffix);
+    return buf;
+}
+
+static void copy_file(const char *src, const char *dst)
+{
+    char buf[65536];
+    ssize_t bytes;
+    int sfd = open(src, O_RDONLY), dfd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (-1 == sfd || -1 == dfd)
+    {
+        perror(-1 == sfd ? src : dst);
+        exit(1);
+    }
+    while (0 < (bytes = read(sfd, buf, sizeof buf)))
+        if (bytes != write(dfd, buf, bytes))
+            exit(1);
+    close(sfd);
+    close(dfd);
+}
+
+static void write_registry(void)
+{
+    char winpath[PATH_MAX];
+    int fd;
+
+    /* registry strings are NUL terminated */
+    join(winpath, root, "\\");
+    fd = open(regpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (-1 == fd || (ssize_t)strlen(winpath) + 1 != write(fd, winpath, strlen(winpath) + 1))
+        exit(1);
+    close(fd);
+}
+
+static void touch_registry(void)
+{
+    struct stat st;
+    struct timespec ts[2];
+
+    stat(regpath, &st);
+    ts[0] = st.st_atim;
+    ts[1] = st.st_mtim;
+    ts[1].tv_sec += 10;
+    utimensat(AT_FDCWD, regpath, ts, 0);
+}
+
+static const char *loaded_from(void *h)
+{
+    static char path[PATH_MAX];
+    Dl_info info;
+    void *sym = 0 != h ? dlsym(h, "fsp_fuse3_version") : 0;
+    if (0 == sym || 0 == dladdr(sym, &info) || 0 == realpath(info.dli_fname, path))
+        return "";
+    return path;
+}
+
+static const char *cache_file(void)
+{
+    static char path[PATH_MAX];
+    char suffix[32];
+    snprintf(suffix, sizeof suffix, ".%u.cache", (unsigned)getuid());
+    return join(path, cachepath, suffix);
+}
+
+static void rewrite_cache(const char *psxpath)
+{
+    char line[64];
+    FILE *f = fopen(cache_file(), "r+");
+    if (0 == f || 0 == fgets(line, sizeof line, f))
+        exit(1);
+    fseek(f, 0, SEEK_SET);
+    fprintf(f, "%s%s\n", line, psxpath);
+    fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *stub = 1 < argc ? argv[1] : "./cygfuse-stub.dll";
+    char tmpl[] = "/tmp/cygfuse-test-XXXXXX", dir[PATH_MAX];
+    void *h;
+
+    if (0 == mkdtemp(tmpl) || 0 == realpath(tmpl, root))
+        return 1;
+    join(dir, root, "/bin");
+    mkdir(dir, 0755);
+    join(dir, root, "/alt");
+    mkdir(dir, 0755);
+    join(binpath, root, "/bin/" TEST_NAME);
+    join(altpath, root, "/alt/" TEST_NAME);
+    join(regpath, root, "/InstallDir");
+    join(cachepath, root, "/cygfuse-winfsp");
+    copy_file(stub, binpath);
+    copy_file(stub, altpath);
+    write_registry();
+    unsetenv(CYGFUSE_WINFSP_ENV);
+
+    /* cache miss: found through the registry and remembered */
+    h = cygfuse_locate_winfsp(TEST_NAME, regpath, cachepath);
+    CHECK(0 == strcmp(binpath, loaded_from(h)));
+    CHECK(0 == access(cache_file(), F_OK));
+
+    /* cache hit: the cached path is used as is */
+    rewrite_cache(altpath);
+    h = cygfuse_locate_winfsp(TEST_NAME, regpath, cachepath);
+    CHECK(0 == strcmp(altpath, loaded_from(h)));
+
+    /* insecure cache: ignored */
+    chmod(cache_file(), 0666);
+    h = cygfuse_locate_winfsp(TEST_NAME, regpath, cachepath);
+    CHECK(0 == strcmp(binpath, loaded_from(h)));
+    chmod(cache_file(), 0644);
+
+    /* registry change: cache is stale and gets rewritten */
+    rewrite_cache(altpath);
+    touch_registry();
+    h = cygfuse_locate_winfsp(TEST_NAME, regpath, cachepath);
+    CHECK(0 == strcmp(binpath, loaded_from(h)));
+    rewrite_cache(altpath);
+    h = cygfuse_locate_winfsp(TEST_NAME, regpath, cachepath);
+    CHECK(0 == strcmp(altpath, loaded_from(h)));
+
+    /* environment override */
+    setenv(CYGFUSE_WINFSP_ENV, binpath, 1);
+    h = cygfuse_locate_winfsp(TEST_NAME, regpath, cachepath);
+    CHECK(0 == strcmp(binpath, loaded_from(h)));
+    setenv(CYGFUSE_WINFSP_ENV, "/nonexistent/" TEST_NAME, 1);
+    h = cygfuse_locate_winfsp(TEST_NAME, regpath, cachepath);
+    CHECK(0 == h);
+    unsetenv(CYGFUSE_WINFSP_ENV);
+
+    /* no registry value: not found */
+    unlink(cache_file());
+    unlink(regpath);
+    h = cygfuse_locate_winfsp(TEST_NAME, regpath, cachepath);
+    CHECK(0 == h);
+
+    unlink(binpath);
+    unlink(altpath);
+    join(dir, root, "/bin");
+    rmdir(dir);
+    join(dir, root, "/alt");
+    rmdir(dir);
+    rmdir(root);
+
+    if (0 == failures)
+        printf("cygfuse-test-locate: all tests passed\n");
+    return !!failures;
+}
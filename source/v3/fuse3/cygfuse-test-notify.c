@@ -0,0 +1,250 @@
+/**
+ * @file fuse3/cygfuse-test-notify.c
+ * Test of the batched change notifications in cygfuse-notify.c.
+ *
+ * Changes are queued for a file system as the interposer would queue
+ * them, and the notifications delivered are recorded. Checks that they
+ * are delivered after the delay and in order; that changes to the same
+ * path are merged as documented; that only the changes of the interposed
+ * file system are queued; and that many changes from several threads,
+ * more than the queue holds, are all delivered by the time the file
+ * system is destroyed. Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define STORM_FILES                     1000
+#define THREADS                         4
+#define THREAD_FILES                    25000
+
+struct delivery
+{
+    char path[32];
+    uint32_t action;
+};
+
+static int fuse_a, fuse_b;
+static struct fuse3_context context = { (struct fuse3 *)&fuse_a };
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct delivery *deliveries;
+static size_t ndeliveries, maxdeliveries;
+static int destroyed, wrong_fuse;
+
+struct fuse3_context *fuse3_get_context(void)
+{
+    return &context;
+}
+
+static int deliver(struct fuse3 *f, const char *path, uint32_t action)
+{
+    pthread_mutex_lock(&mutex);
+    if ((struct fuse3 *)&fuse_a != f)
+        wrong_fuse++;
+    if (ndeliveries == maxdeliveries)
+    {
+        maxdeliveries = 0 == maxdeliveries ? 1024 : 2 * maxdeliveries;
+        deliveries = realloc(deliveries, maxdeliveries * sizeof *deliveries);
+    }
+    snprintf(deliveries[ndeliveries].path, sizeof deliveries[ndeliveries].path, "%s", path);
+    deliveries[ndeliveries].action = action;
+    ndeliveries++;
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+static size_t delivered(void)
+{
+    size_t count;
+
+    pthread_mutex_lock(&mutex);
+    count = ndeliveries;
+    pthread_mutex_unlock(&mutex);
+    return count;
+}
+
+static int queue(const char *path, uint32_t action)
+{
+    return cygfuse_notify_queue((struct fuse3 *)&fuse_a, path, action, deliver);
+}
+
+/* waits for count notifications to be delivered, for up to 5 seconds */
+static int wait_delivered(size_t count)
+{
+    for (int i = 0; 500 > i && count > delivered(); i++)
+        usleep(10000);
+    return count == delivered();
+}
+
+static int find(const char *path, uint32_t action)
+{
+    for (size_t i = 0; ndeliveries > i; i++)
+        if (0 == strcmp(path, deliveries[i].path) && action == deliveries[i].action)
+            return (int)i;
+    return -1;
+}
+
+static size_t count_action(uint32_t action)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; ndeliveries > i; i++)
+        count += action == deliveries[i].action;
+    return count;
+}
+
+static void *mem_init(struct fuse3_conn_info *conn, struct fuse3_config *conf)
+{
+    return &context;
+}
+
+static void mem_destroy(void *data)
+{
+    destroyed = 1;
+}
+
+static const struct fuse3_operations mem_ops =
+{
+    .init = mem_init,
+    .destroy = mem_destroy,
+};
+
+static void *queue_thread(void *arg)
+{
+    char path[32];
+    unsigned id = (unsigned)(uintptr_t)arg;
+
+    for (unsigned i = 0; THREAD_FILES > i; i++)
+    {
+        snprintf(path, sizeof path, "/t%u/%u", id, i);
+        CHECK(queue(path, FSP_FUSE_NOTIFY_CREATE));
+        CHECK(queue(path, FSP_FUSE_NOTIFY_UTIME));
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse3_operations ops;
+    pthread_t threads[THREADS];
+    char path[32];
+    int ok;
+
+    /* not enabled */
+    unsetenv(CYGFUSE_NOTIFY_ENV);
+    CHECK(!cygfuse_notify_init());
+
+    setenv(CYGFUSE_NOTIFY_ENV, "300", 1);
+    CHECK(cygfuse_notify_init());
+    ops = mem_ops;
+    cygfuse_notify_install(&ops, &mem_ops);
+
+    /* nothing is queued before init */
+    CHECK(!queue("/a", FSP_FUSE_NOTIFY_CHMOD));
+    CHECK(&context == ops.init(0, 0));
+
+    /* only the interposed file system */
+    CHECK(!cygfuse_notify_queue((struct fuse3 *)&fuse_b, "/a", FSP_FUSE_NOTIFY_CHMOD, deliver));
+
+    /* a bulk extraction: one notification per file */
+    CHECK(queue("/x", FSP_FUSE_NOTIFY_MKDIR));
+    for (unsigned i = 0; STORM_FILES > i; i++)
+    {
+        snprintf(path, sizeof path, "/x/%u", i);
+        CHECK(queue(path, FSP_FUSE_NOTIFY_CREATE));
+        CHECK(queue(path, FSP_FUSE_NOTIFY_TRUNCATE));
+        CHECK(queue(path, FSP_FUSE_NOTIFY_CHMOD));
+        CHECK(queue(path, FSP_FUSE_NOTIFY_UTIME));
+    }
+    CHECK(queue("/x", FSP_FUSE_NOTIFY_UTIME));
+
+    /* attribute changes are delivered together */
+    CHECK(queue("/a", FSP_FUSE_NOTIFY_CHMOD));
+    CHECK(queue("/a", FSP_FUSE_NOTIFY_UTIME));
+    CHECK(queue("/a", FSP_FUSE_NOTIFY_CHMOD));
+
+    /* created and removed: nothing; removed and created: both */
+    CHECK(queue("/tmp", FSP_FUSE_NOTIFY_CREATE));
+    CHECK(queue("/tmp", FSP_FUSE_NOTIFY_CHMOD));
+    CHECK(queue("/tmp", FSP_FUSE_NOTIFY_UNLINK));
+    CHECK(queue("/r", FSP_FUSE_NOTIFY_UNLINK));
+    CHECK(queue("/r", FSP_FUSE_NOTIFY_CREATE));
+
+    /* removed: attribute changes are not delivered */
+    CHECK(queue("/gone", FSP_FUSE_NOTIFY_CHOWN));
+    CHECK(queue("/gone", FSP_FUSE_NOTIFY_RMDIR));
+
+    /* not known what changed */
+    CHECK(queue("/z", 0));
+    CHECK(queue("/z", 0));
+
+    /* delivered after the delay, all at once */
+    CHECK(0 == delivered());
+    CHECK(wait_delivered(1 + STORM_FILES + 5));
+    usleep(100000);
+    pthread_mutex_lock(&mutex);
+    CHECK(1 + STORM_FILES + 5 == ndeliveries);
+    CHECK(0 == find("/x", FSP_FUSE_NOTIFY_MKDIR));
+    ok = 1;
+    for (unsigned i = 0; STORM_FILES > i; i++)
+    {
+        snprintf(path, sizeof path, "/x/%u", i);
+        ok = ok && 1 + (int)i == find(path, FSP_FUSE_NOTIFY_CREATE);
+    }
+    CHECK(ok);
+    CHECK(-1 == find("/x", FSP_FUSE_NOTIFY_UTIME));
+    CHECK(-1 != find("/a", FSP_FUSE_NOTIFY_CHMOD | FSP_FUSE_NOTIFY_UTIME));
+    CHECK(-1 == find("/tmp", FSP_FUSE_NOTIFY_CREATE));
+    CHECK(-1 == find("/tmp", FSP_FUSE_NOTIFY_UNLINK));
+    CHECK(-1 != find("/r", FSP_FUSE_NOTIFY_UNLINK));
+    CHECK(find("/r", FSP_FUSE_NOTIFY_UNLINK) + 1 == find("/r", FSP_FUSE_NOTIFY_CREATE));
+    CHECK(-1 != find("/gone", FSP_FUSE_NOTIFY_RMDIR));
+    CHECK(-1 == find("/gone", FSP_FUSE_NOTIFY_CHOWN));
+    CHECK(-1 != find("/z", 0));
+    ndeliveries = 0;
+    pthread_mutex_unlock(&mutex);
+
+    /* more than the queue holds, from several threads; all delivered by destroy */
+    for (unsigned i = 0; THREADS > i; i++)
+        pthread_create(&threads[i], 0, queue_thread, (void *)(uintptr_t)i);
+    for (unsigned i = 0; THREADS > i; i++)
+        pthread_join(threads[i], 0);
+    ops.destroy(&context);
+    CHECK(destroyed);
+    /* a change queued after its path was taken for delivery is delivered on its own */
+    CHECK(THREADS * THREAD_FILES == count_action(FSP_FUSE_NOTIFY_CREATE));
+    CHECK(THREADS * THREAD_FILES + THREAD_FILES / 10 > delivered());
+    CHECK(0 == wrong_fuse);
+
+    /* nothing is queued after destroy */
+    CHECK(!queue("/a", FSP_FUSE_NOTIFY_CHMOD));
+
+    free(deliveries);
+
+    if (0 != failures)
+    {
+        fprintf(stderr, "cygfuse-test-notify: %d failures\n", failures);
+        return 1;
+    }
+    printf("cygfuse-test-notify: all tests passed\n");
+    return 0;
+}
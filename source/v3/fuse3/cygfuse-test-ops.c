@@ -0,0 +1,344 @@
+/**
+ * @file fuse3/cygfuse-test-ops.c
+ * Test of the operations interposer in cygfuse-ops.c.
+ *
+ * The interposer is installed over a file system that implements a few
+ * operations, read through read_buf, with statistics and the attr cache
+ * enabled. The table passed to WinFsp must have the operations of the
+ * file system and no others, except for init and destroy; getattr calls
+ * served by the cache must not reach the instrumentation beneath it, and
+ * reads must reach the file system, and be counted, as read_buf. The
+ * report must have the count, errors and latency histogram of each
+ * operation called. Only the first table is interposed.
+ *
+ * The cygfuse_memory= mount option must set the limit of the memory
+ * budget and be taken out of the arguments, which must be left alone if
+ * it is not there; an invalid size must fail. fuse_opt_parse is replaced
+ * by a parser of -o options like that of WinFsp. Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define READ_DELAY                      2000    /* us */
+
+static struct fuse3_context context;
+static unsigned calls_getattr, calls_read_buf, calls_opt_parse;
+
+struct fuse3_context *fuse3_get_context(void)
+{
+    return &context;
+}
+
+/* options of a -o argument are matched against the templates; "name=" matches any value */
+static const struct fuse_opt *opt_match(const struct fuse_opt opts[], const char *opt)
+{
+    for (; 0 != opts->templ; opts++)
+    {
+        size_t len = strlen(opts->templ);
+        if ('=' == opts->templ[len - 1] ?
+            0 == strncmp(opt, opts->templ, len) : 0 == strcmp(opt, opts->templ))
+            return opts;
+    }
+    return 0;
+}
+
+int fuse_opt_parse(struct fuse_args *args, void *data,
+    const struct fuse_opt opts[], fuse_opt_proc_t proc)
+{
+    char **argv = calloc((size_t)args->argc + 1, sizeof *argv);
+    char *list, *opt, *save, *kept;
+    const struct fuse_opt *match;
+    int argc = 0, result;
+
+    calls_opt_parse++;
+    if (0 == argv)
+        return -1;
+    for (int i = 0; args->argc > i; i++)
+    {
+        if (0 != i && 0 == strcmp(args->argv[i], "-o") && args->argc > i + 1)
+            list = strdup(args->argv[++i]);
+        else if (0 != i && 0 == strncmp(args->argv[i], "-o", 2))
+            list = strdup(args->argv[i] + 2);
+        else
+        {
+            argv[argc++] = args->argv[i];
+            continue;
+        }
+        kept = calloc(strlen(list) + 1, 1);
+        for (opt = strtok_r(list, ",", &save); 0 != opt; opt = strtok_r(0, ",", &save))
+        {
+            match = opt_match(opts, opt);
+            result = proc(data, opt, 0 != match ? match->value : FUSE_OPT_KEY_OPT, args);
+            if (-1 == result)
+                return -1;
+            if (1 == result)
+            {
+                if ('\0' != kept[0])
+                    strcat(kept, ",");
+                strcat(kept, opt);
+            }
+        }
+        free(list);
+        if ('\0' != kept[0])
+        {
+            argv[argc++] = "-o";
+            argv[argc++] = kept;
+        }
+    }
+    args->argc = argc;
+    args->argv = argv;
+    args->allocated = 1;
+    return 0;
+}
+
+static void *fs_init(struct fuse3_conn_info *conn, struct fuse3_config *conf)
+{
+    return &context;
+}
+
+static int fs_getattr(const char *path, struct fuse_stat *stbuf, struct fuse3_file_info *fi)
+{
+    calls_getattr++;
+    memset(stbuf, 0, sizeof *stbuf);
+    stbuf->st_mode = S_IFREG | 0644;
+    stbuf->st_size = 1000;
+    return 0;
+}
+
+static int fs_unlink(const char *path)
+{
+    return -EACCES;
+}
+
+static int fs_read_buf(const char *path, struct fuse3_bufvec **bufp, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    struct fuse3_bufvec *bufv = malloc(sizeof *bufv);
+
+    calls_read_buf++;
+    usleep(READ_DELAY);
+    if (0 == bufv)
+        return -ENOMEM;
+    *bufv = (struct fuse3_bufvec)FUSE_BUFVEC_INIT(size);
+    bufv->buf[0].mem = calloc(1, size);
+    if (0 == bufv->buf[0].mem)
+    {
+        free(bufv);
+        return -ENOMEM;
+    }
+    *bufp = bufv;
+    return 0;
+}
+
+static const struct fuse3_operations fs_ops =
+{
+    .init = fs_init,
+    .getattr = fs_getattr,
+    .unlink = fs_unlink,
+    .read_buf = fs_read_buf,
+};
+
+/* the count, errors, histogram total and lowest histogram bucket of name in the report */
+static int report_op(const char *report, const char *name,
+    unsigned long long *count, unsigned long long *errors, unsigned long long *hist,
+    unsigned long long *lowest)
+{
+    char line[64];
+    const char *p;
+    unsigned long long upper, n;
+    int len;
+
+    snprintf(line, sizeof line, "\n%s ", name);
+    p = strstr(report, line);
+    if (0 == p || 2 != sscanf(p + strlen(line), "%llu %llu", count, errors))
+        return 0;
+    p = strstr(p + 1, "\n  hist");
+    if (0 == p)
+        return 0;
+    p += sizeof "\n  hist" - 1;
+    *hist = 0;
+    *lowest = ~0ULL;
+    while (2 == sscanf(p, " %llu:%llu%n", &upper, &n, &len))
+    {
+        *hist += n;
+        if (*lowest > upper)
+            *lowest = upper;
+        p += len;
+    }
+    return 1;
+}
+
+static void test_interpose(void)
+{
+    const struct fuse3_operations *wrap;
+    struct fuse3_config conf;
+    struct fuse_stat stbuf;
+    char buf[100], path[] = "/tmp/cygfuse-test-ops.XXXXXX", *report;
+    unsigned long long count, errors, hist, lowest;
+    size_t opsize = sizeof fs_ops, size;
+    FILE *file;
+    int fd;
+
+    fd = mkstemp(path);
+    CHECK(-1 != fd);
+    close(fd);
+    setenv(CYGFUSE_STATS_ENV, path, 1);
+    CHECK(cygfuse_stats_init());
+    setenv(CYGFUSE_CACHE_ENV, "attr", 1);
+
+    wrap = cygfuse_ops_interpose(&fs_ops, &opsize);
+    CHECK(&fs_ops != wrap && sizeof *wrap == opsize);
+
+    /* the operations of the file system and no others, but for init and destroy */
+    CHECK(0 != wrap->init && 0 != wrap->destroy);
+    CHECK(0 != wrap->getattr && 0 != wrap->unlink);
+    CHECK(0 != wrap->read && 0 == wrap->write && 0 == wrap->mkdir && 0 == wrap->readdir);
+
+    memset(&conf, 0, sizeof conf);
+    conf.attr_timeout = conf.entry_timeout = 60;
+    CHECK(&context == wrap->init(0, &conf));
+
+    /* the cache above the instrumentation */
+    CHECK(0 == wrap->getattr("/file", &stbuf, 0));
+    CHECK(0 == wrap->getattr("/file", &stbuf, 0));
+    CHECK(0 == wrap->getattr("/file", &stbuf, 0));
+    CHECK(1 == calls_getattr && 1000 == stbuf.st_size);
+
+    /* the read_buf adapter beneath it */
+    for (int i = 0; 3 > i; i++)
+        CHECK(sizeof buf == wrap->read("/file", buf, sizeof buf, 0, 0));
+    CHECK(3 == calls_read_buf);
+
+    CHECK(-EACCES == wrap->unlink("/file"));
+    CHECK(-EACCES == wrap->unlink("/file"));
+
+    wrap->destroy(&context);
+
+    /* only the first file system */
+    opsize = sizeof fs_ops;
+    CHECK(&fs_ops == cygfuse_ops_interpose(&fs_ops, &opsize));
+    CHECK(sizeof fs_ops == opsize);
+
+    cygfuse_dump();
+    report = calloc(1, 65536);
+    file = fopen(path, "r");
+    CHECK(0 != report && 0 != file);
+    size = 0 != report && 0 != file ? fread(report, 1, 65535, file) : 0;
+    if (0 != file)
+        fclose(file);
+    unlink(path);
+    if (0 == size)
+    {
+        free(report);
+        return;
+    }
+
+    CHECK(report_op(report, "init", &count, &errors, &hist, &lowest));
+    CHECK(1 == count && 0 == errors && 1 == hist);
+    CHECK(report_op(report, "getattr", &count, &errors, &hist, &lowest));
+    CHECK(1 == count && 0 == errors && 1 == hist);
+    CHECK(report_op(report, "read_buf", &count, &errors, &hist, &lowest));
+    CHECK(3 == count && 0 == errors && 3 == hist);
+    CHECK((unsigned long long)READ_DELAY * 1000 <= lowest);
+    CHECK(report_op(report, "unlink", &count, &errors, &hist, &lowest));
+    CHECK(2 == count && 2 == errors && 2 == hist);
+    CHECK(!report_op(report, "read", &count, &errors, &hist, &lowest));
+    CHECK(!report_op(report, "destroy", &count, &errors, &hist, &lowest));
+    CHECK(0 != strstr(report, "[memory]\n"));
+
+    free(report);
+}
+
+/* the arguments after parsing, joined by spaces */
+static void check_args(const char *const *in, int result, const char *out, int parsed)
+{
+    struct fuse_args args;
+    char joined[256] = "";
+    unsigned calls = calls_opt_parse;
+    int argc = 0;
+
+    while (0 != in[argc])
+        argc++;
+    args = (struct fuse_args)FUSE_ARGS_INIT(argc, (char **)in);
+    CHECK(result == cygfuse_ops_args(&args));
+    CHECK((parsed ? calls + 1 : calls) == calls_opt_parse);
+    if (0 != result)
+        return;
+    for (int i = 0; args.argc > i; i++)
+    {
+        if (0 != i)
+            strcat(joined, " ");
+        strcat(joined, args.argv[i]);
+    }
+    CHECK(0 == strcmp(out, joined));
+}
+
+/* the limit of the memory budget, as reported */
+static unsigned long long budget_limit(void)
+{
+    char report[4096] = "", *p;
+    unsigned long long limit = 0;
+    FILE *file = tmpfile();
+
+    if (0 == file)
+        return 0;
+    cygfuse_budget_report(file);
+    rewind(file);
+    report[fread(report, 1, sizeof report - 1, file)] = '\0';
+    fclose(file);
+    p = strstr(report, "# limit ");
+    if (0 != p)
+        sscanf(p, "# limit %llu", &limit);
+    return limit;
+}
+
+static void test_args(void)
+{
+    static const char *const none[] = { "fs", "-o", "ro,uid=1", "/mnt", 0 };
+    static const char *const alone[] = { "fs", "-o", "cygfuse_memory=64M", "/mnt", 0 };
+    static const char *const among[] = { "fs", "-oro,cygfuse_memory=3k,uid=1", "-f", "/mnt", 0 };
+    static const char *const invalid[] = { "fs", "-o", "cygfuse_memory=lots", "/mnt", 0 };
+
+    check_args(none, 0, "fs -o ro,uid=1 /mnt", 0);
+    check_args(alone, 0, "fs /mnt", 1);
+    CHECK(64ULL << 20 == budget_limit());
+    check_args(among, 0, "fs -o ro,uid=1 -f /mnt", 1);
+    CHECK(3ULL << 10 == budget_limit());
+    check_args(invalid, -1, 0, 1);
+    CHECK(3ULL << 10 == budget_limit());
+}
+
+int main(int argc, char *argv[])
+{
+    test_interpose();
+    test_args();
+
+    if (0 != failures)
+    {
+        fprintf(stderr, "cygfuse-test-ops: %d failures\n", failures);
+        return 1;
+    }
+    printf("cygfuse-test-ops: all tests passed\n");
+    return 0;
+}
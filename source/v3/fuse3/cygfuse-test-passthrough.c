@@ -0,0 +1,372 @@
+/**
+ * @file fuse3/cygfuse-test-passthrough.c
+ * Test of the passthrough layer in cygfuse-passthrough.c.
+ *
+ * A loopback file system over a temporary directory hands the descriptors
+ * of some files to fuse3_passthrough_open. Reads, writes, truncates and
+ * fsyncs of those files must return the data of the backing files without
+ * calling the file system, while other files go to the file system as
+ * before. Opens of the same file in different modes must each use their
+ * own descriptor; an open without a file handle must not pass a
+ * descriptor through, and its handle must follow the file when it is
+ * renamed. The throughput of reading through the file system and through
+ * passthrough is printed. Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define FILESIZE                        (32 * 1024 * 1024)
+#define CHUNK                           (64 * 1024)
+
+static char root[] = "/tmp/cygfuse-test-XXXXXX";
+static unsigned calls_read, calls_write, calls_truncate, calls_fsync, calls_release;
+static int nofh_result;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill(char *p, size_t size, unsigned seed)
+{
+    for (size_t i = 0; size > i; i++)
+        p[i] = (char)((i * 31 + seed) >> 3);
+}
+
+/*
+ * Loopback file system; files whose names start with "pt" are passed
+ * through and files whose names start with "nofh" get no file handle.
+ */
+static void loop_path(char *buf, size_t size, const char *path)
+{
+    snprintf(buf, size, "%s%s", root, path);
+}
+
+static int loop_register(const char *path, struct fuse3_file_info *fi, int fd)
+{
+    if (0 == strncmp(path, "/pt", 3))
+        return cygfuse_passthrough_open(fi, fd);
+    return 0;
+}
+
+static int loop_open(const char *path, struct fuse3_file_info *fi)
+{
+    char buf[256];
+    int fd, result;
+
+    loop_path(buf, sizeof buf, path);
+    fd = open(buf, fi->flags);
+    if (-1 == fd)
+        return -errno;
+    if (0 == strncmp(path, "/nofh", 5))
+    {
+        nofh_result = cygfuse_passthrough_open(fi, fd);
+        close(fd);
+        return 0;
+    }
+    fi->fh = (uint64_t)fd;
+    if (0 != (result = loop_register(path, fi, fd)))
+    {
+        close(fd);
+        return result;
+    }
+    return 0;
+}
+
+static int loop_create(const char *path, fuse_mode_t mode, struct fuse3_file_info *fi)
+{
+    char buf[256];
+    int fd, result;
+
+    loop_path(buf, sizeof buf, path);
+    fd = open(buf, fi->flags | O_CREAT, mode);
+    if (-1 == fd)
+        return -errno;
+    if (0 == strncmp(path, "/nofh", 5))
+    {
+        nofh_result = cygfuse_passthrough_open(fi, fd);
+        close(fd);
+        return 0;
+    }
+    fi->fh = (uint64_t)fd;
+    if (0 != (result = loop_register(path, fi, fd)))
+    {
+        close(fd);
+        return result;
+    }
+    return 0;
+}
+
+static int loop_read(const char *path, char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    ssize_t result;
+
+    calls_read++;
+    result = pread((int)fi->fh, buf, size, off);
+    return -1 != result ? (int)result : -errno;
+}
+
+static int loop_write(const char *path, const char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    ssize_t result;
+
+    calls_write++;
+    result = pwrite((int)fi->fh, buf, size, off);
+    return -1 != result ? (int)result : -errno;
+}
+
+static int loop_truncate(const char *path, fuse_off_t size, struct fuse3_file_info *fi)
+{
+    char buf[256];
+
+    calls_truncate++;
+    if (0 != fi)
+        return -1 != ftruncate((int)fi->fh, size) ? 0 : -errno;
+    loop_path(buf, sizeof buf, path);
+    return -1 != truncate(buf, size) ? 0 : -errno;
+}
+
+static int loop_fsync(const char *path, int datasync, struct fuse3_file_info *fi)
+{
+    calls_fsync++;
+    return -1 != fsync((int)fi->fh) ? 0 : -errno;
+}
+
+static int loop_release(const char *path, struct fuse3_file_info *fi)
+{
+    calls_release++;
+    if (0 != fi->fh)
+        close((int)fi->fh);
+    return 0;
+}
+
+static int loop_rename(const char *oldpath, const char *newpath, unsigned int flags)
+{
+    char oldbuf[256], newbuf[256];
+
+    loop_path(oldbuf, sizeof oldbuf, oldpath);
+    loop_path(newbuf, sizeof newbuf, newpath);
+    return -1 != rename(oldbuf, newbuf) ? 0 : -errno;
+}
+
+static const struct fuse3_operations loop_ops =
+{
+    .open = loop_open,
+    .create = loop_create,
+    .read = loop_read,
+    .write = loop_write,
+    .truncate = loop_truncate,
+    .fsync = loop_fsync,
+    .release = loop_release,
+    .rename = loop_rename,
+};
+
+static struct fuse3_operations ops;
+
+static void test_io(const char *path, int passthrough)
+{
+    char *data = malloc(FILESIZE), *buf = malloc(FILESIZE), name[256];
+    struct fuse3_file_info fi;
+    struct stat st;
+    unsigned calls;
+
+    fill(data, FILESIZE, passthrough);
+    calls_read = calls_write = calls_truncate = calls_fsync = calls_release = 0;
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR;
+    CHECK(0 == ops.create(path, 0644, &fi));
+    for (size_t off = 0; FILESIZE > off; off += CHUNK)
+        CHECK(CHUNK == ops.write(path, data + off, CHUNK, (fuse_off_t)off, &fi));
+    CHECK(0 == ops.fsync(path, 1, &fi));
+    CHECK(0 == ops.release(path, &fi));
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR;
+    CHECK(0 == ops.open(path, &fi));
+    for (size_t off = 0; FILESIZE > off; off += CHUNK)
+        CHECK(CHUNK == ops.read(path, buf + off, CHUNK, (fuse_off_t)off, &fi));
+    CHECK(0 == memcmp(buf, data, FILESIZE));
+
+    /* short read at end of file, nothing past it */
+    CHECK(100 == ops.read(path, buf, CHUNK, FILESIZE - 100, &fi));
+    CHECK(0 == ops.read(path, buf, CHUNK, FILESIZE + 100, &fi));
+
+    CHECK(0 == ops.truncate(path, 1000, &fi));
+    loop_path(name, sizeof name, path);
+    CHECK(0 == stat(name, &st) && 1000 == st.st_size);
+    CHECK(1000 == ops.read(path, buf, CHUNK, 0, &fi));
+    CHECK(0 == memcmp(buf, data, 1000));
+    CHECK(0 == ops.release(path, &fi));
+
+    calls = calls_read + calls_write + calls_truncate + calls_fsync;
+    CHECK(passthrough ? 0 == calls : 0 != calls);
+    CHECK(2 == calls_release);
+
+    unlink(name);
+    free(buf);
+    free(data);
+}
+
+static void count_handle(struct cygfuse_handle *handle, void *ctx)
+{
+    (*(unsigned *)ctx)++;
+}
+
+static unsigned handles(void)
+{
+    unsigned count = 0;
+
+    cygfuse_handle_foreach(count_handle, &count);
+    return count;
+}
+
+/* opens of a file in different modes each use their own descriptor */
+static void test_modes(void)
+{
+    struct fuse3_file_info rdfi, rwfi;
+    char buf[16];
+
+    memset(&rwfi, 0, sizeof rwfi);
+    rwfi.flags = O_RDWR;
+    CHECK(0 == ops.create("/ptmodes", 0644, &rwfi));
+    CHECK(0 == ops.release("/ptmodes", &rwfi));
+
+    memset(&rdfi, 0, sizeof rdfi);
+    rdfi.flags = O_RDONLY;
+    CHECK(0 == ops.open("/ptmodes", &rdfi));
+    memset(&rwfi, 0, sizeof rwfi);
+    rwfi.flags = O_RDWR;
+    CHECK(0 == ops.open("/ptmodes", &rwfi));
+    CHECK(5 == ops.write("/ptmodes", "hello", 5, 0, &rwfi));
+    CHECK(-EBADF == ops.write("/ptmodes", "hello", 5, 0, &rdfi));
+    CHECK(5 == ops.read("/ptmodes", buf, sizeof buf, 0, &rdfi));
+    CHECK(0 == memcmp(buf, "hello", 5));
+    CHECK(0 == ops.release("/ptmodes", &rdfi));
+    CHECK(0 == ops.release("/ptmodes", &rwfi));
+    CHECK(0 == handles());
+
+    CHECK(0 == ops.rename("/ptmodes", "/nofhmodes", 0));
+}
+
+/* an open without an fh passes nothing through, and its handle follows renames */
+static void test_nofh(void)
+{
+    struct fuse3_file_info fi;
+    char name[256];
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR;
+    nofh_result = 0;
+    calls_read = 0;
+    CHECK(0 == ops.open("/nofhmodes", &fi));
+    CHECK(-EINVAL == nofh_result);
+    CHECK(1 == handles());
+
+    CHECK(0 == ops.rename("/nofhmodes", "/nofhrenamed", 0));
+    CHECK(0 == ops.release("/nofhrenamed", &fi));
+    CHECK(0 == handles());
+
+    loop_path(name, sizeof name, "/nofhrenamed");
+    unlink(name);
+}
+
+static double read_throughput(const char *path)
+{
+    char *buf = malloc(CHUNK);
+    struct fuse3_file_info fi;
+    double t0, t1;
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = O_RDWR;
+    ops.create(path, 0644, &fi);
+    for (size_t off = 0; FILESIZE > off; off += CHUNK)
+        ops.write(path, buf, CHUNK, (fuse_off_t)off, &fi);
+
+    t0 = now();
+    for (int pass = 0; 4 > pass; pass++)
+        for (size_t off = 0; FILESIZE > off; off += CHUNK)
+            ops.read(path, buf, CHUNK, (fuse_off_t)off, &fi);
+    t1 = now();
+    ops.release(path, &fi);
+
+    free(buf);
+    return 4.0 * FILESIZE / (1024 * 1024) / (t1 - t0);
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse3_file_info fi;
+    char name[256];
+    double loop, pt;
+
+    if (0 == mkdtemp(root))
+    {
+        fprintf(stderr, "cannot create temporary directory\n");
+        return 1;
+    }
+
+    /* not enabled */
+    unsetenv(CYGFUSE_PASSTHROUGH_ENV);
+    CHECK(!cygfuse_passthrough_init());
+    memset(&fi, 0, sizeof fi);
+    CHECK(-ENOSYS == cygfuse_passthrough_open(&fi, 0));
+
+    setenv(CYGFUSE_PASSTHROUGH_ENV, "1", 1);
+    CHECK(cygfuse_passthrough_init());
+    ops = loop_ops;
+    cygfuse_passthrough_install(&ops, &loop_ops);
+
+    /* only from within open and create */
+    CHECK(-EINVAL == cygfuse_passthrough_open(&fi, 0));
+
+    test_io("/ptfile", 1);
+    test_io("/file", 0);
+    test_modes();
+    test_nofh();
+
+    loop = read_throughput("/file");
+    pt = read_throughput("/ptfile");
+
+    loop_path(name, sizeof name, "/file");
+    unlink(name);
+    loop_path(name, sizeof name, "/ptfile");
+    unlink(name);
+    rmdir(root);
+
+    if (0 != failures)
+    {
+        fprintf(stderr, "cygfuse-test-passthrough: %d failures\n", failures);
+        return 1;
+    }
+    printf("cygfuse-test-passthrough: all tests passed (read %.0f MiB/s, passthrough %.0f MiB/s)\n",
+        loop, pt);
+    return 0;
+}
@@ -0,0 +1,280 @@
+/**
+ * @file fuse3/cygfuse-test-pathcache.c
+ * Test of the sharded path cache in cygfuse-pathcache.c.
+ *
+ * Checks hits, misses and expiry, that an insert made stale by a
+ * concurrent invalidation is dropped, that removing a directory tree
+ * removes exactly the paths under it, LRU eviction, that a Bloom filter
+ * never hides a cached path across rebuilds, that expiring removes exactly
+ * the expired paths and shrinks the tables, and finally that
+ * several threads inserting, looking up and removing paths concurrently
+ * always see values consistent with their keys. Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define THREADS                         4
+#define CALLS                           200000
+#define PATHS                           1000
+
+static struct cygfuse_pathcache cache;
+
+static int put(const char *path, uint64_t value, uint64_t expiry)
+{
+    return cygfuse_pathcache_put(&cache, path,
+        cygfuse_pathcache_generation(&cache, path), &value, sizeof value, expiry);
+}
+
+static int get(const char *path, uint64_t now, uint64_t *value)
+{
+    return cygfuse_pathcache_get(&cache, path, now, value, sizeof *value);
+}
+
+static void test_basic(void)
+{
+    uint64_t value, generation;
+
+    cygfuse_pathcache_init(&cache, "test", CYGFUSE_BUDGET_COST(1, 0), 1024);
+
+    CHECK(!get("/a", 0, &value));
+    CHECK(put("/a", 1, 100));
+    CHECK(get("/a", 0, &value) && 1 == value);
+    CHECK(get("/a", 99, &value) && 1 == value);
+    CHECK(!get("/a", 100, &value));
+    CHECK(0 == cache.entries);
+
+    /* replace */
+    CHECK(put("/a", 1, 100));
+    CHECK(put("/a", 2, 100));
+    CHECK(get("/a", 0, &value) && 2 == value);
+    CHECK(1 == cache.entries);
+
+    /* an invalidation between generation and put drops the put */
+    generation = cygfuse_pathcache_generation(&cache, "/b");
+    cygfuse_pathcache_remove(&cache, "/b");
+    value = 3;
+    CHECK(!cygfuse_pathcache_put(&cache, "/b", generation, &value, sizeof value, 100));
+    CHECK(!get("/b", 0, &value));
+
+    cygfuse_pathcache_remove(&cache, "/a");
+    CHECK(!get("/a", 0, &value));
+    CHECK(0 == cache.entries);
+}
+
+static void test_tree(void)
+{
+    uint64_t value;
+
+    cygfuse_pathcache_clear(&cache);
+    put("/dir", 1, 100);
+    put("/dir/file", 2, 100);
+    put("/dir/sub/file", 3, 100);
+    put("/dirx", 4, 100);
+    put("/dirx/file", 5, 100);
+
+    cygfuse_pathcache_remove_tree(&cache, "/dir");
+    CHECK(!get("/dir", 0, &value));
+    CHECK(!get("/dir/file", 0, &value));
+    CHECK(!get("/dir/sub/file", 0, &value));
+    CHECK(get("/dirx", 0, &value) && 4 == value);
+    CHECK(get("/dirx/file", 0, &value) && 5 == value);
+
+    cygfuse_pathcache_remove_tree(&cache, "/");
+    CHECK(0 == cache.entries);
+}
+
+static void test_evict(void)
+{
+    char path[32];
+    uint64_t value;
+    unsigned present = 0;
+
+    /* 16 entries per shard; the first path inserted is touched throughout */
+    cygfuse_pathcache_init(&cache, "test", CYGFUSE_BUDGET_COST(1, 0), 16 * CYGFUSE_PATHCACHE_SHARDS);
+    put("/keep", 0, 100);
+    for (unsigned i = 1; 16 * CYGFUSE_PATHCACHE_SHARDS * 4 > i; i++)
+    {
+        snprintf(path, sizeof path, "/file%u", i);
+        put(path, i, 100);
+        CHECK(get("/keep", 0, &value));
+    }
+    for (unsigned i = 1; 16 * CYGFUSE_PATHCACHE_SHARDS * 4 > i; i++)
+    {
+        snprintf(path, sizeof path, "/file%u", i);
+        if (get(path, 0, &value))
+        {
+            CHECK(i == value);
+            present++;
+        }
+    }
+    CHECK(16 * CYGFUSE_PATHCACHE_SHARDS >= cache.entries);
+    CHECK(present + 1 == cache.entries);
+    CHECK(0 < cache.evictions);
+}
+
+static void test_filter(void)
+{
+    char path[32];
+    uint64_t value, misses;
+    unsigned present = 0;
+
+    cygfuse_pathcache_init(&cache, "test", CYGFUSE_BUDGET_COST(1, 0), 1024);
+    CHECK(cygfuse_pathcache_filter(&cache));
+
+    /* a lookup the filter rejects is a miss */
+    misses = cache.misses;
+    CHECK(!get("/a", 0, &value));
+    CHECK(misses + 1 == cache.misses);
+    CHECK(put("/a", 1, 100));
+    CHECK(get("/a", 0, &value) && 1 == value);
+    cygfuse_pathcache_remove(&cache, "/a");
+    CHECK(!get("/a", 0, &value));
+
+    /* many more puts than the cache holds force evictions and filter rebuilds */
+    for (unsigned i = 0; 1024 * 64 > i; i++)
+    {
+        snprintf(path, sizeof path, "/file%u", i);
+        CHECK(put(path, i, 100));
+    }
+    CHECK(cache.filter_count <= (cache.filter_mask + 1) / 8);
+
+    /* everything still cached is found */
+    for (unsigned i = 0; 1024 * 64 > i; i++)
+    {
+        snprintf(path, sizeof path, "/file%u", i);
+        if (get(path, 0, &value))
+        {
+            CHECK(i == value);
+            present++;
+        }
+    }
+    CHECK(present == cache.entries);
+    CHECK(1024 - CYGFUSE_PATHCACHE_SHARDS <= present);
+}
+
+static void test_expire(void)
+{
+    char path[32];
+    uint64_t value;
+    size_t freed = 0;
+    int shrunk = 1;
+
+    cygfuse_pathcache_init(&cache, "test", CYGFUSE_BUDGET_COST(1, 0), 65536);
+    CHECK(cygfuse_pathcache_filter(&cache));
+    for (unsigned i = 0; 3500 > i; i++)
+    {
+        snprintf(path, sizeof path, "/file%u", i);
+        CHECK(put(path, i, 0 == i % 7 ? 1000 + i : 100));
+    }
+
+    CHECK(1000 == cygfuse_pathcache_expire(&cache, 200, &freed));
+    CHECK(3000 == freed);
+    CHECK(500 == cache.entries);
+    CHECK(3000 == cache.expirations);
+    CHECK(500 == cache.filter_count);
+    for (unsigned i = 0; CYGFUSE_PATHCACHE_SHARDS > i; i++)
+        shrunk = shrunk && (64 >= cache.shard[i].nbuckets ||
+            cache.shard[i].nbuckets / 4 <= cache.shard[i].count);
+    CHECK(shrunk);
+    for (unsigned i = 0; 3500 > i; i += 7)
+    {
+        snprintf(path, sizeof path, "/file%u", i);
+        CHECK(get(path, 200, &value) && i == value);
+    }
+
+    /* when nothing is left the tables go */
+    freed = 0;
+    CHECK(UINT64_MAX == cygfuse_pathcache_expire(&cache, 10000, &freed));
+    CHECK(500 == freed);
+    CHECK(0 == cache.entries);
+    for (unsigned i = 0; CYGFUSE_PATHCACHE_SHARDS > i; i++)
+        CHECK(0 == cache.shard[i].nbuckets);
+    CHECK(put("/a", 1, 20000));
+    CHECK(get("/a", 10000, &value) && 1 == value);
+    cygfuse_pathcache_clear(&cache);
+}
+
+static void *worker(void *arg)
+{
+    unsigned seed = (unsigned)(uintptr_t)arg;
+    char path[32];
+    uint64_t value;
+
+    for (unsigned i = 0; CALLS > i; i++)
+    {
+        unsigned n = rand_r(&seed) % PATHS;
+        snprintf(path, sizeof path, "/dir%u/file%u", n % 10, n);
+        switch (rand_r(&seed) % 8)
+        {
+        case 0:
+            cygfuse_pathcache_remove(&cache, path);
+            break;
+        case 1:
+            if (0 == i % 1000)
+            {
+                snprintf(path, sizeof path, "/dir%u", n % 10);
+                cygfuse_pathcache_remove_tree(&cache, path);
+            }
+            else if (500 == i % 1000)
+                cygfuse_pathcache_expire(&cache, 0, 0);
+            break;
+        case 2:
+        case 3:
+            put(path, n, UINT64_MAX);
+            break;
+        default:
+            if (get(path, 0, &value))
+                CHECK(n == value);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static void test_threads(int filter)
+{
+    pthread_t threads[THREADS];
+
+    cygfuse_pathcache_init(&cache, "test", CYGFUSE_BUDGET_COST(1, 0), PATHS / 2);
+    if (filter)
+        CHECK(cygfuse_pathcache_filter(&cache));
+    for (uintptr_t i = 0; THREADS > i; i++)
+        pthread_create(&threads[i], 0, worker, (void *)(i + 1));
+    for (unsigned i = 0; THREADS > i; i++)
+        pthread_join(threads[i], 0);
+
+    CHECK(PATHS / 2 + CYGFUSE_PATHCACHE_SHARDS >= cache.entries);
+    cygfuse_pathcache_clear(&cache);
+    CHECK(0 == cache.entries);
+}
+
+int main(void)
+{
+    test_basic();
+    test_tree();
+    test_evict();
+    test_filter();
+    test_expire();
+    test_threads(0);
+    test_threads(1);
+
+    if (0 == failures)
+        printf("cygfuse-test-pathcache: all tests passed\n");
+    return !!failures;
+}
@@ -0,0 +1,113 @@
+/**
+ * @file fuse3/cygfuse-test-pool.c
+ * Test of the worker pool in cygfuse-pool.c.
+ *
+ * Checks that every task that is accepted runs exactly once, that no more
+ * than CYGFUSE_POOL_THREADS tasks run at a time, and that submitting fails
+ * rather than blocks once the queue is full. Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define TASKS                           100000
+
+static unsigned ran[TASKS];
+static unsigned running, maxrunning, completed;
+static int blocked;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static void task(void *arg)
+{
+    unsigned n = __atomic_add_fetch(&running, 1, __ATOMIC_RELAXED);
+    unsigned m = __atomic_load_n(&maxrunning, __ATOMIC_RELAXED);
+    while (n > m && !__atomic_compare_exchange_n(&maxrunning, &m, n, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    __atomic_add_fetch(&ran[(uintptr_t)arg], 1, __ATOMIC_RELAXED);
+
+    __atomic_sub_fetch(&running, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&completed, 1, __ATOMIC_RELEASE);
+}
+
+static void blocking_task(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&mutex);
+    while (blocked)
+        pthread_cond_wait(&cond, &mutex);
+    pthread_mutex_unlock(&mutex);
+    __atomic_add_fetch(&completed, 1, __ATOMIC_RELEASE);
+}
+
+static void test_run(void)
+{
+    unsigned submitted = 0;
+
+    for (uintptr_t i = 0; TASKS > i; i++)
+    {
+        if (cygfuse_pool_submit(task, (void *)i))
+            submitted++;
+        else
+            task((void *)i);            /* the caller runs what the pool cannot */
+    }
+    while (TASKS != __atomic_load_n(&completed, __ATOMIC_ACQUIRE))
+        usleep(1000);
+
+    for (unsigned i = 0; TASKS > i; i++)
+        CHECK(1 == ran[i]);
+    CHECK(0 < submitted);
+    /* the calling thread may run tasks alongside the pool */
+    CHECK(CYGFUSE_POOL_THREADS + 1 >= maxrunning);
+}
+
+static void test_full(void)
+{
+    unsigned submitted = 0;
+
+    completed = 0;
+    blocked = 1;
+    while (cygfuse_pool_submit(blocking_task, 0))
+    {
+        submitted++;
+        if (CYGFUSE_POOL_THREADS + CYGFUSE_POOL_QUEUE < submitted)
+            break;
+    }
+    /* the threads hold some tasks; the rest fill the queue */
+    CHECK(CYGFUSE_POOL_QUEUE <= submitted);
+    CHECK(CYGFUSE_POOL_THREADS + CYGFUSE_POOL_QUEUE >= submitted);
+
+    pthread_mutex_lock(&mutex);
+    blocked = 0;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+    while (submitted != __atomic_load_n(&completed, __ATOMIC_ACQUIRE))
+        usleep(1000);
+}
+
+int main(void)
+{
+    test_run();
+    test_full();
+
+    if (0 == failures)
+        printf("cygfuse-test-pool: all tests passed\n");
+    return !!failures;
+}
@@ -0,0 +1,530 @@
+/**
+ * @file fuse3/cygfuse-test-prefetch.c
+ * Test of the prefetching layer in cygfuse-prefetch.c.
+ *
+ * A file system over a file kept in memory is read through the layer.
+ * Sequential reads must return the data of the file while most of it is
+ * read ahead, and random reads must not read ahead at all. A write
+ * through another handle must discard what was read ahead of it. Data
+ * still being read ahead when a read goes elsewhere is orphaned; it must
+ * be freed by the task reading it, also when its slot has been reused by
+ * then. Release must wait for the reads ahead in progress before the file
+ * system closes its file handle.
+ *
+ * A directory of the same file system lists its entries without stats.
+ * Listed with FUSE_READDIR_PLUS, the entries must come back in order with
+ * the stats of getattr and FUSE_FILL_DIR_PLUS; getattr must not be called
+ * for "." and ".." or for entries listed with stats. Listings without
+ * FUSE_READDIR_PLUS or returned in pieces must be passed on as they are.
+ * When the worker pool takes no work the calling thread must get all the
+ * stats itself.
+ *
+ * The worker pool is replaced by a thread per task, which can be made to
+ * refuse tasks, and reads made on these threads can be held back. Runs on
+ * Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define FILESIZE                        (4 * 1024 * 1024)
+#define READSIZE                        (64 * 1024)
+#define ORPHANS                         (CYGFUSE_READAHEAD_SLOTS + 8)
+#define ENTRIES                         20
+
+static struct fuse3_context context;
+static pthread_t main_thread;
+static char data[FILESIZE];
+static uint64_t fhs;
+static unsigned calls_read, calls_release;
+static unsigned reading, reading_at_release;
+static unsigned calls_getattr, calls_getattr_elsewhere;
+static int pool_refuse, readdir_offsets;
+static pthread_mutex_t gate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static int gate_closed;
+static fuse_off_t gate_held = -1;       /* held back even when the gate is open */
+
+struct fuse3_context *fuse3_get_context(void)
+{
+    return &context;
+}
+
+/* tasks run on threads of their own, unless refused */
+struct pool_task
+{
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+static void *pool_thread(void *arg)
+{
+    struct pool_task task = *(struct pool_task *)arg;
+
+    free(arg);
+    task.fn(task.arg);
+    return 0;
+}
+
+int cygfuse_pool_submit(void (*fn)(void *arg), void *arg)
+{
+    struct pool_task *task;
+    pthread_t thread;
+
+    if (pool_refuse)
+        return 0;
+    task = malloc(sizeof *task);
+    if (0 == task)
+        return 0;
+    task->fn = fn;
+    task->arg = arg;
+    if (0 != pthread_create(&thread, 0, pool_thread, task))
+    {
+        free(task);
+        return 0;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+
+static void gate(int closed, fuse_off_t held)
+{
+    pthread_mutex_lock(&gate_mutex);
+    gate_closed = closed;
+    gate_held = held;
+    pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&gate_mutex);
+}
+
+static unsigned count(unsigned *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+/* until the reads in progress are done */
+static void settle(void)
+{
+    for (int i = 0; 5000 > i && 0 != count(&reading); i++)
+        usleep(1000);
+    usleep(10000);
+}
+
+/*
+ * One file of FILESIZE bytes, whose reads ahead are held back while the gate
+ * is closed, and one directory of ENTRIES files "fN" of size N listed without
+ * stats, and a file "s" listed with them.
+ */
+static int mem_getattr(const char *path, struct fuse_stat *stbuf, struct fuse3_file_info *fi)
+{
+    __atomic_add_fetch(&calls_getattr, 1, __ATOMIC_RELAXED);
+    if (!pthread_equal(main_thread, pthread_self()))
+        __atomic_add_fetch(&calls_getattr_elsewhere, 1, __ATOMIC_RELAXED);
+
+    memset(stbuf, 0, sizeof *stbuf);
+    if (0 == strcmp(path, "/dir"))
+    {
+        stbuf->st_mode = S_IFDIR | 0755;
+        return 0;
+    }
+    if (0 != strncmp(path, "/dir/f", 6))
+        return -ENOENT;
+    stbuf->st_mode = S_IFREG | 0644;
+    stbuf->st_size = atoi(path + 6);
+    return 0;
+}
+
+static int mem_readdir(const char *path, void *buf, fuse3_fill_dir_t filler, fuse_off_t off,
+    struct fuse3_file_info *fi, enum fuse3_readdir_flags flags)
+{
+    struct fuse_stat stbuf;
+    char name[16];
+    fuse_off_t n = 0;
+
+    if (0 != strcmp(path, "/dir"))
+        return -ENOENT;
+
+    /* with offsets, the entries from off on */
+    if (filler(buf, ".", 0, readdir_offsets ? ++n : 0, 0) ||
+        filler(buf, "..", 0, readdir_offsets ? ++n : 0, 0))
+        return 0;
+    for (int i = 0; ENTRIES > i; i++)
+    {
+        snprintf(name, sizeof name, "f%d", i);
+        if (filler(buf, name, 0, readdir_offsets ? ++n : 0, 0))
+            return 0;
+    }
+    memset(&stbuf, 0, sizeof stbuf);
+    stbuf.st_mode = S_IFREG | 0644;
+    stbuf.st_size = 4242;
+    filler(buf, "s", &stbuf, readdir_offsets ? ++n : 0, FUSE_FILL_DIR_PLUS);
+    return 0;
+}
+
+static int mem_open(const char *path, struct fuse3_file_info *fi)
+{
+    fi->fh = __atomic_add_fetch(&fhs, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int mem_read(const char *path, char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    __atomic_add_fetch(&calls_read, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&reading, 1, __ATOMIC_ACQ_REL);
+    if (!pthread_equal(main_thread, pthread_self()))
+    {
+        pthread_mutex_lock(&gate_mutex);
+        while (gate_closed || gate_held == off)
+            pthread_cond_wait(&gate_cond, &gate_mutex);
+        pthread_mutex_unlock(&gate_mutex);
+    }
+
+    if (FILESIZE <= off)
+        size = 0;
+    else if (FILESIZE - off < (fuse_off_t)size)
+        size = (size_t)(FILESIZE - off);
+    memcpy(buf, data + off, size);
+
+    __atomic_sub_fetch(&reading, 1, __ATOMIC_ACQ_REL);
+    return (int)size;
+}
+
+static int mem_write(const char *path, const char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    memcpy(data + off, buf, size);
+    return (int)size;
+}
+
+static int mem_release(const char *path, struct fuse3_file_info *fi)
+{
+    __atomic_add_fetch(&calls_release, 1, __ATOMIC_RELAXED);
+    reading_at_release = count(&reading);
+    return 0;
+}
+
+static const struct fuse3_operations mem_ops =
+{
+    .getattr = mem_getattr,
+    .readdir = mem_readdir,
+    .open = mem_open,
+    .read = mem_read,
+    .write = mem_write,
+    .release = mem_release,
+};
+
+static struct fuse3_operations ops;
+static char buf[FILESIZE];
+
+static uint32_t lcg(uint64_t *state)
+{
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (uint32_t)(*state >> 33);
+}
+
+static void test_sequential(void)
+{
+    struct fuse3_file_info fi;
+    unsigned reads = 0;
+
+    memset(&fi, 0, sizeof fi);
+    CHECK(0 == ops.open("/file", &fi));
+    calls_read = 0;
+    for (fuse_off_t off = 0; FILESIZE > off; off += READSIZE, reads++)
+    {
+        CHECK(READSIZE == ops.read("/file", buf, READSIZE, off, &fi));
+        CHECK(0 == memcmp(buf, data + off, READSIZE));
+    }
+    CHECK(0 == ops.read("/file", buf, READSIZE, FILESIZE, &fi));
+    settle();
+
+    /* read in chunks ahead of the reads, and not much past the end */
+    CHECK(reads > count(&calls_read));
+    CHECK(1 + FILESIZE / CYGFUSE_READAHEAD_CHUNK + CYGFUSE_READAHEAD_MAX / CYGFUSE_READAHEAD_CHUNK >=
+        count(&calls_read));
+    CHECK(0 == ops.release("/file", &fi));
+}
+
+static void test_random(void)
+{
+    struct fuse3_file_info fi;
+    uint64_t state = 1;
+    fuse_off_t off, next = 0;
+    unsigned reads = 0;
+
+    memset(&fi, 0, sizeof fi);
+    CHECK(0 == ops.open("/file", &fi));
+    calls_read = 0;
+    for (; 1000 > reads; reads++)
+    {
+        off = (fuse_off_t)(1 + lcg(&state) % (FILESIZE / 4096 - 2)) * 4096;
+        if (next == off)
+            off -= 4096;
+        CHECK(4096 == ops.read("/file", buf, 4096, off, &fi));
+        CHECK(0 == memcmp(buf, data + off, 4096));
+        next = off + 4096;
+    }
+    settle();
+
+    /* nothing read ahead */
+    CHECK(reads == count(&calls_read));
+    CHECK(0 == ops.release("/file", &fi));
+}
+
+/* a write through another handle discards what was read ahead of it */
+static void test_write(void)
+{
+    struct fuse3_file_info fi, wfi;
+    fuse_off_t off;
+    unsigned calls;
+
+    memset(&fi, 0, sizeof fi);
+    CHECK(0 == ops.open("/file", &fi));
+    memset(&wfi, 0, sizeof wfi);
+    wfi.flags = O_WRONLY;
+    CHECK(0 == ops.open("/file", &wfi));
+
+    for (off = 0; 4 * READSIZE > off; off += READSIZE)
+        CHECK(READSIZE == ops.read("/file", buf, READSIZE, off, &fi));
+    settle();
+
+    calls = count(&calls_read);
+    memset(buf, 0x5a, READSIZE);
+    CHECK(READSIZE == ops.write("/file", buf, READSIZE, 6 * READSIZE, &wfi));
+    CHECK(0x5a == data[6 * READSIZE]);
+
+    for (; 16 * READSIZE > off; off += READSIZE)
+    {
+        CHECK(READSIZE == ops.read("/file", buf, READSIZE, off, &fi));
+        CHECK(0 == memcmp(buf, data + off, READSIZE));
+    }
+    CHECK(calls < count(&calls_read));
+
+    CHECK(0 == ops.release("/file", &wfi));
+    CHECK(0 == ops.release("/file", &fi));
+    settle();
+}
+
+/* data read ahead that is discarded while it is read is freed by its task */
+static void test_orphans(void)
+{
+    struct fuse3_file_info fi;
+    fuse_off_t off = 0;
+    unsigned calls;
+
+    memset(&fi, 0, sizeof fi);
+    CHECK(0 == ops.open("/file", &fi));
+
+    /* a random read orphans the slot that the sequential read before it started; slots wrap */
+    gate(1, -1);
+    for (int i = 0; ORPHANS > i; i++)
+    {
+        /* all different, and away from what is read ahead, which would be sequential */
+        off = (fuse_off_t)(1 + i * 37 % (FILESIZE / 4096 - 64)) * 4096;
+        CHECK(4096 == ops.read("/file", buf, 4096, off, &fi));
+        CHECK(4096 == ops.read("/file", buf, 4096, off + 4096, &fi));
+    }
+    for (int i = 0; 5000 > i && ORPHANS > count(&reading); i++)
+        usleep(1000);
+    CHECK(ORPHANS == count(&reading));
+    CHECK(0 != cygfuse_budget_used());
+
+    /* the orphans first, so that the one whose slot was reused finds it pending */
+    gate(0, off + 8192);
+    for (int i = 0; 5000 > i && 1 < count(&reading); i++)
+        usleep(1000);
+    CHECK(1 == count(&reading));
+    gate(0, -1);
+    settle();
+
+    /* served from what the last task read */
+    calls = count(&calls_read);
+    CHECK(READSIZE == ops.read("/file", buf, READSIZE, off + 8192, &fi));
+    CHECK(0 == memcmp(buf, data + off + 8192, READSIZE));
+    CHECK(calls == count(&calls_read));
+
+    CHECK(0 == ops.release("/file", &fi));
+    settle();
+    CHECK(0 == cygfuse_budget_used());
+}
+
+static void *release_thread(void *arg)
+{
+    struct fuse3_file_info *fi = arg;
+
+    ops.release("/file", fi);
+    return 0;
+}
+
+/* the file system's release is called once the reads ahead in progress are done */
+static void test_release(void)
+{
+    struct fuse3_file_info fi;
+    pthread_t thread;
+    unsigned calls;
+
+    memset(&fi, 0, sizeof fi);
+    CHECK(0 == ops.open("/file", &fi));
+
+    gate(1, -1);
+    CHECK(READSIZE == ops.read("/file", buf, READSIZE, 0, &fi));
+    for (int i = 0; 5000 > i && 0 == count(&reading); i++)
+        usleep(1000);
+    CHECK(0 != count(&reading));
+
+    calls = count(&calls_release);
+    pthread_create(&thread, 0, release_thread, &fi);
+    usleep(100000);
+    CHECK(calls == count(&calls_release));
+    gate(0, -1);
+    pthread_join(thread, 0);
+    CHECK(calls + 1 == count(&calls_release));
+    CHECK(0 == reading_at_release);
+    CHECK(0 == cygfuse_budget_used());
+}
+
+struct listing
+{
+    unsigned count;
+    struct
+    {
+        char name[16];
+        int hasstat;
+        fuse_off_t size, off;
+        enum fuse3_fill_dir_flags flags;
+    } entries[ENTRIES + 3];
+};
+
+static int list_filler(void *buf, const char *name, const struct fuse_stat *stbuf, fuse_off_t off,
+    enum fuse3_fill_dir_flags flags)
+{
+    struct listing *listing = buf;
+
+    if (ENTRIES + 3 == listing->count)
+        return 1;
+    snprintf(listing->entries[listing->count].name, sizeof listing->entries[0].name, "%s", name);
+    listing->entries[listing->count].hasstat = 0 != stbuf;
+    listing->entries[listing->count].size = 0 != stbuf ? stbuf->st_size : -1;
+    listing->entries[listing->count].off = off;
+    listing->entries[listing->count].flags = flags;
+    listing->count++;
+    return 0;
+}
+
+static void check_listing(struct listing *listing, int plus)
+{
+    char name[16];
+
+    CHECK(ENTRIES + 3 == listing->count);
+    if (ENTRIES + 3 != listing->count)
+        return;
+    CHECK(0 == strcmp(".", listing->entries[0].name) && !listing->entries[0].hasstat);
+    CHECK(0 == strcmp("..", listing->entries[1].name) && !listing->entries[1].hasstat);
+    CHECK(!(listing->entries[0].flags & FUSE_FILL_DIR_PLUS));
+    for (int i = 0; ENTRIES > i; i++)
+    {
+        snprintf(name, sizeof name, "f%d", i);
+        CHECK(0 == strcmp(name, listing->entries[2 + i].name));
+        if (plus)
+        {
+            CHECK(listing->entries[2 + i].hasstat && i == listing->entries[2 + i].size);
+            CHECK(listing->entries[2 + i].flags & FUSE_FILL_DIR_PLUS);
+        }
+        else
+            CHECK(!listing->entries[2 + i].hasstat);
+    }
+    CHECK(0 == strcmp("s", listing->entries[ENTRIES + 2].name));
+    CHECK(4242 == listing->entries[ENTRIES + 2].size);
+    CHECK(listing->entries[ENTRIES + 2].flags & FUSE_FILL_DIR_PLUS);
+}
+
+static void test_readdir(void)
+{
+    struct listing listing;
+
+    /* stats of all entries but ".", ".." and those listed with them */
+    memset(&listing, 0, sizeof listing);
+    calls_getattr = calls_getattr_elsewhere = 0;
+    CHECK(0 == ops.readdir("/dir", &listing, list_filler, 0, 0, FUSE_READDIR_PLUS));
+    check_listing(&listing, 1);
+    CHECK(ENTRIES == count(&calls_getattr));
+
+    /* without FUSE_READDIR_PLUS */
+    memset(&listing, 0, sizeof listing);
+    calls_getattr = 0;
+    CHECK(0 == ops.readdir("/dir", &listing, list_filler, 0, 0, 0));
+    check_listing(&listing, 0);
+    CHECK(0 == count(&calls_getattr));
+
+    /* in pieces */
+    memset(&listing, 0, sizeof listing);
+    readdir_offsets = 1;
+    CHECK(0 == ops.readdir("/dir", &listing, list_filler, 0, 0, FUSE_READDIR_PLUS));
+    readdir_offsets = 0;
+    check_listing(&listing, 0);
+    CHECK(ENTRIES + 3 == listing.entries[ENTRIES + 2].off);
+    CHECK(0 == count(&calls_getattr));
+
+    /* the calling thread does it all */
+    memset(&listing, 0, sizeof listing);
+    calls_getattr = calls_getattr_elsewhere = 0;
+    pool_refuse = 1;
+    CHECK(0 == ops.readdir("/dir", &listing, list_filler, 0, 0, FUSE_READDIR_PLUS));
+    pool_refuse = 0;
+    check_listing(&listing, 1);
+    CHECK(ENTRIES == count(&calls_getattr));
+    CHECK(0 == count(&calls_getattr_elsewhere));
+}
+
+int main(int argc, char *argv[])
+{
+    main_thread = pthread_self();
+    for (size_t i = 0; FILESIZE > i; i++)
+        data[i] = (char)((i * 31) >> 9 ^ i);
+
+    /* not enabled */
+    unsetenv(CYGFUSE_PREFETCH_ENV);
+    CHECK(!cygfuse_prefetch_init());
+
+    setenv(CYGFUSE_PREFETCH_ENV, "read,readdir", 1);
+    CHECK(cygfuse_prefetch_init());
+    ops = mem_ops;
+    cygfuse_prefetch_install(&ops, &mem_ops, &ops);
+
+    test_sequential();
+    test_random();
+    test_write();
+    test_orphans();
+    test_release();
+    test_readdir();
+
+    if (0 != failures)
+    {
+        fprintf(stderr, "cygfuse-test-prefetch: %d failures\n", failures);
+        return 1;
+    }
+    printf("cygfuse-test-prefetch: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,114 @@
+/**
+ * @file fuse3/cygfuse-test-record.c
+ * Test of the flight recorder in cygfuse-record.c.
+ *
+ * Several threads record operations whose fields are all derived from a
+ * single counter while the main thread keeps dumping the rings; every
+ * dumped entry must be self-consistent (no torn entries), and each ring
+ * must hold the last CYGFUSE_RECORD_ENTRIES operations of its thread.
+ * Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define THREADS                         4
+#define CALLS                           200000
+
+static const char *const names[] = { "read", "write" };
+static pthread_barrier_t barrier;
+
+static void *worker(void *arg)
+{
+    struct cygfuse_record_entry *entry;
+
+    (void)arg;
+    for (uint64_t i = 1; CALLS >= i; i++)
+    {
+        entry = cygfuse_record_begin(i & 1, "/file", i, i * 2, (int64_t)i * 3, i * 4);
+        cygfuse_record_end(entry, -(int)(i & 0xff), i * 4 + 1, i);
+    }
+
+    /* a thread that exits early would leave its ring to a thread that starts late */
+    pthread_barrier_wait(&barrier);
+
+    return 0;
+}
+
+static void check_dump(int final)
+{
+    char buf[256], op[16];
+    unsigned tid;
+    unsigned long long hash, fh, size;
+    long long offset;
+    double start, duration;
+    int result, lines = 0;
+    FILE *file;
+
+    file = tmpfile();
+    cygfuse_record_dump(file);
+    rewind(file);
+    while (0 != fgets(buf, sizeof buf, file))
+    {
+        if ('#' == buf[0])
+            continue;
+        if (9 != sscanf(buf, "%u %15s %llx %llx %llu %lld %lf %lf %d",
+            &tid, op, &hash, &fh, &size, &offset, &start, &duration, &result))
+        {
+            /* an operation may be in flight in a non-final dump */
+            CHECK(!final);
+            continue;
+        }
+        CHECK(cygfuse_record_hash("/file") == hash);
+        CHECK(0 == strcmp(names[fh & 1], op));
+        CHECK(fh * 2 == size);
+        CHECK((long long)fh * 3 == offset);
+        CHECK(-(int)(fh & 0xff) == result);
+        CHECK(!final || CALLS - CYGFUSE_RECORD_ENTRIES < fh);
+        lines++;
+    }
+    fclose(file);
+
+    if (final)
+        CHECK(THREADS * CYGFUSE_RECORD_ENTRIES == lines);
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t thread[THREADS];
+
+    setenv(CYGFUSE_RECORD_ENV, "/dev/null", 1);
+    if (!cygfuse_record_init(names, 2))
+    {
+        fprintf(stderr, "cannot initialize recorder\n");
+        return 1;
+    }
+
+    pthread_barrier_init(&barrier, 0, THREADS);
+    for (int t = 0; THREADS > t; t++)
+        pthread_create(&thread[t], 0, worker, 0);
+    for (int i = 0; 20 > i && 0 == failures; i++)
+        check_dump(0);
+    for (int t = 0; THREADS > t; t++)
+        pthread_join(thread[t], 0);
+    pthread_barrier_destroy(&barrier);
+    check_dump(1);
+
+    if (0 == failures)
+        printf("cygfuse-test-record: all tests passed\n");
+    return !!failures;
+}
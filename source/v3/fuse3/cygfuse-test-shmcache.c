@@ -0,0 +1,385 @@
+/**
+ * @file fuse3/cygfuse-test-shmcache.c
+ * Test of the shared memory block cache in cygfuse-shmcache.c.
+ *
+ * Several processes attach to one segment by name. Checks that blocks
+ * put by one process are seen by the others and that removals are seen
+ * as well; that a segment is private to its user unless it is given to a
+ * group; that readers never see a block that is half written while
+ * other processes keep replacing it; and that a file system under the
+ * block cache with only shared memory enabled is served the blocks read
+ * by a file system in another process, unless the file has changed.
+ * Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define BLOCKSIZE                       4096
+#define PROCESSES                       4
+#define BLOCKS                          16
+#define FILESIZE                        (3 * CYGFUSE_BLOCKCACHE_BLOCK + 1000)
+
+static char segname[64], fsname[64];
+static volatile unsigned *barrier;
+static char *file_data;
+static time_t file_mtime = 1000000000;
+static unsigned calls_read;
+
+static void fill(char *p, size_t size, unsigned seed)
+{
+    for (size_t i = 0; size > i; i++)
+        p[i] = (char)((i * 31 + seed) >> 3);
+}
+
+static int uniform(const char *p, size_t size)
+{
+    for (size_t i = 1; size > i; i++)
+        if (p[i] != p[0])
+            return 0;
+    return 1;
+}
+
+/* waits until all processes have arrived */
+static void wait_barrier(unsigned count)
+{
+    __atomic_add_fetch(barrier, 1, __ATOMIC_SEQ_CST);
+    while (count > __atomic_load_n(barrier, __ATOMIC_SEQ_CST))
+        sched_yield();
+}
+
+/* waits for the children; each counts its own failures and exits with their number */
+static void wait_children(unsigned count)
+{
+    int status;
+
+    for (unsigned i = 0; count > i; i++)
+    {
+        if (-1 == wait(&status) || !WIFEXITED(status))
+        {
+            failures++;
+            continue;
+        }
+        failures += WEXITSTATUS(status);
+    }
+}
+
+static void exchange_child(unsigned id)
+{
+    struct cygfuse_shmcache cache;
+    char data[BLOCKSIZE], buf[BLOCKSIZE];
+
+    failures = 0;
+
+    CHECK(cygfuse_shmcache_attach(&cache, segname, 4 * 1024 * 1024, BLOCKSIZE, (gid_t)-1));
+    if (0 == cache.header)
+        exit(failures);
+
+    for (unsigned i = 0; BLOCKS > i; i++)
+    {
+        fill(data, BLOCKSIZE, id * 100 + i);
+        cygfuse_shmcache_put(&cache, ((uint64_t)id + 1) << 32 | i, id * 100 + i, data, BLOCKSIZE);
+    }
+
+    wait_barrier(PROCESSES);
+
+    for (unsigned other = 0; PROCESSES > other; other++)
+        for (unsigned i = 0; BLOCKS > i; i++)
+        {
+            fill(data, BLOCKSIZE, other * 100 + i);
+            CHECK(100 == cygfuse_shmcache_get(&cache,
+                ((uint64_t)other + 1) << 32 | i, other * 100 + i, buf, 1000, 100));
+            CHECK(0 == memcmp(buf, data + 1000, 100));
+
+            /* the check must match as well */
+            CHECK(-1 == cygfuse_shmcache_get(&cache,
+                ((uint64_t)other + 1) << 32 | i, other * 100 + i + 1, buf, 0, 100));
+        }
+
+    cygfuse_shmcache_detach(&cache);
+    exit(failures);
+}
+
+/* writers keep replacing blocks of one set, readers check that the blocks they get are whole */
+static void stress_child(unsigned id)
+{
+    struct cygfuse_shmcache cache;
+    char buf[BLOCKSIZE];
+    struct timespec t0, t1;
+    unsigned long gets = 0;
+    uint64_t name;
+
+    failures = 0;
+
+    /* one set only, which is smaller than the names used */
+    CHECK(cygfuse_shmcache_attach(&cache, segname, 0, BLOCKSIZE, (gid_t)-1));
+    if (0 == cache.header)
+        exit(failures);
+
+    wait_barrier(PROCESSES);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (unsigned long i = 0;; i++)
+    {
+        name = 1 + i % (2 * CYGFUSE_SHMCACHE_WAYS);
+        if (id & 1)
+        {
+            memset(buf, (int)(i * 7 + id), BLOCKSIZE);
+            cygfuse_shmcache_put(&cache, name, 1, buf, BLOCKSIZE);
+        }
+        else if (BLOCKSIZE == cygfuse_shmcache_get(&cache, name, 1, buf, 0, BLOCKSIZE))
+        {
+            CHECK(uniform(buf, BLOCKSIZE));
+            gets++;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (500000000L < (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec))
+            break;
+    }
+    CHECK((id & 1) || 0 != gets);
+
+    cygfuse_shmcache_detach(&cache);
+    exit(failures);
+}
+
+/* "/file" in memory */
+static int mem_getattr(const char *path, struct fuse_stat *stbuf, struct fuse3_file_info *fi)
+{
+    memset(stbuf, 0, sizeof *stbuf);
+    if (0 == strcmp(path, "/"))
+    {
+        stbuf->st_mode = S_IFDIR | 0755;
+        return 0;
+    }
+    if (0 != strcmp(path, "/file"))
+        return -ENOENT;
+    stbuf->st_mode = S_IFREG | 0644;
+    stbuf->st_size = FILESIZE;
+    stbuf->st_mtim.tv_sec = file_mtime;
+    return 0;
+}
+
+static int mem_open(const char *path, struct fuse3_file_info *fi)
+{
+    return 0 == strcmp(path, "/file") ? 0 : -ENOENT;
+}
+
+static int mem_read(const char *path, char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    calls_read++;
+    if (0 != strcmp(path, "/file"))
+        return -ENOENT;
+    if (FILESIZE <= off)
+        return 0;
+    if (FILESIZE - (size_t)off < size)
+        size = FILESIZE - (size_t)off;
+    memcpy(buf, file_data + off, size);
+    return (int)size;
+}
+
+static const struct fuse3_operations mem_ops =
+{
+    .getattr = mem_getattr,
+    .open = mem_open,
+    .read = mem_read,
+};
+
+/* reads "/file" through the block cache in a new process; returns the number of reads of the file system */
+static int fs_child(int change)
+{
+    struct fuse3_operations ops;
+    struct fuse3_file_info fi;
+    struct fuse_stat stbuf;
+    char *buf = malloc(FILESIZE);
+    size_t off = 0;
+    int result;
+
+    failures = 0;
+
+    if (change)
+    {
+        fill(file_data, FILESIZE, 3);
+        file_mtime++;
+    }
+
+    memset(&ops, 0, sizeof ops);
+    CHECK(cygfuse_blockcache_init());
+    ops = mem_ops;
+    cygfuse_blockcache_install(&ops, &mem_ops);
+
+    memset(&fi, 0, sizeof fi);
+    CHECK(0 == ops.open("/file", &fi));
+    CHECK(0 == ops.getattr("/file", &stbuf, &fi));
+    while (FILESIZE > off)
+    {
+        result = ops.read("/file", buf + off, 50000 < FILESIZE - off ? 50000 : FILESIZE - off,
+            (fuse_off_t)off, &fi);
+        if (0 >= result)
+            break;
+        off += (size_t)result;
+    }
+    CHECK(FILESIZE == off);
+    CHECK(0 == memcmp(buf, file_data, FILESIZE));
+
+    cygfuse_blockcache_fini();
+    free(buf);
+
+    if (0 != failures)
+        exit(100);
+    exit(0 != calls_read ? 1 : 0);
+}
+
+/* the permissions and group of a segment */
+static mode_t segment_mode(const char *name, gid_t *group)
+{
+    char path[256];
+    struct stat st;
+    int fd;
+
+    *group = (gid_t)-1;
+    snprintf(path, sizeof path, "/cygfuse-%s", name);
+    fd = shm_open(path, O_RDONLY, 0);
+    if (-1 == fd)
+        return (mode_t)-1;
+    if (0 != fstat(fd, &st))
+    {
+        close(fd);
+        return (mode_t)-1;
+    }
+    close(fd);
+    *group = st.st_gid;
+    return st.st_mode & 0777;
+}
+
+static int fs_run(int change)
+{
+    int status;
+    pid_t pid = fork();
+
+    if (0 == pid)
+        fs_child(change);
+    if (-1 == pid || -1 == waitpid(pid, &status, 0) || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+int main(int argc, char *argv[])
+{
+    struct cygfuse_shmcache cache;
+    char data[BLOCKSIZE], buf[BLOCKSIZE];
+    gid_t group;
+    pid_t pid;
+    int status;
+
+    snprintf(segname, sizeof segname, "test-%ld", (long)getpid());
+    snprintf(fsname, sizeof fsname, "test-fs-%ld", (long)getpid());
+    barrier = mmap(0, sizeof *barrier, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == barrier)
+    {
+        fprintf(stderr, "cannot map shared memory\n");
+        return 1;
+    }
+
+    /* blocks put by each process are seen by all */
+    *barrier = 0;
+    for (unsigned id = 0; PROCESSES > id; id++)
+        if (0 == fork())
+            exchange_child(id);
+    wait_children(PROCESSES);
+
+    /* a different block size is refused */
+    CHECK(!cygfuse_shmcache_attach(&cache, segname, 4 * 1024 * 1024, 2 * BLOCKSIZE, (gid_t)-1));
+
+    /* removals are seen by all */
+    CHECK(cygfuse_shmcache_attach(&cache, segname, 4 * 1024 * 1024, BLOCKSIZE, (gid_t)-1));
+    fill(data, BLOCKSIZE, 5);
+    cygfuse_shmcache_put(&cache, 42, 5, data, BLOCKSIZE);
+    CHECK(BLOCKSIZE == cygfuse_shmcache_get(&cache, 42, 5, buf, 0, BLOCKSIZE));
+    CHECK(0 == memcmp(buf, data, BLOCKSIZE));
+    pid = fork();
+    if (0 == pid)
+    {
+        struct cygfuse_shmcache other;
+        failures = 0;
+        CHECK(cygfuse_shmcache_attach(&other, segname, 0, BLOCKSIZE, (gid_t)-1));
+        cygfuse_shmcache_remove(&other, 42);
+        cygfuse_shmcache_detach(&other);
+        exit(failures);
+    }
+    CHECK(-1 != waitpid(pid, &status, 0) && WIFEXITED(status) && 0 == WEXITSTATUS(status));
+    CHECK(-1 == cygfuse_shmcache_get(&cache, 42, 5, buf, 0, BLOCKSIZE));
+
+    /* reads past the end of a block miss */
+    cygfuse_shmcache_put(&cache, 43, 5, data, 1000);
+    CHECK(-1 == cygfuse_shmcache_get(&cache, 43, 5, buf, 900, 200));
+    CHECK(100 == cygfuse_shmcache_get(&cache, 43, 5, buf, 900, 100));
+    cygfuse_shmcache_detach(&cache);
+    CHECK(0600 == segment_mode(segname, &group));
+    CHECK(cygfuse_shmcache_unlink(segname));
+
+    /* a segment given to a group can be attached by its members */
+    umask(022);
+    CHECK(cygfuse_shmcache_attach(&cache, segname, 4 * 1024 * 1024, BLOCKSIZE, getegid()));
+    cygfuse_shmcache_detach(&cache);
+    CHECK(0660 == segment_mode(segname, &group));
+    CHECK(getegid() == group);
+    CHECK(cygfuse_shmcache_unlink(segname));
+
+    /* blocks are never seen half written */
+    *barrier = 0;
+    for (unsigned id = 0; PROCESSES > id; id++)
+        if (0 == fork())
+            stress_child(id);
+    wait_children(PROCESSES);
+    CHECK(cygfuse_shmcache_unlink(segname));
+
+    /* file systems in different processes share the blocks of unchanged files */
+    file_data = malloc(FILESIZE);
+    fill(file_data, FILESIZE, 1);
+    unsetenv(CYGFUSE_BLOCKCACHE_ENV);
+    setenv(CYGFUSE_SHMCACHE_ENV, fsname, 1);
+    setenv(CYGFUSE_SHMCACHE_SIZE_ENV, "4", 1);
+    CHECK(1 == fs_run(0));
+    CHECK(0 == fs_run(0));
+    CHECK(1 == fs_run(1));
+    CHECK(0 == fs_run(0));
+    CHECK(cygfuse_shmcache_unlink(fsname));
+    free(file_data);
+
+    munmap((void *)barrier, sizeof *barrier);
+
+    if (0 != failures)
+    {
+        fprintf(stderr, "cygfuse-test-shmcache: %d failures\n", failures);
+        return 1;
+    }
+    printf("cygfuse-test-shmcache: all tests passed\n");
+    return 0;
+}
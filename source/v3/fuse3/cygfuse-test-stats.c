@@ -0,0 +1,118 @@
+/**
+ * @file fuse3/cygfuse-test-stats.c
+ * Test of the call counters and latency histograms in cygfuse-stats.c.
+ *
+ * Checks the log-linear bucket mapping, then records from several rounds
+ * of threads (later rounds reuse the shards of exited threads) and checks
+ * that the merged counters add up and that the dump lists every entry.
+ * Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define THREADS                         8
+#define ROUNDS                          4
+#define CALLS                           10000
+
+static const char *const names[] = { "alpha", "beta", "gamma" };
+static struct cygfuse_stats stats = CYGFUSE_STATS_INIT("test", names);
+
+static void test_buckets(void)
+{
+    unsigned prev = 0;
+
+    for (uint64_t ns = 0; 1000000 > ns; ns++)
+    {
+        unsigned b = cygfuse_hist_bucket(ns);
+        CHECK(prev == b || prev + 1 == b);
+        CHECK(ns <= cygfuse_hist_upper(b));
+        CHECK(0 == b || ns > cygfuse_hist_upper(b - 1));
+        CHECK(cygfuse_hist_upper(b) - ns <= ns / 4);
+        prev = b;
+        if (0 != failures)
+            return;
+    }
+
+    CHECK(CYGFUSE_HIST_BUCKETS - 1 == cygfuse_hist_bucket(~(uint64_t)0));
+    CHECK(CYGFUSE_HIST_BUCKETS - 1 == cygfuse_hist_bucket((uint64_t)1 << 62));
+}
+
+static void *worker(void *arg)
+{
+    size_t index = (size_t)arg;
+
+    for (int i = 0; CALLS > i; i++)
+        cygfuse_stats_record(&stats, index % 3, (uint64_t)i, 0 == i % 10);
+
+    return 0;
+}
+
+static void test_shards(void)
+{
+    pthread_t thread[THREADS];
+    struct cygfuse_stat stat;
+    uint64_t count = 0, expect[3] = { 0 };
+    char buf[4096];
+    FILE *file;
+
+    for (int r = 0; ROUNDS > r; r++)
+    {
+        for (size_t t = 0; THREADS > t; t++)
+        {
+            pthread_create(&thread[t], 0, worker, (void *)t);
+            expect[t % 3] += CALLS;
+        }
+        for (size_t t = 0; THREADS > t; t++)
+            pthread_join(thread[t], 0);
+    }
+
+    for (size_t i = 0; 3 > i; i++)
+    {
+        cygfuse_stats_merge(&stats, i, &stat);
+        CHECK(expect[i] == stat.count);
+        CHECK(expect[i] / 10 == stat.errors);
+        CHECK(expect[i] / CALLS * ((uint64_t)CALLS * (CALLS - 1) / 2) == stat.sum);
+        count = 0;
+        for (unsigned b = 0; CYGFUSE_HIST_BUCKETS > b; b++)
+            count += stat.hist[b];
+        CHECK(stat.count == count);
+    }
+
+    count = 0;
+    file = tmpfile();
+    cygfuse_stats_dump(&stats, file);
+    rewind(file);
+    while (0 != fgets(buf, sizeof buf, file))
+        for (size_t i = 0; 3 > i; i++)
+            if (0 == strncmp(buf, names[i], strlen(names[i])))
+                count++;
+    fclose(file);
+    CHECK(3 == count);
+}
+
+int main(int argc, char *argv[])
+{
+    cygfuse_stats_register(&stats);
+
+    test_buckets();
+    test_shards();
+
+    if (0 == failures)
+        printf("cygfuse-test-stats: all tests passed\n");
+    return !!failures;
+}
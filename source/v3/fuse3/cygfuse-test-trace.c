@@ -0,0 +1,106 @@
+/**
+ * @file fuse3/cygfuse-test-trace.c
+ * Test of the Chrome trace export in cygfuse-trace.c.
+ *
+ * Several threads emit spans while the background writer drains them;
+ * after shutdown every span must have been either written or counted as
+ * dropped, paths must be escaped, and the trace must be a closed JSON
+ * array. Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define THREADS                         4
+#define CALLS                           50000
+
+static const char *const names[] = { "getattr", "read" };
+
+static void *worker(void *arg)
+{
+    (void)arg;
+    for (int i = 0; CALLS > i; i++)
+    {
+        uint64_t start = cygfuse_now();
+        cygfuse_trace_span(i & 1, "/dir/\"q\"\\\n", -i, start, start + 1000);
+        if (0 == i % 64)
+            usleep(1000);
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t thread[THREADS];
+    char path[] = "/tmp/cygfuse-test-trace.XXXXXX";
+    char buf[512], last[512] = "";
+    unsigned long long spans = 0, dropped = ~0ULL, escaped = 0, threads = 0;
+    FILE *file;
+    int fd;
+
+    fd = mkstemp(path);
+    if (-1 == fd)
+    {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    setenv(CYGFUSE_TRACE_ENV, path, 1);
+    if (!cygfuse_trace_init(names, 2))
+    {
+        fprintf(stderr, "cannot initialize trace\n");
+        return 1;
+    }
+
+    for (int t = 0; THREADS > t; t++)
+        pthread_create(&thread[t], 0, worker, 0);
+    for (int t = 0; THREADS > t; t++)
+        pthread_join(thread[t], 0);
+    cygfuse_trace_fini();
+
+    file = fopen(path, "r");
+    CHECK(0 != file);
+    while (0 != file && 0 != fgets(buf, sizeof buf, file))
+    {
+        if (0 != strstr(buf, "\"ph\":\"X\""))
+        {
+            spans++;
+            if (0 != strstr(buf, "\"path\":\"/dir/\\\"q\\\"\\\\\\u000a\""))
+                escaped++;
+        }
+        else if (0 != strstr(buf, "\"ph\":\"M\""))
+            threads++;
+        else if (0 != strstr(buf, "\"name\":\"dropped\""))
+            sscanf(strstr(buf, "\"events\":"), "\"events\":%llu", &dropped);
+        strcpy(last, buf);
+    }
+    if (0 != file)
+        fclose(file);
+    unlink(path);
+
+    CHECK((unsigned long long)THREADS * CALLS == spans + dropped);
+    CHECK(spans == escaped);
+    CHECK(THREADS == threads);
+    CHECK(0 == strcmp("]\n", last));
+
+    if (0 == failures)
+        printf("cygfuse-test-trace: all tests passed (%llu dropped)\n", dropped);
+    return !!failures;
+}
@@ -0,0 +1,357 @@
+/**
+ * @file fuse3/cygfuse-test-writeback.c
+ * Test of the write-back buffer in cygfuse-writeback.c.
+ *
+ * A file system over a file kept in memory is written through the caching
+ * layer with the write cache enabled. Adjacent and overlapping writes must
+ * reach the file system merged into one; a write after a gap, before the
+ * buffered range or that does not fit must write out what is buffered
+ * first, and a full buffer must be written out at once. An error writing
+ * out the buffer must be returned by the next write, flush or fsync of the
+ * handle, once. Reads through the mount, also through another handle,
+ * must see the writes buffered before them. getattr, which WinFsp calls
+ * after every write, must not write out the buffer but return the size
+ * and modification time the file will have once it is written out, and
+ * these stats must not be cached. Runs on Cygwin and Linux.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+#include "cygfuse-test.h"
+
+#define FILESIZE                        (256 * 1024)
+#define MAXWRITE                        (16 * 1024)
+
+static struct fuse3_context context;
+static char data[FILESIZE];
+static uint64_t fhs;
+static unsigned calls_write;
+static fuse_off_t write_off;            /* of the last write */
+static size_t write_size;
+static int write_error;
+static fuse_off_t file_size;            /* the end of the last byte written */
+static unsigned calls_getattr;
+
+struct fuse3_context *fuse3_get_context(void)
+{
+    return &context;
+}
+
+/* one file of up to FILESIZE bytes; writes fail with write_error while it is set */
+static void *mem_init(struct fuse3_conn_info *conn, struct fuse3_config *conf)
+{
+    return &context;
+}
+
+static int mem_getattr(const char *path, struct fuse_stat *stbuf, struct fuse3_file_info *fi)
+{
+    calls_getattr++;
+    memset(stbuf, 0, sizeof *stbuf);
+    stbuf->st_mode = S_IFREG | 0644;
+    stbuf->st_size = file_size;
+    stbuf->st_mtim.tv_sec = 1;
+    return 0;
+}
+
+static int mem_open(const char *path, struct fuse3_file_info *fi)
+{
+    fi->fh = ++fhs;
+    return 0;
+}
+
+static int mem_read(const char *path, char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    if (FILESIZE <= off)
+        return 0;
+    if (FILESIZE - off < (fuse_off_t)size)
+        size = (size_t)(FILESIZE - off);
+    memcpy(buf, data + off, size);
+    return (int)size;
+}
+
+static int mem_write(const char *path, const char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    calls_write++;
+    write_off = off;
+    write_size = size;
+    if (0 != write_error)
+        return write_error;
+    memcpy(data + off, buf, size);
+    if (file_size < off + (fuse_off_t)size)
+        file_size = off + (fuse_off_t)size;
+    return (int)size;
+}
+
+static const struct fuse3_operations mem_ops =
+{
+    .init = mem_init,
+    .getattr = mem_getattr,
+    .open = mem_open,
+    .read = mem_read,
+    .write = mem_write,
+};
+
+static struct fuse3_operations ops;
+
+static void fill(char *p, size_t size, unsigned seed)
+{
+    for (size_t i = 0; size > i; i++)
+        p[i] = (char)((i * 31 + seed) >> 3);
+}
+
+static void open_file(struct fuse3_file_info *fi)
+{
+    memset(fi, 0, sizeof *fi);
+    fi->flags = O_RDWR;
+    CHECK(0 == ops.open("/file", fi));
+}
+
+static void test_merge(void)
+{
+    struct fuse3_file_info fi;
+    char buf[MAXWRITE];
+
+    fill(buf, sizeof buf, 1);
+    open_file(&fi);
+    calls_write = 0;
+
+    /* adjacent, overlapping and inside */
+    CHECK(1000 == ops.write("/file", buf, 1000, 0, &fi));
+    CHECK(1000 == ops.write("/file", buf + 1000, 1000, 1000, &fi));
+    CHECK(1000 == ops.write("/file", buf + 1500, 1000, 1500, &fi));
+    CHECK(100 == ops.write("/file", buf + 200, 100, 200, &fi));
+    CHECK(0 == calls_write);
+
+    CHECK(0 == ops.flush("/file", &fi));
+    CHECK(1 == calls_write);
+    CHECK(0 == write_off && 2500 == write_size);
+    CHECK(0 == memcmp(data, buf, 2500));
+
+    CHECK(0 == ops.release("/file", &fi));
+    CHECK(1 == calls_write);
+}
+
+static void test_flush(void)
+{
+    struct fuse3_file_info fi;
+    char buf[2 * MAXWRITE];
+
+    fill(buf, sizeof buf, 2);
+    open_file(&fi);
+    calls_write = 0;
+
+    /* a gap after the buffered range */
+    CHECK(100 == ops.write("/file", buf, 100, 0, &fi));
+    CHECK(100 == ops.write("/file", buf, 100, 1000, &fi));
+    CHECK(1 == calls_write);
+    CHECK(0 == write_off && 100 == write_size);
+
+    /* before the buffered range */
+    CHECK(100 == ops.write("/file", buf, 100, 900, &fi));
+    CHECK(2 == calls_write);
+    CHECK(1000 == write_off && 100 == write_size);
+
+    /* does not fit */
+    CHECK(MAXWRITE - 50 == ops.write("/file", buf, MAXWRITE - 50, 1000, &fi));
+    CHECK(3 == calls_write);
+    CHECK(900 == write_off && 100 == write_size);
+
+    /* full: written out at once */
+    CHECK(0 == ops.flush("/file", &fi));
+    calls_write = 0;
+    for (size_t off = 0; MAXWRITE > off; off += 4096)
+        CHECK(4096 == ops.write("/file", buf + off, 4096, 65536 + (fuse_off_t)off, &fi));
+    CHECK(1 == calls_write);
+    CHECK(65536 == write_off && MAXWRITE == write_size);
+    CHECK(0 == memcmp(data + 65536, buf, MAXWRITE));
+
+    /* larger than the buffer: passed through */
+    CHECK(2 * MAXWRITE == ops.write("/file", buf, 2 * MAXWRITE, 131072, &fi));
+    CHECK(2 == calls_write);
+    CHECK(131072 == write_off && 2 * MAXWRITE == write_size);
+
+    CHECK(0 == ops.release("/file", &fi));
+    CHECK(2 == calls_write);
+}
+
+static void test_error(void)
+{
+    struct fuse3_file_info fi;
+    char buf[MAXWRITE];
+
+    fill(buf, sizeof buf, 3);
+    open_file(&fi);
+
+    /* by the next flush, once */
+    CHECK(100 == ops.write("/file", buf, 100, 0, &fi));
+    write_error = -ENOSPC;
+    CHECK(-ENOSPC == ops.flush("/file", &fi));
+    write_error = 0;
+    CHECK(0 == ops.flush("/file", &fi));
+
+    /* by the next fsync */
+    CHECK(100 == ops.write("/file", buf, 100, 0, &fi));
+    write_error = -EIO;
+    CHECK(-EIO == ops.fsync("/file", 0, &fi));
+    write_error = 0;
+    CHECK(0 == ops.fsync("/file", 0, &fi));
+
+    /* by the write that writes out the buffer */
+    CHECK(100 == ops.write("/file", buf, 100, 0, &fi));
+    write_error = -ENOSPC;
+    CHECK(-ENOSPC == ops.write("/file", buf, 100, 5000, &fi));
+    write_error = 0;
+    CHECK(100 == ops.write("/file", buf, 100, 5000, &fi));
+    CHECK(0 == ops.flush("/file", &fi));
+
+    /* a full buffer written out by the write that filled it: by the next write */
+    write_error = -EIO;
+    CHECK(MAXWRITE == ops.write("/file", buf, MAXWRITE, 0, &fi));
+    write_error = 0;
+    CHECK(-EIO == ops.write("/file", buf, 100, 0, &fi));
+    CHECK(100 == ops.write("/file", buf, 100, 0, &fi));
+    CHECK(0 == ops.flush("/file", &fi));
+
+    /* written out for a read: by the next flush */
+    CHECK(100 == ops.write("/file", buf, 100, 0, &fi));
+    write_error = -EIO;
+    CHECK(100 == ops.read("/file", buf, 100, 0, &fi));
+    write_error = 0;
+    CHECK(-EIO == ops.flush("/file", &fi));
+    CHECK(0 == ops.flush("/file", &fi));
+
+    CHECK(0 == ops.release("/file", &fi));
+}
+
+static void test_read(void)
+{
+    struct fuse3_file_info fi, rfi;
+    char buf[1000], rbuf[1000];
+
+    fill(buf, sizeof buf, 4);
+    open_file(&fi);
+    open_file(&rfi);
+    calls_write = 0;
+
+    /* through the handle written */
+    CHECK(1000 == ops.write("/file", buf, 1000, 3000, &fi));
+    CHECK(0 == calls_write);
+    CHECK(1000 == ops.read("/file", rbuf, 1000, 3000, &fi));
+    CHECK(0 == memcmp(rbuf, buf, 1000));
+    CHECK(1 == calls_write);
+
+    /* through another */
+    fill(buf, sizeof buf, 5);
+    CHECK(1000 == ops.write("/file", buf, 1000, 3500, &fi));
+    CHECK(1 == calls_write);
+    CHECK(1000 == ops.read("/file", rbuf, 1000, 3500, &rfi));
+    CHECK(0 == memcmp(rbuf, buf, 1000));
+    CHECK(2 == calls_write);
+
+    CHECK(0 == ops.release("/file", &rfi));
+    CHECK(0 == ops.release("/file", &fi));
+}
+
+static void test_getattr(void)
+{
+    struct fuse3_file_info fi;
+    struct fuse_stat stbuf;
+    char buf[1000];
+    time_t start = time(0);
+
+    fill(buf, sizeof buf, 6);
+    open_file(&fi);
+    CHECK(0 == ops.getattr("/file", &stbuf, &fi));
+    CHECK(200000 > stbuf.st_size);
+    calls_write = 0;
+
+    /* as WinFsp does it: the writes are merged all the same */
+    for (fuse_off_t off = 200000; 204000 > off; off += 1000)
+    {
+        CHECK(1000 == ops.write("/file", buf, 1000, off, &fi));
+        calls_getattr = 0;
+        CHECK(0 == ops.getattr("/file", &stbuf, &fi));
+        CHECK(1 == calls_getattr);
+        CHECK(off + 1000 == stbuf.st_size);
+        CHECK(start <= stbuf.st_mtim.tv_sec);
+    }
+    CHECK(0 == calls_write);
+
+    /* by path, as after the file was written through another handle */
+    calls_getattr = 0;
+    CHECK(0 == ops.getattr("/file", &stbuf, 0));
+    CHECK(1 == calls_getattr);
+    CHECK(204000 == stbuf.st_size);
+
+    /* once written out, the file system has the stats */
+    CHECK(0 == ops.flush("/file", &fi));
+    CHECK(1 == calls_write);
+    CHECK(200000 == write_off && 4000 == write_size);
+    calls_getattr = 0;
+    CHECK(0 == ops.getattr("/file", &stbuf, &fi));
+    CHECK(1 == calls_getattr);
+    CHECK(204000 == stbuf.st_size && 1 == stbuf.st_mtim.tv_sec);
+    CHECK(0 == ops.getattr("/file", &stbuf, &fi));
+    CHECK(1 == calls_getattr);
+
+    CHECK(0 == ops.release("/file", &fi));
+    CHECK(1 == calls_write);
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse3_conn_info conn;
+    struct fuse3_config conf;
+
+    setenv(CYGFUSE_CACHE_ENV, "attr,write", 1);
+    CHECK(cygfuse_cache_init());
+    ops = mem_ops;
+    cygfuse_cache_install(&ops, &mem_ops);
+
+    memset(&conn, 0, sizeof conn);
+    conn.max_write = MAXWRITE;
+    memset(&conf, 0, sizeof conf);
+    conf.attr_timeout = conf.entry_timeout = 60;
+    CHECK(&context == ops.init(&conn, &conf));
+    CHECK(cygfuse_writeback_enabled());
+    CHECK(!(conn.want & FUSE_CAP_WRITEBACK_CACHE));
+
+    test_merge();
+    test_flush();
+    test_error();
+    test_read();
+    test_getattr();
+
+    ops.destroy(&context);
+    cygfuse_cache_invalidate("/file", 0);
+    CHECK(0 == cygfuse_budget_used());
+
+    if (0 != failures)
+    {
+        fprintf(stderr, "cygfuse-test-writeback: %d failures\n", failures);
+        return 1;
+    }
+    printf("cygfuse-test-writeback: all tests passed\n");
+    return 0;
+}
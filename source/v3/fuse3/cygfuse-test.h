@@ -0,0 +1,35 @@
+/**
+ * @file fuse3/cygfuse-test.h
+ * Checks shared between the cygfuse tests.
+ *
+ * A test counts the checks that fail in failures, which a forked child
+ * resets and exits with, and returns nonzero from main if any did.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#ifndef CYGFUSE_TEST_H_INCLUDED
+#define CYGFUSE_TEST_H_INCLUDED
+
+#include <stdio.h>
+
+static int failures;
+
+#define CHECK(cond)                     \
+    do                                  \
+    {                                   \
+        if (!(cond))                    \
+        {                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);\
+            failures++;                 \
+        }                               \
+    } while (0)
+
+#endif
@@ -0,0 +1,315 @@
+/**
+ * @file fuse3/cygfuse-trace.c
+ * Chrome trace export of file system operations.
+ *
+ * Every operation is written as a complete ("X") event of the Chrome
+ * trace event format, with the operation name, thread, path, result,
+ * start time and duration, so that the activity of a mount can be loaded
+ * into chrome://tracing or Perfetto.
+ *
+ * Recording copies the event into a per-thread single producer ring and
+ * never blocks or allocates; if a ring is full the event is dropped and
+ * counted. A background thread drains the rings and formats and writes the
+ * events, periodically or as soon as a ring is half full. It is started
+ * by the first event rather than at initialization, so that it survives
+ * the fork done by fuse_daemonize.
+ *
+ * The trace is enabled by setting the CYGFUSE_TRACE environment variable
+ * to the path of a file. The file is a JSON array that is closed at exit;
+ * trace viewers also accept it unclosed, e.g. after a crash.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cygfuse-internal.h"
+
+struct cygfuse_trace_event
+{
+    uint32_t op;
+    int32_t result;
+    uint64_t start;
+    uint64_t end;
+    char path[CYGFUSE_TRACE_PATHMAX];
+};
+
+struct cygfuse_trace_ring
+{
+    struct cygfuse_tls tls;
+    unsigned thread;
+    int named;
+    uint64_t head, tail;
+    struct cygfuse_trace_event event[CYGFUSE_TRACE_ENTRIES];
+};
+
+static const char *const *cygfuse_trace_names;
+static size_t cygfuse_trace_count;
+static char *cygfuse_trace_path;
+static pthread_key_t cygfuse_trace_key;
+static struct cygfuse_tls *cygfuse_trace_rings;
+static unsigned cygfuse_trace_threads;
+static uint64_t cygfuse_trace_dropped;
+
+static pthread_mutex_t cygfuse_trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cygfuse_trace_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t cygfuse_trace_writer;
+static int cygfuse_trace_running, cygfuse_trace_stop;
+static FILE *cygfuse_trace_file;
+static uint64_t cygfuse_trace_epoch;
+
+static struct cygfuse_trace_ring *cygfuse_trace_ring(void)
+{
+    struct cygfuse_trace_ring *ring;
+    int assigned;
+
+    ring = cygfuse_tls_get(cygfuse_trace_key, &cygfuse_trace_rings, sizeof *ring, &assigned);
+
+    /* a reused ring is named again, after the new thread */
+    if (assigned)
+    {
+        __atomic_store_n(&ring->thread,
+            __atomic_add_fetch(&cygfuse_trace_threads, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        __atomic_store_n(&ring->named, 0, __ATOMIC_RELEASE);
+    }
+    return ring;
+}
+
+static void cygfuse_trace_string(FILE *file, const char *s)
+{
+    fputc('"', file);
+    for (; *s; s++)
+    {
+        unsigned char c = *s;
+        if ('"' == c || '\\' == c)
+            fprintf(file, "\\%c", c);
+        else if (0x20 > c)
+            fprintf(file, "\\u%04x", c);
+        else
+            fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+static void cygfuse_trace_drain(FILE *file, int pid)
+{
+    for (struct cygfuse_tls *tls = __atomic_load_n(&cygfuse_trace_rings, __ATOMIC_ACQUIRE);
+        0 != tls; tls = tls->next)
+    {
+        struct cygfuse_trace_ring *ring = (struct cygfuse_trace_ring *)tls;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned thread = __atomic_load_n(&ring->thread, __ATOMIC_RELAXED);
+
+        if (ring->tail == head)
+            continue;
+
+        if (!__atomic_exchange_n(&ring->named, 1, __ATOMIC_ACQ_REL))
+            fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+                "\"args\":{\"name\":\"fuse-%u\"}},\n", pid, thread, thread);
+
+        for (; ring->tail != head; ring->tail++)
+        {
+            struct cygfuse_trace_event *event =
+                &ring->event[ring->tail & (CYGFUSE_TRACE_ENTRIES - 1)];
+
+            fprintf(file, "{\"name\":");
+            cygfuse_trace_string(file,
+                cygfuse_trace_count > event->op ? cygfuse_trace_names[event->op] : "?");
+            fprintf(file, ",\"cat\":\"fuse\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"path\":",
+                pid, thread,
+                (event->start - cygfuse_trace_epoch) / 1000.0,
+                (event->end - event->start) / 1000.0);
+            cygfuse_trace_string(file, event->path);
+            fprintf(file, ",\"result\":%d}},\n", (int)event->result);
+        }
+        __atomic_store_n(&ring->tail, ring->tail, __ATOMIC_RELEASE);
+    }
+}
+
+static void *cygfuse_trace_thread(void *arg)
+{
+    int pid = getpid(), stop;
+    struct timespec ts;
+
+    (void)arg;
+
+    pthread_mutex_lock(&cygfuse_trace_mutex);
+    do
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += CYGFUSE_TRACE_INTERVAL * 1000000L;
+        if (1000000000L <= ts.tv_nsec)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if (!cygfuse_trace_stop)
+            pthread_cond_timedwait(&cygfuse_trace_cond, &cygfuse_trace_mutex, &ts);
+        stop = cygfuse_trace_stop;
+        pthread_mutex_unlock(&cygfuse_trace_mutex);
+
+        cygfuse_trace_drain(cygfuse_trace_file, pid);
+        fflush(cygfuse_trace_file);
+
+        pthread_mutex_lock(&cygfuse_trace_mutex);
+    } while (!stop);
+    pthread_mutex_unlock(&cygfuse_trace_mutex);
+
+    return 0;
+}
+
+static void cygfuse_trace_start(void)
+{
+    pthread_mutex_lock(&cygfuse_trace_mutex);
+    if (!cygfuse_trace_running && !cygfuse_trace_stop)
+    {
+        cygfuse_trace_file = fopen(cygfuse_trace_path, "w");
+        if (0 != cygfuse_trace_file)
+        {
+            fprintf(cygfuse_trace_file, "[\n");
+            if (0 == pthread_create(&cygfuse_trace_writer, 0, cygfuse_trace_thread, 0))
+                __atomic_store_n(&cygfuse_trace_running, 1, __ATOMIC_RELEASE);
+            else
+            {
+                fclose(cygfuse_trace_file);
+                cygfuse_trace_file = 0;
+            }
+        }
+        if (!cygfuse_trace_running)
+            /* do not try again on every event */
+            cygfuse_trace_stop = 1;
+    }
+    pthread_mutex_unlock(&cygfuse_trace_mutex);
+}
+
+void cygfuse_trace_span(unsigned op, const char *path, int result, uint64_t start, uint64_t end)
+{
+    struct cygfuse_trace_ring *ring;
+    struct cygfuse_trace_event *event;
+    uint64_t used;
+    size_t len;
+
+    if (!__atomic_load_n(&cygfuse_trace_running, __ATOMIC_ACQUIRE))
+        cygfuse_trace_start();
+
+    ring = cygfuse_trace_ring();
+    if (0 == ring)
+        return;
+
+    used = ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (CYGFUSE_TRACE_ENTRIES == used)
+    {
+        __atomic_add_fetch(&cygfuse_trace_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (CYGFUSE_TRACE_ENTRIES / 2 == used)
+        /* wake the writer early; a lost wakeup only delays it */
+        pthread_cond_signal(&cygfuse_trace_cond);
+
+    event = &ring->event[ring->head & (CYGFUSE_TRACE_ENTRIES - 1)];
+    event->op = op;
+    event->result = result;
+    event->start = start;
+    event->end = end;
+    len = 0;
+    if (0 != path)
+    {
+        len = strlen(path);
+        if (sizeof event->path <= len)
+            len = sizeof event->path - 1;
+        memcpy(event->path, path, len);
+    }
+    event->path[len] = '\0';
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void cygfuse_trace_fini(void)
+{
+    pthread_mutex_lock(&cygfuse_trace_mutex);
+    cygfuse_trace_stop = 1;
+    pthread_cond_signal(&cygfuse_trace_cond);
+    pthread_mutex_unlock(&cygfuse_trace_mutex);
+
+    if (!__atomic_exchange_n(&cygfuse_trace_running, 0, __ATOMIC_ACQ_REL))
+        return;
+
+    pthread_join(cygfuse_trace_writer, 0);
+
+    fprintf(cygfuse_trace_file, "{\"name\":\"dropped\",\"ph\":\"C\",\"pid\":%d,\"ts\":%.3f,"
+        "\"args\":{\"events\":%llu}}\n]\n",
+        (int)getpid(), (cygfuse_now() - cygfuse_trace_epoch) / 1000.0,
+        (unsigned long long)__atomic_load_n(&cygfuse_trace_dropped, __ATOMIC_RELAXED));
+    fclose(cygfuse_trace_file);
+    cygfuse_trace_file = 0;
+}
+
+/*
+ * The writer thread does not survive fork: the child starts its own on its
+ * first event and writes a trace of its own. Events recorded but not yet
+ * written by the parent are dropped in the child.
+ */
+static void cygfuse_trace_atfork_prepare(void)
+{
+    pthread_mutex_lock(&cygfuse_trace_mutex);
+}
+
+static void cygfuse_trace_atfork_parent(void)
+{
+    pthread_mutex_unlock(&cygfuse_trace_mutex);
+}
+
+static void cygfuse_trace_atfork_child(void)
+{
+    pthread_mutex_init(&cygfuse_trace_mutex, 0);
+    pthread_cond_init(&cygfuse_trace_cond, 0);
+    cygfuse_trace_running = 0;
+    cygfuse_trace_stop = 0;
+    cygfuse_trace_file = 0;
+    for (struct cygfuse_tls *tls = cygfuse_trace_rings; 0 != tls; tls = tls->next)
+    {
+        struct cygfuse_trace_ring *ring = (struct cygfuse_trace_ring *)tls;
+        ring->tail = ring->head;
+        ring->named = 0;
+    }
+}
+
+int cygfuse_trace_enabled(void)
+{
+    return 0 != cygfuse_trace_path;
+}
+
+int cygfuse_trace_init(const char *const *names, size_t count)
+{
+    const char *path = getenv(CYGFUSE_TRACE_ENV);
+
+    if (0 == path || '\0' == path[0])
+        return 0;
+
+    if (0 != pthread_key_create(&cygfuse_trace_key, cygfuse_tls_retire))
+        return 0;
+
+    cygfuse_trace_path = strdup(path);
+    if (0 == cygfuse_trace_path)
+        return 0;
+
+    cygfuse_trace_names = names;
+    cygfuse_trace_count = count;
+    cygfuse_trace_epoch = cygfuse_now();
+    pthread_atfork(cygfuse_trace_atfork_prepare, cygfuse_trace_atfork_parent,
+        cygfuse_trace_atfork_child);
+    atexit(cygfuse_trace_fini);
+    return 1;
+}
@@ -0,0 +1,400 @@
+/**
+ * @file fuse3/cygfuse-writeback.c
+ * Write-back buffer of the caching layer.
+ *
+ * Writes through an open file are collected in a buffer of max_write bytes
+ * per handle instead of being passed to the file system one at a time.
+ * Adjacent and overlapping writes are merged; a write that does not
+ * continue or overlap the buffered range, or that would not fit, first
+ * writes out what is buffered. The buffer is written out when it is full,
+ * when the file is flushed, fsynced or released, and before any operation
+ * through the mount that could observe or be affected by the buffered data
+ * (read, truncate, rename, etc. of the same path), so that reads through
+ * the mount see their writes. getattr does not write out the buffer, since
+ * WinFsp calls it after every write; the stats it returns are instead
+ * extended to the buffered data, as they will be once it is written out.
+ * All buffers together are limited to CYGFUSE_WRITEBACK_BUDGET bytes;
+ * beyond that a write is written out at once. Buffers are also charged to
+ * the memory budget (see cygfuse-budget.c): a write for which the budget
+ * has no room is passed through, and writes are written out at once while
+ * the budget is under pressure. The budget does not evict buffers, which
+ * drain as they are written out.
+ *
+ * Errors from writing out a buffer cannot be returned by the write that
+ * filled it; they are returned by the next write, flush or fsync of the
+ * handle instead, as with a write-back cache in the kernel.
+ *
+ * @copyright 2022 Mark A. Geisert
+ */
+/*
+ * This file is part of cygfuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FSP_FUSE_API                    extern
+#define CYGFUSE
+#include <fuse.h>
+
+#include "cygfuse-internal.h"
+
+struct cygfuse_writeback_link
+{
+    struct cygfuse_writeback_link *prev, *next;
+};
+
+struct cygfuse_writeback
+{
+    struct cygfuse_writeback_link link; /* must be first; in the dirty list while size != 0 */
+    struct cygfuse_handle *handle;
+    char *path;                         /* changed with the dirty list locked too */
+    struct fuse3_file_info fi;
+    char *data;
+    fuse_off_t off;
+    size_t size;
+    int error;
+};
+
+static const struct fuse3_operations *cygfuse_writeback_next;
+static size_t cygfuse_writeback_max;
+static uint64_t cygfuse_writeback_memory;
+static pthread_mutex_t cygfuse_writeback_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cygfuse_writeback_link cygfuse_writeback_dirty =
+    { &cygfuse_writeback_dirty, &cygfuse_writeback_dirty };
+static unsigned cygfuse_writeback_ndirty;
+/* no cost: buffered writes are written out, not evicted */
+static struct cygfuse_budget cygfuse_writeback_budget =
+    CYGFUSE_BUDGET_INIT("writeback", 0, 0, 0, 0, 0);
+
+int cygfuse_writeback_enabled(void)
+{
+    return 0 != cygfuse_writeback_max;
+}
+
+void cygfuse_writeback_setup(const struct fuse3_operations *next, size_t max_write)
+{
+    cygfuse_writeback_next = next;
+    cygfuse_writeback_max = 0 != max_write ? max_write : CYGFUSE_WRITEBACK_CHUNK;
+    cygfuse_budget_register(&cygfuse_writeback_budget);
+}
+
+/* called with the handle mutex held */
+static int cygfuse_writeback_flush_locked(struct cygfuse_writeback *wb)
+{
+    size_t done = 0;
+    int result;
+
+    if (0 == wb->size)
+        return 0;
+
+    while (wb->size > done)
+    {
+        result = cygfuse_writeback_next->write(wb->path, wb->data + done, wb->size - done,
+            wb->off + (fuse_off_t)done, &wb->fi);
+        if (0 >= result)
+        {
+            if (0 == wb->error)
+                wb->error = 0 > result ? result : -EIO;
+            break;
+        }
+        done += (size_t)result;
+    }
+
+    free(wb->data);
+    wb->data = 0;
+    __atomic_store_n(&wb->size, 0, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&cygfuse_writeback_memory, cygfuse_writeback_max, __ATOMIC_RELAXED);
+    cygfuse_budget_release(&cygfuse_writeback_budget, cygfuse_writeback_max);
+
+    pthread_mutex_lock(&cygfuse_writeback_mutex);
+    wb->link.prev->next = wb->link.next;
+    wb->link.next->prev = wb->link.prev;
+    cygfuse_writeback_ndirty--;
+    pthread_mutex_unlock(&cygfuse_writeback_mutex);
+
+    return wb->error;
+}
+
+/* returns and clears the error of the handle */
+static int cygfuse_writeback_flush_handle(struct cygfuse_handle *handle)
+{
+    struct cygfuse_writeback *wb;
+    int result = 0;
+
+    pthread_mutex_lock(&handle->mutex);
+    wb = handle->writeback;
+    if (0 != wb)
+    {
+        cygfuse_writeback_flush_locked(wb);
+        result = wb->error;
+        wb->error = 0;
+    }
+    pthread_mutex_unlock(&handle->mutex);
+
+    return result;
+}
+
+/*
+ * Write out the buffers of all handles with buffered data for path and of
+ * the handle of fi. Errors are left for the handles to report.
+ */
+void cygfuse_writeback_flush_file(const char *path, const struct fuse3_file_info *fi)
+{
+    struct cygfuse_handle *handles[16], *handle;
+    struct cygfuse_writeback_link *link;
+    size_t count;
+
+    if (0 == __atomic_load_n(&cygfuse_writeback_ndirty, __ATOMIC_RELAXED))
+        return;
+
+    if (0 != fi && 0 != (handle = cygfuse_handle_get(path, fi)))
+    {
+        pthread_mutex_lock(&handle->mutex);
+        if (0 != handle->writeback)
+            cygfuse_writeback_flush_locked(handle->writeback);
+        pthread_mutex_unlock(&handle->mutex);
+        cygfuse_handle_put(handle);
+    }
+
+    if (0 == path)
+        return;
+
+    /* handles cannot be flushed with the dirty list locked; collect some at a time */
+    do
+    {
+        count = 0;
+        pthread_mutex_lock(&cygfuse_writeback_mutex);
+        for (link = cygfuse_writeback_dirty.next;
+            &cygfuse_writeback_dirty != link && sizeof handles / sizeof handles[0] > count;
+            link = link->next)
+        {
+            struct cygfuse_writeback *wb = (struct cygfuse_writeback *)link;
+            if (0 != wb->path && 0 == strcmp(wb->path, path))
+            {
+                handle = wb->handle;
+                __atomic_add_fetch(&handle->refcount, 1, __ATOMIC_RELAXED);
+                handles[count++] = handle;
+            }
+        }
+        pthread_mutex_unlock(&cygfuse_writeback_mutex);
+
+        for (size_t i = 0; count > i; i++)
+        {
+            pthread_mutex_lock(&handles[i]->mutex);
+            if (0 != handles[i]->writeback)
+                cygfuse_writeback_flush_locked(handles[i]->writeback);
+            pthread_mutex_unlock(&handles[i]->mutex);
+            cygfuse_handle_put(handles[i]);
+        }
+    } while (sizeof handles / sizeof handles[0] == count);
+}
+
+/*
+ * Extend stbuf to the data buffered for path or by the handle of fi: the
+ * size to the end of it and the modification time to now. Returns whether
+ * any is buffered; the stats then change when it is written out.
+ *
+ * The offset of a buffer does not change while it is in the dirty list,
+ * and its size only grows, so both can be read with the list locked.
+ */
+int cygfuse_writeback_getattr(const char *path, const struct fuse3_file_info *fi,
+    struct fuse_stat *stbuf)
+{
+    struct cygfuse_handle *handle = 0;
+    struct cygfuse_writeback_link *link;
+    fuse_off_t end = -1;
+    struct timespec now;
+
+    if (0 == __atomic_load_n(&cygfuse_writeback_ndirty, __ATOMIC_RELAXED))
+        return 0;
+
+    if (0 != fi)
+        handle = cygfuse_handle_get(path, fi);
+
+    pthread_mutex_lock(&cygfuse_writeback_mutex);
+    for (link = cygfuse_writeback_dirty.next; &cygfuse_writeback_dirty != link; link = link->next)
+    {
+        struct cygfuse_writeback *wb = (struct cygfuse_writeback *)link;
+        size_t size = __atomic_load_n(&wb->size, __ATOMIC_RELAXED);
+        if (0 != size &&
+            (handle == wb->handle || (0 != path && 0 != wb->path && 0 == strcmp(wb->path, path))) &&
+            end < wb->off + (fuse_off_t)size)
+            end = wb->off + (fuse_off_t)size;
+    }
+    pthread_mutex_unlock(&cygfuse_writeback_mutex);
+
+    if (0 != handle)
+        cygfuse_handle_put(handle);
+
+    if (-1 == end)
+        return 0;
+
+    if (stbuf->st_size < end)
+        stbuf->st_size = end;
+    clock_gettime(CLOCK_REALTIME, &now);
+    stbuf->st_mtim.tv_sec = now.tv_sec;
+    stbuf->st_mtim.tv_nsec = now.tv_nsec;
+
+    return 1;
+}
+
+int cygfuse_writeback_write(const char *path, const char *buf, size_t size, fuse_off_t off,
+    struct fuse3_file_info *fi)
+{
+    struct cygfuse_handle *handle;
+    struct cygfuse_writeback *wb;
+    size_t end;
+    int result;
+
+    handle = cygfuse_handle_get(path, fi);
+    if (0 == handle)
+        return cygfuse_writeback_next->write(path, buf, size, off, fi);
+
+    pthread_mutex_lock(&handle->mutex);
+
+    wb = handle->writeback;
+    if (0 == wb)
+    {
+        wb = handle->writeback = calloc(1, sizeof *wb);
+        if (0 == wb)
+            goto write_through;
+        wb->handle = handle;
+    }
+
+    if (0 != wb->error)
+    {
+        result = wb->error;
+        wb->error = 0;
+        goto exit;
+    }
+
+    /* the write must continue or overlap what is buffered and fit with it */
+    if (0 != wb->size &&
+        (wb->off > off || wb->off + (fuse_off_t)wb->size < off ||
+        cygfuse_writeback_max < (size_t)(off - wb->off) + size))
+    {
+        if (0 != (result = cygfuse_writeback_flush_locked(wb)))
+        {
+            wb->error = 0;
+            goto exit;
+        }
+    }
+    if (cygfuse_writeback_max < size)
+        goto write_through;
+
+    if (0 != path && (0 == wb->path || 0 != strcmp(wb->path, path)))
+    {
+        char *copy = strdup(path), *old;
+        if (0 == copy)
+            goto write_through;
+        pthread_mutex_lock(&cygfuse_writeback_mutex);
+        old = wb->path;
+        wb->path = copy;
+        pthread_mutex_unlock(&cygfuse_writeback_mutex);
+        free(old);
+    }
+
+    if (0 == wb->size)
+    {
+        if (!cygfuse_budget_charge(&cygfuse_writeback_budget, cygfuse_writeback_max))
+            goto write_through;
+        wb->data = malloc(cygfuse_writeback_max);
+        if (0 == wb->data)
+        {
+            cygfuse_budget_release(&cygfuse_writeback_budget, cygfuse_writeback_max);
+            goto write_through;
+        }
+        __atomic_add_fetch(&cygfuse_writeback_memory, cygfuse_writeback_max, __ATOMIC_RELAXED);
+        wb->off = off;
+        wb->fi = *fi;
+
+        pthread_mutex_lock(&cygfuse_writeback_mutex);
+        wb->link.next = &cygfuse_writeback_dirty;
+        wb->link.prev = cygfuse_writeback_dirty.prev;
+        cygfuse_writeback_dirty.prev->next = &wb->link;
+        cygfuse_writeback_dirty.prev = &wb->link;
+        cygfuse_writeback_ndirty++;
+        pthread_mutex_unlock(&cygfuse_writeback_mutex);
+    }
+
+    memcpy(wb->data + (off - wb->off), buf, size);
+    end = (size_t)(off - wb->off) + size;
+    if (wb->size < end)
+        __atomic_store_n(&wb->size, end, __ATOMIC_RELAXED);
+    result = (int)size;
+
+    /* errors of writing out are reported later */
+    if (cygfuse_writeback_max == wb->size ||
+        CYGFUSE_WRITEBACK_BUDGET < __atomic_load_n(&cygfuse_writeback_memory, __ATOMIC_RELAXED) ||
+        cygfuse_budget_pressure())
+        cygfuse_writeback_flush_locked(wb);
+
+exit:
+    pthread_mutex_unlock(&handle->mutex);
+    cygfuse_handle_put(handle);
+    return result;
+
+write_through:
+    pthread_mutex_unlock(&handle->mutex);
+    cygfuse_handle_put(handle);
+    return cygfuse_writeback_next->write(path, buf, size, off, fi);
+}
+
+int cygfuse_writeback_flush(const char *path, struct fuse3_file_info *fi)
+{
+    struct cygfuse_handle *handle;
+    int result = 0;
+
+    handle = cygfuse_handle_get(path, fi);
+    if (0 != handle)
+    {
+        result = cygfuse_writeback_flush_handle(handle);
+        cygfuse_handle_put(handle);
+    }
+
+    return result;
+}
+
+void cygfuse_writeback_open(const char *path, struct fuse3_file_info *fi)
+{
+    struct cygfuse_handle *handle;
+
+    handle = cygfuse_handle_open(path, fi);
+    if (0 != handle)
+        cygfuse_handle_put(handle);
+}
+
+void cygfuse_writeback_free(struct cygfuse_writeback *wb)
+{
+    if (0 == wb)
+        return;
+
+    free(wb->data);
+    free(wb->path);
+    free(wb);
+}
+
+int cygfuse_writeback_release(const char *path, struct fuse3_file_info *fi)
+{
+    struct cygfuse_handle *handle;
+    int result = 0;
+
+    handle = cygfuse_handle_get(path, fi);
+    if (0 == handle)
+        return 0;
+
+    /* the write-back state is freed with the handle, when its last reference goes */
+    result = cygfuse_writeback_flush_handle(handle);
+    cygfuse_handle_close(handle);
+    cygfuse_handle_put(handle);
+
+    return result;
+}
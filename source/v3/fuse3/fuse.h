@@ -81,6 +81,7 @@ struct fuse3_config
 struct fuse3_operations
 {
     /* S - supported by WinFsp */
+    /* C - adapted by cygfuse to operations supported by WinFsp */
     /* S */ int (*getattr)(const char *path, struct fuse_stat *stbuf,
         struct fuse3_file_info *fi);
     /* S */ int (*readlink)(const char *path, char *buf, size_t size);
@@ -130,9 +131,9 @@ struct fuse3_operations
         unsigned int flags, void *data);
     /* _ */ int (*poll)(const char *path, struct fuse3_file_info *fi,
         struct fuse3_pollhandle *ph, unsigned *reventsp);
-    /* _ */ int (*write_buf)(const char *path,
+    /* C */ int (*write_buf)(const char *path,
         struct fuse3_bufvec *buf, fuse_off_t off, struct fuse3_file_info *fi);
-    /* _ */ int (*read_buf)(const char *path,
+    /* C */ int (*read_buf)(const char *path,
         struct fuse3_bufvec **bufp, size_t size, fuse_off_t off, struct fuse3_file_info *fi);
     /* _ */ int (*flock)(const char *path, struct fuse3_file_info *, int op);
     /* _ */ int (*fallocate)(const char *path, int mode, fuse_off_t off, fuse_off_t len,
@@ -149,6 +150,23 @@ struct fuse3_context
     fuse_mode_t umask;
 };
 
+/*
+ * An embedding library may define FSP_FUSE3_OPS to substitute the
+ * operations (and their size) that are passed to WinFsp.
+ */
+#if !defined(FSP_FUSE3_OPS)
+#define FSP_FUSE3_OPS(ops, opsize)      ((void)0)
+#endif
+
+/*
+ * An embedding library may define FSP_FUSE3_ARGS to take options of its
+ * own out of the arguments before WinFsp parses them; it returns nonzero
+ * if they are invalid.
+ */
+#if !defined(FSP_FUSE3_ARGS)
+#define FSP_FUSE3_ARGS(args)            ((void)(args), 0)
+#endif
+
 #define fuse_main(argc, argv, ops, data)\
     fuse3_main_real(argc, argv, ops, sizeof *(ops), data)
 
@@ -177,14 +195,24 @@ FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse3_loop_mt)(struct fsp_fuse_env *env,
     struct fuse3 *f, struct fuse3_loop_config *config);
 FSP_FUSE_API void FSP_FUSE_API_NAME(fsp_fuse3_exit)(struct fsp_fuse_env *env,
     struct fuse3 *f);
+FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse3_notify)(struct fsp_fuse_env *env,
+    struct fuse3 *f, const char *path, uint32_t action);
 FSP_FUSE_API struct fuse3_context *FSP_FUSE_API_NAME(fsp_fuse3_get_context)(struct fsp_fuse_env *env);
 
 FSP_FUSE_SYM(
 int fuse3_main_real(int argc, char *argv[],
     const struct fuse3_operations *ops, size_t opsize, void *data),
 {
-    return FSP_FUSE_API_CALL(fsp_fuse3_main_real)
-        (fsp_fuse_env(), argc, argv, ops, opsize, data);
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    int result;
+    if (FSP_FUSE3_ARGS(&args))
+        return 1;
+    FSP_FUSE3_OPS(ops, opsize);
+    result = FSP_FUSE_API_CALL(fsp_fuse3_main_real)
+        (fsp_fuse_env(), args.argc, args.argv, ops, opsize, data);
+    if (args.allocated)
+        fuse_opt_free_args(&args);
+    return result;
 })
 
 FSP_FUSE_SYM(
@@ -199,6 +227,9 @@ FSP_FUSE_SYM(
 struct fuse3 *fuse3_new_30(struct fuse_args *args,
     const struct fuse3_operations *ops, size_t opsize, void *data),
 {
+    if (FSP_FUSE3_ARGS(args))
+        return 0;
+    FSP_FUSE3_OPS(ops, opsize);
     return FSP_FUSE_API_CALL(fsp_fuse3_new_30)
         (fsp_fuse_env(), args, ops, opsize, data);
 })
@@ -210,6 +241,9 @@ FSP_FUSE_SYM(
 struct fuse3 *fuse3_new(struct fuse_args *args,
     const struct fuse3_operations *ops, size_t opsize, void *data),
 {
+    if (FSP_FUSE3_ARGS(args))
+        return 0;
+    FSP_FUSE3_OPS(ops, opsize);
     return FSP_FUSE_API_CALL(fsp_fuse3_new)
         (fsp_fuse_env(), args, ops, opsize, data);
 })
@@ -269,6 +303,44 @@ void fuse3_exit(struct fuse3 *f),
         (fsp_fuse_env(), f);
 })
 
+/*
+ * Notification. The file system tells about a change to path that it did
+ * not make through the mount (action is one of FSP_FUSE_NOTIFY_*, or 0 if
+ * not known), so that what is cached about path is dropped. An embedding
+ * library with caches of its own may define FSP_FUSE3_INVALIDATE to drop
+ * them; WinFsp is told in any case.
+ */
+#if !defined(FSP_FUSE3_INVALIDATE)
+#define FSP_FUSE3_INVALIDATE(path, action)\
+    ((void)(path), (void)(action))
+#endif
+
+FSP_FUSE_SYM(
+int fuse3_notify(struct fuse3 *f, const char *path, uint32_t action),
+{
+    FSP_FUSE3_INVALIDATE(path, action);
+    return FSP_FUSE_API_CALL(fsp_fuse3_notify)
+        (fsp_fuse_env(), f, path, action);
+})
+
+/*
+ * Queued notification. Like fuse3_notify, but an embedding library may
+ * define FSP_FUSE3_NOTIFY_QUEUE to queue the change and tell WinFsp later,
+ * together with others; it returns nonzero if the change was queued.
+ */
+#if !defined(FSP_FUSE3_NOTIFY_QUEUE)
+#define FSP_FUSE3_NOTIFY_QUEUE(f, path, action)\
+    ((void)(f), (void)(path), (void)(action), 0)
+#endif
+
+FSP_FUSE_SYM(
+int fuse3_notify_queue(struct fuse3 *f, const char *path, uint32_t action),
+{
+    if (FSP_FUSE3_NOTIFY_QUEUE(f, path, action))
+        return 0;
+    return fuse3_notify(f, path, action);
+})
+
 FSP_FUSE_SYM(
 struct fuse3_context *fuse3_get_context(void),
 {
@@ -293,9 +365,9 @@ int fuse3_interrupted(void),
 FSP_FUSE_SYM(
 int fuse3_invalidate_path(struct fuse3 *f, const char *path),
 {
-    (void)f;
-    (void)path;
-    return -ENOENT;
+    FSP_FUSE3_INVALIDATE(path, 0);
+    return FSP_FUSE_API_CALL(fsp_fuse3_notify)
+        (fsp_fuse_env(), f, path, 0);
 })
 
 FSP_FUSE_SYM(
@@ -305,24 +377,63 @@ int fuse3_notify_poll(struct fuse3_pollhandle *ph),
     return 0;
 })
 
+/*
+ * Passthrough. An open or create operation may pass a descriptor of the
+ * file that backs the opened file to fuse3_passthrough_open; reads,
+ * writes, fsyncs and truncates of the open file are then done on the
+ * descriptor without calling the file system. The file handle (fh) must
+ * be set before the call. The descriptor is duplicated and may be closed
+ * once the call returns. An embedding
+ * library may define FSP_FUSE3_PASSTHROUGH_OPEN to an implementation;
+ * -ENOSYS is returned otherwise.
+ */
+#if !defined(FSP_FUSE3_PASSTHROUGH_OPEN)
+#define FSP_FUSE3_PASSTHROUGH_OPEN(fi, fd)\
+    ((void)(fi), (void)(fd), -ENOSYS)
+#endif
+
+FSP_FUSE_SYM(
+int fuse3_passthrough_open(struct fuse3_file_info *fi, int fd),
+{
+    return FSP_FUSE3_PASSTHROUGH_OPEN(fi, fd);
+})
+
+/*
+ * Cache cleanup. WinFsp keeps no caches that need cleaning; an embedding
+ * library that does may define FSP_FUSE3_START_CLEANUP_THREAD,
+ * FSP_FUSE3_STOP_CLEANUP_THREAD and FSP_FUSE3_CLEAN_CACHE to a thread
+ * that cleans them and to cleaning them once. fuse3_clean_cache returns
+ * the seconds until it should be called again.
+ */
+#if !defined(FSP_FUSE3_START_CLEANUP_THREAD)
+#define FSP_FUSE3_START_CLEANUP_THREAD(f)\
+    ((void)(f), 0)
+#endif
+#if !defined(FSP_FUSE3_STOP_CLEANUP_THREAD)
+#define FSP_FUSE3_STOP_CLEANUP_THREAD(f)\
+    ((void)(f))
+#endif
+#if !defined(FSP_FUSE3_CLEAN_CACHE)
+#define FSP_FUSE3_CLEAN_CACHE(f)\
+    ((void)(f), 600)
+#endif
+
 FSP_FUSE_SYM(
 int fuse3_start_cleanup_thread(struct fuse3 *f),
 {
-    (void)f;
-    return 0;
+    return FSP_FUSE3_START_CLEANUP_THREAD(f);
 })
 
 FSP_FUSE_SYM(
 void fuse3_stop_cleanup_thread(struct fuse3 *f),
 {
-    (void)f;
+    FSP_FUSE3_STOP_CLEANUP_THREAD(f);
 })
 
 FSP_FUSE_SYM(
 int fuse3_clean_cache(struct fuse3 *f),
 {
-    (void)f;
-    return 600;
+    return FSP_FUSE3_CLEAN_CACHE(f);
 })
 
 FSP_FUSE_SYM(
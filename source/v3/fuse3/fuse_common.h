@@ -68,6 +68,17 @@ extern "C" {
 
 #define FSP_FUSE_CAP_CASE_INSENSITIVE   FUSE_CAP_CASE_INSENSITIVE
 
+/* notify extension */
+#define FSP_FUSE_NOTIFY_MKDIR           0x0001
+#define FSP_FUSE_NOTIFY_RMDIR           0x0002
+#define FSP_FUSE_NOTIFY_CREATE          0x0004
+#define FSP_FUSE_NOTIFY_UNLINK          0x0008
+#define FSP_FUSE_NOTIFY_CHMOD           0x0010
+#define FSP_FUSE_NOTIFY_CHOWN           0x0020
+#define FSP_FUSE_NOTIFY_UTIME           0x0040
+#define FSP_FUSE_NOTIFY_CHFLAGS         0x0080
+#define FSP_FUSE_NOTIFY_TRUNCATE        0x0100
+
 #define FUSE_IOCTL_COMPAT               (1 << 0)
 #define FUSE_IOCTL_UNRESTRICTED         (1 << 1)
 #define FUSE_IOCTL_RETRY                (1 << 2)
@@ -195,21 +206,30 @@ void fuse3_pollhandle_destroy(struct fuse3_pollhandle *ph),
     (void)ph;
 })
 
+/*
+ * An embedding library may define FSP_FUSE3_BUF_SIZE and FSP_FUSE3_BUF_COPY
+ * to implementations of fuse3_buf_size and fuse3_buf_copy, which WinFsp
+ * does not provide. Both return 0 otherwise.
+ */
+#if !defined(FSP_FUSE3_BUF_SIZE)
+#define FSP_FUSE3_BUF_SIZE(bufv)        ((void)(bufv), (size_t)0)
+#endif
+#if !defined(FSP_FUSE3_BUF_COPY)
+#define FSP_FUSE3_BUF_COPY(dst, src, flags)\
+    ((void)(dst), (void)(src), (void)(flags), (ssize_t)0)
+#endif
+
 FSP_FUSE_SYM(
 size_t fuse3_buf_size(const struct fuse3_bufvec *bufv),
 {
-    (void)bufv;
-    return 0;
+    return FSP_FUSE3_BUF_SIZE(bufv);
 })
 
 FSP_FUSE_SYM(
 ssize_t fuse3_buf_copy(struct fuse3_bufvec *dst, struct fuse3_bufvec *src,
     enum fuse3_buf_copy_flags flags),
 {
-    (void)dst;
-    (void)src;
-    (void)flags;
-    return 0;
+    return FSP_FUSE3_BUF_COPY(dst, src, flags);
 })
 
 FSP_FUSE_SYM(
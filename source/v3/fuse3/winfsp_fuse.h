@@ -63,9 +63,12 @@ typedef intptr_t ssize_t;
 #define fuse3_mount                     fuse_mount
 #define fuse3_new                       fuse_new
 #define fuse3_new_30                    fuse_new_30
+#define fuse3_notify                    fuse_notify
+#define fuse3_notify_queue              fuse_notify_queue
 #define fuse3_notify_poll               fuse_notify_poll
 #define fuse3_operations                fuse_operations
 #define fuse3_parse_conn_info_opts      fuse_parse_conn_info_opts
+#define fuse3_passthrough_open          fuse_passthrough_open
 #define fuse3_pkgversion                fuse_pkgversion
 #define fuse3_pollhandle                fuse_pollhandle
 #define fuse3_pollhandle_destroy        fuse_pollhandle_destroy